@@ -0,0 +1,740 @@
+/* ------------------------------------------------------------------
+ * SBox - End-to-End Archive Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_MEGABYTES 32
+#define BENCH_ROUNDS 3
+#define BENCH_CHUNK 65536
+#define BENCH_TINY_FILES 20000
+#define BENCH_TINY_PER_DIR 500
+#define BENCH_TINY_MAX 1024
+#define BENCH_HUGE_FILES 2
+#define BENCH_RANDOM_FILES 4
+#define BENCH_DEEP_LEVELS 1000
+#define BENCH_DEEP_FILE 1024
+#define BENCH_WIDE_DIRS 10000
+#define BENCH_WIDE_FILE 256
+#define BENCH_BASELINE_MAX 256
+#define BENCH_REGRESSION 15.0
+#define BENCH_PASSWORD "Bench!Passw0rd#1"
+
+/**
+ * Synthetic corpus, entries counts files and directories
+ */
+struct bench_corpus_t
+{
+    const char *name;
+    size_t entries;
+    uint64_t bytes;
+};
+
+/**
+ * Corpus builder, megabytes scale corpora of large files
+ */
+struct bench_shape_t
+{
+    const char *name;
+    int ( *make ) ( struct bench_corpus_t *, size_t );
+};
+
+/**
+ * Codec and encryption combination, flags are added to task flag
+ */
+struct bench_mode_t
+{
+    const char *name;
+    const char *flags;
+};
+
+/**
+ * Archive task measured
+ */
+struct bench_op_t
+{
+    const char *name;
+    char flag;
+};
+
+/**
+ * Result of one measured task
+ */
+struct bench_result_t
+{
+    char corpus[16];
+    char mode[16];
+    char op[16];
+    double speed;
+    double files;
+    unsigned long rss;
+    double cpu;
+};
+
+/**
+ * Combinations measured on each corpus
+ */
+static const struct bench_mode_t bench_modes[] = {
+    {"none", "n"},
+    {"lz4", ""},
+    {"aes", "np"},
+    {"lz4+aes", "p"},
+    {NULL, NULL}
+};
+
+/**
+ * Tasks measured in each combination, pack first
+ */
+static const struct bench_op_t bench_ops[] = {
+    {"pack", 'c'},
+    {"list", 'l'},
+    {"test", 't'},
+    {"extract", 'x'},
+    {NULL, 0}
+};
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill data from seed, compressible data packs about two to one
+ */
+static void bench_fill ( uint8_t * data, size_t len, uint64_t seed, int compressible )
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = ( compressible && i & 1 ) ? 'a' + i % 16 : ( uint8_t ) ( seed >> 56 );
+    }
+}
+
+/**
+ * Create file of given size and add it to corpus
+ */
+static int bench_file ( struct bench_corpus_t *corpus, const char *path, uint64_t size,
+    uint64_t seed, int compressible )
+{
+    int fd;
+    size_t len;
+    uint64_t sum;
+    uint8_t data[BENCH_CHUNK];
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    for ( sum = 0; sum < size; sum += len )
+    {
+        len = MIN ( sizeof ( data ), size - sum );
+        bench_fill ( data, len, seed + sum, compressible );
+
+        if ( write ( fd, data, len ) != ( ssize_t ) len )
+        {
+            perror ( path );
+            close ( fd );
+            return -1;
+        }
+    }
+
+    close ( fd );
+
+    corpus->entries++;
+    corpus->bytes += size;
+
+    return 0;
+}
+
+/**
+ * Create directory and add it to corpus
+ */
+static int bench_dir ( struct bench_corpus_t *corpus, const char *path )
+{
+    if ( mkdir ( path, 0755 ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    corpus->entries++;
+
+    return 0;
+}
+
+/**
+ * Create many tiny files in few directories
+ */
+static int bench_make_tiny ( struct bench_corpus_t *corpus, size_t megabytes )
+{
+    size_t i;
+    char path[PATH_MAX];
+
+    UNUSED ( megabytes );
+
+    if ( bench_dir ( corpus, corpus->name ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < BENCH_TINY_FILES; i++ )
+    {
+        if ( !( i % BENCH_TINY_PER_DIR ) )
+        {
+            snprintf ( path, sizeof ( path ), "%s/dir_%03lu", corpus->name,
+                ( unsigned long ) ( i / BENCH_TINY_PER_DIR ) );
+
+            if ( bench_dir ( corpus, path ) < 0 )
+            {
+                return -1;
+            }
+        }
+
+        snprintf ( path, sizeof ( path ), "%s/dir_%03lu/file_%05lu.txt", corpus->name,
+            ( unsigned long ) ( i / BENCH_TINY_PER_DIR ), ( unsigned long ) i );
+
+        if ( bench_file ( corpus, path, i * 7919 % BENCH_TINY_MAX, i, 1 ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Create few huge compressible files
+ */
+static int bench_make_huge ( struct bench_corpus_t *corpus, size_t megabytes )
+{
+    size_t i;
+    char path[PATH_MAX];
+
+    if ( bench_dir ( corpus, corpus->name ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < BENCH_HUGE_FILES; i++ )
+    {
+        snprintf ( path, sizeof ( path ), "%s/huge_%lu.dat", corpus->name, ( unsigned long ) i );
+
+        if ( bench_file ( corpus, path, ( uint64_t ) megabytes * 1048576 / BENCH_HUGE_FILES,
+                i, 1 ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Create incompressible files
+ */
+static int bench_make_random ( struct bench_corpus_t *corpus, size_t megabytes )
+{
+    size_t i;
+    char path[PATH_MAX];
+
+    if ( bench_dir ( corpus, corpus->name ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < BENCH_RANDOM_FILES; i++ )
+    {
+        snprintf ( path, sizeof ( path ), "%s/random_%lu.bin", corpus->name,
+            ( unsigned long ) i );
+
+        if ( bench_file ( corpus, path, ( uint64_t ) megabytes * 1048576 / BENCH_RANDOM_FILES,
+                i, 0 ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Create deep tree, one directory and one small file per level
+ */
+static int bench_make_deep ( struct bench_corpus_t *corpus, size_t megabytes )
+{
+    size_t i;
+    size_t len;
+    char path[PATH_MAX];
+
+    UNUSED ( megabytes );
+
+    if ( bench_dir ( corpus, corpus->name ) < 0 )
+    {
+        return -1;
+    }
+
+    len = snprintf ( path, sizeof ( path ), "%s", corpus->name );
+
+    for ( i = 0; i < BENCH_DEEP_LEVELS && len + 8 < sizeof ( path ); i++ )
+    {
+        memcpy ( path + len, "/f", 3 );
+
+        if ( bench_file ( corpus, path, BENCH_DEEP_FILE, i, 1 ) < 0 )
+        {
+            return -1;
+        }
+
+        memcpy ( path + len, "/d", 3 );
+        len += 2;
+
+        if ( bench_dir ( corpus, path ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Create wide tree, many directories side by side with one file each
+ */
+static int bench_make_wide ( struct bench_corpus_t *corpus, size_t megabytes )
+{
+    size_t i;
+    char path[PATH_MAX];
+
+    UNUSED ( megabytes );
+
+    if ( bench_dir ( corpus, corpus->name ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < BENCH_WIDE_DIRS; i++ )
+    {
+        snprintf ( path, sizeof ( path ), "%s/dir_%05lu", corpus->name, ( unsigned long ) i );
+
+        if ( bench_dir ( corpus, path ) < 0 )
+        {
+            return -1;
+        }
+
+        snprintf ( path, sizeof ( path ), "%s/dir_%05lu/file", corpus->name,
+            ( unsigned long ) i );
+
+        if ( bench_file ( corpus, path, BENCH_WIDE_FILE, i, 1 ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Remove tree entry
+ */
+static int bench_remove_entry ( const char *path, const struct stat *statbuf, int flag,
+    struct FTW *ftw )
+{
+    UNUSED ( statbuf );
+    UNUSED ( flag );
+    UNUSED ( ftw );
+
+    return remove ( path );
+}
+
+/**
+ * Run sbox in directory with output discarded, collecting its time, CPU and memory
+ */
+static int bench_exec ( char *const argv[], const char *dir, double *wall, double *cpu,
+    unsigned long *rss )
+{
+    int fd;
+    int status;
+    pid_t pid;
+    double start;
+    struct rusage usage;
+
+    start = bench_now (  );
+
+    if ( ( pid = fork (  ) ) < 0 )
+    {
+        perror ( "fork" );
+        return -1;
+    }
+
+    if ( !pid )
+    {
+        if ( chdir ( dir ) < 0 || ( fd = open ( "/dev/null", O_WRONLY ) ) < 0
+            || dup2 ( fd, STDOUT_FILENO ) < 0 )
+        {
+            _exit ( 127 );
+        }
+
+        execv ( argv[0], argv );
+        _exit ( 127 );
+    }
+
+    if ( wait4 ( pid, &status, 0, &usage ) < 0 )
+    {
+        perror ( "wait4" );
+        return -1;
+    }
+
+    *wall = bench_now (  ) - start;
+
+    if ( !WIFEXITED ( status ) || WEXITSTATUS ( status ) )
+    {
+        fprintf ( stderr, "Error: %s %s failed in %s.\n", argv[0], argv[1], dir );
+        return -1;
+    }
+
+    *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+        + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    *rss = usage.ru_maxrss;
+
+    return 0;
+}
+
+/**
+ * Measure archive task on corpus in current directory, best of rounds is kept
+ */
+static int bench_task ( const char *sbox, const struct bench_corpus_t *corpus,
+    const struct bench_mode_t *mode, const struct bench_op_t *op,
+    struct bench_result_t *result )
+{
+    int i;
+    int argc = 0;
+    double wall;
+    double cpu;
+    double best = 0;
+    unsigned long rss;
+    const char *dir;
+    char *argv[6];
+    char flags[16];
+
+    snprintf ( flags, sizeof ( flags ), "-%cs%s", op->flag, mode->flags );
+
+    argv[argc++] = ( char * ) sbox;
+    argv[argc++] = flags;
+
+    if ( strchr ( mode->flags, 'p' ) )
+    {
+        argv[argc++] = ( char * ) BENCH_PASSWORD;
+    }
+
+    /* Archive is packed beside corpus, other tasks run in output directory */
+    if ( op->flag == 'c' )
+    {
+        dir = ".";
+        argv[argc++] = ( char * ) "bench.sbox";
+        argv[argc++] = ( char * ) corpus->name;
+
+    } else
+    {
+        dir = "out";
+        argv[argc++] = ( char * ) "../bench.sbox";
+    }
+
+    argv[argc] = NULL;
+
+    for ( i = 0; i < BENCH_ROUNDS; i++ )
+    {
+        if ( op->flag == 'c' )
+        {
+            unlink ( "bench.sbox" );
+
+        } else
+        {
+            /* Extraction starts from empty directory each round */
+            nftw ( dir, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+
+            if ( mkdir ( dir, 0755 ) < 0 )
+            {
+                perror ( dir );
+                return -1;
+            }
+        }
+
+        if ( bench_exec ( argv, dir, &wall, &cpu, &rss ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( !i || wall < best )
+        {
+            best = wall;
+            result->cpu = cpu;
+            result->rss = rss;
+        }
+    }
+
+    snprintf ( result->corpus, sizeof ( result->corpus ), "%s", corpus->name );
+    snprintf ( result->mode, sizeof ( result->mode ), "%s", mode->name );
+    snprintf ( result->op, sizeof ( result->op ), "%s", op->name );
+    result->speed = corpus->bytes / 1048576.0 / best;
+    result->files = corpus->entries / best;
+
+    return 0;
+}
+
+/**
+ * Format result row, baseline files hold the same rows
+ */
+static void bench_format ( const struct bench_result_t *result, char *row, size_t size )
+{
+    snprintf ( row, size, "%-8s %-8s %-8s %10.1f %12.1f %9lu %8.3f", result->corpus,
+        result->mode, result->op, result->speed, result->files, result->rss, result->cpu );
+}
+
+/**
+ * Load baseline rows, header and malformed lines are skipped
+ */
+static size_t bench_load_baseline ( const char *path, struct bench_result_t *baseline )
+{
+    size_t count = 0;
+    char line[256];
+    FILE *file;
+
+    if ( !( file = fopen ( path, "r" ) ) )
+    {
+        perror ( path );
+        return 0;
+    }
+
+    while ( count < BENCH_BASELINE_MAX && fgets ( line, sizeof ( line ), file ) )
+    {
+        if ( sscanf ( line, "%15s %15s %15s %lf %lf %lu %lf", baseline[count].corpus,
+                baseline[count].mode, baseline[count].op, &baseline[count].speed,
+                &baseline[count].files, &baseline[count].rss, &baseline[count].cpu ) == 7 )
+        {
+            count++;
+        }
+    }
+
+    fclose ( file );
+
+    return count;
+}
+
+/**
+ * Find baseline row of same task
+ */
+static const struct bench_result_t *bench_find_baseline ( const struct bench_result_t
+    *baseline, size_t count, const struct bench_result_t *result )
+{
+    size_t i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( !strcmp ( baseline[i].corpus, result->corpus )
+            && !strcmp ( baseline[i].mode, result->mode )
+            && !strcmp ( baseline[i].op, result->op ) )
+        {
+            return baseline + i;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Corpora in run order
+ */
+static const struct bench_shape_t bench_shapes[] = {
+    {"tiny", bench_make_tiny},
+    {"huge", bench_make_huge},
+    {"random", bench_make_random},
+    {"deep", bench_make_deep},
+    {"wide", bench_make_wide},
+    {NULL, NULL}
+};
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int i;
+    int status = 0;
+    size_t c;
+    size_t m;
+    size_t o;
+    size_t count = 0;
+    size_t megabytes = BENCH_DEFAULT_MEGABYTES;
+    double change;
+    const char *base = "/tmp/sbox-archive-bench";
+    const char *sbox_path = NULL;
+    const char *baseline_path = NULL;
+    const char *save_path = NULL;
+    const struct bench_result_t *previous;
+    struct bench_corpus_t corpus;
+    struct bench_result_t result;
+    FILE *save = NULL;
+    char *slash;
+    char sbox[PATH_MAX];
+    char row[256];
+    static struct bench_result_t baseline[BENCH_BASELINE_MAX];
+
+    for ( i = 1; i < argc; i++ )
+    {
+        if ( !strncmp ( argv[i], "--baseline=", 11 ) )
+        {
+            baseline_path = argv[i] + 11;
+
+        } else if ( !strncmp ( argv[i], "--save=", 7 ) )
+        {
+            save_path = argv[i] + 7;
+
+        } else if ( !strncmp ( argv[i], "--sbox=", 7 ) )
+        {
+            sbox_path = argv[i] + 7;
+
+        } else if ( isdigit ( ( unsigned char ) argv[i][0] ) )
+        {
+            megabytes = strtoul ( argv[i], NULL, 10 );
+
+        } else
+        {
+            base = argv[i];
+        }
+    }
+
+    if ( !megabytes )
+    {
+        megabytes = 1;
+    }
+
+    /* Sbox binary defaults to one beside bench binary, absolute path survives chdir */
+    if ( !realpath ( sbox_path ? sbox_path : argv[0], sbox ) )
+    {
+        perror ( sbox_path ? sbox_path : argv[0] );
+        return 1;
+    }
+
+    if ( !sbox_path && ( slash = strrchr ( sbox, '/' ) ) )
+    {
+        snprintf ( slash + 1, sizeof ( sbox ) - ( slash + 1 - sbox ), "sbox" );
+    }
+
+    if ( access ( sbox, X_OK ) < 0 )
+    {
+        perror ( sbox );
+        return 1;
+    }
+
+    if ( baseline_path && !( count = bench_load_baseline ( baseline_path, baseline ) ) )
+    {
+        fprintf ( stderr, "Error: No rows in baseline %s.\n", baseline_path );
+        return 1;
+    }
+
+    if ( save_path && !( save = fopen ( save_path, "w" ) ) )
+    {
+        perror ( save_path );
+        return 1;
+    }
+
+    nftw ( base, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+
+    if ( mkdir ( base, 0755 ) < 0 || chdir ( base ) < 0 )
+    {
+        perror ( base );
+        if ( save )
+        {
+            fclose ( save );
+        }
+        return 1;
+    }
+
+    snprintf ( row, sizeof ( row ), "%-8s %-8s %-8s %10s %12s %9s %8s", "corpus", "mode", "op",
+        "MB/s", "files/s", "rss KB", "cpu s" );
+    printf ( "%s%s\n", row, count ? "   change" : "" );
+
+    if ( save )
+    {
+        fprintf ( save, "%s\n", row );
+    }
+
+    for ( c = 0; bench_shapes[c].name && status != 1; c++ )
+    {
+        corpus.name = bench_shapes[c].name;
+        corpus.entries = 0;
+        corpus.bytes = 0;
+
+        if ( bench_shapes[c].make ( &corpus, megabytes ) < 0 )
+        {
+            status = 1;
+            break;
+        }
+
+        for ( m = 0; bench_modes[m].name && status != 1; m++ )
+        {
+            for ( o = 0; bench_ops[o].name; o++ )
+            {
+                if ( bench_task ( sbox, &corpus, bench_modes + m, bench_ops + o, &result ) < 0 )
+                {
+                    status = 1;
+                    break;
+                }
+
+                bench_format ( &result, row, sizeof ( row ) );
+
+                if ( save )
+                {
+                    fprintf ( save, "%s\n", row );
+                }
+
+                if ( !( previous = bench_find_baseline ( baseline, count, &result ) ) )
+                {
+                    printf ( "%s\n", row );
+                    fflush ( stdout );
+                    continue;
+                }
+
+                /* Throughput drop past threshold fails run once all rows are shown */
+                change = previous->speed > 0 ? ( result.speed / previous->speed - 1 ) * 100 : 0;
+                printf ( "%s %+7.1f%%%s\n", row, change,
+                    change < -BENCH_REGRESSION ? " REGRESSION" : "" );
+                fflush ( stdout );
+
+                if ( change < -BENCH_REGRESSION )
+                {
+                    status = 2;
+                }
+            }
+        }
+
+        nftw ( corpus.name, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+    }
+
+    if ( save )
+    {
+        fclose ( save );
+    }
+
+    if ( chdir ( "/" ) == 0 )
+    {
+        nftw ( base, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+    }
+
+    return status;
+}
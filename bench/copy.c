@@ -0,0 +1,299 @@
+/* ------------------------------------------------------------------
+ * SBox - Stream Copy Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <time.h>
+
+#define BENCH_DEFAULT_MEGABYTES 64
+#define BENCH_PASSWORD "Bench!Passw0rd#1"
+
+/**
+ * Stream stack variant
+ */
+struct bench_mode_t
+{
+    const char *name;
+    const char *password;
+    uint8_t compression;
+};
+
+/**
+ * Stream stacks measured
+ */
+static const struct bench_mode_t bench_modes[] = {
+    {"plain", NULL, COMP_NONE},
+    {"lz4", NULL, COMP_LZ4},
+    {"aes", BENCH_PASSWORD, COMP_NONE},
+    {"lz4+aes", BENCH_PASSWORD, COMP_LZ4},
+    {NULL, NULL, 0}
+};
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Get bytes copied between stream buffers so far
+ */
+static uint64_t bench_copied ( void )
+{
+    uint64_t copies;
+    uint64_t bytes;
+
+    stream_copy_stats ( &copies, &bytes );
+
+    return bytes;
+}
+
+/**
+ * Fill chunk with data compressing about two to one
+ */
+static void bench_fill ( uint8_t * data, size_t len, uint64_t seed )
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = ( i & 1 ) ? ( uint8_t ) ( seed >> 56 ) : 'a' + i % 16;
+    }
+}
+
+/**
+ * Write payload through output stream stack, borrowing its buffers if asked
+ */
+static int bench_write ( const struct bench_mode_t *mode, const char *path, size_t chunks,
+    int borrow )
+{
+    int fd;
+    size_t i;
+    size_t len;
+    size_t sum;
+    void *data;
+    struct io_stream_t *io;
+    uint8_t buffer[CHUNK_SIZE];
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    if ( !( io = output_stream_new ( fd, mode->password, mode->compression, 1 ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    for ( i = 0; i < chunks; i++ )
+    {
+        if ( !borrow )
+        {
+            bench_fill ( buffer, sizeof ( buffer ), i );
+
+            if ( io->write_complete ( io, buffer, sizeof ( buffer ) ) < 0 )
+            {
+                io->close ( io );
+                return -1;
+            }
+
+            continue;
+        }
+
+        for ( sum = 0; sum < sizeof ( buffer ); sum += len )
+        {
+            if ( ( ssize_t ) ( len =
+                    stream_reserve ( io, &data, buffer, sizeof ( buffer ) - sum ) ) < 0 )
+            {
+                io->close ( io );
+                return -1;
+            }
+
+            /* Generated data stands in for file read into borrowed space */
+            bench_fill ( data, len, i + sum );
+
+            if ( stream_commit ( io, data, len ) < 0 )
+            {
+                io->close ( io );
+                return -1;
+            }
+        }
+    }
+
+    if ( io->flush ( io ) < 0 )
+    {
+        io->close ( io );
+        return -1;
+    }
+
+    io->close ( io );
+
+    return 0;
+}
+
+/**
+ * Read payload back through input stream stack, borrowing its buffers if asked
+ */
+static int bench_read ( const struct bench_mode_t *mode, const char *path, size_t chunks,
+    int borrow, uint32_t * crc )
+{
+    int fd;
+    size_t len;
+    size_t sum;
+    size_t total;
+    const void *data;
+    struct io_stream_t *io;
+    uint8_t buffer[CHUNK_SIZE];
+
+    if ( ( fd = open ( path, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    if ( !( io = input_stream_new ( fd, mode->password, NULL ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    *crc = 0;
+    total = chunks * CHUNK_SIZE;
+
+    for ( sum = 0; sum < total; sum += len )
+    {
+        len = MIN ( sizeof ( buffer ), total - sum );
+
+        if ( !borrow )
+        {
+            if ( io->read_complete ( io, buffer, len ) < 0 )
+            {
+                io->close ( io );
+                return -1;
+            }
+
+            *crc = crc32c_update ( *crc, buffer, len );
+            continue;
+        }
+
+        if ( ( ssize_t ) ( len = stream_peek ( io, &data, buffer, len ) ) <= 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+
+        *crc = crc32c_update ( *crc, data, len );
+
+        if ( stream_consume ( io, len ) < 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+    }
+
+    io->close ( io );
+
+    return 0;
+}
+
+/**
+ * Measure one stream stack with copying and borrowing callers
+ */
+static int bench_mode ( const struct bench_mode_t *mode, const char *path, size_t chunks )
+{
+    int borrow;
+    double start;
+    double elapsed[2];
+    uint64_t copied[2];
+    uint32_t crc[2];
+    double megabytes;
+
+    megabytes = chunks * ( double ) CHUNK_SIZE / ( 1024 * 1024 );
+
+    for ( borrow = 0; borrow < 2; borrow++ )
+    {
+        copied[0] = bench_copied (  );
+        start = bench_now (  );
+
+        if ( bench_write ( mode, path, chunks, borrow ) < 0 )
+        {
+            fprintf ( stderr, "%s: write failed\n", mode->name );
+            return -1;
+        }
+
+        elapsed[0] = bench_now (  ) - start;
+        copied[1] = bench_copied (  );
+        copied[0] = copied[1] - copied[0];
+        start = bench_now (  );
+
+        if ( bench_read ( mode, path, chunks, borrow, crc + borrow ) < 0 )
+        {
+            fprintf ( stderr, "%s: read failed\n", mode->name );
+            return -1;
+        }
+
+        elapsed[1] = bench_now (  ) - start;
+        copied[1] = bench_copied (  ) - copied[1];
+
+        printf ( "%-8s %-6s write %7.1f MB/s %5.2f copies/byte  "
+            "read %7.1f MB/s %5.2f copies/byte\n", mode->name, borrow ? "borrow" : "copy",
+            megabytes / elapsed[0], copied[0] / ( megabytes * 1024 * 1024 ),
+            megabytes / elapsed[1], copied[1] / ( megabytes * 1024 * 1024 ) );
+    }
+
+    if ( crc[0] != crc[1] )
+    {
+        fprintf ( stderr, "%s: borrowed data differs\n", mode->name );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int status = 0;
+    size_t i;
+    size_t chunks;
+    size_t megabytes = BENCH_DEFAULT_MEGABYTES;
+    const char *path = "/tmp/sbox-copy-bench.sbox";
+
+    if ( argc > 1 )
+    {
+        megabytes = strtoul ( argv[1], NULL, 10 );
+    }
+
+    if ( argc > 2 )
+    {
+        path = argv[2];
+    }
+
+    if ( !( chunks = megabytes * 1024 * 1024 / CHUNK_SIZE ) )
+    {
+        chunks = 1;
+    }
+
+    for ( i = 0; bench_modes[i].name; i++ )
+    {
+        if ( bench_mode ( bench_modes + i, path, chunks ) < 0 )
+        {
+            status = 1;
+        }
+    }
+
+    unlink ( path );
+
+    return status;
+}
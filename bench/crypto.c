@@ -0,0 +1,282 @@
+/* ------------------------------------------------------------------
+ * SBox - Crypto Backend Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <time.h>
+
+#ifdef ENABLE_ENCRYPTION
+
+#define BENCH_DEFAULT_MEGABYTES 256
+#define BENCH_ROUNDS 3
+#define BENCH_KEYLEN 32
+#define BENCH_BLOCKLEN 16
+#define BENCH_DIGESTLEN 32
+
+/**
+ * Backend results compared against first backend
+ */
+struct bench_result_t
+{
+    uint8_t cipher[CHUNK_SIZE];
+    uint8_t digest[BENCH_DIGESTLEN];
+};
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Time CBC pass over chunks, best of rounds
+ */
+static double bench_cipher ( const struct crypto_backend_t *crypto, int encrypt,
+    const uint8_t * key, const uint8_t * input, uint8_t * output, size_t chunks )
+{
+    int i;
+    size_t j;
+    void *cipher;
+    double start;
+    double best = 0;
+    double elapsed;
+    uint8_t iv[BENCH_BLOCKLEN];
+
+    if ( !( cipher = crypto->cipher_new ( key, encrypt ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < BENCH_ROUNDS; i++ )
+    {
+        memset ( iv, '\0', sizeof ( iv ) );
+        start = bench_now (  );
+
+        for ( j = 0; j < chunks; j++ )
+        {
+            if ( crypto->cipher_cbc ( cipher, iv, input, output, CHUNK_SIZE ) < 0 )
+            {
+                crypto->cipher_free ( cipher );
+                return -1;
+            }
+        }
+
+        elapsed = bench_now (  ) - start;
+
+        if ( !i || elapsed < best )
+        {
+            best = elapsed;
+        }
+    }
+
+    crypto->cipher_free ( cipher );
+
+    return best;
+}
+
+/**
+ * Time HMAC pass over chunks, best of rounds
+ */
+static double bench_mac ( const struct crypto_backend_t *crypto, const uint8_t * key,
+    const uint8_t * input, uint8_t * digest, size_t chunks )
+{
+    int i;
+    size_t j;
+    void *mac;
+    double start;
+    double best = 0;
+    double elapsed;
+
+    if ( !( mac = crypto->mac_new ( key, BENCH_KEYLEN ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < BENCH_ROUNDS; i++ )
+    {
+        start = bench_now (  );
+
+        for ( j = 0; j < chunks; j++ )
+        {
+            if ( crypto->mac_update ( mac, input, CHUNK_SIZE ) < 0 )
+            {
+                crypto->mac_free ( mac );
+                return -1;
+            }
+        }
+
+        if ( crypto->mac_finish ( mac, digest ) < 0 )
+        {
+            crypto->mac_free ( mac );
+            return -1;
+        }
+
+        elapsed = bench_now (  ) - start;
+
+        if ( !i || elapsed < best )
+        {
+            best = elapsed;
+        }
+    }
+
+    crypto->mac_free ( mac );
+
+    return best;
+}
+
+/**
+ * Benchmark one backend and check its output matches reference
+ */
+static int bench_backend ( const struct crypto_backend_t *crypto, const uint8_t * key,
+    const uint8_t * input, size_t chunks, struct bench_result_t *result, int reference )
+{
+    double megabytes;
+    double encrypt;
+    double decrypt;
+    double mac;
+    uint8_t iv[BENCH_BLOCKLEN];
+    uint8_t plain[CHUNK_SIZE];
+    uint8_t cipher[CHUNK_SIZE];
+    uint8_t digest[BENCH_DIGESTLEN];
+    void *context;
+
+    megabytes = chunks * ( double ) CHUNK_SIZE / ( 1024 * 1024 );
+
+    if ( ( encrypt = bench_cipher ( crypto, 1, key, input, cipher, chunks ) ) < 0
+        || ( decrypt = bench_cipher ( crypto, 0, key, input, plain, chunks ) ) < 0
+        || ( mac = bench_mac ( crypto, key, input, digest, chunks ) ) < 0 )
+    {
+        fprintf ( stderr, "%s: failed\n", crypto->name );
+        return -1;
+    }
+
+    /* Final chained ciphertext and digest must not depend on backend */
+    if ( reference && ( memcmp ( cipher, result->cipher, sizeof ( cipher ) )
+            || memcmp ( digest, result->digest, sizeof ( digest ) ) ) )
+    {
+        fprintf ( stderr, "%s: output differs from %s\n", crypto->name,
+            crypto_backend_list ( 0 )->name );
+        return -1;
+    }
+
+    memcpy ( result->cipher, cipher, sizeof ( cipher ) );
+    memcpy ( result->digest, digest, sizeof ( digest ) );
+
+    /* One chunk must decrypt back in place, the way header nonce is */
+    if ( !( context = crypto->cipher_new ( key, 1 ) ) )
+    {
+        return -1;
+    }
+
+    memset ( iv, '\0', sizeof ( iv ) );
+
+    if ( crypto->cipher_cbc ( context, iv, input, cipher, CHUNK_SIZE ) < 0 )
+    {
+        crypto->cipher_free ( context );
+        return -1;
+    }
+
+    crypto->cipher_free ( context );
+
+    if ( !( context = crypto->cipher_new ( key, 0 ) ) )
+    {
+        return -1;
+    }
+
+    memset ( iv, '\0', sizeof ( iv ) );
+
+    if ( crypto->cipher_cbc ( context, iv, cipher, cipher, CHUNK_SIZE ) < 0
+        || memcmp ( cipher, input, CHUNK_SIZE ) )
+    {
+        fprintf ( stderr, "%s: decryption mismatch\n", crypto->name );
+        crypto->cipher_free ( context );
+        return -1;
+    }
+
+    crypto->cipher_free ( context );
+
+    printf ( "%-8s encrypt %8.1f MB/s  decrypt %8.1f MB/s  hmac %8.1f MB/s\n", crypto->name,
+        megabytes / encrypt, megabytes / decrypt, megabytes / mac );
+
+    return 0;
+}
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int status = 0;
+    size_t i;
+    size_t chunks;
+    size_t megabytes = BENCH_DEFAULT_MEGABYTES;
+    const struct crypto_backend_t *crypto;
+    uint8_t key[BENCH_KEYLEN];
+    uint8_t *input;
+    struct bench_result_t *result;
+
+    if ( argc > 1 )
+    {
+        megabytes = strtoul ( argv[1], NULL, 10 );
+    }
+
+    chunks = megabytes * 1024 * 1024 / CHUNK_SIZE;
+
+    if ( !chunks )
+    {
+        chunks = 1;
+    }
+
+    for ( i = 0; i < sizeof ( key ); i++ )
+    {
+        key[i] = i * 7 + 1;
+    }
+
+    if ( !( input = ( uint8_t * ) malloc ( CHUNK_SIZE ) ) )
+    {
+        return 1;
+    }
+
+    if ( !( result = ( struct bench_result_t * ) malloc ( sizeof ( struct bench_result_t ) ) ) )
+    {
+        free ( input );
+        return 1;
+    }
+
+    for ( i = 0; i < CHUNK_SIZE; i++ )
+    {
+        input[i] = i * 31 + ( i >> 8 );
+    }
+
+    for ( i = 0; ( crypto = crypto_backend_list ( i ) ); i++ )
+    {
+        if ( bench_backend ( crypto, key, input, chunks, result, i > 0 ) < 0 )
+        {
+            status = 1;
+        }
+    }
+
+    free ( result );
+    free ( input );
+
+    return status;
+}
+
+#else
+
+/**
+ * Benchmark entry point, nothing to measure without crypto support
+ */
+int main ( void )
+{
+    fprintf ( stderr, "Crypto support not enabled.\n" );
+    return 0;
+}
+
+#endif
@@ -0,0 +1,551 @@
+/* ------------------------------------------------------------------
+ * SBox - Stream Layer Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <time.h>
+#include <sys/mman.h>
+
+#define BENCH_DEFAULT_MEGABYTES 16
+#define BENCH_CALLS_MAX 4194304
+#define BENCH_PAYLOAD 1048576
+#define BENCH_PASSWORD "Bench!Passw0rd#1"
+#define BENCH_BUDGET_STREAMS 16
+
+#define BENCH_LAYER_FILE 0
+#define BENCH_LAYER_BUFFER 1
+#define BENCH_LAYER_LZ4 2
+#define BENCH_LAYER_AES 3
+
+/**
+ * In-memory storage written by sink and read back by source
+ */
+struct bench_memory_t
+{
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    size_t offset;
+    int fd;
+};
+
+/**
+ * Stream layer measured, file layer runs over memfd and others over memory stream
+ */
+struct bench_layer_t
+{
+    const char *name;
+    int kind;
+};
+
+/**
+ * Layers measured
+ */
+static const struct bench_layer_t bench_layers[] = {
+    {"file", BENCH_LAYER_FILE},
+    {"buffer", BENCH_LAYER_BUFFER},
+#ifdef ENABLE_LZ4
+    {"lz4", BENCH_LAYER_LZ4},
+#endif
+#ifdef ENABLE_ENCRYPTION
+    {"aes", BENCH_LAYER_AES},
+#endif
+    {NULL, 0}
+};
+
+/**
+ * Call sizes measured
+ */
+static const size_t bench_sizes[] = {
+    1, 16, 256, 4096, 65536, 0
+};
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill data compressing about two to one
+ */
+static void bench_fill ( uint8_t * data, size_t len, uint64_t seed )
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = ( i & 1 ) ? ( uint8_t ) ( seed >> 56 ) : 'a' + i % 16;
+    }
+}
+
+/*
+ * Read data from memory stream
+ */
+static ssize_t bench_memory_read ( struct io_stream_t *io, void *data, size_t len )
+{
+    struct bench_memory_t *memory;
+
+    memory = ( struct bench_memory_t * ) io->context;
+
+    len = MIN ( len, memory->length - memory->offset );
+    memcpy ( data, memory->data + memory->offset, len );
+    memory->offset += len;
+
+    return len;
+}
+
+/*
+ * Write data to memory stream
+ */
+static ssize_t bench_memory_write ( struct io_stream_t *io, const void *data, size_t len )
+{
+    size_t capacity;
+    uint8_t *resized;
+    struct bench_memory_t *memory;
+
+    memory = ( struct bench_memory_t * ) io->context;
+
+    if ( memory->length + len > memory->capacity )
+    {
+        capacity = MAX ( memory->capacity * 2, memory->length + len );
+
+        if ( !( resized = ( uint8_t * ) realloc ( memory->data, capacity ) ) )
+        {
+            return -1;
+        }
+
+        memory->data = resized;
+        memory->capacity = capacity;
+    }
+
+    memcpy ( memory->data + memory->length, data, len );
+    memory->length += len;
+
+    return len;
+}
+
+/*
+ * Verify memory stream integrity
+ */
+static int bench_memory_verify ( struct io_stream_t *io )
+{
+    UNUSED ( io );
+
+    return 0;
+}
+
+/*
+ * Flush memory stream output
+ */
+static int bench_memory_flush ( struct io_stream_t *io )
+{
+    UNUSED ( io );
+
+    return 0;
+}
+
+/*
+ * Start new block in memory stream output
+ */
+static int bench_memory_split ( struct io_stream_t *io, uint64_t * offset )
+{
+    struct bench_memory_t *memory;
+
+    memory = ( struct bench_memory_t * ) io->context;
+    *offset = memory->length;
+
+    return 0;
+}
+
+/*
+ * Write annotation data to memory stream
+ */
+static int bench_memory_annotate ( struct io_stream_t *io, const void *data, size_t len )
+{
+    return io->write_complete ( io, data, len );
+}
+
+/*
+ * Seek memory stream to offset
+ */
+static int bench_memory_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    struct bench_memory_t *memory;
+
+    memory = ( struct bench_memory_t * ) io->context;
+
+    if ( offset > memory->length )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memory->offset = offset;
+
+    return 0;
+}
+
+/*
+ * Get memory stream length
+ */
+static int bench_memory_length ( struct io_stream_t *io, uint64_t * length )
+{
+    struct bench_memory_t *memory;
+
+    memory = ( struct bench_memory_t * ) io->context;
+    *length = memory->length;
+
+    return 0;
+}
+
+/*
+ * Close memory stream, storage is kept for reading back
+ */
+static void bench_memory_close ( struct io_stream_t *io )
+{
+    free ( io );
+}
+
+/**
+ * Create memory stream over storage, sink starts empty and source at its start
+ */
+static struct io_stream_t *bench_memory_stream_new ( struct bench_memory_t *memory, int input )
+{
+    struct io_stream_t *io;
+
+    if ( !( io = io_stream_new (  ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !input )
+    {
+        memory->length = 0;
+    }
+
+    memory->offset = 0;
+
+    io->context = memory;
+    io->read = bench_memory_read;
+    io->write = bench_memory_write;
+    io->verify = bench_memory_verify;
+    io->flush = bench_memory_flush;
+    io->split = bench_memory_split;
+    io->annotate = bench_memory_annotate;
+    io->seek = bench_memory_seek;
+    io->length = bench_memory_length;
+    io->close = bench_memory_close;
+
+    return io;
+}
+
+/**
+ * Open layer over memory for writing or reading back
+ */
+static struct io_stream_t *bench_open ( const struct bench_layer_t *layer,
+    struct bench_memory_t *memory, int input )
+{
+    int fd;
+    struct io_stream_t *io;
+    struct io_stream_t *internal;
+
+    /* File stream closes its descriptor, memfd is kept open through duplicate */
+    if ( layer->kind == BENCH_LAYER_FILE )
+    {
+        if ( ( !input && ftruncate ( memory->fd, 0 ) < 0 )
+            || lseek ( memory->fd, 0, SEEK_SET ) < 0 || ( fd = dup ( memory->fd ) ) < 0 )
+        {
+            return NULL;
+        }
+
+        if ( !( io = file_stream_new ( fd ) ) )
+        {
+            close ( fd );
+            return NULL;
+        }
+
+        return io;
+    }
+
+    if ( !( internal = bench_memory_stream_new ( memory, input ) ) )
+    {
+        return NULL;
+    }
+
+    switch ( layer->kind )
+    {
+    case BENCH_LAYER_BUFFER:
+        io = buffer_stream_new ( internal );
+        break;
+#ifdef ENABLE_LZ4
+    case BENCH_LAYER_LZ4:
+        io = input ? input_lz4_stream_new ( internal ) : output_lz4_stream_new ( internal, 1 );
+        break;
+#endif
+#ifdef ENABLE_ENCRYPTION
+    case BENCH_LAYER_AES:
+        io = input ? input_aes_stream_new ( internal,
+            BENCH_PASSWORD ) : output_aes_stream_new ( internal, BENCH_PASSWORD );
+        break;
+#endif
+    default:
+        errno = EINVAL;
+        io = NULL;
+        break;
+    }
+
+    if ( !io )
+    {
+        internal->close ( internal );
+        return NULL;
+    }
+
+    return io;
+}
+
+/**
+ * Write total bytes through layer in calls of given size, returns seconds taken
+ * not counting stream setup such as key derivation
+ */
+static double bench_write ( const struct bench_layer_t *layer, struct bench_memory_t *memory,
+    const uint8_t * payload, size_t size, size_t total )
+{
+    size_t sum;
+    double start;
+    double elapsed;
+    struct io_stream_t *io;
+
+    if ( !( io = bench_open ( layer, memory, 0 ) ) )
+    {
+        return -1;
+    }
+
+    start = bench_now (  );
+
+    for ( sum = 0; sum < total; sum += size )
+    {
+        if ( io->write_complete ( io, payload + sum % BENCH_PAYLOAD, size ) < 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+    }
+
+    if ( io->flush ( io ) < 0 )
+    {
+        io->close ( io );
+        return -1;
+    }
+
+    elapsed = bench_now (  ) - start;
+    io->close ( io );
+
+    return elapsed;
+}
+
+/**
+ * Read total bytes back through layer in calls of given size, returns seconds taken
+ */
+static double bench_read ( const struct bench_layer_t *layer, struct bench_memory_t *memory,
+    uint8_t * buffer, size_t size, size_t total )
+{
+    size_t sum;
+    double start;
+    double elapsed;
+    struct io_stream_t *io;
+
+    if ( !( io = bench_open ( layer, memory, 1 ) ) )
+    {
+        return -1;
+    }
+
+    start = bench_now (  );
+
+    for ( sum = 0; sum < total; sum += size )
+    {
+        if ( io->read_complete ( io, buffer, size ) < 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+    }
+
+    elapsed = bench_now (  ) - start;
+    io->close ( io );
+
+    return elapsed;
+}
+
+/**
+ * Measure layer at each call size, small calls are capped in count
+ */
+static int bench_layer ( const struct bench_layer_t *layer, struct bench_memory_t *memory,
+    const uint8_t * payload, uint8_t * buffer, size_t megabytes )
+{
+    size_t i;
+    size_t size;
+    size_t total;
+    size_t calls;
+    double write_time;
+    double read_time;
+
+    for ( i = 0; ( size = bench_sizes[i] ); i++ )
+    {
+        calls = MIN ( megabytes * 1048576 / size, BENCH_CALLS_MAX );
+
+        if ( !calls )
+        {
+            calls = 1;
+        }
+
+        total = calls * size;
+
+        if ( ( write_time = bench_write ( layer, memory, payload, size, total ) ) < 0 )
+        {
+            fprintf ( stderr, "%s: write of %lu bytes failed\n", layer->name,
+                ( unsigned long ) size );
+            return -1;
+        }
+
+        if ( ( read_time = bench_read ( layer, memory, buffer, size, total ) ) < 0 )
+        {
+            fprintf ( stderr, "%s: read of %lu bytes failed\n", layer->name,
+                ( unsigned long ) size );
+            return -1;
+        }
+
+        printf ( "%-6s %6lu B  write %8.1f MB/s %8.1f ns/call  read %8.1f MB/s %8.1f ns/call\n",
+            layer->name, ( unsigned long ) size, total / 1048576.0 / write_time,
+            write_time * 1e9 / calls, total / 1048576.0 / read_time, read_time * 1e9 / calls );
+    }
+
+    return 0;
+}
+
+#ifdef ENABLE_ENCRYPTION
+
+/**
+ * Open and close AES streams in turn under budget fitting two of them,
+ * budget must be back where it started once all are closed
+ */
+static int bench_aes_budget ( struct bench_memory_t *memory, const uint8_t * payload,
+    uint8_t * buffer )
+{
+    size_t i;
+    size_t used;
+    size_t after;
+    size_t peak;
+    size_t spilled;
+    static const struct bench_layer_t layer = { "aes", BENCH_LAYER_AES };
+
+    budget_stats ( &used, &peak, &spilled );
+    budget_set ( used + 2 * aes_stream_memory (  ) + 4096, 0 );
+
+    for ( i = 0; i < BENCH_BUDGET_STREAMS; i += 2 )
+    {
+        if ( bench_write ( &layer, memory, payload, 4096, 65536 ) < 0
+            || bench_read ( &layer, memory, buffer, 4096, 65536 ) < 0 )
+        {
+            budget_set ( 0, 0 );
+            fprintf ( stderr, "aes: stream %lu failed under budget: %s\n",
+                ( unsigned long ) i, strerror ( errno ) );
+            return -1;
+        }
+    }
+
+    budget_set ( 0, 0 );
+    budget_stats ( &after, &peak, &spilled );
+
+    if ( after != used )
+    {
+        fprintf ( stderr, "aes: %lu bytes left counted after %u streams closed\n",
+            ( unsigned long ) ( after - used ), BENCH_BUDGET_STREAMS );
+        return -1;
+    }
+
+    printf ( "aes    budget    %u streams opened and closed, budget released\n",
+        BENCH_BUDGET_STREAMS );
+
+    return 0;
+}
+
+#endif
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int status = 0;
+    size_t i;
+    size_t megabytes = BENCH_DEFAULT_MEGABYTES;
+    uint8_t *payload;
+    uint8_t *buffer;
+    struct bench_memory_t memory;
+
+    if ( argc > 1 )
+    {
+        megabytes = strtoul ( argv[1], NULL, 10 );
+    }
+
+    if ( !megabytes )
+    {
+        megabytes = 1;
+    }
+
+    /* Payload has room for largest call past its wrap point */
+    if ( !( payload = ( uint8_t * ) malloc ( BENCH_PAYLOAD + 65536 ) ) )
+    {
+        return 1;
+    }
+
+    if ( !( buffer = ( uint8_t * ) malloc ( 65536 ) ) )
+    {
+        free ( payload );
+        return 1;
+    }
+
+    if ( ( memory.fd = memfd_create ( "sbox-layer-bench", 0 ) ) < 0 )
+    {
+        perror ( "memfd_create" );
+        free ( buffer );
+        free ( payload );
+        return 1;
+    }
+
+    bench_fill ( payload, BENCH_PAYLOAD + 65536, 1 );
+    memory.data = NULL;
+    memory.length = 0;
+    memory.capacity = 0;
+    memory.offset = 0;
+
+    for ( i = 0; bench_layers[i].name; i++ )
+    {
+        if ( bench_layer ( bench_layers + i, &memory, payload, buffer, megabytes ) < 0 )
+        {
+            status = 1;
+        }
+    }
+
+#ifdef ENABLE_ENCRYPTION
+    if ( bench_aes_budget ( &memory, payload, buffer ) < 0 )
+    {
+        status = 1;
+    }
+#endif
+
+    close ( memory.fd );
+    free ( memory.data );
+    free ( buffer );
+    free ( payload );
+
+    return status;
+}
@@ -0,0 +1,365 @@
+/* ------------------------------------------------------------------
+ * SBox - Archive Listing Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <time.h>
+#include <sys/resource.h>
+
+#define BENCH_DEFAULT_NODES 10000000
+#define BENCH_WIDE_FILES 100
+#define BENCH_WIDE_DIRS 32
+#define BENCH_DEEP_FILES 3
+#define BENCH_DEEP_DIRS 1
+
+/**
+ * Synthetic tree shape, directories are filled breadth-first
+ */
+struct bench_shape_t
+{
+    const char *name;
+    size_t files;
+    size_t dirs;
+};
+
+/**
+ * Listing benchmark context
+ */
+struct bench_list_context_t
+{
+    size_t count;
+    size_t name_bytes;
+};
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Synthetic directory being filled
+ */
+struct bench_frame_t
+{
+    size_t dir;
+    uint32_t index;
+    size_t child;
+};
+
+/**
+ * Get peak resident memory in bytes
+ */
+static size_t bench_peak_memory ( void )
+{
+    struct rusage usage;
+
+    if ( getrusage ( RUSAGE_SELF, &usage ) < 0 )
+    {
+        return 0;
+    }
+
+    return ( size_t ) usage.ru_maxrss * 1024;
+}
+
+/**
+ * Get synthetic directory content counts
+ */
+static void bench_dir_shape ( const struct bench_shape_t *shape, size_t total, size_t dir,
+    size_t *files, size_t *dirs )
+{
+    size_t used;
+    size_t left;
+
+    used = 1 + dir * ( shape->files + shape->dirs );
+    left = total > used ? total - used : 0;
+
+    *files = MIN ( shape->files, left );
+    *dirs = MIN ( shape->dirs, left - *files );
+}
+
+/**
+ * Append synthetic directory and its files
+ */
+static int bench_append_dir ( struct file_net_t *net, const struct bench_shape_t *shape,
+    size_t total, uint32_t parent, const char *name, struct bench_frame_t *frame )
+{
+    size_t i;
+    size_t files;
+    size_t dirs;
+    char file_name[64];
+
+    if ( file_net_append ( net, parent, name, S_IFDIR | 0755, 0, 0, &frame->index ) < 0 )
+    {
+        return -1;
+    }
+
+    bench_dir_shape ( shape, total, frame->dir, &files, &dirs );
+
+    for ( i = 0; i < files; i++ )
+    {
+        snprintf ( file_name, sizeof ( file_name ), "file_%06lu.dat", ( unsigned long ) i );
+
+        if ( file_net_append ( net, frame->index, file_name, S_IFREG | ( i % 8 ? 0644 : 0600 ),
+                0, 0, NULL ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    frame->child = 0;
+
+    return 0;
+}
+
+/**
+ * Build synthetic file net with given node count
+ */
+static struct file_net_t *bench_build_net ( struct arena_t *arena,
+    const struct bench_shape_t *shape, size_t total )
+{
+    size_t depth = 0;
+    size_t capacity = 64;
+    size_t files;
+    size_t dirs;
+    char name[64];
+    struct file_net_t *net;
+    struct bench_frame_t *frame;
+    struct bench_frame_t *stack;
+    struct bench_frame_t *backup;
+
+    if ( !( net = file_net_new ( arena ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( stack = ( struct bench_frame_t * ) malloc ( capacity *
+                sizeof ( struct bench_frame_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    stack[depth].dir = 0;
+
+    if ( bench_append_dir ( net, shape, total, FILE_NET_ROOT, "bench", stack + depth++ ) < 0 )
+    {
+        free ( stack );
+        return NULL;
+    }
+
+    /* Emit breadth-first filled tree in pre-order */
+    while ( depth )
+    {
+        frame = stack + depth - 1;
+        bench_dir_shape ( shape, total, frame->dir, &files, &dirs );
+
+        if ( frame->child == dirs )
+        {
+            depth--;
+            continue;
+        }
+
+        if ( depth == capacity )
+        {
+            capacity *= 2;
+            backup = stack;
+
+            if ( !( stack = ( struct bench_frame_t * ) realloc ( stack, capacity *
+                        sizeof ( struct bench_frame_t ) ) ) )
+            {
+                free ( backup );
+                return NULL;
+            }
+
+            frame = stack + depth - 1;
+        }
+
+        snprintf ( name, sizeof ( name ), "dir_%04lu", ( unsigned long ) frame->child );
+        stack[depth].dir = 1 + frame->dir * shape->dirs + frame->child++;
+
+        if ( bench_append_dir ( net, shape, total, frame->index, name, stack + depth++ ) < 0 )
+        {
+            free ( stack );
+            return NULL;
+        }
+    }
+
+    free ( stack );
+
+    return net;
+}
+
+/**
+ * Listing benchmark callback
+ */
+static int bench_list_callback ( void *context, struct sbox_node_t *node, const char *path )
+{
+    struct bench_list_context_t *list_context;
+
+    UNUSED ( path );
+
+    list_context = ( struct bench_list_context_t * ) context;
+    list_context->count++;
+    list_context->name_bytes += strlen ( node->name );
+
+    return 0;
+}
+
+/**
+ * Save synthetic file net into archive
+ */
+static int bench_save_archive ( const char *archive, const struct file_net_t *net )
+{
+    int fd;
+    struct io_stream_t *io;
+
+    if ( ( fd = open ( archive, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( archive );
+        return -1;
+    }
+
+    if ( !( io = output_stream_new ( fd, NULL, COMP_LZ4, 6 ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    if ( io->write_complete ( io, sbox_archive_prefix, sizeof ( sbox_archive_prefix ) ) < 0
+        || file_net_save ( net, io ) < 0 || io->flush ( io ) < 0 )
+    {
+        io->close ( io );
+        return -1;
+    }
+
+    io->close ( io );
+
+    return 0;
+}
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int fd;
+    size_t total = BENCH_DEFAULT_NODES;
+    const char *archive = "/tmp/sbox-list-bench.sbox";
+    size_t build_memory;
+    double start;
+    double load_time;
+    double iter_time;
+    struct stat statbuf;
+    struct io_stream_t *io;
+    struct arena_t arena;
+    struct file_net_t *net;
+    struct bench_shape_t shape = { "wide", BENCH_WIDE_FILES, BENCH_WIDE_DIRS };
+    struct bench_list_context_t list_context;
+    unsigned char prefix[ARCHIVE_PREFIX_LENGTH];
+
+    if ( argc > 1 )
+    {
+        total = strtoul ( argv[1], NULL, 10 );
+    }
+
+    if ( argc > 2 )
+    {
+        if ( !strcmp ( argv[2], "deep" ) )
+        {
+            shape.name = "deep";
+            shape.files = BENCH_DEEP_FILES;
+            shape.dirs = BENCH_DEEP_DIRS;
+
+        } else if ( strcmp ( argv[2], "wide" ) )
+        {
+            fprintf ( stderr, "usage: %s [nodes] [wide|deep] [archive]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    if ( argc > 3 )
+    {
+        archive = argv[3];
+    }
+
+    arena_new ( &arena );
+
+    if ( !( net = bench_build_net ( &arena, &shape, total ) ) )
+    {
+        fprintf ( stderr, "Error: Failed to build synthetic file net.\n" );
+        return 1;
+    }
+
+    build_memory = bench_peak_memory (  );
+    start = bench_now (  );
+
+    if ( bench_save_archive ( archive, net ) < 0 )
+    {
+        return 1;
+    }
+
+    printf ( "nodes:      %lu (%s)\n", ( unsigned long ) total, shape.name );
+    printf ( "build:      %lu bytes peak (%.1f bytes/node)\n", ( unsigned long ) build_memory,
+        ( double ) build_memory / total );
+    printf ( "save:       %.3f s\n", bench_now (  ) - start );
+
+    arena_free ( &arena );
+
+    if ( stat ( archive, &statbuf ) >= 0 )
+    {
+        printf ( "archive:    %lu bytes (%.2f bytes/node)\n", ( unsigned long ) statbuf.st_size,
+            ( double ) statbuf.st_size / total );
+    }
+
+    if ( ( fd = open ( archive, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        perror ( archive );
+        return 1;
+    }
+
+    start = bench_now (  );
+
+    if ( !( io = input_stream_new ( fd, NULL, NULL ) ) )
+    {
+        close ( fd );
+        return 1;
+    }
+
+    if ( io->read_complete ( io, prefix, sizeof ( prefix ) ) < 0
+        || !( net = file_net_load ( &arena, io ) ) )
+    {
+        io->close ( io );
+        return 1;
+    }
+
+    load_time = bench_now (  ) - start;
+
+    list_context.count = 0;
+    list_context.name_bytes = 0;
+
+    start = bench_now (  );
+
+    if ( file_net_iter ( net, &list_context, bench_list_callback ) < 0 )
+    {
+        io->close ( io );
+        return 1;
+    }
+
+    iter_time = bench_now (  ) - start;
+
+    io->close ( io );
+    arena_free ( &arena );
+    unlink ( archive );
+
+    printf ( "load:       %.3f s (%.1f ns/node)\n", load_time, load_time * 1e9 / total );
+    printf ( "iterate:    %.3f s (%.1f ns/node)\n", iter_time, iter_time * 1e9 / total );
+    printf ( "list:       %.3f s\n", load_time + iter_time );
+
+    return list_context.count != total;
+}
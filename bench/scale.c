@@ -0,0 +1,537 @@
+/* ------------------------------------------------------------------
+ * SBox - File Net Scaling Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_MAX 1000000
+#define BENCH_TREE_MAX 100000
+
+/**
+ * Synthetic tree shape, directories are filled breadth-first
+ */
+struct bench_shape_t
+{
+    const char *name;
+    size_t files;
+    size_t dirs;
+};
+
+/**
+ * Synthetic directory being filled
+ */
+struct bench_frame_t
+{
+    size_t dir;
+    uint32_t index;
+    size_t child;
+};
+
+/**
+ * Tree creation and iteration context
+ */
+struct bench_iter_context_t
+{
+    size_t count;
+    const char *root;
+};
+
+/**
+ * Shapes measured, from many files per directory to long directory chains
+ */
+static const struct bench_shape_t bench_shapes[] = {
+    {"flat", 10000, 1},
+    {"wide", 100, 32},
+    {"bushy", 8, 8},
+    {"deep", 3, 1},
+    {NULL, 0, 0}
+};
+
+/**
+ * Entry counts measured up to requested maximum
+ */
+static const size_t bench_counts[] = {
+    1000, 10000, 100000, 1000000, 10000000, 50000000, 0
+};
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Get bytes held by arenas and other budget allocations
+ */
+static size_t bench_used_memory ( void )
+{
+    size_t used;
+    size_t peak;
+    size_t spilled;
+
+    budget_stats ( &used, &peak, &spilled );
+
+    return used + spilled;
+}
+
+/**
+ * Get synthetic directory content counts
+ */
+static void bench_dir_shape ( const struct bench_shape_t *shape, size_t total, size_t dir,
+    size_t *files, size_t *dirs )
+{
+    size_t used;
+    size_t left;
+
+    used = 1 + dir * ( shape->files + shape->dirs );
+    left = total > used ? total - used : 0;
+
+    *files = MIN ( shape->files, left );
+    *dirs = MIN ( shape->dirs, left - *files );
+}
+
+/**
+ * Append synthetic directory and its files
+ */
+static int bench_append_dir ( struct file_net_t *net, const struct bench_shape_t *shape,
+    size_t total, uint32_t parent, const char *name, struct bench_frame_t *frame )
+{
+    size_t i;
+    size_t files;
+    size_t dirs;
+    char file_name[64];
+
+    if ( file_net_append ( net, parent, name, S_IFDIR | 0755, 0, 0, &frame->index ) < 0 )
+    {
+        return -1;
+    }
+
+    bench_dir_shape ( shape, total, frame->dir, &files, &dirs );
+
+    for ( i = 0; i < files; i++ )
+    {
+        snprintf ( file_name, sizeof ( file_name ), "file_%06lu.dat", ( unsigned long ) i );
+
+        if ( file_net_append ( net, frame->index, file_name, S_IFREG | ( i % 8 ? 0644 : 0600 ),
+                0, 0, NULL ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    frame->child = 0;
+
+    return 0;
+}
+
+/**
+ * Build synthetic file net with given entry count
+ */
+static struct file_net_t *bench_build_net ( struct arena_t *arena,
+    const struct bench_shape_t *shape, size_t total )
+{
+    size_t depth = 0;
+    size_t capacity = 64;
+    size_t files;
+    size_t dirs;
+    char name[64];
+    struct file_net_t *net;
+    struct bench_frame_t *frame;
+    struct bench_frame_t *stack;
+    struct bench_frame_t *backup;
+
+    if ( !( net = file_net_new ( arena ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( stack = ( struct bench_frame_t * ) malloc ( capacity *
+                sizeof ( struct bench_frame_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    stack[depth].dir = 0;
+
+    if ( bench_append_dir ( net, shape, total, FILE_NET_ROOT, "bench", stack + depth++ ) < 0 )
+    {
+        free ( stack );
+        return NULL;
+    }
+
+    /* Emit breadth-first filled tree in pre-order */
+    while ( depth )
+    {
+        frame = stack + depth - 1;
+        bench_dir_shape ( shape, total, frame->dir, &files, &dirs );
+
+        if ( frame->child == dirs )
+        {
+            depth--;
+            continue;
+        }
+
+        if ( depth == capacity )
+        {
+            capacity *= 2;
+            backup = stack;
+
+            if ( !( stack = ( struct bench_frame_t * ) realloc ( stack, capacity *
+                        sizeof ( struct bench_frame_t ) ) ) )
+            {
+                free ( backup );
+                return NULL;
+            }
+
+            frame = stack + depth - 1;
+        }
+
+        snprintf ( name, sizeof ( name ), "dir_%04lu", ( unsigned long ) frame->child );
+        stack[depth].dir = 1 + frame->dir * shape->dirs + frame->child++;
+
+        if ( bench_append_dir ( net, shape, total, frame->index, name, stack + depth++ ) < 0 )
+        {
+            free ( stack );
+            return NULL;
+        }
+    }
+
+    free ( stack );
+
+    return net;
+}
+
+/**
+ * Count iterated entries
+ */
+static int bench_count_callback ( void *context, struct sbox_node_t *node, const char *path )
+{
+    UNUSED ( node );
+    UNUSED ( path );
+
+    ( ( struct bench_iter_context_t * ) context )->count++;
+
+    return 0;
+}
+
+/**
+ * Create tree entry on disk for file net entry
+ */
+static int bench_create_callback ( void *context, struct sbox_node_t *node, const char *path )
+{
+    int fd;
+    char full[PATH_MAX];
+    struct bench_iter_context_t *iter_context;
+
+    iter_context = ( struct bench_iter_context_t * ) context;
+
+    if ( ( size_t ) snprintf ( full, sizeof ( full ), "%s/%s", iter_context->root,
+            path ) >= sizeof ( full ) )
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ( S_ISDIR ( node->mode ) )
+    {
+        if ( mkdir ( full, 0755 ) < 0 )
+        {
+            return -1;
+        }
+
+    } else
+    {
+        if ( ( fd = open ( full, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+        {
+            return -1;
+        }
+
+        close ( fd );
+    }
+
+    iter_context->count++;
+
+    return 0;
+}
+
+/**
+ * Remove tree entry
+ */
+static int bench_remove_entry ( const char *path, const struct stat *statbuf, int flag,
+    struct FTW *ftw )
+{
+    UNUSED ( statbuf );
+    UNUSED ( flag );
+    UNUSED ( ftw );
+
+    return remove ( path );
+}
+
+/**
+ * Time file net build over tree generated on disk from synthetic net,
+ * returns zero if tree is too large or too deep for the directory
+ */
+static double bench_build ( const struct file_net_t *net, const char *root )
+{
+    double start;
+    double elapsed;
+    char path[PATH_MAX];
+    const char *paths[2] = { path, NULL };
+    struct arena_t arena;
+    struct bench_iter_context_t iter_context;
+
+    iter_context.count = 0;
+    iter_context.root = root;
+
+    nftw ( root, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+
+    if ( mkdir ( root, 0755 ) < 0 )
+    {
+        perror ( root );
+        return -1;
+    }
+
+    if ( file_net_iter ( net, &iter_context, bench_create_callback ) < 0 )
+    {
+        nftw ( root, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+        return 0;
+    }
+
+    if ( ( size_t ) snprintf ( path, sizeof ( path ), "%s/bench", root ) >= sizeof ( path ) )
+    {
+        nftw ( root, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+        return 0;
+    }
+
+    arena_new ( &arena );
+    start = bench_now (  );
+
+    if ( !build_file_net ( &arena, paths ) )
+    {
+        arena_free ( &arena );
+        nftw ( root, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+        return -1;
+    }
+
+    elapsed = bench_now (  ) - start;
+    arena_free ( &arena );
+    nftw ( root, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+
+    return elapsed;
+}
+
+/**
+ * Save file net into uncompressed archive so only metadata path is timed
+ */
+static double bench_save ( const struct file_net_t *net, const char *archive )
+{
+    int fd;
+    double start;
+    double elapsed;
+    struct io_stream_t *io;
+
+    if ( ( fd = open ( archive, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( archive );
+        return -1;
+    }
+
+    if ( !( io = output_stream_new ( fd, NULL, COMP_NONE, 0 ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    start = bench_now (  );
+
+    if ( io->write_complete ( io, sbox_archive_prefix, sizeof ( sbox_archive_prefix ) ) < 0
+        || file_net_save ( net, io ) < 0 || io->flush ( io ) < 0 )
+    {
+        io->close ( io );
+        return -1;
+    }
+
+    elapsed = bench_now (  ) - start;
+    io->close ( io );
+
+    return elapsed;
+}
+
+/**
+ * Load file net back from archive
+ */
+static double bench_load ( struct arena_t *arena, const char *archive,
+    struct file_net_t **net )
+{
+    int fd;
+    double start;
+    double elapsed;
+    struct io_stream_t *io;
+    unsigned char prefix[ARCHIVE_PREFIX_LENGTH];
+
+    if ( ( fd = open ( archive, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        perror ( archive );
+        return -1;
+    }
+
+    start = bench_now (  );
+
+    if ( !( io = input_stream_new ( fd, NULL, NULL ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    if ( io->read_complete ( io, prefix, sizeof ( prefix ) ) < 0
+        || !( *net = file_net_load ( arena, io ) ) )
+    {
+        io->close ( io );
+        return -1;
+    }
+
+    elapsed = bench_now (  ) - start;
+    io->close ( io );
+
+    return elapsed;
+}
+
+/**
+ * Measure one shape at one entry count
+ */
+static int bench_scale ( const struct bench_shape_t *shape, size_t total, const char *dir )
+{
+    size_t memory;
+    double build_time = 0;
+    double save_time;
+    double load_time;
+    double iter_time;
+    double start;
+    char archive[PATH_MAX];
+    char root[PATH_MAX];
+    char build[16];
+    struct stat statbuf;
+    struct arena_t arena;
+    struct file_net_t *net;
+    struct bench_iter_context_t iter_context;
+
+    snprintf ( archive, sizeof ( archive ), "%s/scale.sbox", dir );
+    snprintf ( root, sizeof ( root ), "%s/tree", dir );
+
+    arena_new ( &arena );
+
+    if ( !( net = bench_build_net ( &arena, shape, total ) ) )
+    {
+        fprintf ( stderr, "Error: Failed to build synthetic file net.\n" );
+        arena_free ( &arena );
+        return -1;
+    }
+
+    if ( total <= BENCH_TREE_MAX && ( build_time = bench_build ( net, root ) ) < 0 )
+    {
+        arena_free ( &arena );
+        return -1;
+    }
+
+    if ( ( save_time = bench_save ( net, archive ) ) < 0 || stat ( archive, &statbuf ) < 0 )
+    {
+        arena_free ( &arena );
+        unlink ( archive );
+        return -1;
+    }
+
+    arena_free ( &arena );
+    memory = bench_used_memory (  );
+
+    if ( ( load_time = bench_load ( &arena, archive, &net ) ) < 0 )
+    {
+        arena_free ( &arena );
+        unlink ( archive );
+        return -1;
+    }
+
+    memory = bench_used_memory (  ) - memory;
+    unlink ( archive );
+
+    iter_context.count = 0;
+    start = bench_now (  );
+
+    if ( file_net_iter ( net, &iter_context, bench_count_callback ) < 0 )
+    {
+        arena_free ( &arena );
+        return -1;
+    }
+
+    iter_time = bench_now (  ) - start;
+    arena_free ( &arena );
+
+    /* Trees past size limit or path length are not built on disk */
+    if ( build_time > 0 )
+    {
+        snprintf ( build, sizeof ( build ), "%.1f", build_time * 1e9 / total );
+
+    } else
+    {
+        snprintf ( build, sizeof ( build ), "-" );
+    }
+
+    printf ( "%-6s %9lu %10s %10.1f %10.1f %10.1f %10.2f %10.2f\n", shape->name,
+        ( unsigned long ) total, build, save_time * 1e9 / total, load_time * 1e9 / total,
+        iter_time * 1e9 / total, ( double ) statbuf.st_size / total, ( double ) memory / total );
+    fflush ( stdout );
+
+    return iter_context.count == total ? 0 : -1;
+}
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int status = 0;
+    size_t i;
+    size_t j;
+    size_t max = BENCH_DEFAULT_MAX;
+    const char *dir;
+    struct stat statbuf;
+
+    /* Trees are generated on tmpfs when available */
+    dir = stat ( "/dev/shm", &statbuf ) == 0 ? "/dev/shm" : "/tmp";
+
+    if ( argc > 1 )
+    {
+        max = strtoul ( argv[1], NULL, 10 );
+    }
+
+    if ( argc > 2 )
+    {
+        dir = argv[2];
+    }
+
+    printf ( "%-6s %9s %10s %10s %10s %10s %10s %10s\n", "shape", "entries", "build ns",
+        "save ns", "load ns", "iter ns", "archive B", "memory B" );
+
+    for ( i = 0; bench_shapes[i].name; i++ )
+    {
+        for ( j = 0; bench_counts[j] && bench_counts[j] <= max; j++ )
+        {
+            if ( bench_scale ( bench_shapes + i, bench_counts[j], dir ) < 0 )
+            {
+                fprintf ( stderr, "%s: %lu entries failed\n", bench_shapes[i].name,
+                    ( unsigned long ) bench_counts[j] );
+                status = 1;
+            }
+        }
+    }
+
+    return status;
+}
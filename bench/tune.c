@@ -0,0 +1,308 @@
+/* ------------------------------------------------------------------
+ * SBox - Stream Settings Tuning Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <time.h>
+
+#define BENCH_DEFAULT_MEGABYTES 64
+
+/**
+ * Buffer sizes swept with default lz4 block
+ */
+static const size_t bench_buffer_sizes[] = {
+    4096, 16384, 65536, 262144, 1048576, 4194304, 0
+};
+
+/**
+ * LZ4 block sizes swept at best buffer size
+ */
+static const size_t bench_block_sizes[] = {
+    65536, 262144, 1048576, 4194304, 0
+};
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill data compressing about two to one
+ */
+static void bench_fill ( uint8_t * data, size_t len, uint64_t seed )
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = ( i & 1 ) ? ( uint8_t ) ( seed >> 56 ) : 'a' + i % 16;
+    }
+}
+
+/**
+ * Format size with K or M suffix
+ */
+static const char *bench_size ( size_t size, char *text, size_t text_size )
+{
+    if ( size >= 1048576 )
+    {
+        snprintf ( text, text_size, "%luM", ( unsigned long ) ( size / 1048576 ) );
+
+    } else
+    {
+        snprintf ( text, text_size, "%luK", ( unsigned long ) ( size / 1024 ) );
+    }
+
+    return text;
+}
+
+/**
+ * Write compressed payload with current stream settings
+ */
+static int bench_write ( const char *path, size_t total, uint8_t * mem )
+{
+    int fd;
+    size_t len;
+    size_t sum;
+    void *data;
+    struct io_stream_t *io;
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    if ( !( io = output_stream_new ( fd, NULL, COMP_LZ4, 1 ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    for ( sum = 0; sum < total; sum += len )
+    {
+        if ( ( ssize_t ) ( len =
+                stream_reserve ( io, &data, mem, MIN ( stream_params (  )->buffer_size,
+                        total - sum ) ) ) < 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+
+        bench_fill ( data, len, sum );
+
+        if ( stream_commit ( io, data, len ) < 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+    }
+
+    if ( io->flush ( io ) < 0 )
+    {
+        io->close ( io );
+        return -1;
+    }
+
+    io->close ( io );
+
+    return 0;
+}
+
+/**
+ * Read compressed payload back with current stream settings
+ */
+static int bench_read ( const char *path, size_t total, uint8_t * mem )
+{
+    int fd;
+    size_t len;
+    size_t sum;
+    const void *data;
+    struct io_stream_t *io;
+
+    if ( ( fd = open ( path, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    if ( !( io = input_stream_new ( fd, NULL, NULL ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    for ( sum = 0; sum < total; sum += len )
+    {
+        if ( ( ssize_t ) ( len =
+                stream_peek ( io, &data, mem, MIN ( stream_params (  )->buffer_size,
+                        total - sum ) ) ) <= 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+
+        if ( stream_consume ( io, len ) < 0 )
+        {
+            io->close ( io );
+            return -1;
+        }
+    }
+
+    io->close ( io );
+
+    return 0;
+}
+
+/**
+ * Measure pack and unpack throughput with given settings, returns combined MB/s
+ */
+static double bench_params ( const struct stream_params_t *params, const char *path,
+    size_t total )
+{
+    double start;
+    double write_time;
+    double read_time;
+    double megabytes;
+    uint8_t *mem;
+    char text[2][16];
+
+    if ( stream_params_set ( params ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( !( mem = ( uint8_t * ) malloc ( params->buffer_size ) ) )
+    {
+        return -1;
+    }
+
+    start = bench_now (  );
+
+    if ( bench_write ( path, total, mem ) < 0 )
+    {
+        fprintf ( stderr, "write failed\n" );
+        free ( mem );
+        return -1;
+    }
+
+    write_time = bench_now (  ) - start;
+    start = bench_now (  );
+
+    if ( bench_read ( path, total, mem ) < 0 )
+    {
+        fprintf ( stderr, "read failed\n" );
+        free ( mem );
+        return -1;
+    }
+
+    read_time = bench_now (  ) - start;
+    free ( mem );
+
+    megabytes = total / ( 1024.0 * 1024 );
+
+    printf ( "buffer %-4s block %-7s %-8s pack %7.1f MB/s  unpack %7.1f MB/s\n",
+        bench_size ( params->buffer_size, text[0], sizeof ( text[0] ) ),
+        params->lz4_block_size ? bench_size ( params->lz4_block_size, text[1],
+            sizeof ( text[1] ) ) : "default", params->lz4_linked ? "linked" : "",
+        megabytes / write_time, megabytes / read_time );
+
+    return 2 * megabytes / ( write_time + read_time );
+}
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int linked;
+    size_t i;
+    size_t megabytes = BENCH_DEFAULT_MEGABYTES;
+    double speed;
+    double best_speed = 0;
+    const char *path = "/tmp/sbox-tune-bench.sbox";
+    struct stream_params_t params;
+    struct stream_params_t best;
+    char text[16];
+
+    if ( argc > 1 )
+    {
+        megabytes = strtoul ( argv[1], NULL, 10 );
+    }
+
+    if ( argc > 2 )
+    {
+        path = argv[2];
+    }
+
+    if ( !megabytes )
+    {
+        megabytes = 1;
+    }
+
+    best = *stream_params (  );
+    params = best;
+
+    for ( i = 0; bench_buffer_sizes[i]; i++ )
+    {
+        params.buffer_size = bench_buffer_sizes[i];
+
+        if ( ( speed = bench_params ( &params, path, megabytes * 1024 * 1024 ) ) < 0 )
+        {
+            unlink ( path );
+            return 1;
+        }
+
+        if ( speed > best_speed )
+        {
+            best_speed = speed;
+            best = params;
+        }
+    }
+
+    params = best;
+
+    for ( i = 0; bench_block_sizes[i]; i++ )
+    {
+        for ( linked = 0; linked < 2; linked++ )
+        {
+            params.lz4_block_size = bench_block_sizes[i];
+            params.lz4_linked = linked;
+
+            if ( ( speed = bench_params ( &params, path, megabytes * 1024 * 1024 ) ) < 0 )
+            {
+                unlink ( path );
+                return 1;
+            }
+
+            if ( speed > best_speed )
+            {
+                best_speed = speed;
+                best = params;
+            }
+        }
+    }
+
+    unlink ( path );
+
+    printf ( "best: --buffer-size=%s", bench_size ( best.buffer_size, text,
+            sizeof ( text ) ) );
+
+    if ( best.lz4_block_size )
+    {
+        printf ( " --lz4-block=%s", bench_size ( best.lz4_block_size, text,
+                sizeof ( text ) ) );
+    }
+
+    printf ( "%s\n", best.lz4_linked ? " --lz4-linked" : "" );
+
+    return 0;
+}
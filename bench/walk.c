@@ -0,0 +1,239 @@
+/* ------------------------------------------------------------------
+ * SBox - Directory Walk Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_FILES 100000
+#define BENCH_FILES_PER_DIR 1000
+#define BENCH_DEEP_LEVELS 1500
+#define BENCH_ROUNDS 5
+
+/**
+ * Get monotonic time in seconds
+ */
+static double bench_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Create empty file
+ */
+static int bench_touch ( const char *path )
+{
+    int fd;
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    close ( fd );
+
+    return 0;
+}
+
+/**
+ * Create wide tree, many files in few directories
+ */
+static size_t bench_make_wide ( const char *root, size_t files )
+{
+    size_t i;
+    size_t count = 1;
+    char path[PATH_MAX];
+
+    if ( mkdir ( root, 0755 ) < 0 )
+    {
+        perror ( root );
+        return 0;
+    }
+
+    for ( i = 0; i < files; i++ )
+    {
+        if ( !( i % BENCH_FILES_PER_DIR ) )
+        {
+            if ( ( size_t ) snprintf ( path, sizeof ( path ), "%s/dir_%04lu", root,
+                    ( unsigned long ) ( i / BENCH_FILES_PER_DIR ) ) >= sizeof ( path ) )
+            {
+                fprintf ( stderr, "bench root path too long\n" );
+                return 0;
+            }
+
+            if ( mkdir ( path, 0755 ) < 0 )
+            {
+                perror ( path );
+                return 0;
+            }
+
+            count++;
+        }
+
+        if ( ( size_t ) snprintf ( path, sizeof ( path ), "%s/dir_%04lu/file_%06lu.dat", root,
+                ( unsigned long ) ( i / BENCH_FILES_PER_DIR ),
+                ( unsigned long ) i ) >= sizeof ( path ) )
+        {
+            fprintf ( stderr, "bench root path too long\n" );
+            return 0;
+        }
+
+        if ( bench_touch ( path ) < 0 )
+        {
+            return 0;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Create deep tree, one directory and one file per level
+ */
+static size_t bench_make_deep ( const char *root, size_t levels )
+{
+    size_t i;
+    size_t len;
+    size_t count = 1;
+    char path[PATH_MAX];
+
+    if ( mkdir ( root, 0755 ) < 0 )
+    {
+        perror ( root );
+        return 0;
+    }
+
+    len = snprintf ( path, sizeof ( path ), "%s", root );
+
+    for ( i = 0; i < levels && len + 8 < sizeof ( path ); i++ )
+    {
+        memcpy ( path + len, "/f", 3 );
+
+        if ( bench_touch ( path ) < 0 )
+        {
+            return 0;
+        }
+
+        memcpy ( path + len, "/d", 3 );
+        len += 2;
+
+        if ( mkdir ( path, 0755 ) < 0 )
+        {
+            perror ( path );
+            return 0;
+        }
+
+        count += 2;
+    }
+
+    return count;
+}
+
+/**
+ * Remove tree entry
+ */
+static int bench_remove_entry ( const char *path, const struct stat *statbuf, int flag,
+    struct FTW *ftw )
+{
+    UNUSED ( statbuf );
+    UNUSED ( flag );
+    UNUSED ( ftw );
+
+    return remove ( path );
+}
+
+/**
+ * Time file net build over tree
+ */
+static int bench_walk ( const char *name, const char *root, size_t count )
+{
+    int i;
+    double start;
+    double best = 0;
+    double elapsed;
+    struct arena_t arena;
+    const char *paths[2] = { root, NULL };
+
+    for ( i = 0; i < BENCH_ROUNDS; i++ )
+    {
+        arena_new ( &arena );
+        start = bench_now (  );
+
+        if ( !build_file_net ( &arena, paths ) )
+        {
+            arena_free ( &arena );
+            return -1;
+        }
+
+        elapsed = bench_now (  ) - start;
+        arena_free ( &arena );
+
+        if ( !i || elapsed < best )
+        {
+            best = elapsed;
+        }
+    }
+
+    printf ( "%-6s %8lu entries  %.3f s (%.1f ns/entry)\n", name, ( unsigned long ) count, best,
+        best * 1e9 / count );
+
+    return 0;
+}
+
+/**
+ * Benchmark entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int status = 0;
+    size_t files = BENCH_DEFAULT_FILES;
+    size_t count;
+    const char *base = "/tmp/sbox-walk-bench";
+    char wide[PATH_MAX];
+    char deep[PATH_MAX];
+
+    if ( argc > 1 )
+    {
+        files = strtoul ( argv[1], NULL, 10 );
+    }
+
+    if ( argc > 2 )
+    {
+        base = argv[2];
+    }
+
+    snprintf ( wide, sizeof ( wide ), "%s/wide", base );
+    snprintf ( deep, sizeof ( deep ), "%s/deep", base );
+
+    nftw ( base, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+
+    if ( mkdir ( base, 0755 ) < 0 )
+    {
+        perror ( base );
+        return 1;
+    }
+
+    if ( !( count = bench_make_wide ( wide, files ) ) || bench_walk ( "wide", wide, count ) < 0 )
+    {
+        status = 1;
+    }
+
+    if ( !( count = bench_make_deep ( deep, BENCH_DEEP_LEVELS ) )
+        || bench_walk ( "deep", deep, count ) < 0 )
+    {
+        status = 1;
+    }
+
+    nftw ( base, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS );
+
+    return status;
+}
@@ -39,7 +39,7 @@
 #endif
 
 #define PATH_LIMIT 2048
-#define WORKBUF_LIMIT 65536
 #define CHUNK_SIZE 65536
+#define INDEX_BLOCK_SIZE 1048576
 
 #endif
@@ -7,31 +7,166 @@
 #ifndef SBOX_H
 #define SBOX_H
 
-#define SBOX_VERSION "2.0.11"
+#define SBOX_VERSION "2.1.0"
 
 #define COMP_NONE 0
 #define COMP_LZ4 1
 
 #define ARCHIVE_PREFIX_LENGTH 4
+#define ARCHIVE_FORMAT_VERSION 2
+#define VARINT_LIMIT 10
+
+#define FILE_NET_ROOT 0
+#define FILE_NET_NONE UINT32_MAX
+#define FILE_NET_PAGE_BITS 16
+#define FILE_NET_PAGE_SIZE ( 1 << FILE_NET_PAGE_BITS )
+#define FILE_NET_BLOB_BITS 20
+#define FILE_NET_BLOB_SIZE ( 1 << FILE_NET_BLOB_BITS )
+#define FILE_NET_MODE_LIMIT 65536
+#define FILE_NET_FLAG_LINK 1
+#define FILE_NET_FLAG_TARGET 2
+#define FILE_NET_FLAG_COPY 4
+#define FILE_NET_LENGTH_LIMIT ( ( uint64_t ) 1 << 40 )
+
+#define REPOSITORY_ID_LEN 32
+#define REPOSITORY_CHUNK_MAX 1048576
+
+#define SHARD_MAX 64
+#define SHARD_NONE 0xff
+
+#define POOL_QUEUE_SIZE 1024
+#define POOL_THREADS_MAX 256
+
+#define ASYNC_STREAM_DEPTH 4
+
+#define STATS_STAGE_MAX 16
+
+#define STREAM_BUFFER_MIN 4096
+#define STREAM_BUFFER_MAX 16777216
 
 #define OPTION_VERBOSE 1
 #define OPTION_LISTONLY 2
 #define OPTION_TESTONLY 4
 #define OPTION_LZ4 8
+#define OPTION_UPDATE 16
+#define OPTION_DEDUP 32
+#define OPTION_DEDUP_LINK 64
+#define OPTION_DEDUP_REFLINK 128
+#define OPTION_APPEND 256
+#define OPTION_STATS 512
+#define OPTION_STATS_JSON 1024
 
 /**
- * SBox Archive Node
+ * SBox Archive Node, view of one file net entry, zero mode marks a tombstone
  */
 struct sbox_node_t
 {
+    uint32_t index;
+    uint32_t flags;
+    uint32_t link;
     uint32_t mode;
     time_t mtime;
-    uint32_t size;
-    char *name;
-    struct sbox_node_t *head;
-    struct sbox_node_t *tail;
-    struct sbox_node_t *next;
-    struct sbox_node_t *prev;
+    uint64_t size;
+    const char *name;
+};
+
+/**
+ * Expandable buffer structure
+ */
+struct ext_buffer_t
+{
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+};
+
+/**
+ * Arena memory allocator
+ */
+struct arena_t
+{
+    struct arena_chunk_t *chunk;
+    size_t chunk_size;
+};
+
+/**
+ * File mode dictionary
+ */
+struct mode_dict_t
+{
+    size_t count;
+    size_t capacity;
+    uint32_t *modes;
+    uint16_t *order;
+};
+
+/**
+ * File net page, one column per entry attribute, size holds target of links and copies
+ */
+struct file_net_page_t
+{
+    uint32_t parent[FILE_NET_PAGE_SIZE];
+    uint32_t name[FILE_NET_PAGE_SIZE];
+    uint64_t size[FILE_NET_PAGE_SIZE];
+    int64_t mtime[FILE_NET_PAGE_SIZE];
+    uint16_t mode[FILE_NET_PAGE_SIZE];
+    uint8_t flags[FILE_NET_PAGE_SIZE];
+};
+
+/**
+ * File net, table of entries in pre-order
+ */
+struct file_net_t
+{
+    struct arena_t *arena;
+    uint32_t count;
+    size_t page_capacity;
+    struct file_net_page_t **pages;
+    size_t blob_count;
+    size_t blob_capacity;
+    size_t blob_used;
+    char **blobs;
+    struct mode_dict_t modes;
+};
+
+/**
+ * Archive block index entry
+ */
+struct archive_block_t
+{
+    uint64_t logical;
+    uint64_t storage;
+};
+
+/**
+ * Archive block index
+ */
+struct archive_index_t
+{
+    size_t count;
+    size_t capacity;
+    struct archive_block_t *blocks;
+};
+
+/**
+ * Archive segment, appended segments follow original archive in same file
+ */
+struct archive_segment_t
+{
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * XXH64 hash state
+ */
+struct xxh64_t
+{
+    uint64_t total;
+    uint64_t acc[4];
+    uint64_t seed;
+    size_t buffered;
+    uint8_t buffer[32];
 };
 
 /**
@@ -41,7 +176,32 @@ struct iter_context_t
 {
     int options;
     struct io_stream_t *io;
-    char buffer[CHUNK_SIZE];
+    const char **paths;
+    struct archive_index_t *index;
+    struct link_table_t *links;
+    struct repository_t *repository;
+    struct pool_t *pool;
+    uint32_t *checksums;
+    uint32_t *checksum_entries;
+    uint32_t checksum_count;
+    const uint8_t *shards;
+    int shard;
+    int damaged;
+    uint64_t offset;
+    uint64_t block_offset;
+    uint64_t stream_offset;
+    size_t buffer_size;
+    char buffer[];
+};
+
+/**
+ * Stream buffer and LZ4 block settings, LZ4 block size zero means library default
+ */
+struct stream_params_t
+{
+    size_t buffer_size;
+    size_t lz4_block_size;
+    int lz4_linked;
 };
 
 /**
@@ -57,24 +217,74 @@ struct io_stream_t
     int ( *write_complete ) ( struct io_stream_t *, const void *, size_t );
     int ( *verify ) ( struct io_stream_t * );
     int ( *flush ) ( struct io_stream_t * );
+    int ( *split ) ( struct io_stream_t *, uint64_t * );
+    int ( *annotate ) ( struct io_stream_t *, const void *, size_t );
+    int ( *seek ) ( struct io_stream_t *, uint64_t );
+    int ( *length ) ( struct io_stream_t *, uint64_t * );
+      ssize_t ( *peek ) ( struct io_stream_t *, const void **, size_t );
+    int ( *consume ) ( struct io_stream_t *, size_t );
+      ssize_t ( *reserve ) ( struct io_stream_t *, void **, size_t );
+    int ( *commit ) ( struct io_stream_t *, size_t );
     void ( *close ) ( struct io_stream_t * );
 };
 
+/**
+ * Crypto backend, AES-256-CBC without padding and HMAC-SHA-256
+ */
+struct crypto_backend_t
+{
+    const char *name;
+    int ( *random ) ( uint8_t *, size_t );
+    int ( *derive_key ) ( const char *, const uint8_t *, size_t, unsigned int, uint8_t *,
+        size_t );
+    void *( *cipher_new ) ( const uint8_t *, int );
+    int ( *cipher_cbc ) ( void *, uint8_t *, const uint8_t *, uint8_t *, size_t );
+    void ( *cipher_free ) ( void * );
+    void *( *mac_new ) ( const uint8_t *, size_t );
+    int ( *mac_update ) ( void *, const uint8_t *, size_t );
+    int ( *mac_finish ) ( void *, uint8_t * );
+    void ( *mac_free ) ( void * );
+};
+
 /**
  * File net browsing callback
  */
 typedef int ( *file_net_iter_callback ) ( void *, struct sbox_node_t *, const char * );
 
+/**
+ * Thread pool task
+ */
+typedef int ( *pool_task_fn ) ( void * );
+
 /**
  * Pack files to an archive
  */
 extern int sbox_pack_archive ( const char *archive, uint32_t options, int level,
-    const char *password, const char *files[] );
+    const char *password, const char *files[], const char *references[],
+    const char *repository, int shards, struct pool_t *pool );
 
 /** 
  * Unpack files from an archive
  */
-extern int sbox_unpack_archive ( const char *archive, uint32_t options, const char *password );
+extern int sbox_unpack_archive ( const char *archive, uint32_t options, const char *password,
+    const char *paths[], const char *repository, struct pool_t *pool );
+
+/**
+ * Unpack base archive and replay its increments
+ */
+extern int sbox_restore_archives ( const char *archives[], uint32_t options,
+    const char *password, const char *repository, struct pool_t *pool );
+
+/**
+ * Load file net from an archive
+ */
+extern struct file_net_t *sbox_load_file_net ( struct arena_t *arena, const char *archive,
+    const char *password );
+
+/**
+ * Check that archive can take appended segments
+ */
+extern int sbox_check_append ( const char *archive, const char *password );
 
 /**
  * Show operation progress with current file path
@@ -86,15 +296,42 @@ extern void show_progress ( char action, const char *path );
  */
 extern const unsigned char sbox_archive_prefix[ARCHIVE_PREFIX_LENGTH];
 
+/**
+ * SBox repository manifest prefix
+ */
+extern const unsigned char sbox_manifest_prefix[ARCHIVE_PREFIX_LENGTH];
+
+/**
+ * SBox file checksum table prefix
+ */
+extern const unsigned char sbox_checksum_prefix[ARCHIVE_PREFIX_LENGTH];
+
+/**
+ * SBox sharded archive prefix
+ */
+extern const unsigned char sbox_sharded_prefix[ARCHIVE_PREFIX_LENGTH];
+
+/**
+ * SBox archive shard prefix
+ */
+extern const unsigned char sbox_shard_prefix[ARCHIVE_PREFIX_LENGTH];
+
 /**
  * Create new IO stream
  */
 extern struct io_stream_t *io_stream_new ( void );
 
 /**
- * Create new input stream
+ * Create new input stream, optionally exposing its storage layer
  */
-extern struct io_stream_t *input_stream_new ( int fd, const char *password );
+extern struct io_stream_t *input_stream_new ( int fd, const char *password,
+    struct io_stream_t **storage );
+
+/**
+ * Create new input stream over part of file
+ */
+extern struct io_stream_t *input_range_stream_new ( int fd, uint64_t start, uint64_t end,
+    const char *password, struct io_stream_t **storage );
 
 /**
  * Create new output stream
@@ -102,6 +339,12 @@ extern struct io_stream_t *input_stream_new ( int fd, const char *password );
 extern struct io_stream_t *output_stream_new ( int fd, const char *password, uint8_t compression,
     int level );
 
+/**
+ * Create new output stream starting at given file offset
+ */
+extern struct io_stream_t *output_range_stream_new ( int fd, uint64_t start,
+    const char *password, uint8_t compression, int level );
+
 /**
  * Read complete data chunk from stream
  */
@@ -117,11 +360,114 @@ extern ssize_t stream_read_max ( struct io_stream_t *io, void *mem, size_t total
  */
 extern int stream_write_complete ( struct io_stream_t *io, const void *mem, size_t total );
 
+/**
+ * Borrow readable data from stream buffer, read into mem if stream has none
+ */
+extern ssize_t stream_peek ( struct io_stream_t *io, const void **data, void *mem,
+    size_t total );
+
+/**
+ * Drop data borrowed by stream_peek
+ */
+extern int stream_consume ( struct io_stream_t *io, size_t total );
+
+/**
+ * Borrow writable space from stream buffer, mem is used if stream has none
+ */
+extern ssize_t stream_reserve ( struct io_stream_t *io, void **data, void *mem, size_t total );
+
+/**
+ * Pass data written to space borrowed by stream_reserve
+ */
+extern int stream_commit ( struct io_stream_t *io, const void *data, size_t total );
+
+/**
+ * Get stream settings used by new streams
+ */
+extern const struct stream_params_t *stream_params ( void );
+
+/**
+ * Change stream settings used by new streams
+ */
+extern int stream_params_set ( const struct stream_params_t *params );
+
+/**
+ * Allocate iterate context with buffer of current stream buffer size
+ */
+extern struct iter_context_t *iter_context_new ( void );
+
+/**
+ * Free iterate context
+ */
+extern void iter_context_free ( struct iter_context_t *iter_context );
+
+/**
+ * Estimate memory taken by stream stack with current settings
+ */
+extern size_t stream_memory_estimate ( int input, const char *password,
+    uint8_t compression, int level );
+
+/**
+ * Count bytes copied between stream buffers
+ */
+extern void stream_count_copy ( size_t total );
+
+/**
+ * Get number of copies and bytes copied between stream buffers
+ */
+extern void stream_copy_stats ( uint64_t * copies, uint64_t * bytes );
+
+/**
+ * Create new stats stream counting bytes, calls, wall and blocked time
+ * of internal stream under given stage name
+ */
+extern struct io_stream_t *stats_stream_new ( struct io_stream_t *internal, const char *name );
+
+/**
+ * Wrap stream in stats stream if stats are collected, stream is closed on failure
+ */
+extern struct io_stream_t *stats_stream_wrap ( struct io_stream_t *stream, const char *name );
+
+/**
+ * Start collecting stats of new streams, counters start from zero
+ */
+extern void stats_start ( void );
+
+/**
+ * Get time for wait about to start, zero if no stats stream call is in progress
+ */
+extern uint64_t stats_wait_begin ( void );
+
+/**
+ * Count wait as time blocked by stats stream call in progress
+ */
+extern void stats_wait_end ( uint64_t start );
+
+/**
+ * Stop collecting stats and print summary of stages to stderr
+ */
+extern void stats_show ( int json );
+
+/**
+ * Read variable length integer from stream
+ */
+extern int stream_read_varint ( struct io_stream_t *io, uint64_t * value );
+
+/**
+ * Write variable length integer to stream
+ */
+extern int stream_write_varint ( struct io_stream_t *io, uint64_t value );
+
 /**
  * Create new file stream
  */
 extern struct io_stream_t *file_stream_new ( int fd );
 
+/**
+ * Create new file stream over part of file, offsets are relative to its start
+ */
+extern struct io_stream_t *file_range_stream_new ( int fd, uint64_t start, uint64_t end );
+
 /**
  * Create new input AES stream
  */
@@ -138,6 +484,27 @@ extern struct io_stream_t *output_aes_stream_new ( struct io_stream_t *internal,
     const char *password );
 #endif
 
+/**
+ * Estimate memory taken by AES stream with current stream settings
+ */
+#ifdef ENABLE_ENCRYPTION
+extern size_t aes_stream_memory ( void );
+#endif
+
+/**
+ * Start caching keys for one pack or unpack operation
+ */
+#ifdef ENABLE_ENCRYPTION
+extern void aes_key_cache_begin ( void );
+#endif
+
+/**
+ * Stop caching keys and wipe those cached
+ */
+#ifdef ENABLE_ENCRYPTION
+extern void aes_key_cache_end ( void );
+#endif
+
 /**
  * Create new output LZ4 stream
  */
@@ -152,36 +519,422 @@ extern struct io_stream_t *output_lz4_stream_new ( struct io_stream_t *internal,
 extern struct io_stream_t *input_lz4_stream_new ( struct io_stream_t *internal );
 #endif
 
+/**
+ * Estimate memory taken by LZ4 stream with current stream settings
+ */
+#ifdef ENABLE_LZ4
+extern size_t lz4_stream_memory ( int input, int level );
+#endif
+
 /**
  * Create new buffer stream
  */
 extern struct io_stream_t *buffer_stream_new ( struct io_stream_t *internal );
 
+/**
+ * Create new input async stream reading ahead from internal stream on own thread
+ */
+extern struct io_stream_t *input_async_stream_new ( struct io_stream_t *internal, size_t depth );
+
+/**
+ * Create new output async stream writing to internal stream on own thread
+ */
+extern struct io_stream_t *output_async_stream_new ( struct io_stream_t *internal, size_t depth );
+
+/**
+ * Create new expandable buffer
+ */
+extern int ext_buffer_new ( struct ext_buffer_t *buffer );
+
+/**
+ * Clear expandable buffer content
+ */
+extern void ext_buffer_clear ( struct ext_buffer_t *buffer );
+
+/**
+ * Reserve space in expandable buffer
+ */
+extern int ext_buffer_reserve ( struct ext_buffer_t *buffer, size_t len );
+
+/**
+ * Append one byte to expandable buffer
+ */
+extern int ext_buffer_append ( struct ext_buffer_t *buffer, uint8_t byte );
+
+/**
+ * Append bytes to expandable buffer
+ */
+extern int ext_buffer_append_bytes ( struct ext_buffer_t *buffer, const void *bytes, size_t len );
+
+/**
+ * Append variable length integer to expandable buffer
+ */
+extern int ext_buffer_append_varint ( struct ext_buffer_t *buffer, uint64_t value );
+
+/**
+ * Free expandable buffer from memory
+ */
+extern void ext_buffer_free ( struct ext_buffer_t *buffer );
+
+/**
+ * Encode variable length integer, returns encoded length
+ */
+extern size_t varint_encode ( uint8_t * bytes, uint64_t value );
+
+/**
+ * Decode variable length integer from memory
+ */
+extern int varint_decode ( const uint8_t ** bytes, const uint8_t * end, uint64_t * value );
+
+/**
+ * Create new archive block index
+ */
+extern void archive_index_new ( struct archive_index_t *index );
+
+/**
+ * Append block to archive index
+ */
+extern int archive_index_append ( struct archive_index_t *index, uint64_t logical,
+    uint64_t storage );
+
+/**
+ * Find last block starting at or before logical offset
+ */
+extern const struct archive_block_t *archive_index_lookup ( const struct archive_index_t *index,
+    uint64_t logical );
+
+/**
+ * Save archive index as stream annotation
+ */
+extern int archive_index_save ( const struct archive_index_t *index, struct io_stream_t *io );
+
+/**
+ * Load archive index from storage stream
+ */
+extern int archive_index_load ( struct archive_index_t *index, struct io_stream_t *storage );
+
+/**
+ * Free archive index from memory
+ */
+extern void archive_index_free ( struct archive_index_t *index );
+
+/**
+ * List archive segments in append order, walking footers back from file end
+ */
+extern int archive_segments_load ( int fd, struct archive_segment_t **segments, size_t *count );
+
+/**
+ * Finish appended segment with footer pointing at its start
+ */
+extern int archive_segment_finish ( int fd, uint64_t start );
+
+/**
+ * Set memory budget, zero removes limit, headroom is kept for stream buffers
+ */
+extern void budget_set ( size_t limit, size_t headroom );
+
+/**
+ * Get memory budget, zero if unlimited
+ */
+extern size_t budget_limit ( void );
+
+/**
+ * Count memory allocated elsewhere against budget
+ */
+extern int budget_reserve ( size_t size );
+
+/**
+ * Return memory counted by budget reserve
+ */
+extern void budget_release ( size_t size );
+
+/**
+ * Get memory in use, its peak and metadata spilled to disk, in bytes
+ */
+extern void budget_stats ( size_t *used, size_t *peak, size_t *spilled );
+
+/**
+ * Get size of last allocation refused by budget, zero if none was
+ */
+extern size_t budget_shortfall ( void );
+
+/**
+ * Get memory counted against budget for allocation of given size
+ */
+extern size_t budget_cost ( size_t size );
+
+/**
+ * Allocate memory counted against budget
+ */
+extern void *budget_alloc ( size_t size );
+
+/**
+ * Allocate zeroed memory counted against budget
+ */
+extern void *budget_calloc ( size_t size );
+
+/**
+ * Allocate metadata memory, spilled to disk once budget is used up
+ */
+extern void *budget_spill_alloc ( size_t size );
+
+/**
+ * Resize metadata memory, moved to disk once budget is used up
+ */
+extern void *budget_spill_realloc ( void *ptr, size_t size );
+
+/**
+ * Free memory allocated by budget
+ */
+extern void budget_free ( void *ptr );
+
+/**
+ * Create new arena
+ */
+extern void arena_new ( struct arena_t *arena );
+
+/**
+ * Allocate memory from arena
+ */
+extern void *arena_alloc ( struct arena_t *arena, size_t size );
+
+/**
+ * Move arena allocation into a larger one
+ */
+extern void *arena_realloc ( struct arena_t *arena, void *ptr, size_t old_size, size_t new_size );
+
+/**
+ * Duplicate string into arena
+ */
+extern char *arena_strdup ( struct arena_t *arena, const char *str );
+
+/**
+ * Free arena with all its allocations
+ */
+extern void arena_free ( struct arena_t *arena );
+
+/**
+ * Create new empty file net
+ */
+extern struct file_net_t *file_net_new ( struct arena_t *arena );
+
+/**
+ * Append entry to file net, entries must be appended in pre-order
+ */
+extern int file_net_append ( struct file_net_t *net, uint32_t parent, const char *name,
+    uint32_t mode, uint64_t size, time_t mtime, uint32_t * index );
+
+/**
+ * Append hard link to earlier file net entry
+ */
+extern int file_net_append_link ( struct file_net_t *net, uint32_t parent, const char *name,
+    uint32_t target, uint32_t * index );
+
+/**
+ * Turn file net entry into copy of earlier entry with identical content
+ */
+extern int file_net_set_copy ( struct file_net_t *net, uint32_t index, uint32_t target );
+
+/**
+ * Get file net entry
+ */
+extern void file_net_get ( const struct file_net_t *net, uint32_t index,
+    struct sbox_node_t *node );
+
+/**
+ * Get file net entry parent
+ */
+extern uint32_t file_net_parent ( const struct file_net_t *net, uint32_t index );
+
+/**
+ * Get node basename suitable for storing in archive
+ */
+extern const char *file_net_get_safe_basename ( const char *name );
+
 /**
  * Create new file net from paths
  */
-struct sbox_node_t *build_file_net ( const char *paths[] );
+extern struct file_net_t *build_file_net ( struct arena_t *arena, const char *paths[] );
 
 /**
  * Browse file net
  */
-extern int file_net_iter ( struct sbox_node_t *root, void *context,
+extern int file_net_iter ( const struct file_net_t *net, void *context,
     file_net_iter_callback callback );
 
 /**
- * Free file net from memory
+ * Check if node content is stored in archive body
  */
-extern void free_file_net ( struct sbox_node_t *node );
+extern int file_net_has_body ( const struct sbox_node_t *node );
 
 /**
  * Save file net to stream
  */
-extern int file_net_save ( struct sbox_node_t *root, struct io_stream_t *io );
+extern int file_net_save ( const struct file_net_t *net, struct io_stream_t *io );
 
 /**
  * Load file net from stream
  */
-extern struct sbox_node_t *file_net_load ( struct io_stream_t *io );
+extern struct file_net_t *file_net_load ( struct arena_t *arena, struct io_stream_t *io );
+
+/**
+ * Create file net with entries changed since reference and tombstones for removed ones
+ */
+extern struct file_net_t *file_net_diff ( struct arena_t *arena, const struct file_net_t *net,
+    const struct file_net_t *reference );
+
+/**
+ * Apply increment with tombstones to base file net
+ */
+extern struct file_net_t *file_net_merge ( struct arena_t *arena, const struct file_net_t *base,
+    const struct file_net_t *increment );
+
+/**
+ * Replace file net entries by copies of earlier entries with identical content
+ */
+extern int file_net_dedup ( struct file_net_t *net, struct pool_t *pool );
+
+/**
+ * Start new XXH64 hash
+ */
+extern void xxh64_init ( struct xxh64_t *state, uint64_t seed );
+
+/**
+ * Feed data into XXH64 hash
+ */
+extern void xxh64_update ( struct xxh64_t *state, const void *mem, size_t len );
+
+/**
+ * Finish XXH64 hash
+ */
+extern uint64_t xxh64_digest ( const struct xxh64_t *state );
+
+/**
+ * Open chunk repository, creating it if needed
+ */
+extern struct repository_t *repository_open ( const char *path, const char *password,
+    uint8_t compression, int level );
+
+/**
+ * Split stream content into chunks, store them and reference them in manifest
+ */
+extern int repository_store ( struct repository_t *repo, struct io_stream_t *input,
+    struct io_stream_t *manifest, uint64_t * size );
+
+/**
+ * Close pack and record its chunks in repository index
+ */
+extern int repository_commit ( struct repository_t *repo );
+
+/**
+ * Load chunk content from repository and check it against its identifier
+ */
+extern int repository_load ( struct repository_t *repo, const uint8_t id[REPOSITORY_ID_LEN],
+    uint8_t * data, size_t len );
+
+/**
+ * Show repository growth caused by last store
+ */
+extern void repository_show_stats ( const struct repository_t *repo );
+
+/**
+ * Close chunk repository, uncommitted chunks are dropped from index
+ */
+extern void repository_close ( struct repository_t *repo );
+
+/**
+ * Create new chunk stream over file contents referenced by manifest
+ */
+extern struct io_stream_t *chunk_stream_new ( struct repository_t *repo,
+    struct io_stream_t *manifest, struct archive_index_t *index );
+
+/**
+ * Update CRC32C checksum with data, start with zero
+ */
+extern uint32_t crc32c_update ( uint32_t crc, const void *mem, size_t len );
+
+/**
+ * Assign file contents to shards, duplicates follow their target
+ */
+extern uint8_t *shard_assign ( const struct file_net_t *net, int count );
 
+/**
+ * Get path of archive shard
+ */
+extern char *shard_path ( const char *archive, int shard );
+
+/**
+ * Save shard assignment to stream
+ */
+extern int shard_save_map ( struct io_stream_t *io, const uint8_t * shards, uint32_t entries,
+    int count );
+
+/**
+ * Load shard assignment from stream
+ */
+extern uint8_t *shard_load_map ( struct io_stream_t *io, const struct file_net_t *net,
+    int *count );
+
+/**
+ * Browse file net once per shard, shards run as pool tasks
+ */
+extern int shard_run ( struct pool_t *pool, const struct file_net_t *net,
+    struct iter_context_t *contexts[], int count, file_net_iter_callback callback );
+
+/**
+ * Create new thread pool, zero threads means one per online CPU
+ */
+extern struct pool_t *pool_new ( int threads, int affinity );
+
+/**
+ * Get number of pool threads
+ */
+extern int pool_threads ( const struct pool_t *pool );
+
+/**
+ * Submit task to pool, it runs on calling thread if queues are full
+ */
+extern void pool_submit ( struct pool_t *pool, pool_task_fn run, void *arg );
+
+/**
+ * Cancel tasks not yet started, first error is kept
+ */
+extern void pool_cancel ( struct pool_t *pool, int error );
+
+/**
+ * Check if pool was cancelled, running tasks should stop early
+ */
+extern int pool_cancelled ( struct pool_t *pool );
+
+/**
+ * Wait for all submitted tasks, fails with first task error
+ */
+extern int pool_wait ( struct pool_t *pool );
+
+/**
+ * Stop pool threads and free pool from memory
+ */
+extern void pool_free ( struct pool_t *pool );
+
+/**
+ * Get crypto backend in use
+ */
+#ifdef ENABLE_ENCRYPTION
+extern const struct crypto_backend_t *crypto_backend ( void );
+#endif
+
+/**
+ * Get built in crypto backend by position, NULL past last one
+ */
+#ifdef ENABLE_ENCRYPTION
+extern const struct crypto_backend_t *crypto_backend_list ( size_t index );
+#endif
+
+/**
+ * Select crypto backend by name
+ */
+#ifdef ENABLE_ENCRYPTION
+extern int crypto_backend_select ( const char *name );
+#endif
 
 #endif
@@ -5,18 +5,25 @@
 #ifdef ENABLE_ENCRYPTION
 
 #include "sbox.h"
-#include <mbedtls/aes.h>
-#include <mbedtls/sha256.h>
-#include <mbedtls/pkcs5.h>
-#include <mbedtls/entropy.h>
-#include <mbedtls/ctr_drbg.h>
+#include <pthread.h>
 
 #define AES256_KEYLEN 32
-#define AES256_KEYLEN_BITS (AES256_KEYLEN * 8)
 #define AES256_BLOCKLEN 16
 #define SHA256_BLOCKLEN 32
 #define DERIVE_N_ROUNDS 10000
 #define NONCE_LEN (16 * AES256_BLOCKLEN)
+#define HEADER_LEN (2 * AES256_KEYLEN + AES256_BLOCKLEN + NONCE_LEN)
+#define MAC_SLOTS 2
+#define KEY_CACHE_SLOTS 16
+
+/**
+ * Ciphertext waiting for HMAC update
+ */
+struct aes_mac_slot_t
+{
+    size_t length;
+    uint8_t *data;
+};
 
 /**
  * AES stream context
@@ -24,13 +31,16 @@
 struct aes_stream_context_t
 {
     int eof;
+    int seeked;
     size_t unconsumed_len;
+    size_t buffer_offset;
+    size_t buffer_length;
+    uint64_t offset;
 
     struct io_stream_t *internal;
-    mbedtls_aes_context aes;
-    mbedtls_md_context_t md_ctx;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
+    const struct crypto_backend_t *crypto;
+    void *cipher;
+    void *mac;
 
     uint8_t esalt[AES256_KEYLEN];
     uint8_t hsalt[AES256_KEYLEN];
@@ -38,113 +48,186 @@ struct aes_stream_context_t
     uint8_t unconsumed[AES256_BLOCKLEN];
     uint8_t tail[AES256_BLOCKLEN + SHA256_BLOCKLEN];
 
-    uint8_t buffer[AES256_BLOCKLEN + SHA256_BLOCKLEN + CHUNK_SIZE];
+    size_t size;
+    uint8_t *buffer;
+
+    int mac_threaded;
+    int mac_stopping;
+    int mac_error;
+    size_t mac_head;
+    size_t mac_tail;
+    pthread_t mac_thread;
+    pthread_mutex_t mac_lock;
+    pthread_cond_t mac_wake;
+    pthread_cond_t mac_done;
+    struct aes_mac_slot_t mac_slots[MAC_SLOTS];
+
+    uint8_t storage[];
 };
 
 /**
- * Derive crypto key using PBKDF2 and SHA-256
+ * Key derived from password and salt
  */
-static int aes_stream_derive_key ( const char *password, const uint8_t * salt,
-    size_t salt_len, uint8_t * key, size_t key_size )
+struct aes_cached_key_t
 {
-    mbedtls_md_context_t sha256_ctx;
-    const mbedtls_md_info_t *sha256_info;
-
-    mbedtls_md_init ( &sha256_ctx );
-
-    if ( !( sha256_info = mbedtls_md_info_from_type ( MBEDTLS_MD_SHA256 ) ) )
-    {
-        mbedtls_md_free ( &sha256_ctx );
-        return -1;
-    }
-
-    if ( mbedtls_md_setup ( &sha256_ctx, sha256_info, 1 ) != 0 )
-    {
-        mbedtls_md_free ( &sha256_ctx );
-        return -1;
-    }
+    int used;
+    uint8_t salt[AES256_KEYLEN];
+    uint8_t key[AES256_KEYLEN];
+};
 
-    if ( mbedtls_pkcs5_pbkdf2_hmac ( &sha256_ctx, ( const uint8_t * ) password,
-            strlen ( password ), salt, salt_len, DERIVE_N_ROUNDS, key_size, key ) != 0 )
-    {
-        memset ( key, '\0', key_size );
-        mbedtls_md_free ( &sha256_ctx );
-        return -1;
-    }
+/**
+ * Keys derived during current pack or unpack operation, which uses a single password,
+ * its output streams share salts so each key is derived once, all is wiped at its end
+ */
+static pthread_mutex_t aes_key_lock = PTHREAD_MUTEX_INITIALIZER;
+static int aes_key_active;
+static int aes_key_salted;
+static size_t aes_key_next;
+static uint8_t aes_key_esalt[AES256_KEYLEN];
+static uint8_t aes_key_hsalt[AES256_KEYLEN];
+static struct aes_cached_key_t aes_keys[KEY_CACHE_SLOTS];
 
-    mbedtls_md_free ( &sha256_ctx );
+/**
+ * Wipe cached keys and shared salts, lock must be held
+ */
+static void aes_key_wipe ( void )
+{
+    memset ( aes_keys, '\0', sizeof ( aes_keys ) );
+    memset ( aes_key_esalt, '\0', sizeof ( aes_key_esalt ) );
+    memset ( aes_key_hsalt, '\0', sizeof ( aes_key_hsalt ) );
+    aes_key_salted = 0;
+    aes_key_next = 0;
+}
 
-    return 0;
+/**
+ * Start caching keys for one pack or unpack operation
+ */
+void aes_key_cache_begin ( void )
+{
+    pthread_mutex_lock ( &aes_key_lock );
+    aes_key_wipe (  );
+    aes_key_active = 1;
+    pthread_mutex_unlock ( &aes_key_lock );
 }
 
 /**
- * Random generator personalization bytes
+ * Stop caching keys and wipe those cached
  */
-static const uint8_t aes_stream_random_pers[] = {
-    0x13, 0xc6, 0xae, 0x24, 0xcd, 0x52, 0x15, 0x1b,
-    0x68, 0xbf, 0x64, 0x47, 0x07, 0x54, 0xc9, 0x10,
-    0xda, 0x21, 0xae, 0x9f, 0x9f, 0xda, 0xc0, 0xf2,
-    0x40, 0x9b, 0x8d, 0xea, 0x32, 0x9c, 0x1d, 0x04
-};
+void aes_key_cache_end ( void )
+{
+    pthread_mutex_lock ( &aes_key_lock );
+    aes_key_wipe (  );
+    aes_key_active = 0;
+    pthread_mutex_unlock ( &aes_key_lock );
+}
 
 /**
- * Setup random generator
+ * Get salts for new output stream, shared by output streams of current operation
  */
-static int aes_stream_random_init ( struct aes_stream_context_t *context )
+static int aes_key_salts ( const struct crypto_backend_t *crypto, uint8_t * esalt,
+    uint8_t * hsalt )
 {
-    mbedtls_entropy_init ( &context->entropy );
-    mbedtls_ctr_drbg_init ( &context->ctr_drbg );
+    pthread_mutex_lock ( &aes_key_lock );
+
+    if ( !aes_key_active )
+    {
+        pthread_mutex_unlock ( &aes_key_lock );
+
+        if ( crypto->random ( esalt, AES256_KEYLEN ) < 0
+            || crypto->random ( hsalt, AES256_KEYLEN ) < 0 )
+        {
+            return -1;
+        }
 
-    mbedtls_ctr_drbg_set_prediction_resistance ( &context->ctr_drbg, MBEDTLS_CTR_DRBG_PR_ON );
+        return 0;
+    }
 
-    if ( mbedtls_ctr_drbg_seed ( &context->ctr_drbg, mbedtls_entropy_func, &context->entropy,
-            aes_stream_random_pers, sizeof ( aes_stream_random_pers ) ) != 0 )
+    if ( !aes_key_salted && ( crypto->random ( aes_key_esalt, sizeof ( aes_key_esalt ) ) < 0
+            || crypto->random ( aes_key_hsalt, sizeof ( aes_key_hsalt ) ) < 0 ) )
     {
+        pthread_mutex_unlock ( &aes_key_lock );
         return -1;
     }
 
+    aes_key_salted = 1;
+    memcpy ( esalt, aes_key_esalt, sizeof ( aes_key_esalt ) );
+    memcpy ( hsalt, aes_key_hsalt, sizeof ( aes_key_hsalt ) );
+    pthread_mutex_unlock ( &aes_key_lock );
+
     return 0;
 }
 
 /**
- * Generate random bytes
+ * Find key derived earlier from salt during current operation
  */
-static int aes_stream_random_bytes ( struct aes_stream_context_t *context, uint8_t * data,
-    size_t len )
+static int aes_key_lookup ( const uint8_t * salt, uint8_t * key )
 {
-    if ( mbedtls_ctr_drbg_random ( &context->ctr_drbg, data, len ) != 0 )
+    size_t i;
+
+    pthread_mutex_lock ( &aes_key_lock );
+
+    for ( i = 0; aes_key_active && i < KEY_CACHE_SLOTS; i++ )
     {
-        return -1;
+        if ( aes_keys[i].used && !memcmp ( aes_keys[i].salt, salt, AES256_KEYLEN ) )
+        {
+            memcpy ( key, aes_keys[i].key, AES256_KEYLEN );
+            pthread_mutex_unlock ( &aes_key_lock );
+            return 1;
+        }
     }
 
+    pthread_mutex_unlock ( &aes_key_lock );
+
     return 0;
 }
 
 /**
- * Cleanup random generator
+ * Keep derived key for later streams of current operation,
+ * oldest key is replaced once cache is full
  */
-static void aes_stream_random_free ( struct aes_stream_context_t *context )
+static void aes_key_store ( const uint8_t * salt, const uint8_t * key )
 {
-    mbedtls_entropy_free ( &context->entropy );
-    mbedtls_ctr_drbg_free ( &context->ctr_drbg );
+    struct aes_cached_key_t *cached;
+
+    pthread_mutex_lock ( &aes_key_lock );
+
+    if ( aes_key_active )
+    {
+        cached = aes_keys + aes_key_next++ % KEY_CACHE_SLOTS;
+        cached->used = 1;
+        memcpy ( cached->salt, salt, AES256_KEYLEN );
+        memcpy ( cached->key, key, AES256_KEYLEN );
+    }
+
+    pthread_mutex_unlock ( &aes_key_lock );
 }
 
 /**
- * Shift unconsumed queue
+ * Derive crypto key using PBKDF2 and SHA-256, reusing key derived earlier from same salt
  */
-static size_t aes_stream_shift_unconsumed ( struct aes_stream_context_t *context, void *data,
-    size_t len )
+static int aes_stream_derive_key ( struct aes_stream_context_t *context, const char *password,
+    const uint8_t * salt, size_t salt_len, uint8_t * key, size_t key_size )
 {
-    size_t shift_len;
-    uint8_t temp[AES256_BLOCKLEN];
+    if ( salt_len != AES256_KEYLEN || key_size != AES256_KEYLEN )
+    {
+        return context->crypto->derive_key ( password, salt, salt_len, DERIVE_N_ROUNDS, key,
+            key_size );
+    }
 
-    shift_len = MIN ( len, context->unconsumed_len );
-    context->unconsumed_len -= shift_len;
-    memcpy ( data, context->unconsumed, shift_len );
-    memcpy ( temp, context->unconsumed + shift_len, context->unconsumed_len );
-    memcpy ( context->unconsumed, temp, context->unconsumed_len );
+    if ( aes_key_lookup ( salt, key ) )
+    {
+        return 0;
+    }
+
+    if ( context->crypto->derive_key ( password, salt, salt_len, DERIVE_N_ROUNDS, key,
+            key_size ) < 0 )
+    {
+        return -1;
+    }
 
-    return shift_len;
+    aes_key_store ( salt, key );
+
+    return 0;
 }
 
 /*
@@ -180,45 +263,199 @@ static int pkcs7_get_padding_length ( const uint8_t * input, size_t length, size
     return 0;
 }
 
-/*
- * Read data from AES stream
+/**
+ * HMAC worker thread entry, hashes ciphertext slots in order
  */
-static ssize_t aes_stream_read ( struct io_stream_t *io, void *data, size_t len )
+static void *aes_mac_worker ( void *arg )
 {
-    ssize_t read_len;
-    size_t aligned_len;
-    size_t padding_len;
+    struct aes_mac_slot_t *slot;
     struct aes_stream_context_t *context;
 
-    context = ( struct aes_stream_context_t * ) io->context;
+    context = ( struct aes_stream_context_t * ) arg;
 
-    if ( context->unconsumed_len )
+    pthread_mutex_lock ( &context->mac_lock );
+
+    for ( ;; )
     {
-        return aes_stream_shift_unconsumed ( context, data, len );
+        while ( !context->mac_stopping && context->mac_tail == context->mac_head )
+        {
+            pthread_cond_wait ( &context->mac_wake, &context->mac_lock );
+        }
+
+        if ( context->mac_tail == context->mac_head )
+        {
+            break;
+        }
+
+        slot = context->mac_slots + context->mac_tail % MAC_SLOTS;
+        pthread_mutex_unlock ( &context->mac_lock );
+
+        if ( context->crypto->mac_update ( context->mac, slot->data, slot->length ) < 0 )
+        {
+            context->mac_error = 1;
+        }
+
+        pthread_mutex_lock ( &context->mac_lock );
+        context->mac_tail++;
+        pthread_cond_signal ( &context->mac_done );
     }
 
-    if ( context->eof )
+    pthread_mutex_unlock ( &context->mac_lock );
+
+    return NULL;
+}
+
+/**
+ * Get free ciphertext slot, waiting for HMAC worker if both are queued
+ */
+static struct aes_mac_slot_t *aes_mac_slot ( struct aes_stream_context_t *context )
+{
+    uint64_t wait;
+
+    if ( !context->mac_threaded )
     {
-        return 0;
+        return context->mac_slots;
     }
 
-    aligned_len = len;
+    wait = stats_wait_begin (  );
+    pthread_mutex_lock ( &context->mac_lock );
 
-    if ( aligned_len % AES256_BLOCKLEN )
+    while ( context->mac_head - context->mac_tail == MAC_SLOTS )
+    {
+        pthread_cond_wait ( &context->mac_done, &context->mac_lock );
+    }
+
+    pthread_mutex_unlock ( &context->mac_lock );
+    stats_wait_end ( wait );
+
+    return context->mac_slots + context->mac_head % MAC_SLOTS;
+}
+
+/**
+ * Queue ciphertext slot for HMAC update, slot stays readable until reused
+ */
+static int aes_mac_submit ( struct aes_stream_context_t *context, struct aes_mac_slot_t *slot,
+    size_t length )
+{
+    slot->length = length;
+
+    if ( !context->mac_threaded )
+    {
+        return context->crypto->mac_update ( context->mac, slot->data, length );
+    }
+
+    pthread_mutex_lock ( &context->mac_lock );
+    context->mac_head++;
+    pthread_cond_signal ( &context->mac_wake );
+    pthread_mutex_unlock ( &context->mac_lock );
+
+    return 0;
+}
+
+/**
+ * Wait until HMAC covers all queued ciphertext
+ */
+static int aes_mac_join ( struct aes_stream_context_t *context )
+{
+    uint64_t wait;
+
+    if ( context->mac_threaded )
+    {
+        wait = stats_wait_begin (  );
+        pthread_mutex_lock ( &context->mac_lock );
+
+        while ( context->mac_tail != context->mac_head )
+        {
+            pthread_cond_wait ( &context->mac_done, &context->mac_lock );
+        }
+
+        pthread_mutex_unlock ( &context->mac_lock );
+        stats_wait_end ( wait );
+    }
+
+    return context->mac_error ? -1 : 0;
+}
+
+/**
+ * Start HMAC worker, on single CPU HMAC is updated inline
+ */
+static void aes_mac_start ( struct aes_stream_context_t *context )
+{
+    context->mac_stopping = 0;
+    context->mac_error = 0;
+    context->mac_head = 0;
+    context->mac_tail = 0;
+    context->mac_threaded = 0;
+
+    if ( sysconf ( _SC_NPROCESSORS_ONLN ) < 2 )
+    {
+        return;
+    }
+
+    pthread_mutex_init ( &context->mac_lock, NULL );
+    pthread_cond_init ( &context->mac_wake, NULL );
+    pthread_cond_init ( &context->mac_done, NULL );
+
+    if ( pthread_create ( &context->mac_thread, NULL, aes_mac_worker, context ) )
+    {
+        pthread_cond_destroy ( &context->mac_done );
+        pthread_cond_destroy ( &context->mac_wake );
+        pthread_mutex_destroy ( &context->mac_lock );
+        return;
+    }
+
+    context->mac_threaded = 1;
+}
+
+/**
+ * Stop HMAC worker
+ */
+static void aes_mac_stop ( struct aes_stream_context_t *context )
+{
+    if ( !context->mac_threaded )
     {
-        aligned_len += AES256_BLOCKLEN - aligned_len % AES256_BLOCKLEN;
+        return;
     }
 
-    if ( AES256_BLOCKLEN + SHA256_BLOCKLEN + aligned_len > CHUNK_SIZE )
+    pthread_mutex_lock ( &context->mac_lock );
+    context->mac_stopping = 1;
+    pthread_cond_signal ( &context->mac_wake );
+    pthread_mutex_unlock ( &context->mac_lock );
+
+    pthread_join ( context->mac_thread, NULL );
+
+    pthread_cond_destroy ( &context->mac_done );
+    pthread_cond_destroy ( &context->mac_wake );
+    pthread_mutex_destroy ( &context->mac_lock );
+    context->mac_threaded = 0;
+}
+
+/**
+ * Decrypt next ciphertext chunk into plaintext buffer
+ */
+static int aes_stream_fill ( struct aes_stream_context_t *context )
+{
+    ssize_t read_len;
+    size_t aligned_len;
+    size_t padding_len;
+    struct aes_mac_slot_t *slot;
+
+    context->buffer_offset = 0;
+    context->buffer_length = 0;
+
+    if ( context->eof )
     {
-        aligned_len = CHUNK_SIZE - AES256_BLOCKLEN - SHA256_BLOCKLEN;
+        return 0;
     }
 
-    memcpy ( context->buffer, context->tail, AES256_BLOCKLEN + SHA256_BLOCKLEN );
+    /* Ciphertext stays in slot for HMAC worker while it is decrypted to buffer */
+    slot = aes_mac_slot ( context );
+    memcpy ( slot->data, context->tail, AES256_BLOCKLEN + SHA256_BLOCKLEN );
 
     if ( ( read_len =
             context->internal->read_max ( context->internal,
-                context->buffer + AES256_BLOCKLEN + SHA256_BLOCKLEN, aligned_len ) ) < 0 )
+                slot->data + AES256_BLOCKLEN + SHA256_BLOCKLEN,
+                context->size - AES256_BLOCKLEN - SHA256_BLOCKLEN ) ) < 0 )
     {
         return -1;
     }
@@ -232,54 +469,95 @@ static ssize_t aes_stream_read ( struct io_stream_t *io, void *data, size_t len
 
     if ( !aligned_len )
     {
-        if ( mbedtls_md_hmac_update ( &context->md_ctx, context->tail, AES256_BLOCKLEN ) != 0 )
+        /* HMAC is of no use after seek, verify refuses it */
+        if ( !context->seeked && aes_mac_submit ( context, slot, AES256_BLOCKLEN ) < 0 )
         {
             return -1;
         }
 
-        if ( mbedtls_aes_crypt_cbc ( &context->aes, MBEDTLS_AES_DECRYPT, AES256_BLOCKLEN,
-                context->iv, context->tail, context->unconsumed ) != 0 )
+        if ( context->crypto->cipher_cbc ( context->cipher, context->iv, context->tail,
+                context->buffer, AES256_BLOCKLEN ) < 0 )
         {
             return -1;
         }
 
-        if ( pkcs7_get_padding_length ( context->unconsumed, AES256_BLOCKLEN, &padding_len ) < 0 )
+        if ( pkcs7_get_padding_length ( context->buffer, AES256_BLOCKLEN, &padding_len ) < 0 )
         {
             return -1;
         }
 
-        context->unconsumed_len = AES256_BLOCKLEN - padding_len;
-
+        context->buffer_length = AES256_BLOCKLEN - padding_len;
         context->eof = 1;
 
-        return aes_stream_shift_unconsumed ( context, data, len );
+        return 0;
     }
 
-    if ( mbedtls_md_hmac_update ( &context->md_ctx, context->buffer, aligned_len ) != 0 )
+    if ( !context->seeked && aes_mac_submit ( context, slot, aligned_len ) < 0 )
     {
         return -1;
     }
 
-    if ( mbedtls_aes_crypt_cbc ( &context->aes, MBEDTLS_AES_DECRYPT, aligned_len, context->iv,
-            context->buffer, context->buffer ) != 0 )
+    if ( context->crypto->cipher_cbc ( context->cipher, context->iv, slot->data, context->buffer,
+            aligned_len ) < 0 )
     {
         return -1;
     }
 
-    memcpy ( context->tail, context->buffer + aligned_len, AES256_BLOCKLEN + SHA256_BLOCKLEN );
+    memcpy ( context->tail, slot->data + aligned_len, AES256_BLOCKLEN + SHA256_BLOCKLEN );
+    context->buffer_length = aligned_len;
 
-    if ( len < aligned_len )
+    return 0;
+}
+
+/*
+ * Borrow decrypted data from AES stream
+ */
+static ssize_t aes_stream_peek ( struct io_stream_t *io, const void **data, size_t len )
+{
+    struct aes_stream_context_t *context;
+
+    context = ( struct aes_stream_context_t * ) io->context;
+
+    if ( context->buffer_offset == context->buffer_length && aes_stream_fill ( context ) < 0 )
     {
-        memcpy ( data, context->buffer, len );
-        context->unconsumed_len = aligned_len - len;
-        memcpy ( context->unconsumed, context->buffer + len, context->unconsumed_len );
-        return len;
+        return -1;
     }
 
-    memcpy ( data, context->buffer, aligned_len );
-    context->unconsumed_len = 0;
+    *data = context->buffer + context->buffer_offset;
+
+    return MIN ( len, context->buffer_length - context->buffer_offset );
+}
 
-    return aligned_len;
+/*
+ * Drop data borrowed from AES stream
+ */
+static int aes_stream_consume ( struct io_stream_t *io, size_t len )
+{
+    struct aes_stream_context_t *context;
+
+    context = ( struct aes_stream_context_t * ) io->context;
+    context->buffer_offset += MIN ( len, context->buffer_length - context->buffer_offset );
+
+    return 0;
+}
+
+/*
+ * Read data from AES stream
+ */
+static ssize_t aes_stream_read ( struct io_stream_t *io, void *data, size_t len )
+{
+    ssize_t length;
+    const void *borrowed;
+
+    if ( ( length = aes_stream_peek ( io, &borrowed, len ) ) <= 0 )
+    {
+        return length;
+    }
+
+    memcpy ( data, borrowed, length );
+    stream_count_copy ( length );
+
+    return aes_stream_consume ( io, length ) < 0 ? -1 : length;
 }
 
 /*
@@ -290,6 +568,7 @@ static ssize_t aes_stream_write ( struct io_stream_t *io, const void *data, size
     size_t shift_len;
     size_t aligned_len;
     size_t offset = 0;
+    struct aes_mac_slot_t *slot;
     struct aes_stream_context_t *context;
 
     context = ( struct aes_stream_context_t * ) io->context;
@@ -310,21 +589,24 @@ static ssize_t aes_stream_write ( struct io_stream_t *io, const void *data, size
 
         if ( context->unconsumed_len < AES256_BLOCKLEN )
         {
+            context->offset += len;
             return len;
         }
 
-        if ( mbedtls_aes_crypt_cbc ( &context->aes, MBEDTLS_AES_ENCRYPT, AES256_BLOCKLEN,
-                context->iv, context->unconsumed, context->buffer ) != 0 )
+        slot = aes_mac_slot ( context );
+
+        if ( context->crypto->cipher_cbc ( context->cipher, context->iv, context->unconsumed,
+                slot->data, AES256_BLOCKLEN ) < 0 )
         {
             return -1;
         }
 
-        if ( mbedtls_md_hmac_update ( &context->md_ctx, context->buffer, AES256_BLOCKLEN ) != 0 )
+        if ( aes_mac_submit ( context, slot, AES256_BLOCKLEN ) < 0 )
         {
             return -1;
         }
 
-        if ( context->internal->write_complete ( context->internal, context->buffer,
+        if ( context->internal->write_complete ( context->internal, slot->data,
                 AES256_BLOCKLEN ) < 0 )
         {
             return -1;
@@ -343,23 +625,26 @@ static ssize_t aes_stream_write ( struct io_stream_t *io, const void *data, size
         aligned_len -= aligned_len % AES256_BLOCKLEN;
     }
 
-    if ( aligned_len > sizeof ( context->buffer ) )
+    slot = aes_mac_slot ( context );
+
+    if ( aligned_len > AES256_BLOCKLEN + SHA256_BLOCKLEN + context->size )
     {
-        aligned_len = sizeof ( context->buffer );
+        aligned_len = AES256_BLOCKLEN + SHA256_BLOCKLEN + context->size;
     }
 
-    if ( mbedtls_aes_crypt_cbc ( &context->aes, MBEDTLS_AES_ENCRYPT, aligned_len, context->iv,
-            data + offset, context->buffer ) != 0 )
+    /* HMAC worker hashes this ciphertext while it is written and next one encrypted */
+    if ( context->crypto->cipher_cbc ( context->cipher, context->iv, data + offset, slot->data,
+            aligned_len ) < 0 )
     {
         return -1;
     }
 
-    if ( mbedtls_md_hmac_update ( &context->md_ctx, context->buffer, aligned_len ) != 0 )
+    if ( aes_mac_submit ( context, slot, aligned_len ) < 0 )
     {
         return -1;
     }
 
-    if ( context->internal->write_complete ( context->internal, context->buffer, aligned_len ) < 0 )
+    if ( context->internal->write_complete ( context->internal, slot->data, aligned_len ) < 0 )
     {
         return -1;
     }
@@ -374,6 +659,8 @@ static ssize_t aes_stream_write ( struct io_stream_t *io, const void *data, size
         offset += context->unconsumed_len;
     }
 
+    context->offset += offset;
+
     return offset;
 }
 
@@ -384,19 +671,29 @@ static int aes_stream_verify ( struct io_stream_t *io )
 {
     struct aes_stream_context_t *context;
     uint8_t calc_hmac[SHA256_BLOCKLEN];
-    uint8_t temp[AES256_BLOCKLEN];
 
     context = ( struct aes_stream_context_t * ) io->context;
 
+    if ( context->seeked )
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
     while ( !context->eof )
     {
-        if ( aes_stream_read ( io, temp, sizeof ( temp ) ) < 0 )
+        if ( aes_stream_fill ( context ) < 0 )
         {
             return -1;
         }
     }
 
-    if ( mbedtls_md_hmac_finish ( &context->md_ctx, calc_hmac ) != 0 )
+    if ( aes_mac_join ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( context->crypto->mac_finish ( context->mac, calc_hmac ) < 0 )
     {
         return -1;
     }
@@ -418,6 +715,7 @@ static int aes_stream_flush ( struct io_stream_t *io )
     uint8_t padding;
     uint8_t buffer[AES256_BLOCKLEN] = { 0 };
     uint8_t hmac[SHA256_BLOCKLEN];
+    struct aes_mac_slot_t *slot;
 
     context = ( struct aes_stream_context_t * ) io->context;
     padding = AES256_BLOCKLEN - context->unconsumed_len;
@@ -425,23 +723,31 @@ static int aes_stream_flush ( struct io_stream_t *io )
     memcpy ( buffer, context->unconsumed, context->unconsumed_len );
     memset ( buffer + context->unconsumed_len, padding, padding );
 
-    if ( mbedtls_aes_crypt_cbc ( &context->aes, MBEDTLS_AES_ENCRYPT, AES256_BLOCKLEN, context->iv,
-            buffer, buffer ) != 0 )
+    slot = aes_mac_slot ( context );
+
+    if ( context->crypto->cipher_cbc ( context->cipher, context->iv, buffer, slot->data,
+            AES256_BLOCKLEN ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( aes_mac_submit ( context, slot, AES256_BLOCKLEN ) < 0 )
     {
         return -1;
     }
 
-    if ( mbedtls_md_hmac_update ( &context->md_ctx, buffer, sizeof ( buffer ) ) != 0 )
+    if ( context->internal->write_complete ( context->internal, slot->data,
+            AES256_BLOCKLEN ) < 0 )
     {
         return -1;
     }
 
-    if ( context->internal->write_complete ( context->internal, buffer, sizeof ( buffer ) ) < 0 )
+    if ( aes_mac_join ( context ) < 0 )
     {
         return -1;
     }
 
-    if ( mbedtls_md_hmac_finish ( &context->md_ctx, hmac ) != 0 )
+    if ( context->crypto->mac_finish ( context->mac, hmac ) < 0 )
     {
         return -1;
     }
@@ -459,6 +765,145 @@ static int aes_stream_flush ( struct io_stream_t *io )
     return 0;
 }
 
+/*
+ * Get AES stream plaintext offset
+ */
+static int aes_stream_split ( struct io_stream_t *io, uint64_t * offset )
+{
+    struct aes_stream_context_t *context;
+
+    context = ( struct aes_stream_context_t * ) io->context;
+
+    *offset = context->offset;
+
+    return 0;
+}
+
+/*
+ * Write annotation data to AES stream
+ */
+static int aes_stream_annotate ( struct io_stream_t *io, const void *data, size_t len )
+{
+    return io->write_complete ( io, data, len );
+}
+
+/*
+ * Seek AES stream to plaintext offset
+ */
+static int aes_stream_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    size_t len;
+    uint64_t aligned;
+    struct aes_stream_context_t *context;
+    uint8_t temp[AES256_BLOCKLEN];
+
+    context = ( struct aes_stream_context_t * ) io->context;
+
+    /* CBC decryption may restart at any block given the preceding ciphertext block */
+    aligned = offset - offset % AES256_BLOCKLEN;
+
+    if ( context->internal->seek ( context->internal,
+            HEADER_LEN + aligned - AES256_BLOCKLEN ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( context->internal->read_complete ( context->internal, context->iv,
+            sizeof ( context->iv ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( context->internal->read_complete ( context->internal, context->tail,
+            sizeof ( context->tail ) ) < 0 )
+    {
+        return -1;
+    }
+
+    context->eof = 0;
+    context->seeked = 1;
+    context->buffer_offset = 0;
+    context->buffer_length = 0;
+
+    for ( offset -= aligned; offset; offset -= len )
+    {
+        if ( ( ssize_t ) ( len = aes_stream_read ( io, temp, offset ) ) <= 0 )
+        {
+            errno = ENODATA;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Get AES stream plaintext length
+ */
+static int aes_stream_length ( struct io_stream_t *io, uint64_t * length )
+{
+    size_t padding_len;
+    uint64_t total;
+    uint64_t cipher_len;
+    struct aes_stream_context_t *context;
+    uint8_t iv[AES256_BLOCKLEN];
+    uint8_t block[AES256_BLOCKLEN];
+
+    context = ( struct aes_stream_context_t * ) io->context;
+
+    if ( context->internal->length ( context->internal, &total ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( total < HEADER_LEN + AES256_BLOCKLEN + SHA256_BLOCKLEN )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cipher_len = total - HEADER_LEN - SHA256_BLOCKLEN;
+
+    if ( cipher_len % AES256_BLOCKLEN )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    context->seeked = 1;
+
+    if ( context->internal->seek ( context->internal,
+            HEADER_LEN + cipher_len - 2 * AES256_BLOCKLEN ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( context->internal->read_complete ( context->internal, iv, sizeof ( iv ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( context->internal->read_complete ( context->internal, block, sizeof ( block ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( context->crypto->cipher_cbc ( context->cipher, iv, block, block, AES256_BLOCKLEN ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( pkcs7_get_padding_length ( block, AES256_BLOCKLEN, &padding_len ) < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *length = cipher_len - padding_len;
+
+    return 0;
+}
+
 /*
  * Close AES stream
  */
@@ -468,12 +913,54 @@ static void aes_stream_close ( struct io_stream_t *io )
 
     context = ( struct aes_stream_context_t * ) io->context;
 
-    mbedtls_aes_free ( &context->aes );
-    mbedtls_md_free ( &context->md_ctx );
+    aes_mac_stop ( context );
+    context->crypto->cipher_free ( context->cipher );
+    context->crypto->mac_free ( context->mac );
     context->internal->close ( context->internal );
+    budget_free ( context );
     free ( io );
 }
 
+/**
+ * Estimate memory taken by AES stream with current stream settings
+ */
+size_t aes_stream_memory ( void )
+{
+    return budget_cost ( sizeof ( struct aes_stream_context_t ) + ( MAC_SLOTS +
+            1 ) * ( AES256_BLOCKLEN + SHA256_BLOCKLEN + stream_params (  )->buffer_size ) );
+}
+
+/**
+ * Allocate AES stream context with decrypt buffer and HMAC slots sized for stream buffer
+ */
+static struct aes_stream_context_t *aes_stream_context_new ( void )
+{
+    size_t i;
+    size_t size;
+    size_t slot_size;
+    struct aes_stream_context_t *context;
+
+    size = stream_params (  )->buffer_size;
+    slot_size = AES256_BLOCKLEN + SHA256_BLOCKLEN + size;
+
+    if ( !( context =
+            ( struct aes_stream_context_t * ) budget_alloc ( sizeof ( struct aes_stream_context_t )
+                + ( MAC_SLOTS + 1 ) * slot_size ) ) )
+    {
+        return NULL;
+    }
+
+    context->size = size;
+    context->buffer = context->storage;
+
+    for ( i = 0; i < MAC_SLOTS; i++ )
+    {
+        context->mac_slots[i].data = context->storage + ( i + 1 ) * slot_size;
+    }
+
+    return context;
+}
+
 /**
  * Create new input AES stream
  */
@@ -481,100 +968,87 @@ struct io_stream_t *input_aes_stream_new ( struct io_stream_t *internal, const c
 {
     struct io_stream_t *io;
     struct aes_stream_context_t *context;
-    mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
     uint8_t ekey[AES256_KEYLEN];
     uint8_t hkey[AES256_KEYLEN];
     uint8_t nonce[NONCE_LEN];
 
-    if ( !( context =
-            ( struct aes_stream_context_t * ) malloc ( sizeof ( struct aes_stream_context_t ) ) ) )
+    if ( !( context = aes_stream_context_new (  ) ) )
     {
         return NULL;
     }
 
     context->eof = 0;
-    context->unconsumed_len = 0;
+    context->seeked = 0;
+    context->buffer_offset = 0;
+    context->buffer_length = 0;
+    context->offset = 0;
     context->internal = internal;
+    context->crypto = crypto_backend (  );
 
     if ( context->internal->read_complete ( context->internal, context->esalt,
             sizeof ( context->esalt ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     if ( context->internal->read_complete ( context->internal, context->hsalt,
             sizeof ( context->hsalt ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     if ( context->internal->read_complete ( context->internal, context->iv,
             sizeof ( context->iv ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     if ( context->internal->read_complete ( context->internal, nonce, sizeof ( nonce ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    if ( aes_stream_derive_key ( password, context->esalt, sizeof ( context->esalt ), ekey,
-            sizeof ( ekey ) ) < 0 )
+    if ( aes_stream_derive_key ( context, password, context->esalt, sizeof ( context->esalt ),
+            ekey, sizeof ( ekey ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    mbedtls_aes_init ( &context->aes );
-
-    if ( mbedtls_aes_setkey_dec ( &context->aes, ekey, AES256_KEYLEN_BITS ) != 0 )
+    if ( !( context->cipher = context->crypto->cipher_new ( ekey, 0 ) ) )
     {
         memset ( ekey, '\0', sizeof ( ekey ) );
-        mbedtls_aes_free ( &context->aes );
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     memset ( ekey, '\0', sizeof ( ekey ) );
 
-    if ( mbedtls_aes_crypt_cbc ( &context->aes, MBEDTLS_AES_DECRYPT, sizeof ( nonce ), context->iv,
-            nonce, nonce ) != 0 )
-    {
-        mbedtls_aes_free ( &context->aes );
-        free ( context );
-        return NULL;
-    }
-
-    if ( aes_stream_derive_key ( password, context->hsalt, sizeof ( context->hsalt ), hkey,
-            sizeof ( hkey ) ) < 0 )
+    if ( context->crypto->cipher_cbc ( context->cipher, context->iv, nonce, nonce,
+            sizeof ( nonce ) ) < 0 )
     {
-        mbedtls_aes_free ( &context->aes );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        budget_free ( context );
         return NULL;
     }
 
-    mbedtls_md_init ( &context->md_ctx );
-
-    if ( mbedtls_md_setup ( &context->md_ctx, mbedtls_md_info_from_type ( md_type ), 1 ) != 0 )
+    if ( aes_stream_derive_key ( context, password, context->hsalt, sizeof ( context->hsalt ),
+            hkey, sizeof ( hkey ) ) < 0 )
     {
-        memset ( hkey, '\0', sizeof ( hkey ) );
-        mbedtls_aes_free ( &context->aes );
-        mbedtls_md_free ( &context->md_ctx );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        budget_free ( context );
         return NULL;
     }
 
-    if ( mbedtls_md_hmac_starts ( &context->md_ctx, hkey, sizeof ( hkey ) ) != 0 )
+    if ( !( context->mac = context->crypto->mac_new ( hkey, sizeof ( hkey ) ) ) )
     {
         memset ( hkey, '\0', sizeof ( hkey ) );
-        mbedtls_aes_free ( &context->aes );
-        mbedtls_md_free ( &context->md_ctx );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        budget_free ( context );
         return NULL;
     }
 
@@ -583,23 +1057,30 @@ struct io_stream_t *input_aes_stream_new ( struct io_stream_t *internal, const c
     if ( context->internal->read_complete ( context->internal, context->tail,
             sizeof ( context->tail ) ) < 0 )
     {
-        mbedtls_aes_free ( &context->aes );
-        mbedtls_md_free ( &context->md_ctx );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        context->crypto->mac_free ( context->mac );
+        budget_free ( context );
         return NULL;
     }
 
+    aes_mac_start ( context );
+
     if ( !( io = io_stream_new (  ) ) )
     {
-        mbedtls_aes_free ( &context->aes );
-        mbedtls_md_free ( &context->md_ctx );
-        free ( context );
+        aes_mac_stop ( context );
+        context->crypto->cipher_free ( context->cipher );
+        context->crypto->mac_free ( context->mac );
+        budget_free ( context );
         return NULL;
     }
 
     io->context = ( struct io_base_context_t * ) context;
     io->read = aes_stream_read;
+    io->peek = aes_stream_peek;
+    io->consume = aes_stream_consume;
     io->verify = aes_stream_verify;
+    io->seek = aes_stream_seek;
+    io->length = aes_stream_length;
     io->close = aes_stream_close;
 
     return io;
@@ -612,152 +1093,124 @@ struct io_stream_t *output_aes_stream_new ( struct io_stream_t *internal, const
 {
     struct io_stream_t *io;
     struct aes_stream_context_t *context;
-    mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
     uint8_t ekey[AES256_KEYLEN];
     uint8_t hkey[AES256_KEYLEN];
     uint8_t nonce[NONCE_LEN];
 
-    if ( !( context =
-            ( struct aes_stream_context_t * ) malloc ( sizeof ( struct aes_stream_context_t ) ) ) )
+    if ( !( context = aes_stream_context_new (  ) ) )
     {
         return NULL;
     }
 
     context->unconsumed_len = 0;
+    context->offset = 0;
     context->internal = internal;
+    context->crypto = crypto_backend (  );
 
-    if ( aes_stream_random_init ( context ) < 0 )
-    {
-        free ( context );
-        return NULL;
-    }
-
-    if ( aes_stream_random_bytes ( context, context->esalt, sizeof ( context->esalt ) ) < 0 )
-    {
-        aes_stream_random_free ( context );
-        free ( context );
-        return NULL;
-    }
-
-    if ( aes_stream_random_bytes ( context, context->hsalt, sizeof ( context->hsalt ) ) < 0 )
+    if ( aes_key_salts ( context->crypto, context->esalt, context->hsalt ) < 0 )
     {
-        aes_stream_random_free ( context );
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    if ( aes_stream_random_bytes ( context, context->iv, sizeof ( context->iv ) ) < 0 )
+    if ( context->crypto->random ( context->iv, sizeof ( context->iv ) ) < 0 )
     {
-        aes_stream_random_free ( context );
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    if ( aes_stream_random_bytes ( context, nonce, sizeof ( nonce ) ) < 0 )
+    if ( context->crypto->random ( nonce, sizeof ( nonce ) ) < 0 )
     {
-        aes_stream_random_free ( context );
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    aes_stream_random_free ( context );
-
     if ( context->internal->write_complete ( context->internal, context->esalt,
             sizeof ( context->esalt ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     if ( context->internal->write_complete ( context->internal, context->hsalt,
             sizeof ( context->hsalt ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     if ( context->internal->write_complete ( context->internal, context->iv,
             sizeof ( context->iv ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    if ( aes_stream_derive_key ( password, context->esalt, sizeof ( context->esalt ), ekey,
-            sizeof ( ekey ) ) < 0 )
+    if ( aes_stream_derive_key ( context, password, context->esalt, sizeof ( context->esalt ),
+            ekey, sizeof ( ekey ) ) < 0 )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    mbedtls_aes_init ( &context->aes );
-
-    if ( mbedtls_aes_setkey_enc ( &context->aes, ekey, AES256_KEYLEN_BITS ) != 0 )
+    if ( !( context->cipher = context->crypto->cipher_new ( ekey, 1 ) ) )
     {
         memset ( ekey, '\0', sizeof ( ekey ) );
-        mbedtls_aes_free ( &context->aes );
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     memset ( ekey, '\0', sizeof ( ekey ) );
 
-    if ( mbedtls_aes_crypt_cbc ( &context->aes, MBEDTLS_AES_ENCRYPT, sizeof ( nonce ), context->iv,
-            nonce, nonce ) != 0 )
+    if ( context->crypto->cipher_cbc ( context->cipher, context->iv, nonce, nonce,
+            sizeof ( nonce ) ) < 0 )
     {
-        mbedtls_aes_free ( &context->aes );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        budget_free ( context );
         return NULL;
     }
 
     if ( context->internal->write_complete ( context->internal, nonce, sizeof ( nonce ) ) < 0 )
     {
-        mbedtls_aes_free ( &context->aes );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        budget_free ( context );
         return NULL;
     }
 
-    if ( aes_stream_derive_key ( password, context->hsalt, sizeof ( context->hsalt ), hkey,
-            sizeof ( hkey ) ) < 0 )
+    if ( aes_stream_derive_key ( context, password, context->hsalt, sizeof ( context->hsalt ),
+            hkey, sizeof ( hkey ) ) < 0 )
     {
-        mbedtls_aes_free ( &context->aes );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        budget_free ( context );
         return NULL;
     }
 
-    mbedtls_md_init ( &context->md_ctx );
-
-    if ( mbedtls_md_setup ( &context->md_ctx, mbedtls_md_info_from_type ( md_type ), 1 ) != 0 )
+    if ( !( context->mac = context->crypto->mac_new ( hkey, sizeof ( hkey ) ) ) )
     {
         memset ( hkey, '\0', sizeof ( hkey ) );
-        mbedtls_aes_free ( &context->aes );
-        mbedtls_md_free ( &context->md_ctx );
-        free ( context );
-        return NULL;
-    }
-
-    if ( mbedtls_md_hmac_starts ( &context->md_ctx, hkey, sizeof ( hkey ) ) != 0 )
-    {
-        memset ( hkey, '\0', sizeof ( hkey ) );
-        mbedtls_aes_free ( &context->aes );
-        mbedtls_md_free ( &context->md_ctx );
-        free ( context );
+        context->crypto->cipher_free ( context->cipher );
+        budget_free ( context );
         return NULL;
     }
 
     memset ( hkey, '\0', sizeof ( hkey ) );
 
+    aes_mac_start ( context );
+
     if ( !( io = io_stream_new (  ) ) )
     {
-        mbedtls_aes_free ( &context->aes );
-        mbedtls_md_free ( &context->md_ctx );
-        free ( context );
+        aes_mac_stop ( context );
+        context->crypto->cipher_free ( context->cipher );
+        context->crypto->mac_free ( context->mac );
+        budget_free ( context );
         return NULL;
     }
 
     io->context = ( struct io_base_context_t * ) context;
     io->write = aes_stream_write;
     io->flush = aes_stream_flush;
+    io->split = aes_stream_split;
+    io->annotate = aes_stream_annotate;
     io->close = aes_stream_close;
 
     return io;
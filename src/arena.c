@@ -0,0 +1,137 @@
+/* ------------------------------------------------------------------
+ * SBox - Arena Memory Allocator
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_CHUNK_MIN 65536
+#define ARENA_CHUNK_MAX 67108864
+
+/**
+ * Arena memory chunk
+ */
+struct arena_chunk_t
+{
+    struct arena_chunk_t *prev;
+    size_t used;
+    size_t size;
+    uint8_t bytes[];
+};
+
+/**
+ * Create new arena
+ */
+void arena_new ( struct arena_t *arena )
+{
+    arena->chunk = NULL;
+    arena->chunk_size = ARENA_CHUNK_MIN;
+}
+
+/**
+ * Allocate memory from arena with given alignment
+ */
+static void *arena_alloc_aligned ( struct arena_t *arena, size_t size, size_t align )
+{
+    size_t offset;
+    size_t chunk_size;
+    struct arena_chunk_t *chunk;
+
+    if ( ( chunk = arena->chunk ) )
+    {
+        offset = ( chunk->used + align - 1 ) & ~( align - 1 );
+
+        if ( offset <= chunk->size && size <= chunk->size - offset )
+        {
+            chunk->used = offset + size;
+            return chunk->bytes + offset;
+        }
+    }
+
+    chunk_size = MAX ( arena->chunk_size, size );
+
+    /* Chunks past memory budget are spilled to disk */
+    if ( !( chunk =
+            ( struct arena_chunk_t * ) budget_spill_alloc ( sizeof ( struct arena_chunk_t ) +
+                chunk_size ) ) )
+    {
+        return NULL;
+    }
+
+    chunk->prev = arena->chunk;
+    chunk->used = size;
+    chunk->size = chunk_size;
+    arena->chunk = chunk;
+
+    if ( arena->chunk_size < ARENA_CHUNK_MAX )
+    {
+        arena->chunk_size *= 2;
+    }
+
+    return chunk->bytes;
+}
+
+/**
+ * Allocate memory from arena
+ */
+void *arena_alloc ( struct arena_t *arena, size_t size )
+{
+    return arena_alloc_aligned ( arena, size, ARENA_ALIGN );
+}
+
+/**
+ * Move arena allocation into a larger one
+ */
+void *arena_realloc ( struct arena_t *arena, void *ptr, size_t old_size, size_t new_size )
+{
+    void *copy;
+
+    if ( !( copy = arena_alloc ( arena, new_size ) ) )
+    {
+        return NULL;
+    }
+
+    if ( ptr )
+    {
+        memcpy ( copy, ptr, MIN ( old_size, new_size ) );
+    }
+
+    return copy;
+}
+
+/**
+ * Duplicate string into arena
+ */
+char *arena_strdup ( struct arena_t *arena, const char *str )
+{
+    size_t len;
+    char *copy;
+
+    len = strlen ( str ) + 1;
+
+    if ( !( copy = ( char * ) arena_alloc_aligned ( arena, len, 1 ) ) )
+    {
+        return NULL;
+    }
+
+    memcpy ( copy, str, len );
+
+    return copy;
+}
+
+/**
+ * Free arena with all its allocations
+ */
+void arena_free ( struct arena_t *arena )
+{
+    struct arena_chunk_t *chunk;
+    struct arena_chunk_t *prev;
+
+    for ( chunk = arena->chunk; chunk; chunk = prev )
+    {
+        prev = chunk->prev;
+        budget_free ( chunk );
+    }
+
+    arena->chunk = NULL;
+}
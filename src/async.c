@@ -0,0 +1,772 @@
+/* ------------------------------------------------------------------
+ * SBox - Asynchronous Stream Impl.
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <pthread.h>
+
+/**
+ * Ring slot, input slot shorter than chunk marks end of stream
+ */
+struct async_slot_t
+{
+    size_t length;
+    int error;
+    uint8_t *data;
+};
+
+/**
+ * Async stream context, slots between tail and head are filled,
+ * ring indices are single producer single consumer counters,
+ * lock is only taken by a side going to sleep or waking the other one
+ */
+struct async_stream_context_t
+{
+    struct io_stream_t *internal;
+    int input;
+    size_t depth;
+    size_t size;
+    struct async_slot_t *slots;
+
+    size_t head;
+    size_t tail;
+    size_t offset;
+    int error;
+
+    int worker_waiting;
+    int caller_waiting;
+    int paused;
+    int busy;
+    int eof;
+    int stopping;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t ready;
+};
+
+/**
+ * Load ring counter published by other thread
+ */
+static size_t async_load ( size_t *counter )
+{
+    return __atomic_load_n ( counter, __ATOMIC_SEQ_CST );
+}
+
+/**
+ * Publish ring counter to other thread
+ */
+static void async_store ( size_t *counter, size_t value )
+{
+    __atomic_store_n ( counter, value, __ATOMIC_SEQ_CST );
+}
+
+/**
+ * Wake worker thread if it sleeps
+ */
+static void async_wake_worker ( struct async_stream_context_t *context )
+{
+    if ( __atomic_load_n ( &context->worker_waiting, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock ( &context->lock );
+        pthread_cond_signal ( &context->wake );
+        pthread_mutex_unlock ( &context->lock );
+    }
+}
+
+/**
+ * Wake calling thread if it sleeps
+ */
+static void async_wake_caller ( struct async_stream_context_t *context )
+{
+    if ( __atomic_load_n ( &context->caller_waiting, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock ( &context->lock );
+        pthread_cond_signal ( &context->ready );
+        pthread_mutex_unlock ( &context->lock );
+    }
+}
+
+/**
+ * Wait in calling thread until ring counter reaches target
+ */
+static void async_wait_caller ( struct async_stream_context_t *context, size_t *counter,
+    size_t target )
+{
+    uint64_t wait;
+
+    if ( async_load ( counter ) >= target )
+    {
+        return;
+    }
+
+    wait = stats_wait_begin (  );
+    pthread_mutex_lock ( &context->lock );
+    __atomic_store_n ( &context->caller_waiting, 1, __ATOMIC_SEQ_CST );
+
+    while ( async_load ( counter ) < target )
+    {
+        pthread_cond_wait ( &context->ready, &context->lock );
+    }
+
+    __atomic_store_n ( &context->caller_waiting, 0, __ATOMIC_SEQ_CST );
+    pthread_mutex_unlock ( &context->lock );
+    stats_wait_end ( wait );
+}
+
+/**
+ * Output worker, write filled slots to internal stream
+ */
+static void async_write_worker ( struct async_stream_context_t *context )
+{
+    struct async_slot_t *slot;
+
+    for ( ;; )
+    {
+        if ( async_load ( &context->head ) == context->tail )
+        {
+            pthread_mutex_lock ( &context->lock );
+            __atomic_store_n ( &context->worker_waiting, 1, __ATOMIC_SEQ_CST );
+
+            while ( !context->stopping && async_load ( &context->head ) == context->tail )
+            {
+                pthread_cond_wait ( &context->wake, &context->lock );
+            }
+
+            __atomic_store_n ( &context->worker_waiting, 0, __ATOMIC_SEQ_CST );
+
+            if ( async_load ( &context->head ) == context->tail )
+            {
+                pthread_mutex_unlock ( &context->lock );
+                break;
+            }
+
+            pthread_mutex_unlock ( &context->lock );
+        }
+
+        slot = context->slots + context->tail % context->depth;
+
+        /* After first failure remaining slots are dropped, caller sees error */
+        if ( !__atomic_load_n ( &context->error, __ATOMIC_SEQ_CST )
+            && context->internal->write_complete ( context->internal, slot->data,
+                slot->length ) < 0 )
+        {
+            __atomic_store_n ( &context->error, errno ? errno : EIO, __ATOMIC_SEQ_CST );
+        }
+
+        async_store ( &context->tail, context->tail + 1 );
+        async_wake_caller ( context );
+    }
+}
+
+/**
+ * Check if input worker may fill next slot
+ */
+static int async_read_ready ( struct async_stream_context_t *context )
+{
+    return !__atomic_load_n ( &context->stopping, __ATOMIC_SEQ_CST )
+        && !__atomic_load_n ( &context->paused, __ATOMIC_SEQ_CST )
+        && !__atomic_load_n ( &context->eof, __ATOMIC_SEQ_CST )
+        && async_load ( &context->head ) - async_load ( &context->tail ) < context->depth;
+}
+
+/**
+ * Sleep in input worker until next slot may be filled, returns -1 when stopping
+ */
+static int async_read_sleep ( struct async_stream_context_t *context )
+{
+    int stopping;
+
+    pthread_mutex_lock ( &context->lock );
+    __atomic_store_n ( &context->worker_waiting, 1, __ATOMIC_SEQ_CST );
+
+    while ( !( stopping = __atomic_load_n ( &context->stopping, __ATOMIC_SEQ_CST ) )
+        && !async_read_ready ( context ) )
+    {
+        pthread_cond_wait ( &context->wake, &context->lock );
+    }
+
+    __atomic_store_n ( &context->worker_waiting, 0, __ATOMIC_SEQ_CST );
+    pthread_mutex_unlock ( &context->lock );
+
+    return stopping ? -1 : 0;
+}
+
+/**
+ * Input worker, read ahead from internal stream into free slots
+ */
+static void async_read_worker ( struct async_stream_context_t *context )
+{
+    ssize_t len;
+    size_t head;
+    struct async_slot_t *slot;
+
+    for ( ;; )
+    {
+        /* Busy is raised before pause is checked, so pause sees at least one of them */
+        __atomic_store_n ( &context->busy, 1, __ATOMIC_SEQ_CST );
+
+        if ( !async_read_ready ( context ) )
+        {
+            __atomic_store_n ( &context->busy, 0, __ATOMIC_SEQ_CST );
+            async_wake_caller ( context );
+
+            if ( async_read_sleep ( context ) < 0 )
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        head = async_load ( &context->head );
+        slot = context->slots + head % context->depth;
+        slot->error = 0;
+
+        if ( ( len = context->internal->read_max ( context->internal, slot->data,
+                    context->size ) ) < 0 )
+        {
+            slot->error = errno ? errno : EIO;
+            len = 0;
+        }
+
+        slot->length = len;
+
+        /* End of stream and errors stay in ring until seek */
+        if ( ( size_t ) len < context->size )
+        {
+            __atomic_store_n ( &context->eof, 1, __ATOMIC_SEQ_CST );
+        }
+
+        async_store ( &context->head, head + 1 );
+        __atomic_store_n ( &context->busy, 0, __ATOMIC_SEQ_CST );
+        async_wake_caller ( context );
+    }
+}
+
+/**
+ * Async stream worker thread entry
+ */
+static void *async_stream_worker ( void *arg )
+{
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) arg;
+
+    if ( context->input )
+    {
+        async_read_worker ( context );
+
+    } else
+    {
+        async_write_worker ( context );
+    }
+
+    return NULL;
+}
+
+/**
+ * Pass filled output slot to worker
+ */
+static void async_publish ( struct async_stream_context_t *context )
+{
+    context->slots[context->head % context->depth].length = context->offset;
+    context->offset = 0;
+    async_store ( &context->head, context->head + 1 );
+    async_wake_worker ( context );
+}
+
+/**
+ * Wait until worker wrote all output, then internal stream may be used directly
+ */
+static int async_drain ( struct async_stream_context_t *context )
+{
+    int error;
+
+    if ( context->offset )
+    {
+        async_publish ( context );
+    }
+
+    async_wait_caller ( context, &context->tail, context->head );
+
+    if ( ( error = __atomic_load_n ( &context->error, __ATOMIC_SEQ_CST ) ) )
+    {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop input read ahead, then internal stream may be used directly
+ */
+static void async_pause ( struct async_stream_context_t *context )
+{
+    uint64_t wait;
+
+    __atomic_store_n ( &context->paused, 1, __ATOMIC_SEQ_CST );
+
+    if ( !__atomic_load_n ( &context->busy, __ATOMIC_SEQ_CST ) )
+    {
+        return;
+    }
+
+    wait = stats_wait_begin (  );
+    pthread_mutex_lock ( &context->lock );
+    __atomic_store_n ( &context->caller_waiting, 1, __ATOMIC_SEQ_CST );
+
+    while ( __atomic_load_n ( &context->busy, __ATOMIC_SEQ_CST ) )
+    {
+        pthread_cond_wait ( &context->ready, &context->lock );
+    }
+
+    __atomic_store_n ( &context->caller_waiting, 0, __ATOMIC_SEQ_CST );
+    pthread_mutex_unlock ( &context->lock );
+    stats_wait_end ( wait );
+}
+
+/**
+ * Resume input read ahead, dropping data read ahead if requested
+ */
+static void async_resume ( struct async_stream_context_t *context, int reset )
+{
+    if ( reset )
+    {
+        async_store ( &context->head, 0 );
+        async_store ( &context->tail, 0 );
+        context->offset = 0;
+        __atomic_store_n ( &context->eof, 0, __ATOMIC_SEQ_CST );
+    }
+
+    __atomic_store_n ( &context->paused, 0, __ATOMIC_SEQ_CST );
+    async_wake_worker ( context );
+}
+
+/**
+ * Stop worker before internal stream is used directly from calling thread
+ */
+static int async_stop ( struct async_stream_context_t *context )
+{
+    if ( context->input )
+    {
+        async_pause ( context );
+        return 0;
+    }
+
+    return async_drain ( context );
+}
+
+/**
+ * Restart worker after internal stream was used directly
+ */
+static void async_start ( struct async_stream_context_t *context, int reset )
+{
+    if ( context->input )
+    {
+        async_resume ( context, reset );
+    }
+}
+
+/*
+ * Borrow read ahead data from async stream
+ */
+static ssize_t async_stream_peek ( struct io_stream_t *io, const void **data, size_t len )
+{
+    size_t tail;
+    struct async_slot_t *slot;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+    tail = context->tail;
+
+    async_wait_caller ( context, &context->head, tail + 1 );
+
+    slot = context->slots + tail % context->depth;
+
+    if ( slot->error )
+    {
+        errno = slot->error;
+        return -1;
+    }
+
+    *data = slot->data + context->offset;
+
+    return MIN ( len, slot->length - context->offset );
+}
+
+/*
+ * Drop data borrowed from async stream
+ */
+static int async_stream_consume ( struct io_stream_t *io, size_t len )
+{
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+    context->offset += len;
+
+    /* Short slot ends stream, it is kept to report end again */
+    if ( context->offset == context->size )
+    {
+        context->offset = 0;
+        async_store ( &context->tail, context->tail + 1 );
+        async_wake_worker ( context );
+    }
+
+    return 0;
+}
+
+/*
+ * Read data from async stream
+ */
+static ssize_t async_stream_read ( struct io_stream_t *io, void *data, size_t len )
+{
+    ssize_t length;
+    const void *borrowed;
+
+    if ( ( length = async_stream_peek ( io, &borrowed, len ) ) <= 0 )
+    {
+        return length;
+    }
+
+    memcpy ( data, borrowed, length );
+    stream_count_copy ( length );
+
+    if ( async_stream_consume ( io, length ) < 0 )
+    {
+        return -1;
+    }
+
+    return length;
+}
+
+/*
+ * Borrow free slot space from async stream
+ */
+static ssize_t async_stream_reserve ( struct io_stream_t *io, void **data, size_t len )
+{
+    int error;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( ( error = __atomic_load_n ( &context->error, __ATOMIC_SEQ_CST ) ) )
+    {
+        errno = error;
+        return -1;
+    }
+
+    if ( context->head >= context->depth )
+    {
+        async_wait_caller ( context, &context->tail, context->head + 1 - context->depth );
+    }
+
+    *data = context->slots[context->head % context->depth].data + context->offset;
+
+    return MIN ( len, context->size - context->offset );
+}
+
+/*
+ * Pass data written to slot space borrowed from async stream
+ */
+static int async_stream_commit ( struct io_stream_t *io, size_t len )
+{
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+    context->offset += len;
+
+    if ( context->offset == context->size )
+    {
+        async_publish ( context );
+    }
+
+    return 0;
+}
+
+/*
+ * Write data to async stream
+ */
+static ssize_t async_stream_write ( struct io_stream_t *io, const void *data, size_t len )
+{
+    ssize_t length;
+    void *borrowed;
+
+    if ( ( length = async_stream_reserve ( io, &borrowed, len ) ) < 0 )
+    {
+        return -1;
+    }
+
+    memcpy ( borrowed, data, length );
+    stream_count_copy ( length );
+
+    if ( async_stream_commit ( io, length ) < 0 )
+    {
+        return -1;
+    }
+
+    return length;
+}
+
+/*
+ * Verify async stream integrity
+ */
+static int async_stream_verify ( struct io_stream_t *io )
+{
+    int status;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( async_stop ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    status = context->internal->verify ( context->internal );
+    async_start ( context, 0 );
+
+    return status;
+}
+
+/*
+ * Flush async stream output
+ */
+static int async_stream_flush ( struct io_stream_t *io )
+{
+    int status;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( async_stop ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    status = context->internal->flush ( context->internal );
+    async_start ( context, 0 );
+
+    return status;
+}
+
+/*
+ * Start new block in async stream output
+ */
+static int async_stream_split ( struct io_stream_t *io, uint64_t * offset )
+{
+    int status;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( async_stop ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    status = context->internal->split ( context->internal, offset );
+    async_start ( context, 0 );
+
+    return status;
+}
+
+/*
+ * Write annotation data to async stream
+ */
+static int async_stream_annotate ( struct io_stream_t *io, const void *data, size_t len )
+{
+    int status;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( async_stop ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    status = context->internal->annotate ( context->internal, data, len );
+    async_start ( context, 0 );
+
+    return status;
+}
+
+/*
+ * Seek async stream to storage offset, data read ahead is dropped
+ */
+static int async_stream_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    int status;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( async_stop ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    status = context->internal->seek ( context->internal, offset );
+    async_start ( context, 1 );
+
+    return status;
+}
+
+/*
+ * Get async stream storage length
+ */
+static int async_stream_length ( struct io_stream_t *io, uint64_t * length )
+{
+    int status;
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( async_stop ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    status = context->internal->length ( context->internal, length );
+    async_start ( context, 0 );
+
+    return status;
+}
+
+/*
+ * Close async stream, output written so far still reaches internal stream
+ */
+static void async_stream_close ( struct io_stream_t *io )
+{
+    struct async_stream_context_t *context;
+
+    context = ( struct async_stream_context_t * ) io->context;
+
+    if ( !context->input && context->offset )
+    {
+        async_publish ( context );
+    }
+
+    pthread_mutex_lock ( &context->lock );
+    __atomic_store_n ( &context->stopping, 1, __ATOMIC_SEQ_CST );
+    pthread_cond_signal ( &context->wake );
+    pthread_mutex_unlock ( &context->lock );
+
+    pthread_join ( context->thread, NULL );
+
+    context->internal->close ( context->internal );
+
+    pthread_cond_destroy ( &context->ready );
+    pthread_cond_destroy ( &context->wake );
+    pthread_mutex_destroy ( &context->lock );
+    budget_free ( context->slots );
+    free ( context );
+    free ( io );
+}
+
+/**
+ * Create new async stream running internal stream on own thread,
+ * connected by ring of given number of buffer sized slots
+ */
+static struct io_stream_t *async_stream_new ( struct io_stream_t *internal, int input,
+    size_t depth )
+{
+    int error;
+    size_t i;
+    struct io_stream_t *io;
+    struct async_stream_context_t *context;
+
+    if ( !( io = io_stream_new (  ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( context =
+            ( struct async_stream_context_t * ) calloc ( 1,
+                sizeof ( struct async_stream_context_t ) ) ) )
+    {
+        free ( io );
+        return NULL;
+    }
+
+    context->internal = internal;
+    context->input = input;
+    context->depth = MAX ( depth, 2 );
+    context->size = stream_params (  )->buffer_size;
+
+    /* Slot data follows slot array in the same allocation */
+    if ( !( context->slots =
+            ( struct async_slot_t * ) budget_alloc ( context->depth *
+                ( sizeof ( struct async_slot_t ) + context->size ) ) ) )
+    {
+        free ( context );
+        free ( io );
+        return NULL;
+    }
+
+    for ( i = 0; i < context->depth; i++ )
+    {
+        context->slots[i].data =
+            ( uint8_t * ) ( context->slots + context->depth ) + i * context->size;
+    }
+
+    pthread_mutex_init ( &context->lock, NULL );
+    pthread_cond_init ( &context->wake, NULL );
+    pthread_cond_init ( &context->ready, NULL );
+
+    if ( ( error = pthread_create ( &context->thread, NULL, async_stream_worker, context ) ) )
+    {
+        pthread_cond_destroy ( &context->ready );
+        pthread_cond_destroy ( &context->wake );
+        pthread_mutex_destroy ( &context->lock );
+        budget_free ( context->slots );
+        free ( context );
+        free ( io );
+        errno = error;
+        return NULL;
+    }
+
+    io->context = context;
+
+    if ( input )
+    {
+        io->read = async_stream_read;
+        io->peek = async_stream_peek;
+        io->consume = async_stream_consume;
+
+    } else
+    {
+        io->write = async_stream_write;
+        io->reserve = async_stream_reserve;
+        io->commit = async_stream_commit;
+    }
+
+    io->verify = async_stream_verify;
+    io->flush = async_stream_flush;
+    io->split = async_stream_split;
+    io->annotate = async_stream_annotate;
+    io->seek = async_stream_seek;
+    io->length = async_stream_length;
+    io->close = async_stream_close;
+
+    return io;
+}
+
+/**
+ * Create new input async stream reading ahead from internal stream on own thread
+ */
+struct io_stream_t *input_async_stream_new ( struct io_stream_t *internal, size_t depth )
+{
+    return async_stream_new ( internal, 1, depth );
+}
+
+/**
+ * Create new output async stream writing to internal stream on own thread
+ */
+struct io_stream_t *output_async_stream_new ( struct io_stream_t *internal, size_t depth )
+{
+    return async_stream_new ( internal, 0, depth );
+}
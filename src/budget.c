@@ -0,0 +1,362 @@
+/* ------------------------------------------------------------------
+ * SBox - Memory Budget
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <sys/mman.h>
+
+#define BUDGET_HEAP 0
+#define BUDGET_HEAP_SPILL 1
+#define BUDGET_MAPPED 2
+
+/**
+ * Header in front of budget allocations
+ */
+struct budget_header_t
+{
+    size_t size;
+    size_t kind;
+};
+
+/**
+ * Budget shared by all threads, zero limit means no limit,
+ * headroom is left to stream buffers by memory that can spill
+ */
+static size_t budget_limit_bytes;
+static size_t budget_headroom_bytes;
+static size_t budget_used_bytes;
+static size_t budget_peak_bytes;
+static size_t budget_spilled_bytes;
+static size_t budget_shortfall_bytes;
+
+/**
+ * Count memory against budget if it fits, leaving headroom free
+ */
+static int budget_try ( size_t size, size_t headroom )
+{
+    size_t used;
+    size_t peak;
+    size_t limit;
+
+    limit = __atomic_load_n ( &budget_limit_bytes, __ATOMIC_RELAXED );
+    used = __atomic_load_n ( &budget_used_bytes, __ATOMIC_RELAXED );
+
+    do
+    {
+        if ( limit && ( size > limit || headroom > limit - size
+                || used > limit - size - headroom ) )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+    } while ( !__atomic_compare_exchange_n ( &budget_used_bytes, &used, used + size, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+
+    used += size;
+    peak = __atomic_load_n ( &budget_peak_bytes, __ATOMIC_RELAXED );
+
+    while ( used > peak
+        && !__atomic_compare_exchange_n ( &budget_peak_bytes, &peak, used, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+
+    return 0;
+}
+
+/**
+ * Check if allocation size leaves room for header, fails with ENOMEM if not
+ */
+static int budget_fits ( size_t size )
+{
+    if ( size > SIZE_MAX - sizeof ( struct budget_header_t ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Get memory counted against budget for allocation of given size
+ */
+size_t budget_cost ( size_t size )
+{
+    return sizeof ( struct budget_header_t ) + size;
+}
+
+/**
+ * Set memory budget, zero removes limit, headroom is kept for stream buffers
+ */
+void budget_set ( size_t limit, size_t headroom )
+{
+    __atomic_store_n ( &budget_limit_bytes, limit, __ATOMIC_RELAXED );
+    __atomic_store_n ( &budget_headroom_bytes, headroom, __ATOMIC_RELAXED );
+}
+
+/**
+ * Get memory budget, zero if unlimited
+ */
+size_t budget_limit ( void )
+{
+    return __atomic_load_n ( &budget_limit_bytes, __ATOMIC_RELAXED );
+}
+
+/**
+ * Count memory allocated elsewhere against budget
+ */
+int budget_reserve ( size_t size )
+{
+    if ( budget_try ( size, 0 ) < 0 )
+    {
+        __atomic_store_n ( &budget_shortfall_bytes, size, __ATOMIC_RELAXED );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Return memory counted by budget reserve
+ */
+void budget_release ( size_t size )
+{
+    __atomic_fetch_sub ( &budget_used_bytes, size, __ATOMIC_RELAXED );
+}
+
+/**
+ * Get memory in use, its peak and metadata spilled to disk, in bytes
+ */
+void budget_stats ( size_t *used, size_t *peak, size_t *spilled )
+{
+    *used = __atomic_load_n ( &budget_used_bytes, __ATOMIC_RELAXED );
+    *peak = __atomic_load_n ( &budget_peak_bytes, __ATOMIC_RELAXED );
+    *spilled = __atomic_load_n ( &budget_spilled_bytes, __ATOMIC_RELAXED );
+}
+
+/**
+ * Get size of last allocation refused by budget, zero if none was
+ */
+size_t budget_shortfall ( void )
+{
+    return __atomic_load_n ( &budget_shortfall_bytes, __ATOMIC_RELAXED );
+}
+
+/**
+ * Allocate memory counted against budget
+ */
+void *budget_alloc ( size_t size )
+{
+    struct budget_header_t *header;
+
+    if ( budget_fits ( size ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( budget_reserve ( sizeof ( struct budget_header_t ) + size ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( !( header =
+            ( struct budget_header_t * ) malloc ( sizeof ( struct budget_header_t ) + size ) ) )
+    {
+        budget_release ( sizeof ( struct budget_header_t ) + size );
+        return NULL;
+    }
+
+    header->size = size;
+    header->kind = BUDGET_HEAP;
+
+    return header + 1;
+}
+
+/**
+ * Allocate zeroed memory counted against budget
+ */
+void *budget_calloc ( size_t size )
+{
+    void *ptr;
+
+    if ( ( ptr = budget_alloc ( size ) ) )
+    {
+        memset ( ptr, '\0', size );
+    }
+
+    return ptr;
+}
+
+/**
+ * Map memory backed by unlinked temporary file, kernel writes it back under pressure
+ */
+static struct budget_header_t *budget_map ( size_t size )
+{
+    int fd;
+    int error;
+    void *ptr;
+    const char *dir;
+    char path[PATH_LIMIT];
+
+    if ( budget_fits ( size ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( !( dir = getenv ( "TMPDIR" ) ) )
+    {
+        dir = "/tmp";
+    }
+
+    snprintf ( path, sizeof ( path ), "%s/sbox-spill-XXXXXX", dir );
+
+    if ( ( fd = mkstemp ( path ) ) < 0 )
+    {
+        return NULL;
+    }
+
+    unlink ( path );
+
+    /* Disk space is taken up front so full disk fails here, not as fault later */
+    if ( ( error = posix_fallocate ( fd, 0, sizeof ( struct budget_header_t ) + size ) ) )
+    {
+        close ( fd );
+        errno = error;
+        return NULL;
+    }
+
+    ptr = mmap ( NULL, sizeof ( struct budget_header_t ) + size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0 );
+    close ( fd );
+
+    if ( ptr == MAP_FAILED )
+    {
+        return NULL;
+    }
+
+    __atomic_fetch_add ( &budget_spilled_bytes, size, __ATOMIC_RELAXED );
+
+    return ( struct budget_header_t * ) ptr;
+}
+
+/**
+ * Allocate metadata memory, spilled to disk once budget is used up
+ */
+void *budget_spill_alloc ( size_t size )
+{
+    struct budget_header_t *header;
+
+    if ( budget_fits ( size ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( budget_try ( sizeof ( struct budget_header_t ) + size,
+            __atomic_load_n ( &budget_headroom_bytes, __ATOMIC_RELAXED ) ) < 0 )
+    {
+        if ( !( header = budget_map ( size ) ) )
+        {
+            return NULL;
+        }
+
+        header->size = size;
+        header->kind = BUDGET_MAPPED;
+
+        return header + 1;
+    }
+
+    if ( !( header =
+            ( struct budget_header_t * ) malloc ( sizeof ( struct budget_header_t ) + size ) ) )
+    {
+        budget_release ( sizeof ( struct budget_header_t ) + size );
+        return NULL;
+    }
+
+    header->size = size;
+    header->kind = BUDGET_HEAP_SPILL;
+
+    return header + 1;
+}
+
+/**
+ * Resize metadata memory, moved to disk once budget is used up
+ */
+void *budget_spill_realloc ( void *ptr, size_t size )
+{
+    void *copy;
+    struct budget_header_t *header;
+    struct budget_header_t *resized;
+
+    if ( !ptr )
+    {
+        return budget_spill_alloc ( size );
+    }
+
+    if ( budget_fits ( size ) < 0 )
+    {
+        return NULL;
+    }
+
+    header = ( struct budget_header_t * ) ptr - 1;
+
+    if ( header->kind == BUDGET_HEAP_SPILL
+        && ( size <= header->size || budget_try ( size - header->size,
+                __atomic_load_n ( &budget_headroom_bytes, __ATOMIC_RELAXED ) ) >= 0 ) )
+    {
+        if ( !( resized =
+                ( struct budget_header_t * ) realloc ( header,
+                    sizeof ( struct budget_header_t ) + size ) ) )
+        {
+            if ( size > header->size )
+            {
+                budget_release ( size - header->size );
+            }
+
+            return NULL;
+        }
+
+        if ( size < resized->size )
+        {
+            budget_release ( resized->size - size );
+        }
+
+        resized->size = size;
+
+        return resized + 1;
+    }
+
+    if ( !( copy = budget_spill_alloc ( size ) ) )
+    {
+        return NULL;
+    }
+
+    memcpy ( copy, ptr, MIN ( size, header->size ) );
+    budget_free ( ptr );
+
+    return copy;
+}
+
+/**
+ * Free memory allocated by budget
+ */
+void budget_free ( void *ptr )
+{
+    struct budget_header_t *header;
+
+    if ( !ptr )
+    {
+        return;
+    }
+
+    header = ( struct budget_header_t * ) ptr - 1;
+
+    if ( header->kind == BUDGET_MAPPED )
+    {
+        __atomic_fetch_sub ( &budget_spilled_bytes, header->size, __ATOMIC_RELAXED );
+        munmap ( header, sizeof ( struct budget_header_t ) + header->size );
+        return;
+    }
+
+    budget_release ( sizeof ( struct budget_header_t ) + header->size );
+    free ( header );
+}
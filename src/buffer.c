@@ -12,7 +12,8 @@ struct buffer_stream_context_t
     struct io_stream_t *internal;
     size_t offset;
     size_t length;
-    char buffer[CHUNK_SIZE];
+    size_t size;
+    char buffer[];
 };
 
 /**
@@ -25,16 +26,38 @@ static size_t dequeue_buffer ( struct buffer_stream_context_t *context, void *da
     dequeue_len = MIN ( len, context->length - context->offset );
     memcpy ( data, context->buffer + context->offset, dequeue_len );
     context->offset += dequeue_len;
+    stream_count_copy ( dequeue_len );
 
     return dequeue_len;
 }
 
+/**
+ * Refill cache buffer from internal stream
+ */
+static int buffer_stream_fill ( struct buffer_stream_context_t *context )
+{
+    size_t length;
+
+    if ( ( ssize_t ) ( length =
+            context->internal->read ( context->internal, context->buffer,
+                context->size ) ) < 0 )
+    {
+        return -1;
+    }
+
+    context->offset = 0;
+    context->length = length;
+
+    return 0;
+}
+
 /*
  * Read data from buffer stream
  */
 static ssize_t buffer_stream_read ( struct io_stream_t *io, void *data, size_t len )
 {
-    size_t length;
+    ssize_t length;
+    const void *borrowed;
     struct buffer_stream_context_t *context;
 
     context = ( struct buffer_stream_context_t * ) io->context;
@@ -44,30 +67,86 @@ static ssize_t buffer_stream_read ( struct io_stream_t *io, void *data, size_t l
         return dequeue_buffer ( context, data, len );
     }
 
-    if ( ( ssize_t ) ( length =
-            context->internal->read ( context->internal, context->buffer,
-                sizeof ( context->buffer ) ) ) < 0 )
+    /* Internal stream buffer is copied from directly, bypassing cache buffer */
+    if ( context->internal->peek )
     {
-        return -1;
+        if ( ( length = context->internal->peek ( context->internal, &borrowed, len ) ) <= 0 )
+        {
+            return length;
+        }
+
+        memcpy ( data, borrowed, length );
+        stream_count_copy ( length );
+
+        if ( context->internal->consume ( context->internal, length ) < 0 )
+        {
+            return -1;
+        }
+
+        return length;
     }
 
-    context->offset = 0;
-    context->length = length;
+    if ( buffer_stream_fill ( context ) < 0 )
+    {
+        return -1;
+    }
 
     return dequeue_buffer ( context, data, len );
 }
 
 /*
- * Write data to buffer stream
+ * Borrow data from buffer stream
  */
-static ssize_t buffer_stream_write ( struct io_stream_t *io, const void *data, size_t len )
+static ssize_t buffer_stream_peek ( struct io_stream_t *io, const void **data, size_t len )
+{
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    if ( context->offset == context->length )
+    {
+        if ( context->internal->peek )
+        {
+            return context->internal->peek ( context->internal, data, len );
+        }
+
+        if ( buffer_stream_fill ( context ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    *data = context->buffer + context->offset;
+
+    return MIN ( len, context->length - context->offset );
+}
+
+/*
+ * Drop data borrowed from buffer stream
+ */
+static int buffer_stream_consume ( struct io_stream_t *io, size_t len )
 {
-    size_t cache_len;
     struct buffer_stream_context_t *context;
 
     context = ( struct buffer_stream_context_t * ) io->context;
 
-    if ( context->length == sizeof ( context->buffer ) )
+    /* Empty cache means data was borrowed from internal stream */
+    if ( context->offset == context->length && context->internal->peek )
+    {
+        return context->internal->consume ( context->internal, len );
+    }
+
+    context->offset += MIN ( len, context->length - context->offset );
+
+    return 0;
+}
+
+/*
+ * Write cached data to internal stream
+ */
+static int buffer_stream_drain ( struct buffer_stream_context_t *context )
+{
+    if ( context->length )
     {
         if ( context->internal->write_complete ( context->internal, context->buffer,
                 context->length ) < 0 )
@@ -78,13 +157,82 @@ static ssize_t buffer_stream_write ( struct io_stream_t *io, const void *data, s
         context->length = 0;
     }
 
-    cache_len = MIN ( len, sizeof ( context->buffer ) - context->length );
+    return 0;
+}
+
+/*
+ * Write data to buffer stream
+ */
+static ssize_t buffer_stream_write ( struct io_stream_t *io, const void *data, size_t len )
+{
+    size_t cache_len;
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    if ( context->length == context->size )
+    {
+        if ( buffer_stream_drain ( context ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    cache_len = MIN ( len, context->size - context->length );
     memcpy ( context->buffer + context->length, data, cache_len );
     context->length += cache_len;
+    stream_count_copy ( cache_len );
 
     return cache_len;
 }
 
+/*
+ * Borrow space for data written to buffer stream
+ */
+static ssize_t buffer_stream_reserve ( struct io_stream_t *io, void **data, size_t len )
+{
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    if ( context->length == context->size )
+    {
+        if ( buffer_stream_drain ( context ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    /* Internal stream buffer is written directly while cache buffer is empty */
+    if ( !context->length && context->internal->reserve )
+    {
+        return context->internal->reserve ( context->internal, data, len );
+    }
+
+    *data = context->buffer + context->length;
+
+    return MIN ( len, context->size - context->length );
+}
+
+/*
+ * Pass data written to space borrowed from buffer stream
+ */
+static int buffer_stream_commit ( struct io_stream_t *io, size_t len )
+{
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    if ( !context->length && context->internal->reserve )
+    {
+        return context->internal->commit ( context->internal, len );
+    }
+
+    context->length += len;
+
+    return 0;
+}
+
 /*
  * Verify buffer stream integrity
  */
@@ -106,20 +254,75 @@ static int buffer_stream_flush ( struct io_stream_t *io )
 
     context = ( struct buffer_stream_context_t * ) io->context;
 
-    if ( context->length )
+    if ( buffer_stream_drain ( context ) < 0 )
     {
-        if ( context->internal->write_complete ( context->internal, context->buffer,
-                context->length ) < 0 )
-        {
-            return -1;
-        }
-
-        context->length = 0;
+        return -1;
     }
 
     return context->internal->flush ( context->internal );
 }
 
+/*
+ * Start new block in buffer stream output
+ */
+static int buffer_stream_split ( struct io_stream_t *io, uint64_t * offset )
+{
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    if ( buffer_stream_drain ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    return context->internal->split ( context->internal, offset );
+}
+
+/*
+ * Write annotation data to buffer stream
+ */
+static int buffer_stream_annotate ( struct io_stream_t *io, const void *data, size_t len )
+{
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    if ( buffer_stream_drain ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    return context->internal->annotate ( context->internal, data, len );
+}
+
+/*
+ * Seek buffer stream to storage offset
+ */
+static int buffer_stream_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    context->offset = 0;
+    context->length = 0;
+
+    return context->internal->seek ( context->internal, offset );
+}
+
+/*
+ * Get buffer stream storage length
+ */
+static int buffer_stream_length ( struct io_stream_t *io, uint64_t * length )
+{
+    struct buffer_stream_context_t *context;
+
+    context = ( struct buffer_stream_context_t * ) io->context;
+
+    return context->internal->length ( context->internal, length );
+}
+
 /*
  * Close IO stream
  */
@@ -131,6 +334,7 @@ static void buffer_stream_close ( struct io_stream_t *io )
 
     context->internal->close ( context->internal );
 
+    budget_free ( context );
     free ( io );
 }
 
@@ -140,6 +344,7 @@ static void buffer_stream_close ( struct io_stream_t *io )
 struct io_stream_t *buffer_stream_new ( struct io_stream_t *internal )
 {
     struct io_stream_t *io;
+    size_t size;
     struct buffer_stream_context_t *context;
 
     if ( !( io = io_stream_new (  ) ) )
@@ -147,14 +352,17 @@ struct io_stream_t *buffer_stream_new ( struct io_stream_t *internal )
         return NULL;
     }
 
+    size = stream_params (  )->buffer_size;
+
     if ( !( context =
-            ( struct buffer_stream_context_t * ) malloc ( sizeof ( struct
-                    buffer_stream_context_t ) ) ) )
+            ( struct buffer_stream_context_t * ) budget_alloc ( sizeof ( struct
+                    buffer_stream_context_t ) + size ) ) )
     {
         free ( io );
         return NULL;
     }
 
+    context->size = size;
     context->length = 0;
     context->offset = 0;
     context->internal = internal;
@@ -164,6 +372,14 @@ struct io_stream_t *buffer_stream_new ( struct io_stream_t *internal )
     io->write = buffer_stream_write;
     io->verify = buffer_stream_verify;
     io->flush = buffer_stream_flush;
+    io->split = buffer_stream_split;
+    io->annotate = buffer_stream_annotate;
+    io->seek = buffer_stream_seek;
+    io->length = buffer_stream_length;
+    io->peek = buffer_stream_peek;
+    io->consume = buffer_stream_consume;
+    io->reserve = buffer_stream_reserve;
+    io->commit = buffer_stream_commit;
     io->close = buffer_stream_close;
 
     return io;
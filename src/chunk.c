@@ -0,0 +1,219 @@
+/* ------------------------------------------------------------------
+ * SBox - Repository Chunk Stream Impl.
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+/**
+ * Chunk reference read from manifest
+ */
+struct chunk_ref_t
+{
+    uint8_t id[REPOSITORY_ID_LEN];
+    uint32_t length;
+};
+
+/**
+ * Chunk stream context
+ */
+struct chunk_stream_context_t
+{
+    struct repository_t *repo;
+    size_t count;
+    size_t capacity;
+    struct chunk_ref_t *refs;
+    size_t current;
+    size_t loaded;
+    size_t position;
+    uint8_t *chunk;
+};
+
+/*
+ * Read data from chunk stream
+ */
+static ssize_t chunk_stream_read ( struct io_stream_t *io, void *data, size_t len )
+{
+    struct chunk_ref_t *ref;
+    struct chunk_stream_context_t *context;
+
+    context = ( struct chunk_stream_context_t * ) io->context;
+
+    if ( context->current == context->count )
+    {
+        return 0;
+    }
+
+    ref = context->refs + context->current;
+
+    if ( context->loaded != context->current )
+    {
+        if ( repository_load ( context->repo, ref->id, context->chunk, ref->length ) < 0 )
+        {
+            return -1;
+        }
+
+        context->loaded = context->current;
+    }
+
+    len = MIN ( len, ref->length - context->position );
+    memcpy ( data, context->chunk + context->position, len );
+    context->position += len;
+
+    if ( context->position == ref->length )
+    {
+        context->current++;
+        context->position = 0;
+    }
+
+    return len;
+}
+
+/*
+ * Verify chunk stream integrity, chunks are checked as they are loaded
+ */
+static int chunk_stream_verify ( struct io_stream_t *io )
+{
+    UNUSED ( io );
+    return 0;
+}
+
+/*
+ * Seek chunk stream to chunk number
+ */
+static int chunk_stream_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    struct chunk_stream_context_t *context;
+
+    context = ( struct chunk_stream_context_t * ) io->context;
+
+    if ( offset > context->count )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    context->current = offset;
+    context->position = 0;
+
+    return 0;
+}
+
+/*
+ * Close chunk stream, repository stays open
+ */
+static void chunk_stream_close ( struct io_stream_t *io )
+{
+    struct chunk_stream_context_t *context;
+
+    context = ( struct chunk_stream_context_t * ) io->context;
+
+    free ( context->chunk );
+    free ( context->refs );
+    free ( context );
+    free ( io );
+}
+
+/**
+ * Read chunk references from manifest, one index block per chunk
+ */
+static int chunk_stream_load_refs ( struct chunk_stream_context_t *context,
+    struct io_stream_t *manifest, struct archive_index_t *index )
+{
+    uint64_t length;
+    uint64_t logical = 0;
+    struct chunk_ref_t *refs;
+
+    for ( ;; )
+    {
+        if ( stream_read_varint ( manifest, &length ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( !length )
+        {
+            break;
+        }
+
+        if ( length > REPOSITORY_CHUNK_MAX )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( context->count == context->capacity )
+        {
+            context->capacity = context->capacity ? 2 * context->capacity : 1024;
+
+            if ( !( refs =
+                    ( struct chunk_ref_t * ) realloc ( context->refs,
+                        context->capacity * sizeof ( struct chunk_ref_t ) ) ) )
+            {
+                return -1;
+            }
+
+            context->refs = refs;
+        }
+
+        if ( manifest->read_complete ( manifest, context->refs[context->count].id,
+                REPOSITORY_ID_LEN ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( archive_index_append ( index, logical, context->count ) < 0 )
+        {
+            return -1;
+        }
+
+        context->refs[context->count++].length = length;
+        logical += length;
+    }
+
+    return 0;
+}
+
+/**
+ * Create new chunk stream over file contents referenced by manifest
+ */
+struct io_stream_t *chunk_stream_new ( struct repository_t *repo, struct io_stream_t *manifest,
+    struct archive_index_t *index )
+{
+    struct io_stream_t *io;
+    struct chunk_stream_context_t *context;
+
+    if ( !( io = io_stream_new (  ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( context =
+            ( struct chunk_stream_context_t * ) calloc ( 1,
+                sizeof ( struct chunk_stream_context_t ) ) ) )
+    {
+        free ( io );
+        return NULL;
+    }
+
+    context->repo = repo;
+    context->loaded = SIZE_MAX;
+    io->context = context;
+    io->read = chunk_stream_read;
+    io->verify = chunk_stream_verify;
+    io->seek = chunk_stream_seek;
+    io->close = chunk_stream_close;
+
+    if ( !( context->chunk = ( uint8_t * ) malloc ( REPOSITORY_CHUNK_MAX ) ) )
+    {
+        io->close ( io );
+        return NULL;
+    }
+
+    if ( chunk_stream_load_refs ( context, manifest, index ) < 0 )
+    {
+        io->close ( io );
+        return NULL;
+    }
+
+    return io;
+}
@@ -0,0 +1,554 @@
+/* ------------------------------------------------------------------
+ * SBox - Crypto Backends
+ * ------------------------------------------------------------------ */
+
+#ifdef ENABLE_ENCRYPTION
+
+#include "sbox.h"
+
+#if !defined ( ENABLE_MBEDTLS ) && !defined ( ENABLE_OPENSSL )
+#error "Encryption needs ENABLE_MBEDTLS or ENABLE_OPENSSL"
+#endif
+
+#ifdef ENABLE_MBEDTLS
+#include <mbedtls/aes.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pkcs5.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#endif
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#endif
+
+#define CRYPTO_KEY_BITS 256
+#define CRYPTO_BLOCK_LEN 16
+#define CRYPTO_DIGEST_LEN 32
+
+#ifdef ENABLE_MBEDTLS
+
+/**
+ * Random generator personalization bytes
+ */
+static const uint8_t crypto_mbedtls_pers[] = {
+    0x13, 0xc6, 0xae, 0x24, 0xcd, 0x52, 0x15, 0x1b,
+    0x68, 0xbf, 0x64, 0x47, 0x07, 0x54, 0xc9, 0x10,
+    0xda, 0x21, 0xae, 0x9f, 0x9f, 0xda, 0xc0, 0xf2,
+    0x40, 0x9b, 0x8d, 0xea, 0x32, 0x9c, 0x1d, 0x04
+};
+
+/**
+ * Mbed TLS cipher context
+ */
+struct crypto_mbedtls_cipher_t
+{
+    int mode;
+    mbedtls_aes_context aes;
+};
+
+/**
+ * Generate random bytes with Mbed TLS
+ */
+static int crypto_mbedtls_random ( uint8_t * data, size_t len )
+{
+    int status = 0;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+
+    mbedtls_entropy_init ( &entropy );
+    mbedtls_ctr_drbg_init ( &ctr_drbg );
+
+    mbedtls_ctr_drbg_set_prediction_resistance ( &ctr_drbg, MBEDTLS_CTR_DRBG_PR_ON );
+
+    if ( mbedtls_ctr_drbg_seed ( &ctr_drbg, mbedtls_entropy_func, &entropy,
+            crypto_mbedtls_pers, sizeof ( crypto_mbedtls_pers ) ) != 0
+        || mbedtls_ctr_drbg_random ( &ctr_drbg, data, len ) != 0 )
+    {
+        status = -1;
+    }
+
+    mbedtls_ctr_drbg_free ( &ctr_drbg );
+    mbedtls_entropy_free ( &entropy );
+
+    return status;
+}
+
+/**
+ * Derive key using PBKDF2 and SHA-256 with Mbed TLS
+ */
+static int crypto_mbedtls_derive_key ( const char *password, const uint8_t * salt,
+    size_t salt_len, unsigned int rounds, uint8_t * key, size_t key_len )
+{
+    mbedtls_md_context_t sha256_ctx;
+    const mbedtls_md_info_t *sha256_info;
+
+    mbedtls_md_init ( &sha256_ctx );
+
+    if ( !( sha256_info = mbedtls_md_info_from_type ( MBEDTLS_MD_SHA256 ) ) )
+    {
+        mbedtls_md_free ( &sha256_ctx );
+        return -1;
+    }
+
+    if ( mbedtls_md_setup ( &sha256_ctx, sha256_info, 1 ) != 0 )
+    {
+        mbedtls_md_free ( &sha256_ctx );
+        return -1;
+    }
+
+    if ( mbedtls_pkcs5_pbkdf2_hmac ( &sha256_ctx, ( const uint8_t * ) password,
+            strlen ( password ), salt, salt_len, rounds, key_len, key ) != 0 )
+    {
+        memset ( key, '\0', key_len );
+        mbedtls_md_free ( &sha256_ctx );
+        return -1;
+    }
+
+    mbedtls_md_free ( &sha256_ctx );
+
+    return 0;
+}
+
+/**
+ * Create Mbed TLS AES-256 cipher
+ */
+static void *crypto_mbedtls_cipher_new ( const uint8_t * key, int encrypt )
+{
+    int ret;
+    struct crypto_mbedtls_cipher_t *cipher;
+
+    if ( !( cipher =
+            ( struct crypto_mbedtls_cipher_t * ) malloc ( sizeof ( struct
+                    crypto_mbedtls_cipher_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    mbedtls_aes_init ( &cipher->aes );
+    cipher->mode = encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT;
+
+    ret = encrypt ? mbedtls_aes_setkey_enc ( &cipher->aes, key, CRYPTO_KEY_BITS )
+        : mbedtls_aes_setkey_dec ( &cipher->aes, key, CRYPTO_KEY_BITS );
+
+    if ( ret != 0 )
+    {
+        mbedtls_aes_free ( &cipher->aes );
+        free ( cipher );
+        return NULL;
+    }
+
+    return cipher;
+}
+
+/**
+ * Process whole blocks in CBC mode with Mbed TLS
+ */
+static int crypto_mbedtls_cipher_cbc ( void *context, uint8_t * iv, const uint8_t * input,
+    uint8_t * output, size_t len )
+{
+    struct crypto_mbedtls_cipher_t *cipher;
+
+    cipher = ( struct crypto_mbedtls_cipher_t * ) context;
+
+    return mbedtls_aes_crypt_cbc ( &cipher->aes, cipher->mode, len, iv, input,
+        output ) != 0 ? -1 : 0;
+}
+
+/**
+ * Free Mbed TLS cipher
+ */
+static void crypto_mbedtls_cipher_free ( void *context )
+{
+    struct crypto_mbedtls_cipher_t *cipher;
+
+    cipher = ( struct crypto_mbedtls_cipher_t * ) context;
+
+    mbedtls_aes_free ( &cipher->aes );
+    free ( cipher );
+}
+
+/**
+ * Create Mbed TLS HMAC-SHA-256
+ */
+static void *crypto_mbedtls_mac_new ( const uint8_t * key, size_t key_len )
+{
+    mbedtls_md_context_t *md_ctx;
+
+    if ( !( md_ctx = ( mbedtls_md_context_t * ) malloc ( sizeof ( mbedtls_md_context_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    mbedtls_md_init ( md_ctx );
+
+    if ( mbedtls_md_setup ( md_ctx, mbedtls_md_info_from_type ( MBEDTLS_MD_SHA256 ), 1 ) != 0
+        || mbedtls_md_hmac_starts ( md_ctx, key, key_len ) != 0 )
+    {
+        mbedtls_md_free ( md_ctx );
+        free ( md_ctx );
+        return NULL;
+    }
+
+    return md_ctx;
+}
+
+/**
+ * Feed data into Mbed TLS HMAC
+ */
+static int crypto_mbedtls_mac_update ( void *context, const uint8_t * data, size_t len )
+{
+    return mbedtls_md_hmac_update ( ( mbedtls_md_context_t * ) context, data,
+        len ) != 0 ? -1 : 0;
+}
+
+/**
+ * Finish Mbed TLS HMAC and restart it with same key
+ */
+static int crypto_mbedtls_mac_finish ( void *context, uint8_t * digest )
+{
+    mbedtls_md_context_t *md_ctx;
+
+    md_ctx = ( mbedtls_md_context_t * ) context;
+
+    if ( mbedtls_md_hmac_finish ( md_ctx, digest ) != 0 || mbedtls_md_hmac_reset ( md_ctx ) != 0 )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Free Mbed TLS HMAC
+ */
+static void crypto_mbedtls_mac_free ( void *context )
+{
+    mbedtls_md_free ( ( mbedtls_md_context_t * ) context );
+    free ( context );
+}
+
+/**
+ * Mbed TLS backend
+ */
+static const struct crypto_backend_t crypto_mbedtls = {
+    "mbedtls",
+    crypto_mbedtls_random,
+    crypto_mbedtls_derive_key,
+    crypto_mbedtls_cipher_new,
+    crypto_mbedtls_cipher_cbc,
+    crypto_mbedtls_cipher_free,
+    crypto_mbedtls_mac_new,
+    crypto_mbedtls_mac_update,
+    crypto_mbedtls_mac_finish,
+    crypto_mbedtls_mac_free
+};
+
+#endif
+
+#ifdef ENABLE_OPENSSL
+
+/**
+ * OpenSSL cipher context, chain IV is kept to skip IV reload between calls
+ */
+struct crypto_openssl_cipher_t
+{
+    int encrypt;
+    EVP_CIPHER_CTX *ctx;
+    uint8_t chain[CRYPTO_BLOCK_LEN];
+};
+
+/**
+ * OpenSSL HMAC context
+ */
+struct crypto_openssl_mac_t
+{
+    EVP_MAC *mac;
+    EVP_MAC_CTX *ctx;
+};
+
+/**
+ * Generate random bytes with OpenSSL
+ */
+static int crypto_openssl_random ( uint8_t * data, size_t len )
+{
+    return RAND_bytes ( data, len ) == 1 ? 0 : -1;
+}
+
+/**
+ * Derive key using PBKDF2 and SHA-256 with OpenSSL
+ */
+static int crypto_openssl_derive_key ( const char *password, const uint8_t * salt,
+    size_t salt_len, unsigned int rounds, uint8_t * key, size_t key_len )
+{
+    if ( PKCS5_PBKDF2_HMAC ( password, strlen ( password ), salt, salt_len, rounds,
+            EVP_sha256 (  ), key_len, key ) != 1 )
+    {
+        memset ( key, '\0', key_len );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Create OpenSSL AES-256 cipher, EVP picks AES-NI or VAES code by CPUID
+ */
+static void *crypto_openssl_cipher_new ( const uint8_t * key, int encrypt )
+{
+    struct crypto_openssl_cipher_t *cipher;
+
+    if ( !( cipher =
+            ( struct crypto_openssl_cipher_t * ) malloc ( sizeof ( struct
+                    crypto_openssl_cipher_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( cipher->ctx = EVP_CIPHER_CTX_new (  ) ) )
+    {
+        free ( cipher );
+        return NULL;
+    }
+
+    memset ( cipher->chain, '\0', sizeof ( cipher->chain ) );
+    cipher->encrypt = !!encrypt;
+
+    if ( EVP_CipherInit_ex ( cipher->ctx, EVP_aes_256_cbc (  ), NULL, key, cipher->chain,
+            cipher->encrypt ) != 1 || EVP_CIPHER_CTX_set_padding ( cipher->ctx, 0 ) != 1 )
+    {
+        EVP_CIPHER_CTX_free ( cipher->ctx );
+        free ( cipher );
+        return NULL;
+    }
+
+    return cipher;
+}
+
+/**
+ * Process whole blocks in CBC mode with OpenSSL
+ */
+static int crypto_openssl_cipher_cbc ( void *context, uint8_t * iv, const uint8_t * input,
+    uint8_t * output, size_t len )
+{
+    int olen;
+    uint8_t next[CRYPTO_BLOCK_LEN];
+    struct crypto_openssl_cipher_t *cipher;
+
+    cipher = ( struct crypto_openssl_cipher_t * ) context;
+
+    if ( !len )
+    {
+        return 0;
+    }
+
+    if ( len % CRYPTO_BLOCK_LEN || len > INT32_MAX )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Caller may continue other chain than the one cipher is at */
+    if ( memcmp ( iv, cipher->chain, CRYPTO_BLOCK_LEN )
+        && EVP_CipherInit_ex ( cipher->ctx, NULL, NULL, NULL, iv, -1 ) != 1 )
+    {
+        return -1;
+    }
+
+    /* Decryption chains on last ciphertext block, save it before in place update */
+    memcpy ( next, input + len - CRYPTO_BLOCK_LEN, CRYPTO_BLOCK_LEN );
+
+    if ( EVP_CipherUpdate ( cipher->ctx, output, &olen, input, len ) != 1
+        || ( size_t ) olen != len )
+    {
+        return -1;
+    }
+
+    if ( cipher->encrypt )
+    {
+        memcpy ( next, output + len - CRYPTO_BLOCK_LEN, CRYPTO_BLOCK_LEN );
+    }
+
+    memcpy ( iv, next, CRYPTO_BLOCK_LEN );
+    memcpy ( cipher->chain, next, CRYPTO_BLOCK_LEN );
+
+    return 0;
+}
+
+/**
+ * Free OpenSSL cipher
+ */
+static void crypto_openssl_cipher_free ( void *context )
+{
+    struct crypto_openssl_cipher_t *cipher;
+
+    cipher = ( struct crypto_openssl_cipher_t * ) context;
+
+    EVP_CIPHER_CTX_free ( cipher->ctx );
+    free ( cipher );
+}
+
+/**
+ * Create OpenSSL HMAC-SHA-256, EVP picks SHA-NI code by CPUID
+ */
+static void *crypto_openssl_mac_new ( const uint8_t * key, size_t key_len )
+{
+    char digest[] = "SHA256";
+    struct crypto_openssl_mac_t *mac;
+    OSSL_PARAM params[2];
+
+    if ( !( mac = ( struct crypto_openssl_mac_t * ) malloc ( sizeof ( struct
+                    crypto_openssl_mac_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( mac->mac = EVP_MAC_fetch ( NULL, "HMAC", NULL ) ) )
+    {
+        free ( mac );
+        return NULL;
+    }
+
+    if ( !( mac->ctx = EVP_MAC_CTX_new ( mac->mac ) ) )
+    {
+        EVP_MAC_free ( mac->mac );
+        free ( mac );
+        return NULL;
+    }
+
+    params[0] = OSSL_PARAM_construct_utf8_string ( OSSL_MAC_PARAM_DIGEST, digest, 0 );
+    params[1] = OSSL_PARAM_construct_end (  );
+
+    if ( EVP_MAC_init ( mac->ctx, key, key_len, params ) != 1 )
+    {
+        EVP_MAC_CTX_free ( mac->ctx );
+        EVP_MAC_free ( mac->mac );
+        free ( mac );
+        return NULL;
+    }
+
+    return mac;
+}
+
+/**
+ * Feed data into OpenSSL HMAC
+ */
+static int crypto_openssl_mac_update ( void *context, const uint8_t * data, size_t len )
+{
+    struct crypto_openssl_mac_t *mac;
+
+    mac = ( struct crypto_openssl_mac_t * ) context;
+
+    return EVP_MAC_update ( mac->ctx, data, len ) == 1 ? 0 : -1;
+}
+
+/**
+ * Finish OpenSSL HMAC and restart it with same key
+ */
+static int crypto_openssl_mac_finish ( void *context, uint8_t * digest )
+{
+    size_t len;
+    struct crypto_openssl_mac_t *mac;
+
+    mac = ( struct crypto_openssl_mac_t * ) context;
+
+    if ( EVP_MAC_final ( mac->ctx, digest, &len, CRYPTO_DIGEST_LEN ) != 1
+        || len != CRYPTO_DIGEST_LEN || EVP_MAC_init ( mac->ctx, NULL, 0, NULL ) != 1 )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Free OpenSSL HMAC
+ */
+static void crypto_openssl_mac_free ( void *context )
+{
+    struct crypto_openssl_mac_t *mac;
+
+    mac = ( struct crypto_openssl_mac_t * ) context;
+
+    EVP_MAC_CTX_free ( mac->ctx );
+    EVP_MAC_free ( mac->mac );
+    free ( mac );
+}
+
+/**
+ * OpenSSL backend
+ */
+static const struct crypto_backend_t crypto_openssl = {
+    "openssl",
+    crypto_openssl_random,
+    crypto_openssl_derive_key,
+    crypto_openssl_cipher_new,
+    crypto_openssl_cipher_cbc,
+    crypto_openssl_cipher_free,
+    crypto_openssl_mac_new,
+    crypto_openssl_mac_update,
+    crypto_openssl_mac_finish,
+    crypto_openssl_mac_free
+};
+#endif
+
+/**
+ * Backends built in, preferred one first
+ */
+static const struct crypto_backend_t *const crypto_backends[] = {
+#ifdef ENABLE_OPENSSL
+    &crypto_openssl,
+#endif
+#ifdef ENABLE_MBEDTLS
+    &crypto_mbedtls,
+#endif
+    NULL
+};
+
+/**
+ * Backend in use
+ */
+static const struct crypto_backend_t *crypto_current;
+
+/**
+ * Get crypto backend in use
+ */
+const struct crypto_backend_t *crypto_backend ( void )
+{
+    return crypto_current ? crypto_current : crypto_backends[0];
+}
+
+/**
+ * Get built in crypto backend by position, NULL past last one
+ */
+const struct crypto_backend_t *crypto_backend_list ( size_t index )
+{
+    size_t i;
+
+    for ( i = 0; i < index && crypto_backends[i]; i++ );
+
+    return crypto_backends[i];
+}
+
+/**
+ * Select crypto backend by name
+ */
+int crypto_backend_select ( const char *name )
+{
+    size_t i;
+
+    for ( i = 0; crypto_backends[i]; i++ )
+    {
+        if ( !strcmp ( crypto_backends[i]->name, name ) )
+        {
+            crypto_current = crypto_backends[i];
+            return 0;
+        }
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+#endif
@@ -0,0 +1,541 @@
+/* ------------------------------------------------------------------
+ * SBox - Content Deduplication
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+/**
+ * Dedup table slot, first entry seen with given content
+ */
+struct dedup_slot_t
+{
+    uint64_t size;
+    uint64_t hash;
+    uint32_t entry;
+    char *path;
+};
+
+/**
+ * Dedup table, open addressing by size and content hash
+ */
+struct dedup_table_t
+{
+    size_t count;
+    size_t mask;
+    struct dedup_slot_t *slots;
+};
+
+/**
+ * File waiting for content hash
+ */
+struct dedup_item_t
+{
+    uint64_t size;
+    uint64_t hash;
+    uint32_t entry;
+    int hashed;
+    char *path;
+};
+
+/**
+ * Dedup pass state
+ */
+struct dedup_context_t
+{
+    struct file_net_t *net;
+    size_t size_count;
+    uint64_t *sizes;
+    size_t item_count;
+    size_t item_limit;
+    struct dedup_item_t *items;
+    struct dedup_table_t table;
+    size_t size;
+    uint8_t *buffer;
+    uint8_t *other;
+};
+
+/**
+ * Compare file sizes for sorting
+ */
+static int dedup_compare_sizes ( const void *a, const void *b )
+{
+    uint64_t size_a = *( const uint64_t * ) a;
+    uint64_t size_b = *( const uint64_t * ) b;
+
+    return size_a < size_b ? -1 : size_a > size_b;
+}
+
+/**
+ * Check if entry may share its content with other entries
+ */
+static int dedup_candidate ( const struct sbox_node_t *node )
+{
+    return S_ISREG ( node->mode ) && !( node->flags & FILE_NET_FLAG_LINK ) && node->size;
+}
+
+/**
+ * Collect sizes shared by more than one file, only those need hashing
+ */
+static int dedup_collect_sizes ( struct dedup_context_t *dedup )
+{
+    uint32_t i;
+    size_t j;
+    size_t count = 0;
+    uint64_t *sizes;
+    struct sbox_node_t node;
+
+    if ( !( sizes = ( uint64_t * ) malloc ( MAX ( dedup->net->count, 1 ) * sizeof ( uint64_t ) ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = FILE_NET_ROOT + 1; i < dedup->net->count; i++ )
+    {
+        file_net_get ( dedup->net, i, &node );
+
+        if ( dedup_candidate ( &node ) )
+        {
+            sizes[count++] = node.size;
+        }
+    }
+
+    qsort ( sizes, count, sizeof ( uint64_t ), dedup_compare_sizes );
+
+    dedup->size_count = 0;
+
+    for ( j = 0; j + 1 < count; j++ )
+    {
+        if ( sizes[j] == sizes[j + 1] && ( !dedup->size_count
+                || sizes[dedup->size_count - 1] != sizes[j] ) )
+        {
+            sizes[dedup->size_count++] = sizes[j];
+        }
+    }
+
+    dedup->sizes = sizes;
+
+    return 0;
+}
+
+/**
+ * Check if size is shared by more than one file
+ */
+static int dedup_shared_size ( const struct dedup_context_t *dedup, uint64_t size )
+{
+    return !!bsearch ( &size, dedup->sizes, dedup->size_count, sizeof ( uint64_t ),
+        dedup_compare_sizes );
+}
+
+/**
+ * Create new dedup table
+ */
+static int dedup_table_new ( struct dedup_table_t *table )
+{
+    table->count = 0;
+    table->mask = 1023;
+
+    if ( !( table->slots =
+            ( struct dedup_slot_t * ) calloc ( table->mask + 1,
+                sizeof ( struct dedup_slot_t ) ) ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Get first dedup table slot for size and hash
+ */
+static size_t dedup_table_home ( size_t mask, uint64_t size, uint64_t hash )
+{
+    return ( hash ^ size * 0x9E3779B97F4A7C15ULL ) & mask;
+}
+
+/**
+ * Double dedup table capacity
+ */
+static int dedup_table_grow ( struct dedup_table_t *table )
+{
+    size_t i;
+    size_t pos;
+    size_t mask;
+    struct dedup_slot_t *slots;
+    struct dedup_slot_t *old_slots;
+
+    mask = 2 * table->mask + 1;
+
+    if ( !( slots =
+            ( struct dedup_slot_t * ) calloc ( mask + 1, sizeof ( struct dedup_slot_t ) ) ) )
+    {
+        return -1;
+    }
+
+    old_slots = table->slots;
+
+    for ( i = 0; i <= table->mask; i++ )
+    {
+        if ( !old_slots[i].path )
+        {
+            continue;
+        }
+
+        pos = dedup_table_home ( mask, old_slots[i].size, old_slots[i].hash );
+
+        while ( slots[pos].path )
+        {
+            pos = ( pos + 1 ) & mask;
+        }
+
+        slots[pos] = old_slots[i];
+    }
+
+    free ( old_slots );
+    table->slots = slots;
+    table->mask = mask;
+
+    return 0;
+}
+
+/**
+ * Free dedup table from memory
+ */
+static void dedup_table_free ( struct dedup_table_t *table )
+{
+    size_t i;
+
+    for ( i = 0; i <= table->mask; i++ )
+    {
+        free ( table->slots[i].path );
+    }
+
+    free ( table->slots );
+}
+
+/**
+ * Hash file content, returns zero on success
+ */
+static int dedup_hash_file ( const char *path, uint64_t size, uint64_t * hash )
+{
+    int fd;
+    ssize_t len;
+    size_t limit;
+    uint64_t sum = 0;
+    uint8_t *buffer;
+    struct xxh64_t state;
+
+    limit = stream_params (  )->buffer_size;
+
+    if ( !( buffer = ( uint8_t * ) malloc ( limit ) ) )
+    {
+        return -1;
+    }
+
+    if ( ( fd = open ( path, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        free ( buffer );
+        return -1;
+    }
+
+    xxh64_init ( &state, 0 );
+
+    while ( ( len = read ( fd, buffer, limit ) ) > 0 )
+    {
+        xxh64_update ( &state, buffer, len );
+        sum += len;
+    }
+
+    close ( fd );
+    free ( buffer );
+
+    if ( len < 0 || sum != size )
+    {
+        return -1;
+    }
+
+    *hash = xxh64_digest ( &state );
+
+    return 0;
+}
+
+/**
+ * Read longest data chunk from file
+ */
+static ssize_t dedup_read_max ( int fd, uint8_t * mem, size_t total )
+{
+    ssize_t len;
+    size_t sum = 0;
+
+    while ( sum < total )
+    {
+        if ( ( len = read ( fd, mem + sum, total - sum ) ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( !len )
+        {
+            break;
+        }
+
+        sum += len;
+    }
+
+    return sum;
+}
+
+/**
+ * Compare content of two files byte by byte, hash match alone is not trusted
+ */
+static int dedup_same_content ( struct dedup_context_t *dedup, const char *path_a,
+    const char *path_b )
+{
+    int fd_a;
+    int fd_b;
+    int same = 1;
+    ssize_t len_a;
+    ssize_t len_b;
+
+    if ( ( fd_a = open ( path_a, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        return 0;
+    }
+
+    if ( ( fd_b = open ( path_b, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        close ( fd_a );
+        return 0;
+    }
+
+    do
+    {
+        len_a = dedup_read_max ( fd_a, dedup->buffer, dedup->size );
+        len_b = dedup_read_max ( fd_b, dedup->other, dedup->size );
+
+        if ( len_a < 0 || len_a != len_b || memcmp ( dedup->buffer, dedup->other, len_a ) )
+        {
+            same = 0;
+            break;
+        }
+
+    } while ( len_a );
+
+    close ( fd_b );
+    close ( fd_a );
+
+    return same;
+}
+
+/**
+ * Collect pass callback, remember candidates with shared size
+ */
+static int dedup_collect_callback ( void *context, struct sbox_node_t *node, const char *path )
+{
+    size_t limit;
+    struct dedup_item_t *items;
+    struct dedup_item_t *item;
+    struct dedup_context_t *dedup;
+
+    dedup = ( struct dedup_context_t * ) context;
+
+    if ( !dedup_candidate ( node ) || !dedup_shared_size ( dedup, node->size ) )
+    {
+        return 0;
+    }
+
+    if ( dedup->item_count == dedup->item_limit )
+    {
+        limit = MAX ( 2 * dedup->item_limit, 256 );
+
+        if ( !( items =
+                ( struct dedup_item_t * ) realloc ( dedup->items,
+                    limit * sizeof ( struct dedup_item_t ) ) ) )
+        {
+            return -1;
+        }
+
+        dedup->items = items;
+        dedup->item_limit = limit;
+    }
+
+    item = dedup->items + dedup->item_count;
+
+    if ( !( item->path = strdup ( path ) ) )
+    {
+        return -1;
+    }
+
+    item->size = node->size;
+    item->entry = node->index;
+    item->hashed = 0;
+    dedup->item_count++;
+
+    return 0;
+}
+
+/**
+ * Hash task, unreadable or changing file is left to pack pass to report
+ */
+static int dedup_hash_task ( void *arg )
+{
+    struct dedup_item_t *item;
+
+    item = ( struct dedup_item_t * ) arg;
+    item->hashed = dedup_hash_file ( item->path, item->size, &item->hash ) >= 0;
+
+    return 0;
+}
+
+/**
+ * Hash collected candidates, in parallel if pool is given
+ */
+static int dedup_hash_items ( struct dedup_context_t *dedup, struct pool_t *pool )
+{
+    size_t i;
+
+    for ( i = 0; i < dedup->item_count; i++ )
+    {
+        if ( pool )
+        {
+            pool_submit ( pool, dedup_hash_task, dedup->items + i );
+
+        } else
+        {
+            dedup_hash_task ( dedup->items + i );
+        }
+    }
+
+    return pool ? pool_wait ( pool ) : 0;
+}
+
+/**
+ * Point hashed candidate at first earlier entry with identical content
+ */
+static int dedup_match_item ( struct dedup_context_t *dedup, struct dedup_item_t *item )
+{
+    size_t pos;
+    struct dedup_slot_t *slot;
+    struct sbox_node_t node;
+
+    for ( pos = dedup_table_home ( dedup->table.mask, item->size, item->hash );
+        ( slot = dedup->table.slots + pos )->path; pos = ( pos + 1 ) & dedup->table.mask )
+    {
+        if ( slot->size == item->size && slot->hash == item->hash
+            && dedup_same_content ( dedup, slot->path, item->path ) )
+        {
+            file_net_get ( dedup->net, item->entry, &node );
+
+            /* Hard link targets keep their body */
+            if ( node.flags )
+            {
+                return 0;
+            }
+
+            return file_net_set_copy ( dedup->net, item->entry, slot->entry );
+        }
+    }
+
+    /* Table takes over path ownership */
+    slot->path = item->path;
+    item->path = NULL;
+    slot->size = item->size;
+    slot->hash = item->hash;
+    slot->entry = item->entry;
+
+    if ( ++dedup->table.count * 2 > dedup->table.mask )
+    {
+        return dedup_table_grow ( &dedup->table );
+    }
+
+    return 0;
+}
+
+/**
+ * Free collected candidates from memory
+ */
+static void dedup_free_items ( struct dedup_context_t *dedup )
+{
+    size_t i;
+
+    for ( i = 0; i < dedup->item_count; i++ )
+    {
+        free ( dedup->items[i].path );
+    }
+
+    free ( dedup->items );
+}
+
+/**
+ * Replace file net entries by copies of earlier entries with identical content,
+ * candidates are hashed on pool if given and matched in file net order
+ */
+int file_net_dedup ( struct file_net_t *net, struct pool_t *pool )
+{
+    size_t i;
+    int status;
+    struct dedup_context_t *dedup;
+
+    if ( !( dedup = ( struct dedup_context_t * ) malloc ( sizeof ( struct dedup_context_t ) ) ) )
+    {
+        return -1;
+    }
+
+    dedup->net = net;
+    dedup->item_count = 0;
+    dedup->item_limit = 0;
+    dedup->items = NULL;
+
+    if ( dedup_collect_sizes ( dedup ) < 0 )
+    {
+        free ( dedup );
+        return -1;
+    }
+
+    if ( !dedup->size_count )
+    {
+        free ( dedup->sizes );
+        free ( dedup );
+        return 0;
+    }
+
+    /* Both compare buffers share one allocation */
+    dedup->size = stream_params (  )->buffer_size;
+
+    if ( !( dedup->buffer = ( uint8_t * ) malloc ( 2 * dedup->size ) ) )
+    {
+        free ( dedup->sizes );
+        free ( dedup );
+        return -1;
+    }
+
+    dedup->other = dedup->buffer + dedup->size;
+
+    if ( dedup_table_new ( &dedup->table ) < 0 )
+    {
+        free ( dedup->buffer );
+        free ( dedup->sizes );
+        free ( dedup );
+        return -1;
+    }
+
+    if ( ( status = file_net_iter ( net, dedup, dedup_collect_callback ) ) >= 0 )
+    {
+        status = dedup_hash_items ( dedup, pool );
+    }
+
+    for ( i = 0; status >= 0 && i < dedup->item_count; i++ )
+    {
+        if ( dedup->items[i].hashed )
+        {
+            status = dedup_match_item ( dedup, dedup->items + i );
+        }
+    }
+
+    dedup_free_items ( dedup );
+    dedup_table_free ( &dedup->table );
+    free ( dedup->buffer );
+    free ( dedup->sizes );
+    free ( dedup );
+
+    return status;
+}
@@ -0,0 +1,692 @@
+/* ------------------------------------------------------------------
+ * SBox - File Net Difference
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+/**
+ * Reference entry lookup table, keyed by parent and name
+ */
+struct diff_table_t
+{
+    size_t mask;
+    uint32_t *slots;
+};
+
+/**
+ * Tombstone, reference entry missing under current directory
+ */
+struct diff_tombstone_t
+{
+    uint32_t parent;
+    uint32_t entry;
+};
+
+/**
+ * Difference builder context
+ */
+struct diff_context_t
+{
+    const struct file_net_t *net;
+    const struct file_net_t *reference;
+    uint32_t *net_map;
+    uint32_t *reference_map;
+    uint8_t *keep;
+    size_t tombstone_count;
+    struct diff_tombstone_t *tombstones;
+};
+
+/**
+ * Hash entry name under parent
+ */
+static uint64_t diff_hash ( uint32_t parent, const char *name )
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ parent;
+
+    while ( *name )
+    {
+        hash ^= ( uint8_t ) * name++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Get entry name as stored in archive
+ */
+static const char *diff_entry_name ( const struct file_net_t *net, uint32_t index )
+{
+    struct sbox_node_t node;
+
+    file_net_get ( net, index, &node );
+
+    return file_net_parent ( net, index ) == FILE_NET_ROOT
+        ? file_net_get_safe_basename ( node.name ) : node.name;
+}
+
+/**
+ * Create reference entry lookup table
+ */
+static int diff_table_new ( struct diff_table_t *table, const struct file_net_t *reference )
+{
+    size_t size = 16;
+    size_t slot;
+    uint32_t i;
+
+    while ( size < 2 * ( size_t ) reference->count )
+    {
+        size *= 2;
+    }
+
+    if ( !( table->slots = ( uint32_t * ) malloc ( size * sizeof ( uint32_t ) ) ) )
+    {
+        return -1;
+    }
+
+    memset ( table->slots, 0xff, size * sizeof ( uint32_t ) );
+    table->mask = size - 1;
+
+    for ( i = FILE_NET_ROOT + 1; i < reference->count; i++ )
+    {
+        slot = diff_hash ( file_net_parent ( reference, i ),
+            diff_entry_name ( reference, i ) ) & table->mask;
+
+        while ( table->slots[slot] != FILE_NET_NONE )
+        {
+            slot = ( slot + 1 ) & table->mask;
+        }
+
+        table->slots[slot] = i;
+    }
+
+    return 0;
+}
+
+/**
+ * Find reference entry or tombstone by parent and name
+ */
+static uint32_t diff_table_find ( const struct diff_table_t *table,
+    const struct file_net_t *reference, uint32_t parent, const char *name, int tombstone )
+{
+    size_t slot;
+    uint32_t entry;
+    struct sbox_node_t node;
+
+    slot = diff_hash ( parent, name ) & table->mask;
+
+    while ( ( entry = table->slots[slot] ) != FILE_NET_NONE )
+    {
+        file_net_get ( reference, entry, &node );
+
+        if ( file_net_parent ( reference, entry ) == parent && ( !node.mode ) == tombstone
+            && !strcmp ( diff_entry_name ( reference, entry ), name ) )
+        {
+            return entry;
+        }
+
+        slot = ( slot + 1 ) & table->mask;
+    }
+
+    return FILE_NET_NONE;
+}
+
+/**
+ * Free reference entry lookup table
+ */
+static void diff_table_free ( struct diff_table_t *table )
+{
+    free ( table->slots );
+}
+
+/**
+ * Mark current entry and its ancestors to be kept
+ */
+static void diff_keep ( struct diff_context_t *diff, uint32_t index )
+{
+    while ( index != FILE_NET_ROOT && !( diff->keep[index / 8] & ( 1 << ( index % 8 ) ) ) )
+    {
+        diff->keep[index / 8] |= 1 << ( index % 8 );
+        index = file_net_parent ( diff->net, index );
+    }
+}
+
+/**
+ * Mark changed current entry to be kept, along with target of hard link
+ */
+static void diff_keep_entry ( struct diff_context_t *diff, const struct sbox_node_t *node )
+{
+    diff_keep ( diff, node->index );
+
+    if ( node->link != FILE_NET_NONE )
+    {
+        diff_keep ( diff, node->link );
+    }
+}
+
+/**
+ * Match current entries against reference entries
+ */
+static void diff_match ( struct diff_context_t *diff, const struct diff_table_t *table )
+{
+    uint32_t i;
+    uint32_t entry;
+    uint32_t parent;
+    struct sbox_node_t node;
+    struct sbox_node_t reference;
+
+    for ( i = FILE_NET_ROOT + 1; i < diff->net->count; i++ )
+    {
+        parent = diff->net_map[file_net_parent ( diff->net, i )];
+        entry = FILE_NET_NONE;
+
+        file_net_get ( diff->net, i, &node );
+
+        if ( parent != FILE_NET_NONE )
+        {
+            entry = diff_table_find ( table, diff->reference, parent,
+                diff_entry_name ( diff->net, i ), 0 );
+        }
+
+        if ( entry != FILE_NET_NONE )
+        {
+            file_net_get ( diff->reference, entry, &reference );
+
+            /* Type change is a deletion followed by a new entry */
+            if ( ( node.mode & S_IFMT ) != ( reference.mode & S_IFMT ) )
+            {
+                entry = FILE_NET_NONE;
+            }
+        }
+
+        diff->net_map[i] = entry;
+
+        if ( entry == FILE_NET_NONE )
+        {
+            diff_keep_entry ( diff, &node );
+            continue;
+        }
+
+        diff->reference_map[entry] = i;
+
+        if ( node.mode != reference.mode || ( !( node.mode & S_IFDIR )
+                && ( node.size != reference.size || node.mtime != reference.mtime ) ) )
+        {
+            diff_keep_entry ( diff, &node );
+        }
+    }
+}
+
+/**
+ * Collect reference entries missing from current file net
+ */
+static int diff_collect_tombstones ( struct diff_context_t *diff )
+{
+    uint32_t i;
+    uint32_t parent;
+    size_t capacity = 0;
+    struct diff_tombstone_t *tombstones;
+
+    for ( i = FILE_NET_ROOT + 1; i < diff->reference->count; i++ )
+    {
+        parent = diff->reference_map[file_net_parent ( diff->reference, i )];
+
+        if ( diff->reference_map[i] != FILE_NET_NONE || parent == FILE_NET_NONE )
+        {
+            continue;
+        }
+
+        if ( diff->tombstone_count == capacity )
+        {
+            capacity = capacity ? 2 * capacity : 64;
+
+            if ( !( tombstones =
+                    ( struct diff_tombstone_t * ) realloc ( diff->tombstones,
+                        capacity * sizeof ( struct diff_tombstone_t ) ) ) )
+            {
+                return -1;
+            }
+
+            diff->tombstones = tombstones;
+        }
+
+        diff->tombstones[diff->tombstone_count].parent = parent;
+        diff->tombstones[diff->tombstone_count].entry = i;
+        diff->tombstone_count++;
+
+        diff_keep ( diff, parent );
+    }
+
+    return 0;
+}
+
+/**
+ * Compare tombstones by current parent, then by reference order
+ */
+static int diff_tombstone_compare ( const void *a, const void *b )
+{
+    const struct diff_tombstone_t *ta = ( const struct diff_tombstone_t * ) a;
+    const struct diff_tombstone_t *tb = ( const struct diff_tombstone_t * ) b;
+
+    if ( ta->parent != tb->parent )
+    {
+        return ta->parent < tb->parent ? -1 : 1;
+    }
+
+    return ta->entry < tb->entry ? -1 : ta->entry > tb->entry;
+}
+
+/**
+ * Append tombstones of current directory to difference file net
+ */
+static int diff_emit_tombstones ( struct diff_context_t *diff, struct file_net_t *result,
+    size_t *pos, uint32_t parent, uint32_t result_parent )
+{
+    for ( ; *pos < diff->tombstone_count && diff->tombstones[*pos].parent == parent; ( *pos )++ )
+    {
+        if ( file_net_append ( result, result_parent, diff_entry_name ( diff->reference,
+                    diff->tombstones[*pos].entry ), 0, 0, 0, NULL ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Build difference file net from kept entries and tombstones
+ */
+static struct file_net_t *diff_emit ( struct diff_context_t *diff, struct arena_t *arena )
+{
+    size_t pos = 0;
+    uint32_t i;
+    uint32_t *result_map;
+    struct sbox_node_t node;
+    struct file_net_t *result;
+
+    if ( !( result = file_net_new ( arena ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( result_map = ( uint32_t * ) malloc ( diff->net->count * sizeof ( uint32_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    result_map[FILE_NET_ROOT] = FILE_NET_ROOT;
+
+    if ( diff_emit_tombstones ( diff, result, &pos, FILE_NET_ROOT, FILE_NET_ROOT ) < 0 )
+    {
+        free ( result_map );
+        return NULL;
+    }
+
+    for ( i = FILE_NET_ROOT + 1; i < diff->net->count; i++ )
+    {
+        if ( !( diff->keep[i / 8] & ( 1 << ( i % 8 ) ) ) )
+        {
+            continue;
+        }
+
+        file_net_get ( diff->net, i, &node );
+
+        if ( node.flags & FILE_NET_FLAG_LINK )
+        {
+            if ( file_net_append_link ( result, result_map[file_net_parent ( diff->net, i )],
+                    node.name, result_map[node.link], result_map + i ) < 0 )
+            {
+                free ( result_map );
+                return NULL;
+            }
+
+        } else if ( file_net_append ( result, result_map[file_net_parent ( diff->net, i )],
+                node.name, node.mode, node.size, node.mtime, result_map + i ) < 0 )
+        {
+            free ( result_map );
+            return NULL;
+        }
+
+        if ( diff_emit_tombstones ( diff, result, &pos, i, result_map[i] ) < 0 )
+        {
+            free ( result_map );
+            return NULL;
+        }
+    }
+
+    free ( result_map );
+
+    return result;
+}
+
+/**
+ * Free difference builder context
+ */
+static void diff_context_free ( struct diff_context_t *diff )
+{
+    free ( diff->tombstones );
+    free ( diff->keep );
+    free ( diff->reference_map );
+    free ( diff->net_map );
+}
+
+/**
+ * Create file net with entries changed since reference and tombstones for removed ones
+ */
+struct file_net_t *file_net_diff ( struct arena_t *arena, const struct file_net_t *net,
+    const struct file_net_t *reference )
+{
+    struct file_net_t *result;
+    struct diff_table_t table;
+    struct diff_context_t diff;
+
+    memset ( &diff, '\0', sizeof ( diff ) );
+    diff.net = net;
+    diff.reference = reference;
+
+    if ( !( diff.net_map = ( uint32_t * ) malloc ( net->count * sizeof ( uint32_t ) ) )
+        || !( diff.reference_map =
+            ( uint32_t * ) malloc ( reference->count * sizeof ( uint32_t ) ) )
+        || !( diff.keep = ( uint8_t * ) calloc ( net->count / 8 + 1, 1 ) ) )
+    {
+        diff_context_free ( &diff );
+        return NULL;
+    }
+
+    memset ( diff.reference_map, 0xff, reference->count * sizeof ( uint32_t ) );
+    diff.net_map[FILE_NET_ROOT] = FILE_NET_ROOT;
+    diff.reference_map[FILE_NET_ROOT] = FILE_NET_ROOT;
+
+    if ( diff_table_new ( &table, reference ) < 0 )
+    {
+        diff_context_free ( &diff );
+        return NULL;
+    }
+
+    diff_match ( &diff, &table );
+    diff_table_free ( &table );
+
+    if ( diff_collect_tombstones ( &diff ) < 0 )
+    {
+        diff_context_free ( &diff );
+        return NULL;
+    }
+
+    qsort ( diff.tombstones, diff.tombstone_count, sizeof ( struct diff_tombstone_t ),
+        diff_tombstone_compare );
+
+    result = diff_emit ( &diff, arena );
+
+    diff_context_free ( &diff );
+
+    return result;
+}
+
+/**
+ * File net merge context
+ */
+struct merge_context_t
+{
+    const struct file_net_t *base;
+    const struct file_net_t *increment;
+    struct file_net_t *result;
+    uint32_t *base_map;
+    uint32_t *result_map;
+    uint32_t *children;
+    uint32_t *siblings;
+    uint32_t *increment_map;
+    uint8_t *removed;
+    uint8_t *consumed;
+};
+
+/**
+ * Link increment entries to their parents
+ */
+static void merge_link_children ( struct merge_context_t *merge )
+{
+    uint32_t i;
+    uint32_t parent;
+
+    memset ( merge->children, 0xff, merge->increment->count * sizeof ( uint32_t ) );
+    memset ( merge->siblings, 0xff, merge->increment->count * sizeof ( uint32_t ) );
+
+    /* Prepend in reverse so children keep their order */
+    for ( i = merge->increment->count - 1; i > FILE_NET_ROOT; i-- )
+    {
+        parent = file_net_parent ( merge->increment, i );
+        merge->siblings[i] = merge->children[parent];
+        merge->children[parent] = i;
+    }
+}
+
+/**
+ * Match base entries against increment entries and tombstones
+ */
+static void merge_match ( struct merge_context_t *merge, const struct diff_table_t *table )
+{
+    uint32_t i;
+    uint32_t entry;
+    uint32_t parent;
+    const char *name;
+    struct sbox_node_t node;
+    struct sbox_node_t update;
+
+    for ( i = FILE_NET_ROOT + 1; i < merge->base->count; i++ )
+    {
+        parent = file_net_parent ( merge->base, i );
+        merge->base_map[i] = FILE_NET_NONE;
+
+        if ( merge->removed[parent / 8] & ( 1 << ( parent % 8 ) ) )
+        {
+            merge->removed[i / 8] |= 1 << ( i % 8 );
+            continue;
+        }
+
+        if ( ( parent = merge->base_map[parent] ) == FILE_NET_NONE )
+        {
+            continue;
+        }
+
+        name = diff_entry_name ( merge->base, i );
+
+        if ( diff_table_find ( table, merge->increment, parent, name, 1 ) != FILE_NET_NONE )
+        {
+            merge->removed[i / 8] |= 1 << ( i % 8 );
+            continue;
+        }
+
+        if ( ( entry = diff_table_find ( table, merge->increment, parent, name,
+                    0 ) ) == FILE_NET_NONE )
+        {
+            continue;
+        }
+
+        file_net_get ( merge->base, i, &node );
+        file_net_get ( merge->increment, entry, &update );
+
+        if ( ( node.mode & S_IFMT ) != ( update.mode & S_IFMT ) )
+        {
+            merge->removed[i / 8] |= 1 << ( i % 8 );
+            continue;
+        }
+
+        merge->base_map[i] = entry;
+        merge->consumed[entry / 8] |= 1 << ( entry % 8 );
+    }
+}
+
+/**
+ * Copy new increment subtree into merged file net
+ */
+static int merge_copy_subtree ( struct merge_context_t *merge, uint32_t entry,
+    uint32_t result_parent )
+{
+    uint32_t i;
+    uint32_t parent;
+    struct sbox_node_t node;
+
+    for ( i = entry; i < merge->increment->count; i++ )
+    {
+        parent = i == entry ? result_parent
+            : merge->increment_map[file_net_parent ( merge->increment, i )];
+
+        /* Subtree ends at first entry outside of it */
+        if ( parent == FILE_NET_NONE )
+        {
+            break;
+        }
+
+        file_net_get ( merge->increment, i, &node );
+
+        if ( node.mode && file_net_append ( merge->result, parent, node.name, node.mode,
+                node.size, node.mtime, merge->increment_map + i ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy new increment children of directory into merged file net
+ */
+static int merge_copy_children ( struct merge_context_t *merge, uint32_t entry,
+    uint32_t result_parent )
+{
+    uint32_t child;
+    struct sbox_node_t node;
+
+    for ( child = merge->children[entry]; child != FILE_NET_NONE; child = merge->siblings[child] )
+    {
+        file_net_get ( merge->increment, child, &node );
+
+        if ( !node.mode || merge->consumed[child / 8] & ( 1 << ( child % 8 ) ) )
+        {
+            continue;
+        }
+
+        if ( merge_copy_subtree ( merge, child, result_parent ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Build merged file net from base entries and increment
+ */
+static int merge_emit ( struct merge_context_t *merge )
+{
+    uint32_t i;
+    uint32_t entry;
+    struct sbox_node_t node;
+    struct sbox_node_t update;
+
+    merge->result_map[FILE_NET_ROOT] = FILE_NET_ROOT;
+
+    if ( merge_copy_children ( merge, FILE_NET_ROOT, FILE_NET_ROOT ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = FILE_NET_ROOT + 1; i < merge->base->count; i++ )
+    {
+        if ( merge->removed[i / 8] & ( 1 << ( i % 8 ) ) )
+        {
+            continue;
+        }
+
+        file_net_get ( merge->base, i, &node );
+
+        if ( ( entry = merge->base_map[i] ) != FILE_NET_NONE )
+        {
+            file_net_get ( merge->increment, entry, &update );
+            node.mode = update.mode;
+            node.size = update.size;
+            node.mtime = update.mtime;
+        }
+
+        if ( file_net_append ( merge->result,
+                merge->result_map[file_net_parent ( merge->base, i )], node.name, node.mode,
+                node.size, node.mtime, merge->result_map + i ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( entry != FILE_NET_NONE
+            && merge_copy_children ( merge, entry, merge->result_map[i] ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Free file net merge context
+ */
+static void merge_context_free ( struct merge_context_t *merge )
+{
+    free ( merge->consumed );
+    free ( merge->removed );
+    free ( merge->increment_map );
+    free ( merge->siblings );
+    free ( merge->children );
+    free ( merge->result_map );
+    free ( merge->base_map );
+}
+
+/**
+ * Apply increment with tombstones to base file net
+ */
+struct file_net_t *file_net_merge ( struct arena_t *arena, const struct file_net_t *base,
+    const struct file_net_t *increment )
+{
+    struct diff_table_t table;
+    struct merge_context_t merge;
+
+    memset ( &merge, '\0', sizeof ( merge ) );
+    merge.base = base;
+    merge.increment = increment;
+
+    if ( !( merge.base_map = ( uint32_t * ) malloc ( base->count * sizeof ( uint32_t ) ) )
+        || !( merge.result_map = ( uint32_t * ) malloc ( base->count * sizeof ( uint32_t ) ) )
+        || !( merge.children = ( uint32_t * ) malloc ( increment->count * sizeof ( uint32_t ) ) )
+        || !( merge.siblings = ( uint32_t * ) malloc ( increment->count * sizeof ( uint32_t ) ) )
+        || !( merge.increment_map =
+            ( uint32_t * ) malloc ( increment->count * sizeof ( uint32_t ) ) )
+        || !( merge.removed = ( uint8_t * ) calloc ( base->count / 8 + 1, 1 ) )
+        || !( merge.consumed = ( uint8_t * ) calloc ( increment->count / 8 + 1, 1 ) ) )
+    {
+        merge_context_free ( &merge );
+        return NULL;
+    }
+
+    memset ( merge.increment_map, 0xff, increment->count * sizeof ( uint32_t ) );
+    merge.base_map[FILE_NET_ROOT] = FILE_NET_ROOT;
+    merge_link_children ( &merge );
+
+    if ( diff_table_new ( &table, increment ) < 0 )
+    {
+        merge_context_free ( &merge );
+        return NULL;
+    }
+
+    merge_match ( &merge, &table );
+    diff_table_free ( &table );
+
+    if ( !( merge.result = file_net_new ( arena ) ) || merge_emit ( &merge ) < 0 )
+    {
+        merge_context_free ( &merge );
+        return NULL;
+    }
+
+    merge_context_free ( &merge );
+
+    return merge.result;
+}
@@ -10,6 +10,8 @@
 struct file_stream_context_t
 {
     int fd;
+    uint64_t start;
+    uint64_t end;
 };
 
 /*
@@ -17,10 +19,26 @@ struct file_stream_context_t
  */
 static ssize_t file_stream_read ( struct io_stream_t *io, void *data, size_t len )
 {
+    off_t position;
     struct file_stream_context_t *context;
 
     context = ( struct file_stream_context_t * ) io->context;
 
+    if ( context->end != UINT64_MAX )
+    {
+        if ( ( position = lseek ( context->fd, 0, SEEK_CUR ) ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( ( uint64_t ) position >= context->end )
+        {
+            return 0;
+        }
+
+        len = MIN ( len, context->end - position );
+    }
+
     return read ( context->fd, data, len );
 }
 
@@ -63,6 +81,71 @@ static int file_stream_flush ( struct io_stream_t *io )
 #endif
 }
 
+/*
+ * Get file stream storage offset
+ */
+static int file_stream_split ( struct io_stream_t *io, uint64_t * offset )
+{
+    off_t position;
+    struct file_stream_context_t *context;
+
+    context = ( struct file_stream_context_t * ) io->context;
+
+    if ( ( position = lseek ( context->fd, 0, SEEK_CUR ) ) < 0 )
+    {
+        return -1;
+    }
+
+    *offset = position - context->start;
+
+    return 0;
+}
+
+/*
+ * Write annotation data to file stream
+ */
+static int file_stream_annotate ( struct io_stream_t *io, const void *data, size_t len )
+{
+    return io->write_complete ( io, data, len );
+}
+
+/*
+ * Seek file stream to storage offset
+ */
+static int file_stream_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    struct file_stream_context_t *context;
+
+    context = ( struct file_stream_context_t * ) io->context;
+
+    if ( lseek ( context->fd, context->start + offset, SEEK_SET ) < 0 )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Get file stream storage length
+ */
+static int file_stream_length ( struct io_stream_t *io, uint64_t * length )
+{
+    struct stat statbuf;
+    struct file_stream_context_t *context;
+
+    context = ( struct file_stream_context_t * ) io->context;
+
+    if ( fstat ( context->fd, &statbuf ) < 0 )
+    {
+        return -1;
+    }
+
+    *length = MIN ( ( uint64_t ) statbuf.st_size, context->end ) - context->start;
+
+    return 0;
+}
+
 /*
  * Close IO stream
  */
@@ -84,10 +167,23 @@ static void file_stream_close ( struct io_stream_t *io )
  * Create new file stream
  */
 struct io_stream_t *file_stream_new ( int fd )
+{
+    return file_range_stream_new ( fd, 0, UINT64_MAX );
+}
+
+/**
+ * Create new file stream over part of file, offsets are relative to its start
+ */
+struct io_stream_t *file_range_stream_new ( int fd, uint64_t start, uint64_t end )
 {
     struct io_stream_t *io;
     struct file_stream_context_t *context;
 
+    if ( start && lseek ( fd, start, SEEK_SET ) < 0 )
+    {
+        return NULL;
+    }
+
     if ( !( io = io_stream_new (  ) ) )
     {
         return NULL;
@@ -102,12 +198,18 @@ struct io_stream_t *file_stream_new ( int fd )
     }
 
     context->fd = fd;
+    context->start = start;
+    context->end = end;
 
     io->context = context;
     io->read = file_stream_read;
     io->write = file_stream_write;
     io->verify = file_stream_verify;
     io->flush = file_stream_flush;
+    io->split = file_stream_split;
+    io->annotate = file_stream_annotate;
+    io->seek = file_stream_seek;
+    io->length = file_stream_length;
     io->close = file_stream_close;
 
     return io;
@@ -4,16 +4,6 @@
 
 #include "sbox.h"
 
-/**
- * Name chunk structure
- */
-struct name_chunk_t
-{
-    size_t len;
-    struct name_chunk_t *next;
-    struct name_chunk_t *prev;
-};
-
 /**
  * Name stack structure
  */
@@ -22,20 +12,81 @@ struct name_stack_t
     size_t path_len;
     size_t path_size;
     char *path;
-    struct name_chunk_t *head;
-    struct name_chunk_t *tail;
+    size_t depth;
+    size_t capacity;
+    size_t *lens;
+    uint32_t *entries;
 };
 
 /**
- * Expandable buffer structure
+ * File net frame, one directory being walked
  */
-struct ext_buffer_t
+struct net_frame_t
 {
-    uint8_t *bytes;
-    size_t length;
+    uint32_t entry;
+    uint32_t last;
+    int more;
+    size_t names;
+    size_t cursor;
+    dev_t dev;
+    ino_t ino;
+};
+
+/**
+ * File net frame stack structure
+ */
+struct frame_stack_t
+{
+    size_t depth;
     size_t capacity;
+    struct net_frame_t *frames;
+};
+
+/**
+ * Hard link map slot
+ */
+struct link_slot_t
+{
+    dev_t dev;
+    ino_t ino;
+    uint32_t entry;
+};
+
+/**
+ * Hard link map, first file net entry of each multiply linked inode
+ */
+struct link_map_t
+{
+    size_t count;
+    size_t mask;
+    struct link_slot_t *slots;
+};
+
+/**
+ * File net builder state
+ */
+struct net_builder_t
+{
+    struct file_net_t *net;
+    struct name_stack_t stack;
+    struct frame_stack_t frames;
+    struct ext_buffer_t names;
+    struct link_map_t links;
+    int dir_fd;
+};
+
+/**
+ * File net reader structure
+ */
+struct net_reader_t
+{
+    const uint8_t *ptr;
+    const uint8_t *end;
 };
 
+#define FILE_NET_PAGE(net, index) ( ( net )->pages[( index ) >> FILE_NET_PAGE_BITS] )
+#define FILE_NET_SLOT(index) ( ( index ) & ( FILE_NET_PAGE_SIZE - 1 ) )
+
 /**
  * Create new name stack
  */
@@ -43,16 +94,28 @@ static int name_stack_new ( struct name_stack_t *stack )
 {
     stack->path_len = 0;
     stack->path_size = 256;
+    stack->depth = 0;
+    stack->capacity = 64;
 
     if ( !( stack->path = ( char * ) malloc ( stack->path_size ) ) )
     {
         return -1;
     }
 
-    stack->path[0] = '\0';
+    if ( !( stack->lens = ( size_t * ) malloc ( stack->capacity * sizeof ( size_t ) ) ) )
+    {
+        free ( stack->path );
+        return -1;
+    }
+
+    if ( !( stack->entries = ( uint32_t * ) malloc ( stack->capacity * sizeof ( uint32_t ) ) ) )
+    {
+        free ( stack->lens );
+        free ( stack->path );
+        return -1;
+    }
 
-    stack->head = NULL;
-    stack->tail = NULL;
+    stack->path[0] = '\0';
 
     return 0;
 }
@@ -60,12 +123,14 @@ static int name_stack_new ( struct name_stack_t *stack )
 /**
  * Push name into name stack
  */
-static int name_stack_push ( struct name_stack_t *stack, const char *name )
+static int name_stack_push ( struct name_stack_t *stack, const char *name, uint32_t entry )
 {
     size_t name_len;
     size_t new_path_len;
+    size_t capacity;
     char *backup;
-    struct name_chunk_t *chunk;
+    size_t *lens;
+    uint32_t *entries;
 
     name_len = strlen ( name );
 
@@ -78,41 +143,42 @@ static int name_stack_push ( struct name_stack_t *stack, const char *name )
 
         if ( !( stack->path = realloc ( stack->path, stack->path_size ) ) )
         {
-            free ( backup );
+            stack->path = backup;
             return -1;
         }
     }
 
-    if ( stack->path[0] )
+    if ( stack->depth == stack->capacity )
     {
-        stack->path[stack->path_len++] = '/';
-    }
+        capacity = 2 * stack->capacity;
 
-    memcpy ( stack->path + stack->path_len, name, name_len + 1 );
-    stack->path_len = new_path_len;
-
-    if ( !( chunk = ( struct name_chunk_t * ) malloc ( sizeof ( struct name_chunk_t ) ) ) )
-    {
-        return -1;
-    }
+        if ( !( lens = ( size_t * ) realloc ( stack->lens, capacity * sizeof ( size_t ) ) ) )
+        {
+            return -1;
+        }
 
-    chunk->len = name_len;
+        stack->lens = lens;
 
-    chunk->next = NULL;
-    chunk->prev = stack->tail;
+        if ( !( entries =
+                ( uint32_t * ) realloc ( stack->entries, capacity * sizeof ( uint32_t ) ) ) )
+        {
+            return -1;
+        }
 
-    if ( stack->tail )
-    {
-        stack->tail->next = chunk;
+        stack->entries = entries;
+        stack->capacity = capacity;
     }
 
-    stack->tail = chunk;
-
-    if ( !stack->head )
+    if ( stack->path[0] )
     {
-        stack->head = chunk;
+        stack->path[stack->path_len++] = '/';
     }
 
+    memcpy ( stack->path + stack->path_len, name, name_len + 1 );
+    stack->path_len = new_path_len;
+    stack->lens[stack->depth] = name_len;
+    stack->entries[stack->depth++] = entry;
+
     return 0;
 }
 
@@ -121,44 +187,31 @@ static int name_stack_push ( struct name_stack_t *stack, const char *name )
  */
 static int name_stack_pop_discard ( struct name_stack_t *stack )
 {
-    struct name_chunk_t *last;
+    size_t last_len;
 
-    if ( !stack->tail )
+    if ( !stack->depth )
     {
         return -1;
     }
 
-    last = stack->tail;
+    last_len = stack->lens[--stack->depth];
 
-    if ( stack->path_len == last->len )
+    if ( stack->path_len == last_len )
     {
         stack->path_len = 0;
 
     } else
     {
-        if ( stack->path_len < 1 + last->len )
+        if ( stack->path_len < 1 + last_len )
         {
             return -1;
         }
 
-        stack->path_len -= 1 + last->len;
+        stack->path_len -= 1 + last_len;
     }
 
     stack->path[stack->path_len] = '\0';
 
-    stack->tail = last->prev;
-
-    if ( stack->tail )
-    {
-        stack->tail->next = NULL;
-
-    } else
-    {
-        stack->head = NULL;
-    }
-
-    free ( last );
-
     return 0;
 }
 
@@ -167,397 +220,1088 @@ static int name_stack_pop_discard ( struct name_stack_t *stack )
  */
 static void name_stack_free ( struct name_stack_t *stack )
 {
-    struct name_chunk_t *ptr;
-    struct name_chunk_t *next;
-
-    for ( ptr = stack->head; ptr; ptr = next )
-    {
-        next = ptr->next;
-        free ( ptr );
-    }
-
+    free ( stack->entries );
+    free ( stack->lens );
     free ( stack->path );
 }
 
 /**
- * Create new sbox node with name
+ * Create new file net frame stack
  */
-static struct sbox_node_t *sbox_node_new ( const char *name )
+static int frame_stack_new ( struct frame_stack_t *stack )
 {
-    size_t name_len;
-    struct sbox_node_t *node;
+    stack->depth = 0;
+    stack->capacity = 64;
 
-    if ( !( node = ( struct sbox_node_t * ) calloc ( 1, sizeof ( struct sbox_node_t ) ) ) )
+    if ( !( stack->frames =
+            ( struct net_frame_t * ) malloc ( stack->capacity *
+                sizeof ( struct net_frame_t ) ) ) )
     {
-        return NULL;
-    }
-
-    if ( name )
-    {
-        name_len = strlen ( name );
-
-        if ( !( node->name = ( char * ) malloc ( name_len + 1 ) ) )
-        {
-            free ( node );
-            return NULL;
-        }
-
-        memcpy ( node->name, name, name_len + 1 );
+        return -1;
     }
 
-    return node;
+    return 0;
 }
 
-static int file_net_append_child ( struct sbox_node_t *parent, struct sbox_node_t *child )
+/**
+ * Push directory entry into file net frame stack
+ */
+static int frame_stack_push ( struct frame_stack_t *stack, uint32_t entry )
 {
-    child->next = NULL;
-    child->prev = parent->tail;
+    size_t capacity;
+    struct net_frame_t *frames;
+    struct net_frame_t *frame;
 
-    if ( parent->tail )
+    if ( stack->depth == stack->capacity )
     {
-        parent->tail->next = child;
-    }
+        capacity = 2 * stack->capacity;
 
-    parent->tail = child;
+        if ( !( frames =
+                ( struct net_frame_t * ) realloc ( stack->frames,
+                    capacity * sizeof ( struct net_frame_t ) ) ) )
+        {
+            return -1;
+        }
 
-    if ( !parent->head )
-    {
-        parent->head = child;
+        stack->frames = frames;
+        stack->capacity = capacity;
     }
 
+    frame = stack->frames + stack->depth++;
+    frame->entry = entry;
+    frame->last = FILE_NET_NONE;
+    frame->more = 1;
+    frame->names = 0;
+    frame->cursor = 0;
+
     return 0;
 }
 
 /**
- * Get file basename from path
+ * Free file net frame stack from memory
  */
-static const char *file_net_get_basename ( const char *path )
+static void frame_stack_free ( struct frame_stack_t *stack )
 {
-    const char *backup;
-    const char *ptr;
+    free ( stack->frames );
+}
 
-    ptr = path;
+/**
+ * Find file mode position in dictionary order
+ */
+static size_t mode_dict_find ( const struct mode_dict_t *dict, uint32_t mode )
+{
+    size_t lo = 0;
+    size_t hi = dict->count;
+    size_t mid;
 
-    do
+    while ( lo < hi )
     {
-        backup = ptr;
-        ptr = strchr ( ptr, '/' );
-        if ( ptr )
+        mid = lo + ( hi - lo ) / 2;
+
+        if ( dict->modes[dict->order[mid]] < mode )
         {
-            ptr++;
+            lo = mid + 1;
+
+        } else
+        {
+            hi = mid;
         }
-    } while ( ptr );
+    }
 
-    return backup;
+    return lo;
 }
 
 /**
- * Create new file net from paths internal
+ * Get file mode index in dictionary, inserting mode if not present
  */
-struct sbox_node_t *build_file_net_in ( struct name_stack_t *stack, const char *name )
+static int mode_dict_index ( struct arena_t *arena, struct mode_dict_t *dict, uint32_t mode,
+    uint16_t * index )
 {
-    DIR *dir;
-    struct dirent *entry;
-    struct sbox_node_t *node;
-    struct sbox_node_t *child;
-    struct stat statbuf;
+    size_t pos;
+    size_t capacity;
 
-    if ( !( node = sbox_node_new ( name ) ) )
-    {
-        return NULL;
-    }
+    pos = mode_dict_find ( dict, mode );
 
-    if ( name_stack_push ( stack, name ) < 0 )
+    if ( pos < dict->count && dict->modes[dict->order[pos]] == mode )
     {
-        free_file_net ( node );
-        return NULL;
+        *index = dict->order[pos];
+        return 0;
     }
 
-    if ( stat ( stack->path, &statbuf ) < 0 )
+    if ( dict->count == FILE_NET_MODE_LIMIT )
     {
-        perror ( stack->path );
-        free_file_net ( node );
-        return NULL;
+        errno = EOVERFLOW;
+        return -1;
     }
 
-    node->mode = statbuf.st_mode;
-    node->mtime = statbuf.st_mtime;
-
-    if ( statbuf.st_mode & S_IFDIR )
+    if ( dict->count == dict->capacity )
     {
-        if ( !( dir = opendir ( stack->path ) ) )
+        capacity = dict->capacity ? 2 * dict->capacity : 16;
+
+        if ( !( dict->modes =
+                ( uint32_t * ) arena_realloc ( arena, dict->modes,
+                    dict->capacity * sizeof ( uint32_t ), capacity * sizeof ( uint32_t ) ) ) )
         {
-            perror ( stack->path );
-            free_file_net ( node );
-            return NULL;
+            return -1;
         }
 
-        while ( ( entry = readdir ( dir ) ) )
+        if ( !( dict->order =
+                ( uint16_t * ) arena_realloc ( arena, dict->order,
+                    dict->capacity * sizeof ( uint16_t ), capacity * sizeof ( uint16_t ) ) ) )
         {
-            if ( !strcmp ( entry->d_name, "." ) || !strcmp ( entry->d_name, ".." ) )
-            {
-                continue;
-            }
-
-            if ( !( child = build_file_net_in ( stack, entry->d_name ) ) )
-            {
-                free_file_net ( node );
-                return NULL;
-            }
-
-            file_net_append_child ( node, child );
+            return -1;
         }
 
-        closedir ( dir );
-
-    } else
-    {
-        node->size = statbuf.st_size;
+        dict->capacity = capacity;
     }
 
-    if ( name_stack_pop_discard ( stack ) < 0 )
-    {
-        free_file_net ( node );
-        return NULL;
-    }
+    memmove ( dict->order + pos + 1, dict->order + pos,
+        ( dict->count - pos ) * sizeof ( uint16_t ) );
+    dict->order[pos] = dict->count;
+    dict->modes[dict->count] = mode;
+    *index = dict->count++;
 
-    return node;
+    return 0;
 }
 
 /**
- * Create new file net from paths
+ * Store entry name in file net name blobs
  */
-struct sbox_node_t *build_file_net ( const char *paths[] )
+static int file_net_store_name ( struct file_net_t *net, const char *name, uint32_t * offset )
 {
-    struct sbox_node_t *root;
-    struct sbox_node_t *child;
-    struct name_stack_t stack;
+    size_t len;
+    size_t capacity;
 
-    if ( !( root = sbox_node_new ( NULL ) ) )
-    {
-        return NULL;
-    }
+    len = strlen ( name ) + 1;
 
-    if ( name_stack_new ( &stack ) < 0 )
+    if ( len > FILE_NET_BLOB_SIZE )
     {
-        free_file_net ( root );
-        return NULL;
+        errno = ENAMETOOLONG;
+        return -1;
     }
 
-    if ( !paths[0] )
+    if ( !net->blob_count || len > FILE_NET_BLOB_SIZE - net->blob_used )
     {
-        free_file_net ( root );
-        return NULL;
-    }
+        if ( net->blob_count == ( ( size_t ) 1 << ( 32 - FILE_NET_BLOB_BITS ) ) )
+        {
+            errno = EOVERFLOW;
+            return -1;
+        }
 
-    while ( paths[0] )
-    {
-        if ( !( child = build_file_net_in ( &stack, *paths ) ) )
+        if ( net->blob_count == net->blob_capacity )
         {
-            free_file_net ( root );
-            name_stack_free ( &stack );
-            return NULL;
+            capacity = net->blob_capacity ? 2 * net->blob_capacity : 16;
+
+            if ( !( net->blobs =
+                    ( char ** ) arena_realloc ( net->arena, net->blobs,
+                        net->blob_capacity * sizeof ( char * ),
+                        capacity * sizeof ( char * ) ) ) )
+            {
+                return -1;
+            }
+
+            net->blob_capacity = capacity;
         }
 
-        file_net_append_child ( root, child );
+        if ( !( net->blobs[net->blob_count] =
+                ( char * ) arena_alloc ( net->arena, FILE_NET_BLOB_SIZE ) ) )
+        {
+            return -1;
+        }
 
-        paths++;
+        net->blob_count++;
+        net->blob_used = 0;
     }
 
-    if ( stack.head || stack.tail )
-    {
-        free_file_net ( root );
-        root = NULL;
-    }
+    memcpy ( net->blobs[net->blob_count - 1] + net->blob_used, name, len );
+    *offset = ( ( net->blob_count - 1 ) << FILE_NET_BLOB_BITS ) | net->blob_used;
+    net->blob_used += len;
 
-    name_stack_free ( &stack );
+    return 0;
+}
+
+/**
+ * Get file net entry parent
+ */
+uint32_t file_net_parent ( const struct file_net_t *net, uint32_t index )
+{
+    return FILE_NET_PAGE ( net, index )->parent[FILE_NET_SLOT ( index )];
+}
+
+/**
+ * Get file net entry name
+ */
+static const char *file_net_name ( const struct file_net_t *net, uint32_t index )
+{
+    uint32_t offset;
+
+    offset = FILE_NET_PAGE ( net, index )->name[FILE_NET_SLOT ( index )];
 
-    return root;
+    return net->blobs[offset >> FILE_NET_BLOB_BITS] + ( offset & ( FILE_NET_BLOB_SIZE - 1 ) );
 }
 
 /**
- * Browse file net internal
+ * Append entry with known mode index to file net
  */
-static int file_net_iter_in ( struct sbox_node_t *node, struct name_stack_t *stack, void *context,
-    file_net_iter_callback callback )
+static int file_net_append_in ( struct file_net_t *net, uint32_t parent, const char *name,
+    uint16_t mode_index, uint64_t size, time_t mtime, uint32_t * index )
 {
-    struct sbox_node_t *ptr;
+    size_t capacity;
+    uint32_t slot;
+    uint32_t name_offset;
+    struct file_net_page_t *page;
 
-    if ( name_stack_push ( stack, node->name ) < 0 )
+    if ( net->count == FILE_NET_NONE )
     {
+        errno = EOVERFLOW;
         return -1;
     }
 
-    if ( callback ( context, node, stack->path ) < 0 )
+    if ( parent != FILE_NET_NONE && parent >= net->count )
     {
+        errno = EINVAL;
         return -1;
     }
 
-    for ( ptr = node->head; ptr; ptr = ptr->next )
+    slot = FILE_NET_SLOT ( net->count );
+
+    if ( !slot )
     {
-        if ( file_net_iter_in ( ptr, stack, context, callback ) < 0 )
+        if ( ( net->count >> FILE_NET_PAGE_BITS ) == net->page_capacity )
+        {
+            capacity = net->page_capacity ? 2 * net->page_capacity : 16;
+
+            if ( !( net->pages =
+                    ( struct file_net_page_t ** ) arena_realloc ( net->arena, net->pages,
+                        net->page_capacity * sizeof ( struct file_net_page_t * ),
+                        capacity * sizeof ( struct file_net_page_t * ) ) ) )
+            {
+                return -1;
+            }
+
+            net->page_capacity = capacity;
+        }
+
+        if ( !( FILE_NET_PAGE ( net, net->count ) =
+                ( struct file_net_page_t * ) arena_alloc ( net->arena,
+                    sizeof ( struct file_net_page_t ) ) ) )
         {
             return -1;
         }
     }
 
-    if ( name_stack_pop_discard ( stack ) < 0 )
+    if ( file_net_store_name ( net, name, &name_offset ) < 0 )
     {
         return -1;
     }
 
+    page = FILE_NET_PAGE ( net, net->count );
+    page->parent[slot] = parent;
+    page->name[slot] = name_offset;
+    page->size[slot] = size;
+    page->mtime[slot] = mtime;
+    page->mode[slot] = mode_index;
+    page->flags[slot] = 0;
+
+    if ( index )
+    {
+        *index = net->count;
+    }
+
+    net->count++;
+
     return 0;
 }
 
 /**
- * Browse file net
+ * Create new empty file net
  */
-int file_net_iter ( struct sbox_node_t *root, void *context, file_net_iter_callback callback )
+struct file_net_t *file_net_new ( struct arena_t *arena )
 {
-    struct sbox_node_t *ptr;
-    struct name_stack_t stack;
+    struct file_net_t *net;
 
-    if ( name_stack_new ( &stack ) < 0 )
+    if ( !( net = ( struct file_net_t * ) arena_alloc ( arena, sizeof ( struct file_net_t ) ) ) )
     {
-        return -1;
+        return NULL;
     }
 
-    for ( ptr = root->head; ptr; ptr = ptr->next )
-    {
-        if ( file_net_iter_in ( ptr, &stack, context, callback ) < 0 )
-        {
-            name_stack_free ( &stack );
-            return -1;
-        }
-    }
+    memset ( net, '\0', sizeof ( struct file_net_t ) );
+    net->arena = arena;
 
-    if ( stack.head || stack.tail )
+    if ( file_net_append_in ( net, FILE_NET_NONE, "", 0, 0, 0, NULL ) < 0 )
     {
-        name_stack_free ( &stack );
-        return -1;
+        return NULL;
     }
 
-    name_stack_free ( &stack );
-    return 0;
+    return net;
 }
 
 /**
- * Free file net from memory
+ * Append entry to file net, entries must be appended in pre-order
  */
-void free_file_net ( struct sbox_node_t *node )
+int file_net_append ( struct file_net_t *net, uint32_t parent, const char *name, uint32_t mode,
+    uint64_t size, time_t mtime, uint32_t * index )
 {
-    struct sbox_node_t *ptr;
-    struct sbox_node_t *next;
-
-    if ( node->name )
-    {
-        free ( node->name );
-    }
+    uint16_t mode_index;
 
-    for ( ptr = node->head; ptr; ptr = next )
+    if ( mode_dict_index ( net->arena, &net->modes, mode, &mode_index ) < 0 )
     {
-        next = ptr->next;
-        free ( ptr );
+        return -1;
     }
 
-    free ( node );
+    return file_net_append_in ( net, parent, name, mode_index, size, mtime, index );
 }
 
 /**
- * Save file net to stream internal
+ * Append hard link to earlier file net entry
  */
-static int file_net_save_in ( struct sbox_node_t *node, struct io_stream_t *io )
+int file_net_append_link ( struct file_net_t *net, uint32_t parent, const char *name,
+    uint32_t target, uint32_t * index )
 {
-    uint8_t type;
-    uint8_t opcode;
-    uint32_t net_mode;
-    uint32_t net_size;
-    const char *basename;
-    struct sbox_node_t *ptr;
-
-    if ( node->mode & S_IFDIR )
-    {
-        type = node->head ? 'd' : 'e';
+    uint32_t slot;
+    uint32_t link;
+    struct file_net_page_t *page;
 
-    } else
+    if ( target == FILE_NET_ROOT || target >= net->count )
     {
-        type = 'f';
+        errno = EINVAL;
+        return -1;
     }
 
-    opcode = node->next ? toupper ( type ) : type;
+    page = FILE_NET_PAGE ( net, target );
+    slot = FILE_NET_SLOT ( target );
 
-    if ( io->write_complete ( io, &opcode, sizeof ( opcode ) ) < 0 )
+    if ( page->flags[slot] & ( FILE_NET_FLAG_LINK | FILE_NET_FLAG_COPY )
+        || !S_ISREG ( net->modes.modes[page->mode[slot]] ) )
     {
+        errno = EINVAL;
         return -1;
     }
 
-    net_mode = htonl ( node->mode );
-
-    if ( io->write_complete ( io, &net_mode, sizeof ( net_mode ) ) < 0 )
+    if ( file_net_append_in ( net, parent, name, page->mode[slot], target, page->mtime[slot],
+            &link ) < 0 )
     {
         return -1;
     }
 
-    if ( type == 'f' )
-    {
-        net_size = htonl ( node->size );
+    page->flags[slot] |= FILE_NET_FLAG_TARGET;
+    FILE_NET_PAGE ( net, link )->flags[FILE_NET_SLOT ( link )] = FILE_NET_FLAG_LINK;
 
-        if ( io->write_complete ( io, &net_size, sizeof ( net_size ) ) < 0 )
-        {
-            return -1;
-        }
+    if ( index )
+    {
+        *index = link;
     }
 
-    basename = file_net_get_basename ( node->name );
+    return 0;
+}
+
+/**
+ * Turn file net entry into copy of earlier entry with identical content
+ */
+int file_net_set_copy ( struct file_net_t *net, uint32_t index, uint32_t target )
+{
+    uint32_t slot;
+    uint32_t target_slot;
+    struct file_net_page_t *page;
+    struct file_net_page_t *target_page;
 
-    if ( !*basename || strchr ( basename, '/' ) || !strcmp ( basename, ".." ) )
+    if ( target == FILE_NET_ROOT || target >= index || index >= net->count )
     {
-        basename = ".";
+        errno = EINVAL;
+        return -1;
     }
 
-    if ( io->write_complete ( io, basename, strlen ( basename ) + 1 ) < 0 )
+    page = FILE_NET_PAGE ( net, index );
+    slot = FILE_NET_SLOT ( index );
+    target_page = FILE_NET_PAGE ( net, target );
+    target_slot = FILE_NET_SLOT ( target );
+
+    if ( page->flags[slot] || !S_ISREG ( net->modes.modes[page->mode[slot]] )
+        || target_page->flags[target_slot] & ( FILE_NET_FLAG_LINK | FILE_NET_FLAG_COPY )
+        || !S_ISREG ( net->modes.modes[target_page->mode[target_slot]] ) )
     {
+        errno = EINVAL;
         return -1;
     }
 
-    for ( ptr = node->head; ptr; ptr = ptr->next )
-    {
-        if ( file_net_save_in ( ptr, io ) < 0 )
-        {
-            return -1;
-        }
-    }
+    page->size[slot] = target;
+    page->flags[slot] = FILE_NET_FLAG_COPY;
+    target_page->flags[target_slot] |= FILE_NET_FLAG_TARGET;
 
     return 0;
 }
 
 /**
- * Save file net to stream
+ * Get file net entry, links and copies report size of their target
  */
-int file_net_save ( struct sbox_node_t *root, struct io_stream_t *io )
+void file_net_get ( const struct file_net_t *net, uint32_t index, struct sbox_node_t *node )
 {
-    struct sbox_node_t *ptr;
+    uint32_t slot;
+    const struct file_net_page_t *page;
+
+    page = FILE_NET_PAGE ( net, index );
+    slot = FILE_NET_SLOT ( index );
 
-    for ( ptr = root->head; ptr; ptr = ptr->next )
+    node->index = index;
+    node->flags = page->flags[slot];
+    node->link = FILE_NET_NONE;
+    node->mode = index == FILE_NET_ROOT ? S_IFDIR : net->modes.modes[page->mode[slot]];
+    node->mtime = page->mtime[slot];
+    node->size = page->size[slot];
+    node->name = file_net_name ( net, index );
+
+    if ( node->flags & ( FILE_NET_FLAG_LINK | FILE_NET_FLAG_COPY ) )
     {
-        if ( file_net_save_in ( ptr, io ) < 0 )
-        {
+        node->link = node->size;
+        node->size = FILE_NET_PAGE ( net, node->link )->size[FILE_NET_SLOT ( node->link )];
+    }
+}
+
+/**
+ * Get file basename from path
+ */
+static const char *file_net_get_basename ( const char *path )
+{
+    const char *backup;
+    const char *ptr;
+
+    ptr = path;
+
+    do
+    {
+        backup = ptr;
+        ptr = strchr ( ptr, '/' );
+        if ( ptr )
+        {
+            ptr++;
+        }
+    } while ( ptr );
+
+    return backup;
+}
+
+/**
+ * Read directory entry names into buffer, list ends with an empty name
+ */
+static int build_file_net_read_dir ( int fd, const char *path, struct ext_buffer_t *names )
+{
+    DIR *dir;
+    struct dirent *entry;
+
+    if ( !( dir = fdopendir ( fd ) ) )
+    {
+        perror ( path );
+        close ( fd );
+        return -1;
+    }
+
+    while ( ( entry = readdir ( dir ) ) )
+    {
+        if ( !strcmp ( entry->d_name, "." ) || !strcmp ( entry->d_name, ".." ) )
+        {
+            continue;
+        }
+
+        if ( ext_buffer_append_bytes ( names, entry->d_name, strlen ( entry->d_name ) + 1 ) < 0 )
+        {
+            closedir ( dir );
+            return -1;
+        }
+    }
+
+    closedir ( dir );
+
+    return ext_buffer_append ( names, '\0' );
+}
+
+/**
+ * Create new hard link map
+ */
+static void link_map_new ( struct link_map_t *map )
+{
+    map->count = 0;
+    map->mask = 0;
+    map->slots = NULL;
+}
+
+/**
+ * Find slot of inode in hard link map
+ */
+static struct link_slot_t *link_map_slot ( const struct link_map_t *map, dev_t dev, ino_t ino )
+{
+    size_t slot;
+    struct link_slot_t *ptr;
+
+    slot = ( ( uint64_t ) ino * 0x9e3779b97f4a7c15ULL ^ ( uint64_t ) dev ) & map->mask;
+
+    for ( ;; )
+    {
+        ptr = map->slots + slot;
+
+        if ( ptr->entry == FILE_NET_NONE || ( ptr->dev == dev && ptr->ino == ino ) )
+        {
+            return ptr;
+        }
+
+        slot = ( slot + 1 ) & map->mask;
+    }
+}
+
+/**
+ * Find first entry of inode or remember entry as first one
+ */
+static int link_map_find ( struct link_map_t *map, dev_t dev, ino_t ino, uint32_t entry,
+    uint32_t * first )
+{
+    size_t i;
+    size_t size;
+    struct link_map_t grown;
+    struct link_slot_t *slot;
+
+    if ( 2 * ( map->count + 1 ) > map->mask + 1 )
+    {
+        size = map->slots ? 2 * ( map->mask + 1 ) : 256;
+
+        if ( !( grown.slots =
+                ( struct link_slot_t * ) malloc ( size * sizeof ( struct link_slot_t ) ) ) )
+        {
+            return -1;
+        }
+
+        grown.mask = size - 1;
+        grown.count = map->count;
+
+        for ( i = 0; i < size; i++ )
+        {
+            grown.slots[i].entry = FILE_NET_NONE;
+        }
+
+        for ( i = 0; map->slots && i <= map->mask; i++ )
+        {
+            if ( map->slots[i].entry != FILE_NET_NONE )
+            {
+                *link_map_slot ( &grown, map->slots[i].dev, map->slots[i].ino ) = map->slots[i];
+            }
+        }
+
+        free ( map->slots );
+        *map = grown;
+    }
+
+    slot = link_map_slot ( map, dev, ino );
+
+    if ( slot->entry == FILE_NET_NONE )
+    {
+        slot->dev = dev;
+        slot->ino = ino;
+        slot->entry = entry;
+        map->count++;
+    }
+
+    *first = slot->entry;
+
+    return 0;
+}
+
+/**
+ * Free hard link map from memory
+ */
+static void link_map_free ( struct link_map_t *map )
+{
+    free ( map->slots );
+}
+
+/**
+ * Append stat'ed path to file net, files sharing an inode become links
+ */
+static int build_file_net_append ( struct net_builder_t *builder, uint32_t parent,
+    const char *name, const struct stat *statbuf, uint32_t * index )
+{
+    uint32_t first;
+
+    if ( S_ISREG ( statbuf->st_mode ) && statbuf->st_nlink > 1 )
+    {
+        if ( link_map_find ( &builder->links, statbuf->st_dev, statbuf->st_ino,
+                builder->net->count, &first ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( first != builder->net->count )
+        {
+            return file_net_append_link ( builder->net, parent, name, first, index );
+        }
+    }
+
+    return file_net_append ( builder->net, parent, name, statbuf->st_mode,
+        statbuf->st_mode & S_IFDIR ? 0 : statbuf->st_size, statbuf->st_mtime, index );
+}
+
+/**
+ * Add path to file net, directories are pushed onto frame stack and become current
+ */
+static int build_file_net_in ( struct net_builder_t *builder, uint32_t parent, const char *name )
+{
+    int fd;
+    int list_fd;
+    size_t base;
+    uint32_t index;
+    struct stat statbuf;
+    struct net_frame_t *frame;
+
+    if ( name_stack_push ( &builder->stack, name, FILE_NET_NONE ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( fstatat ( builder->dir_fd, name, &statbuf, 0 ) < 0 )
+    {
+        perror ( builder->stack.path );
+        return -1;
+    }
+
+    /* Name may point into names buffer, store it before buffer grows */
+    if ( build_file_net_append ( builder, parent, name, &statbuf, &index ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( !( statbuf.st_mode & S_IFDIR ) )
+    {
+        return name_stack_pop_discard ( &builder->stack );
+    }
+
+    if ( ( fd = openat ( builder->dir_fd, name, O_RDONLY | O_DIRECTORY ) ) < 0 )
+    {
+        perror ( builder->stack.path );
+        return -1;
+    }
+
+    if ( ( list_fd = dup ( fd ) ) < 0 )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    base = builder->names.length;
+
+    if ( build_file_net_read_dir ( list_fd, builder->stack.path, &builder->names ) < 0 )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    if ( frame_stack_push ( &builder->frames, index ) < 0 )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    frame = builder->frames.frames + builder->frames.depth - 1;
+    frame->names = base;
+    frame->cursor = base;
+    frame->dev = statbuf.st_dev;
+    frame->ino = statbuf.st_ino;
+
+    if ( builder->dir_fd != AT_FDCWD )
+    {
+        close ( builder->dir_fd );
+    }
+
+    builder->dir_fd = fd;
+
+    return 0;
+}
+
+/**
+ * Leave current directory, reopening its parent
+ */
+static int build_file_net_leave ( struct net_builder_t *builder )
+{
+    int fd;
+    struct stat statbuf;
+    const struct net_frame_t *frame;
+
+    builder->frames.depth--;
+
+    if ( name_stack_pop_discard ( &builder->stack ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( !builder->frames.depth )
+    {
+        close ( builder->dir_fd );
+        builder->dir_fd = AT_FDCWD;
+        return 0;
+    }
+
+    /* Parent is the directory above unless it was reached through a symlink */
+    frame = builder->frames.frames + builder->frames.depth - 1;
+
+    if ( ( fd = openat ( builder->dir_fd, "..", O_RDONLY | O_DIRECTORY ) ) >= 0 )
+    {
+        if ( fstat ( fd, &statbuf ) < 0 || statbuf.st_dev != frame->dev
+            || statbuf.st_ino != frame->ino )
+        {
+            close ( fd );
+            fd = -1;
+        }
+    }
+
+    close ( builder->dir_fd );
+
+    if ( fd < 0 && ( fd = open ( builder->stack.path, O_RDONLY | O_DIRECTORY ) ) < 0 )
+    {
+        perror ( builder->stack.path );
+        builder->dir_fd = AT_FDCWD;
+        return -1;
+    }
+
+    builder->dir_fd = fd;
+
+    return 0;
+}
+
+/**
+ * Walk directories pushed onto frame stack until it is empty
+ */
+static int build_file_net_walk ( struct net_builder_t *builder )
+{
+    const char *name;
+    struct net_frame_t *frame;
+
+    while ( builder->frames.depth )
+    {
+        frame = builder->frames.frames + builder->frames.depth - 1;
+        name = ( const char * ) builder->names.bytes + frame->cursor;
+
+        if ( !*name )
+        {
+            builder->names.length = frame->names;
+
+            if ( build_file_net_leave ( builder ) < 0 )
+            {
+                return -1;
+            }
+
+            continue;
+        }
+
+        frame->cursor += strlen ( name ) + 1;
+
+        if ( build_file_net_in ( builder, frame->entry, name ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Free file net builder
+ */
+static void build_file_net_free ( struct net_builder_t *builder )
+{
+    if ( builder->dir_fd != AT_FDCWD )
+    {
+        close ( builder->dir_fd );
+    }
+
+    link_map_free ( &builder->links );
+    ext_buffer_free ( &builder->names );
+    frame_stack_free ( &builder->frames );
+    name_stack_free ( &builder->stack );
+}
+
+/**
+ * Create new file net from paths
+ */
+struct file_net_t *build_file_net ( struct arena_t *arena, const char *paths[] )
+{
+    struct file_net_t *net;
+    struct net_builder_t builder;
+
+    if ( !paths[0] )
+    {
+        return NULL;
+    }
+
+    if ( !( net = file_net_new ( arena ) ) )
+    {
+        return NULL;
+    }
+
+    builder.net = net;
+    builder.dir_fd = AT_FDCWD;
+
+    if ( name_stack_new ( &builder.stack ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( frame_stack_new ( &builder.frames ) < 0 )
+    {
+        name_stack_free ( &builder.stack );
+        return NULL;
+    }
+
+    if ( ext_buffer_new ( &builder.names ) < 0 )
+    {
+        frame_stack_free ( &builder.frames );
+        name_stack_free ( &builder.stack );
+        return NULL;
+    }
+
+    link_map_new ( &builder.links );
+
+    while ( paths[0] )
+    {
+        if ( build_file_net_in ( &builder, FILE_NET_ROOT, *paths ) < 0
+            || build_file_net_walk ( &builder ) < 0 )
+        {
+            build_file_net_free ( &builder );
+            return NULL;
+        }
+
+        paths++;
+    }
+
+    if ( builder.stack.depth )
+    {
+        net = NULL;
+    }
+
+    build_file_net_free ( &builder );
+
+    return net;
+}
+
+/**
+ * Browse file net
+ */
+int file_net_iter ( const struct file_net_t *net, void *context, file_net_iter_callback callback )
+{
+    uint32_t i;
+    uint32_t parent;
+    struct sbox_node_t node;
+    struct name_stack_t stack;
+
+    if ( name_stack_new ( &stack ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = FILE_NET_ROOT + 1; i < net->count; i++ )
+    {
+        parent = file_net_parent ( net, i );
+
+        while ( stack.depth && stack.entries[stack.depth - 1] != parent )
+        {
+            name_stack_pop_discard ( &stack );
+        }
+
+        if ( !stack.depth && parent != FILE_NET_ROOT )
+        {
+            name_stack_free ( &stack );
+            errno = EINVAL;
+            return -1;
+        }
+
+        file_net_get ( net, i, &node );
+
+        if ( name_stack_push ( &stack, node.name, i ) < 0 )
+        {
+            name_stack_free ( &stack );
+            return -1;
+        }
+
+        if ( callback ( context, &node, stack.path ) < 0 )
+        {
+            name_stack_free ( &stack );
+            return -1;
+        }
+    }
+
+    name_stack_free ( &stack );
+    return 0;
+}
+
+/**
+ * Check if node content is stored in archive body
+ */
+int file_net_has_body ( const struct sbox_node_t *node )
+{
+    return node->mode && !( node->mode & S_IFDIR ) && node->link == FILE_NET_NONE;
+}
+
+/**
+ * Get node basename suitable for storing in archive
+ */
+const char *file_net_get_safe_basename ( const char *name )
+{
+    const char *basename;
+
+    basename = file_net_get_basename ( name );
+
+    if ( !*basename || strchr ( basename, '/' ) || !strcmp ( basename, ".." ) )
+    {
+        return ".";
+    }
+
+    return basename;
+}
+
+/**
+ * Get length of common prefix of two names
+ */
+static size_t common_prefix_length ( const char *a, const char *b )
+{
+    size_t len = 0;
+
+    while ( a[len] && a[len] == b[len] )
+    {
+        len++;
+    }
+
+    return len;
+}
+
+/**
+ * Map signed integer onto unsigned one, small magnitudes stay small
+ */
+static uint64_t zigzag_encode ( int64_t value )
+{
+    return ( ( uint64_t ) value << 1 ) ^ ( uint64_t ) ( value >> 63 );
+}
+
+/**
+ * Map unsigned integer back onto signed one
+ */
+static int64_t zigzag_decode ( uint64_t value )
+{
+    return ( int64_t ) ( value >> 1 ) ^ -( int64_t ) ( value & 1 );
+}
+
+/**
+ * Mark file net entries followed by a sibling
+ */
+static uint8_t *file_net_mark_siblings ( const struct file_net_t *net )
+{
+    uint32_t i;
+    uint32_t parent;
+    uint8_t *seen;
+    uint8_t *marks;
+
+    if ( !( seen = ( uint8_t * ) calloc ( net->count / 8 + 1, 1 ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( marks = ( uint8_t * ) calloc ( net->count / 8 + 1, 1 ) ) )
+    {
+        free ( seen );
+        return NULL;
+    }
+
+    for ( i = net->count - 1; i > FILE_NET_ROOT; i-- )
+    {
+        parent = file_net_parent ( net, i );
+
+        if ( seen[parent / 8] & ( 1 << ( parent % 8 ) ) )
+        {
+            marks[i / 8] |= 1 << ( i % 8 );
+        }
+
+        seen[parent / 8] |= 1 << ( parent % 8 );
+    }
+
+    free ( seen );
+
+    return marks;
+}
+
+/**
+ * Save file net entry to buffer
+ */
+static int file_net_save_entry ( const struct file_net_t *net, uint32_t index, int has_next,
+    const char *prev_name, int64_t * prev_mtime, struct ext_buffer_t *buffer )
+{
+    uint8_t type;
+    size_t shared;
+    const char *basename;
+    struct sbox_node_t node;
+
+    file_net_get ( net, index, &node );
+
+    if ( !node.mode )
+    {
+        type = 'x';
+
+    } else if ( node.flags & FILE_NET_FLAG_LINK )
+    {
+        type = 'h';
+
+    } else if ( node.flags & FILE_NET_FLAG_COPY )
+    {
+        type = 'c';
+
+    } else if ( node.mode & S_IFDIR )
+    {
+        type = index + 1 < net->count
+            && file_net_parent ( net, index + 1 ) == index ? 'd' : 'e';
+
+    } else
+    {
+        type = 'f';
+    }
+
+    if ( ext_buffer_append ( buffer, has_next ? toupper ( type ) : type ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( ext_buffer_append_varint ( buffer,
+            FILE_NET_PAGE ( net, index )->mode[FILE_NET_SLOT ( index )] ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( type == 'h' || type == 'c' )
+    {
+        if ( ext_buffer_append_varint ( buffer, index - node.link ) < 0 )
+        {
             return -1;
         }
     }
 
-    return 0;
-}
+    if ( type == 'f' && ext_buffer_append_varint ( buffer, node.size ) < 0 )
+    {
+        return -1;
+    }
 
-/**
- * Create new expandable buffer
- */
-static int ext_buffer_new ( struct ext_buffer_t *buffer )
-{
-    buffer->length = 0;
-    buffer->capacity = 256;
+    if ( type == 'f' || type == 'c' )
+    {
+        if ( ext_buffer_append_varint ( buffer,
+                zigzag_encode ( ( uint64_t ) node.mtime - ( uint64_t ) * prev_mtime ) ) < 0 )
+        {
+            return -1;
+        }
+
+        *prev_mtime = node.mtime;
+    }
+
+    basename = file_net_get_safe_basename ( node.name );
+    shared = prev_name ? common_prefix_length ( prev_name, basename ) : 0;
+
+    if ( ext_buffer_append_varint ( buffer, shared ) < 0 )
+    {
+        return -1;
+    }
 
-    if ( !( buffer->bytes = ( uint8_t * ) malloc ( buffer->capacity ) ) )
+    if ( ext_buffer_append_bytes ( buffer, basename + shared,
+            strlen ( basename + shared ) + 1 ) < 0 )
     {
         return -1;
     }
@@ -566,171 +1310,496 @@ static int ext_buffer_new ( struct ext_buffer_t *buffer )
 }
 
 /**
- * Clear expandable buffer content
+ * Save file net entries to buffer
  */
-static void ext_buffer_clear ( struct ext_buffer_t *buffer )
+static int file_net_save_entries ( const struct file_net_t *net, const uint8_t * marks,
+    struct ext_buffer_t *buffer )
 {
-    buffer->length = 0;
-}
+    uint32_t i;
+    uint32_t parent;
+    int64_t prev_mtime = 0;
+    const char *prev_name;
+    struct net_frame_t *frame;
+    struct frame_stack_t stack;
+
+    if ( frame_stack_new ( &stack ) < 0 )
+    {
+        return -1;
+    }
 
-/**
- * Append one byte to expandable buffer
- */
-static int ext_buffer_append ( struct ext_buffer_t *buffer, uint8_t byte )
-{
-    uint8_t *backup;
+    if ( frame_stack_push ( &stack, FILE_NET_ROOT ) < 0 )
+    {
+        frame_stack_free ( &stack );
+        return -1;
+    }
 
-    if ( buffer->length + 1 >= buffer->capacity )
+    for ( i = FILE_NET_ROOT + 1; i < net->count; i++ )
     {
-        buffer->capacity = 2 * ( buffer->length + 1 );
-        backup = buffer->bytes;
+        parent = file_net_parent ( net, i );
+
+        while ( stack.depth && stack.frames[stack.depth - 1].entry != parent )
+        {
+            stack.depth--;
+        }
+
+        if ( !stack.depth )
+        {
+            frame_stack_free ( &stack );
+            errno = EINVAL;
+            return -1;
+        }
+
+        frame = stack.frames + stack.depth - 1;
+        prev_name = frame->last != FILE_NET_NONE
+            ? file_net_get_safe_basename ( file_net_name ( net, frame->last ) ) : NULL;
+        frame->last = i;
+
+        if ( file_net_save_entry ( net, i, marks[i / 8] & ( 1 << ( i % 8 ) ), prev_name,
+                &prev_mtime, buffer ) < 0 )
+        {
+            frame_stack_free ( &stack );
+            return -1;
+        }
 
-        if ( !( buffer->bytes = realloc ( buffer->bytes, buffer->capacity ) ) )
+        if ( frame_stack_push ( &stack, i ) < 0 )
         {
-            free ( backup );
+            frame_stack_free ( &stack );
             return -1;
         }
     }
 
-    buffer->bytes[buffer->length++] = byte;
+    frame_stack_free ( &stack );
+
     return 0;
 }
 
 /**
- * Free expandable buffer from memory
+ * Save file net to stream
  */
-static void ext_buffer_free ( struct ext_buffer_t *buffer )
+int file_net_save ( const struct file_net_t *net, struct io_stream_t *io )
 {
-    free ( buffer->bytes );
+    size_t i;
+    size_t prefix_len;
+    uint8_t prefix[VARINT_LIMIT];
+    uint8_t *marks;
+    struct ext_buffer_t buffer;
+
+    if ( ext_buffer_new ( &buffer ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( ext_buffer_append_varint ( &buffer, net->modes.count ) < 0 )
+    {
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    for ( i = 0; i < net->modes.count; i++ )
+    {
+        if ( ext_buffer_append_varint ( &buffer, net->modes.modes[i] ) < 0 )
+        {
+            ext_buffer_free ( &buffer );
+            return -1;
+        }
+    }
+
+    if ( !( marks = file_net_mark_siblings ( net ) ) )
+    {
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    if ( file_net_save_entries ( net, marks, &buffer ) < 0 )
+    {
+        free ( marks );
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    free ( marks );
+
+    prefix_len = varint_encode ( prefix, buffer.length );
+
+    if ( io->write_complete ( io, prefix, prefix_len ) < 0 )
+    {
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    if ( io->write_complete ( io, buffer.bytes, buffer.length ) < 0 )
+    {
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    ext_buffer_free ( &buffer );
+
+    return 0;
 }
 
 /**
- * Load file net from stream internal
+ * Load file net entry from reader
  */
-struct sbox_node_t *file_net_load_in ( struct io_stream_t *io, struct ext_buffer_t *buffer,
-    int *has_sibling )
+static int file_net_load_entry ( struct file_net_t *net, struct net_reader_t *reader,
+    struct net_frame_t *frame, struct ext_buffer_t *buffer, int64_t * prev_mtime, int *type )
 {
-    int type;
-    int has_next = 1;
     uint8_t byte;
-    uint32_t net_mode;
-    uint32_t net_size;
-    char *name;
-    struct sbox_node_t *node;
-    struct sbox_node_t *child;
+    uint64_t mode_index;
+    uint64_t size = 0;
+    uint64_t mtime_delta;
+    uint64_t link_delta = 0;
+    uint32_t target;
+    int64_t mtime = 0;
+    uint64_t shared;
+    size_t suffix_len;
+    const char *name;
+    const char *prev_name;
+    const uint8_t *suffix_end;
+
+    if ( reader->ptr >= reader->end )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    byte = *reader->ptr++;
+
+    frame->more = byte == toupper ( byte );
+
+    *type = tolower ( byte );
 
-    if ( io->read_complete ( io, &byte, sizeof ( byte ) ) < 0 )
+    if ( *type != 'f' && *type != 'd' && *type != 'e' && *type != 'x' && *type != 'h'
+        && *type != 'c' )
     {
-        return NULL;
+        errno = EINVAL;
+        return -1;
     }
 
-    *has_sibling = byte == toupper ( byte );
+    if ( varint_decode ( &reader->ptr, reader->end, &mode_index ) < 0 )
+    {
+        return -1;
+    }
 
-    type = tolower ( byte );
+    if ( mode_index >= net->modes.count
+        || ( *type == 'x' ) != !net->modes.modes[mode_index] )
+    {
+        errno = EINVAL;
+        return -1;
+    }
 
-    if ( io->read_complete ( io, &net_mode, sizeof ( net_mode ) ) < 0 )
+    /* Directory test matches the one save and unpack use */
+    if ( ( *type == 'd' || *type == 'e' || *type == 'f' )
+        && ( *type != 'f' ) != !!( net->modes.modes[mode_index] & S_IFDIR ) )
     {
-        return NULL;
+        errno = EINVAL;
+        return -1;
     }
 
-    if ( type == 'f' )
+    if ( *type == 'h' || *type == 'c' )
     {
-        if ( io->read_complete ( io, &net_size, sizeof ( net_size ) ) < 0 )
+        if ( varint_decode ( &reader->ptr, reader->end, &link_delta ) < 0 )
         {
-            return NULL;
+            return -1;
+        }
+
+        if ( !link_delta || link_delta >= net->count )
+        {
+            errno = EINVAL;
+            return -1;
         }
     }
 
-    ext_buffer_clear ( buffer );
+    if ( *type == 'f' && varint_decode ( &reader->ptr, reader->end, &size ) < 0 )
+    {
+        return -1;
+    }
 
-    do
+    if ( *type == 'f' || *type == 'c' )
     {
-        if ( io->read_complete ( io, &byte, sizeof ( byte ) ) < 0 )
+        if ( varint_decode ( &reader->ptr, reader->end, &mtime_delta ) < 0 )
         {
-            return NULL;
+            return -1;
         }
 
-        if ( ext_buffer_append ( buffer, byte ) < 0 )
+        mtime = ( uint64_t ) * prev_mtime + ( uint64_t ) zigzag_decode ( mtime_delta );
+        *prev_mtime = mtime;
+    }
+
+    if ( varint_decode ( &reader->ptr, reader->end, &shared ) < 0 )
+    {
+        return -1;
+    }
+
+    prev_name = frame->last != FILE_NET_NONE ? file_net_name ( net, frame->last ) : "";
+
+    if ( shared > strlen ( prev_name ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( !( suffix_end =
+            ( const uint8_t * ) memchr ( reader->ptr, '\0', reader->end - reader->ptr ) ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    suffix_len = suffix_end - reader->ptr + 1;
+
+    if ( shared )
+    {
+        ext_buffer_clear ( buffer );
+
+        if ( ext_buffer_append_bytes ( buffer, prev_name, shared ) < 0
+            || ext_buffer_append_bytes ( buffer, reader->ptr, suffix_len ) < 0 )
         {
-            return NULL;
+            return -1;
         }
 
-    } while ( byte );
+        name = ( const char * ) buffer->bytes;
+
+    } else
+    {
+        name = ( const char * ) reader->ptr;
+    }
+
+    reader->ptr += suffix_len;
 
-    name = ( char * ) buffer->bytes;
+    if ( !*name )
+    {
+        errno = EINVAL;
+        return -1;
+    }
 
     if ( !strcmp ( name, ".." ) || strchr ( name, '/' ) )
     {
-        node = sbox_node_new ( "_name_restricted_" );
+        name = "_name_restricted_";
+    }
 
-    } else
+    if ( *type == 'h' )
     {
-        node = sbox_node_new ( name );
+        return file_net_append_link ( net, frame->entry, name, net->count - link_delta,
+            &frame->last );
     }
 
-    if ( !node )
+    if ( *type == 'c' )
     {
-        return NULL;
+        target = net->count - link_delta;
+
+        if ( file_net_append_in ( net, frame->entry, name, mode_index, 0, mtime,
+                &frame->last ) < 0 )
+        {
+            return -1;
+        }
+
+        return file_net_set_copy ( net, frame->last, target );
+    }
+
+    return file_net_append_in ( net, frame->entry, name, mode_index, size, mtime,
+        &frame->last );
+}
+
+/**
+ * Load file mode dictionary from reader
+ */
+static int file_net_load_modes ( struct file_net_t *net, struct net_reader_t *reader )
+{
+    size_t i;
+    uint64_t count;
+    uint64_t mode;
+    uint16_t index;
+
+    if ( varint_decode ( &reader->ptr, reader->end, &count ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( varint_decode ( &reader->ptr, reader->end, &mode ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( mode > UINT32_MAX )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( mode_dict_index ( net->arena, &net->modes, mode, &index ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( index != i )
+        {
+            errno = EINVAL;
+            return -1;
+        }
     }
 
-    node->mode = ntohl ( net_mode );
+    return 0;
+}
+
+/**
+ * Load file net entries from reader
+ */
+static int file_net_load_entries ( struct file_net_t *net, struct net_reader_t *reader,
+    struct ext_buffer_t *buffer )
+{
+    int type;
+    int64_t prev_mtime = 0;
+    struct net_frame_t *frame;
+    struct frame_stack_t stack;
+
+    if ( frame_stack_new ( &stack ) < 0 )
+    {
+        return -1;
+    }
 
-    if ( type == 'f' )
+    if ( frame_stack_push ( &stack, FILE_NET_ROOT ) < 0 )
     {
-        node->size = ntohl ( net_size );
+        frame_stack_free ( &stack );
+        return -1;
     }
 
-    if ( type == 'd' )
+    /* Net without entries has an empty entry list */
+    stack.frames[0].more = reader->ptr < reader->end;
+
+    while ( stack.depth )
     {
-        while ( has_next )
+        frame = stack.frames + stack.depth - 1;
+
+        if ( !frame->more )
+        {
+            stack.depth--;
+            continue;
+        }
+
+        if ( file_net_load_entry ( net, reader, frame, buffer, &prev_mtime, &type ) < 0 )
+        {
+            frame_stack_free ( &stack );
+            return -1;
+        }
+
+        if ( type == 'd' )
         {
-            if ( !( child = file_net_load_in ( io, buffer, &has_next ) ) )
+            if ( frame_stack_push ( &stack, frame->last ) < 0 )
             {
-                free_file_net ( node );
-                return NULL;
+                frame_stack_free ( &stack );
+                return -1;
             }
-
-            file_net_append_child ( node, child );
         }
     }
 
-    return node;
+    frame_stack_free ( &stack );
+
+    return 0;
 }
 
 /**
- * Load file net from stream
+ * Load file net from memory block
  */
-struct sbox_node_t *file_net_load ( struct io_stream_t *io )
+static struct file_net_t *file_net_load_block ( struct arena_t *arena, const uint8_t * bytes,
+    size_t length )
 {
-    int has_sibling = 1;
-    struct sbox_node_t *root;
-    struct sbox_node_t *child;
+    struct file_net_t *net;
     struct ext_buffer_t buffer;
+    struct net_reader_t reader;
 
-    if ( !( root = sbox_node_new ( NULL ) ) )
+    reader.ptr = bytes;
+    reader.end = bytes + length;
+
+    if ( !( net = file_net_new ( arena ) ) )
+    {
+        return NULL;
+    }
+
+    if ( file_net_load_modes ( net, &reader ) < 0 )
     {
         return NULL;
     }
 
     if ( ext_buffer_new ( &buffer ) < 0 )
     {
-        free_file_net ( root );
         return NULL;
     }
 
-    while ( has_sibling )
+    if ( file_net_load_entries ( net, &reader, &buffer ) < 0 )
+    {
+        ext_buffer_free ( &buffer );
+        return NULL;
+    }
+
+    ext_buffer_free ( &buffer );
+
+    if ( reader.ptr != reader.end )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return net;
+}
+
+/**
+ * Load file net from stream
+ */
+struct file_net_t *file_net_load ( struct arena_t *arena, struct io_stream_t *io )
+{
+    size_t len;
+    size_t offset;
+    uint64_t length;
+    uint8_t *bytes;
+    uint8_t *grown;
+    struct file_net_t *net;
+
+    if ( stream_read_varint ( io, &length ) < 0 )
+    {
+        return NULL;
+    }
+
+    /* Bound keeps allocation size math far from wrapping, also on 32-bit size_t */
+    if ( length > MIN ( FILE_NET_LENGTH_LIMIT, SIZE_MAX / 2 ) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( !( bytes = ( uint8_t * ) budget_spill_alloc ( MIN ( length, INDEX_BLOCK_SIZE ) ) ) )
     {
-        if ( !( child = file_net_load_in ( io, &buffer, &has_sibling ) ) )
+        return NULL;
+    }
+
+    /* Buffer grows with data read, so short input fails before length is allocated */
+    for ( offset = 0; offset < length; offset += len )
+    {
+        len = MIN ( length - offset, MAX ( offset, INDEX_BLOCK_SIZE ) );
+
+        if ( offset )
         {
-            ext_buffer_free ( &buffer );
-            free_file_net ( root );
-            return NULL;
+            if ( !( grown = ( uint8_t * ) budget_spill_realloc ( bytes, offset + len ) ) )
+            {
+                budget_free ( bytes );
+                return NULL;
+            }
+
+            bytes = grown;
         }
 
-        file_net_append_child ( root, child );
+        if ( io->read_complete ( io, bytes + offset, len ) < 0 )
+        {
+            budget_free ( bytes );
+            return NULL;
+        }
     }
 
-    ext_buffer_free ( &buffer );
+    net = file_net_load_block ( arena, bytes, length );
+
+    budget_free ( bytes );
 
-    return root;
+    return net;
 }
@@ -0,0 +1,299 @@
+/* ------------------------------------------------------------------
+ * SBox - Content Hashing
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <pthread.h>
+
+#define XXH64_PRIME_1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME_3 0x165667B19E3779F9ULL
+#define XXH64_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME_5 0x27D4EB2F165667C5ULL
+
+/**
+ * Rotate 64-bit value left
+ */
+static uint64_t xxh64_rotl ( uint64_t value, int bits )
+{
+    return ( value << bits ) | ( value >> ( 64 - bits ) );
+}
+
+/**
+ * Read little endian 64-bit value
+ */
+static uint64_t xxh64_read64 ( const uint8_t * bytes )
+{
+    return ( uint64_t ) bytes[0] | ( uint64_t ) bytes[1] << 8 | ( uint64_t ) bytes[2] << 16
+        | ( uint64_t ) bytes[3] << 24 | ( uint64_t ) bytes[4] << 32 | ( uint64_t ) bytes[5] << 40
+        | ( uint64_t ) bytes[6] << 48 | ( uint64_t ) bytes[7] << 56;
+}
+
+/**
+ * Read little endian 32-bit value
+ */
+static uint64_t xxh64_read32 ( const uint8_t * bytes )
+{
+    return ( uint64_t ) bytes[0] | ( uint64_t ) bytes[1] << 8 | ( uint64_t ) bytes[2] << 16
+        | ( uint64_t ) bytes[3] << 24;
+}
+
+/**
+ * Mix one input lane into accumulator
+ */
+static uint64_t xxh64_round ( uint64_t acc, uint64_t input )
+{
+    acc += input * XXH64_PRIME_2;
+    acc = xxh64_rotl ( acc, 31 );
+
+    return acc * XXH64_PRIME_1;
+}
+
+/**
+ * Merge accumulator into final hash
+ */
+static uint64_t xxh64_merge_round ( uint64_t hash, uint64_t acc )
+{
+    hash ^= xxh64_round ( 0, acc );
+
+    return hash * XXH64_PRIME_1 + XXH64_PRIME_4;
+}
+
+/**
+ * Mix one 32-byte stripe into accumulators
+ */
+static void xxh64_stripe ( uint64_t acc[4], const uint8_t * bytes )
+{
+    acc[0] = xxh64_round ( acc[0], xxh64_read64 ( bytes ) );
+    acc[1] = xxh64_round ( acc[1], xxh64_read64 ( bytes + 8 ) );
+    acc[2] = xxh64_round ( acc[2], xxh64_read64 ( bytes + 16 ) );
+    acc[3] = xxh64_round ( acc[3], xxh64_read64 ( bytes + 24 ) );
+}
+
+/**
+ * Start new XXH64 hash
+ */
+void xxh64_init ( struct xxh64_t *state, uint64_t seed )
+{
+    state->total = 0;
+    state->acc[0] = seed + XXH64_PRIME_1 + XXH64_PRIME_2;
+    state->acc[1] = seed + XXH64_PRIME_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - XXH64_PRIME_1;
+    state->seed = seed;
+    state->buffered = 0;
+}
+
+/**
+ * Feed data into XXH64 hash
+ */
+void xxh64_update ( struct xxh64_t *state, const void *mem, size_t len )
+{
+    size_t fill;
+    const uint8_t *bytes = ( const uint8_t * ) mem;
+    const uint8_t *end = bytes + len;
+
+    state->total += len;
+
+    if ( state->buffered )
+    {
+        fill = MIN ( sizeof ( state->buffer ) - state->buffered, len );
+        memcpy ( state->buffer + state->buffered, bytes, fill );
+        state->buffered += fill;
+        bytes += fill;
+
+        if ( state->buffered < sizeof ( state->buffer ) )
+        {
+            return;
+        }
+
+        xxh64_stripe ( state->acc, state->buffer );
+        state->buffered = 0;
+    }
+
+    while ( ( size_t ) ( end - bytes ) >= sizeof ( state->buffer ) )
+    {
+        xxh64_stripe ( state->acc, bytes );
+        bytes += sizeof ( state->buffer );
+    }
+
+    memcpy ( state->buffer, bytes, end - bytes );
+    state->buffered = end - bytes;
+}
+
+/**
+ * Finish XXH64 hash
+ */
+uint64_t xxh64_digest ( const struct xxh64_t *state )
+{
+    uint64_t hash;
+    const uint8_t *bytes = state->buffer;
+    const uint8_t *end = state->buffer + state->buffered;
+
+    if ( state->total >= sizeof ( state->buffer ) )
+    {
+        hash = xxh64_rotl ( state->acc[0], 1 ) + xxh64_rotl ( state->acc[1], 7 )
+            + xxh64_rotl ( state->acc[2], 12 ) + xxh64_rotl ( state->acc[3], 18 );
+        hash = xxh64_merge_round ( hash, state->acc[0] );
+        hash = xxh64_merge_round ( hash, state->acc[1] );
+        hash = xxh64_merge_round ( hash, state->acc[2] );
+        hash = xxh64_merge_round ( hash, state->acc[3] );
+
+    } else
+    {
+        hash = state->seed + XXH64_PRIME_5;
+    }
+
+    hash += state->total;
+
+    for ( ; end - bytes >= 8; bytes += 8 )
+    {
+        hash ^= xxh64_round ( 0, xxh64_read64 ( bytes ) );
+        hash = xxh64_rotl ( hash, 27 ) * XXH64_PRIME_1 + XXH64_PRIME_4;
+    }
+
+    if ( end - bytes >= 4 )
+    {
+        hash ^= xxh64_read32 ( bytes ) * XXH64_PRIME_1;
+        hash = xxh64_rotl ( hash, 23 ) * XXH64_PRIME_2 + XXH64_PRIME_3;
+        bytes += 4;
+    }
+
+    for ( ; bytes < end; bytes++ )
+    {
+        hash ^= *bytes * XXH64_PRIME_5;
+        hash = xxh64_rotl ( hash, 11 ) * XXH64_PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH64_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= XXH64_PRIME_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+#define CRC32C_POLY 0x82F63B78
+
+/**
+ * CRC32C lookup tables for eight bytes at once
+ */
+static uint32_t crc32c_table[8][256];
+
+/**
+ * CRC32C implementation in use
+ */
+static int crc32c_mode;
+
+/**
+ * CRC32C setup guard, shard threads may hash concurrently
+ */
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fill CRC32C lookup tables and pick implementation
+ */
+static void crc32c_init ( void )
+{
+    int k;
+    uint32_t i;
+    uint32_t crc;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        crc = i;
+
+        for ( k = 0; k < 8; k++ )
+        {
+            crc = crc & 1 ? ( crc >> 1 ) ^ CRC32C_POLY : crc >> 1;
+        }
+
+        crc32c_table[0][i] = crc;
+    }
+
+    for ( i = 0; i < 256; i++ )
+    {
+        for ( k = 1; k < 8; k++ )
+        {
+            crc32c_table[k][i] = ( crc32c_table[k - 1][i] >> 8 )
+                ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+        }
+    }
+
+    crc32c_mode = 1;
+#if defined ( __x86_64__ ) && defined ( __GNUC__ )
+    if ( __builtin_cpu_supports ( "sse4.2" ) )
+    {
+        crc32c_mode = 2;
+    }
+#endif
+}
+
+/**
+ * Compute CRC32C with lookup tables
+ */
+static uint32_t crc32c_soft ( uint32_t crc, const uint8_t * bytes, size_t len )
+{
+    uint64_t value;
+
+    for ( ; len >= 8; len -= 8, bytes += 8 )
+    {
+        value = xxh64_read64 ( bytes ) ^ crc;
+        crc = crc32c_table[7][value & 0xff] ^ crc32c_table[6][( value >> 8 ) & 0xff]
+            ^ crc32c_table[5][( value >> 16 ) & 0xff] ^ crc32c_table[4][( value >> 24 ) & 0xff]
+            ^ crc32c_table[3][( value >> 32 ) & 0xff] ^ crc32c_table[2][( value >> 40 ) & 0xff]
+            ^ crc32c_table[1][( value >> 48 ) & 0xff] ^ crc32c_table[0][value >> 56];
+    }
+
+    for ( ; len; len--, bytes++ )
+    {
+        crc = crc32c_table[0][( crc ^ *bytes ) & 0xff] ^ ( crc >> 8 );
+    }
+
+    return crc;
+}
+
+#if defined ( __x86_64__ ) && defined ( __GNUC__ )
+#include <nmmintrin.h>
+
+/**
+ * Compute CRC32C with SSE4.2 instructions
+ */
+__attribute__ ( ( target ( "sse4.2" ) ) )
+static uint32_t crc32c_sse42 ( uint32_t crc, const uint8_t * bytes, size_t len )
+{
+    uint64_t value;
+    uint64_t state = crc;
+
+    for ( ; len >= 8; len -= 8, bytes += 8 )
+    {
+        memcpy ( &value, bytes, sizeof ( value ) );
+        state = _mm_crc32_u64 ( state, value );
+    }
+
+    crc = state;
+
+    for ( ; len; len--, bytes++ )
+    {
+        crc = _mm_crc32_u8 ( crc, *bytes );
+    }
+
+    return crc;
+}
+#endif
+
+/**
+ * Update CRC32C checksum with data, start with zero
+ */
+uint32_t crc32c_update ( uint32_t crc, const void *mem, size_t len )
+{
+    pthread_once ( &crc32c_once, crc32c_init );
+#if defined ( __x86_64__ ) && defined ( __GNUC__ )
+    if ( crc32c_mode == 2 )
+    {
+        return ~crc32c_sse42 ( ~crc, ( const uint8_t * ) mem, len );
+    }
+#endif
+    return ~crc32c_soft ( ~crc, ( const uint8_t * ) mem, len );
+}
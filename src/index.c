@@ -0,0 +1,277 @@
+/* ------------------------------------------------------------------
+ * SBox - Archive Block Index
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+#define INDEX_TRAILER_LEN 12
+
+/**
+ * Archive index trailer magic
+ */
+static const uint8_t archive_index_magic[4] = { 's', 'b', 'x', 'i' };
+
+/**
+ * Create new archive block index
+ */
+void archive_index_new ( struct archive_index_t *index )
+{
+    index->count = 0;
+    index->capacity = 0;
+    index->blocks = NULL;
+}
+
+/**
+ * Append block to archive index
+ */
+int archive_index_append ( struct archive_index_t *index, uint64_t logical, uint64_t storage )
+{
+    struct archive_block_t *backup;
+
+    if ( index->count && ( logical < index->blocks[index->count - 1].logical
+            || storage < index->blocks[index->count - 1].storage ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( index->count == index->capacity )
+    {
+        index->capacity = index->capacity ? 2 * index->capacity : 64;
+        backup = index->blocks;
+
+        if ( !( index->blocks =
+                ( struct archive_block_t * ) realloc ( index->blocks,
+                    index->capacity * sizeof ( struct archive_block_t ) ) ) )
+        {
+            free ( backup );
+            return -1;
+        }
+    }
+
+    index->blocks[index->count].logical = logical;
+    index->blocks[index->count].storage = storage;
+    index->count++;
+
+    return 0;
+}
+
+/**
+ * Find last block starting at or before logical offset
+ */
+const struct archive_block_t *archive_index_lookup ( const struct archive_index_t *index,
+    uint64_t logical )
+{
+    size_t lo = 0;
+    size_t hi = index->count;
+    size_t mid;
+
+    while ( lo < hi )
+    {
+        mid = lo + ( hi - lo ) / 2;
+
+        if ( index->blocks[mid].logical <= logical )
+        {
+            lo = mid + 1;
+
+        } else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo ? &index->blocks[lo - 1] : NULL;
+}
+
+/**
+ * Save archive index as stream annotation
+ */
+int archive_index_save ( const struct archive_index_t *index, struct io_stream_t *io )
+{
+    size_t i;
+    uint64_t length;
+    uint64_t logical = 0;
+    uint64_t storage = 0;
+    uint8_t trailer[INDEX_TRAILER_LEN];
+    struct ext_buffer_t buffer;
+
+    if ( ext_buffer_new ( &buffer ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( ext_buffer_append_varint ( &buffer, index->count ) < 0 )
+    {
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    for ( i = 0; i < index->count; i++ )
+    {
+        if ( ext_buffer_append_varint ( &buffer, index->blocks[i].logical - logical ) < 0
+            || ext_buffer_append_varint ( &buffer, index->blocks[i].storage - storage ) < 0 )
+        {
+            ext_buffer_free ( &buffer );
+            return -1;
+        }
+
+        logical = index->blocks[i].logical;
+        storage = index->blocks[i].storage;
+    }
+
+    length = buffer.length;
+
+    for ( i = 0; i < 8; i++ )
+    {
+        trailer[i] = ( length >> ( 56 - 8 * i ) ) & 0xff;
+    }
+
+    memcpy ( trailer + 8, archive_index_magic, sizeof ( archive_index_magic ) );
+
+    if ( ext_buffer_append_bytes ( &buffer, trailer, sizeof ( trailer ) ) < 0 )
+    {
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    if ( io->annotate ( io, buffer.bytes, buffer.length ) < 0 )
+    {
+        ext_buffer_free ( &buffer );
+        return -1;
+    }
+
+    ext_buffer_free ( &buffer );
+
+    return 0;
+}
+
+/**
+ * Decode archive index entries
+ */
+static int archive_index_parse ( struct archive_index_t *index, const uint8_t * bytes,
+    size_t length )
+{
+    uint64_t i;
+    uint64_t count;
+    uint64_t logical_delta;
+    uint64_t storage_delta;
+    uint64_t logical = 0;
+    uint64_t storage = 0;
+    const uint8_t *end = bytes + length;
+
+    if ( varint_decode ( &bytes, end, &count ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( varint_decode ( &bytes, end, &logical_delta ) < 0
+            || varint_decode ( &bytes, end, &storage_delta ) < 0 )
+        {
+            return -1;
+        }
+
+        logical += logical_delta;
+        storage += storage_delta;
+
+        if ( archive_index_append ( index, logical, storage ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( bytes != end || !index->count )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Load archive index from storage stream
+ */
+int archive_index_load ( struct archive_index_t *index, struct io_stream_t *storage )
+{
+    size_t i;
+    uint64_t total;
+    uint64_t length = 0;
+    uint8_t *bytes;
+    uint8_t trailer[INDEX_TRAILER_LEN];
+
+    if ( storage->length ( storage, &total ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( total < sizeof ( trailer ) )
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if ( storage->seek ( storage, total - sizeof ( trailer ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( storage->read_complete ( storage, trailer, sizeof ( trailer ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( memcmp ( trailer + 8, archive_index_magic, sizeof ( archive_index_magic ) ) != 0 )
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    for ( i = 0; i < 8; i++ )
+    {
+        length = ( length << 8 ) | trailer[i];
+    }
+
+    if ( length > total - sizeof ( trailer ) || length > SIZE_MAX )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( storage->seek ( storage, total - sizeof ( trailer ) - length ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( !( bytes = ( uint8_t * ) malloc ( length ) ) )
+    {
+        return -1;
+    }
+
+    if ( storage->read_complete ( storage, bytes, length ) < 0 )
+    {
+        free ( bytes );
+        return -1;
+    }
+
+    if ( archive_index_parse ( index, bytes, length ) < 0 )
+    {
+        free ( bytes );
+        archive_index_free ( index );
+        archive_index_new ( index );
+        return -1;
+    }
+
+    free ( bytes );
+
+    return 0;
+}
+
+/**
+ * Free archive index from memory
+ */
+void archive_index_free ( struct archive_index_t *index )
+{
+    free ( index->blocks );
+}
@@ -11,27 +11,178 @@
 #define LZ4F_HEADER_SIZE_MAX 15
 #endif
 
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50
+#define LZ4_SKIPPABLE_HEADER_SIZE 8
+#define LZ4_BLOCK_DEFAULT 65536
+#define LZ4_LINKED_WINDOW 131072
+#define LZ4_STATE_SIZE 16384
+#define LZ4_HC_STATE_SIZE 262144
+#define LZ4_HC_LEVEL_MIN 3
+
 /**
  * LZ4 stream context
  */
 struct lz4_stream_context_t
 {
     int begin_flag;
+    int frame_known;
 
     size_t offset;
     size_t length;
     size_t capacity;
+    size_t size;
+    size_t reserved;
+    size_t work_offset;
+    size_t work_length;
 
     uint8_t *buffer;
+    uint8_t *workbuf;
 
     struct io_stream_t *internal;
     LZ4F_preferences_t lz4_prefs;
     LZ4F_compressionContext_t lz4_ctx;
     LZ4F_decompressionContext_t lz4_dctx;
-
-    uint8_t workbuf[MAX ( LZ4F_HEADER_SIZE_MAX, CHUNK_SIZE )];
 };
 
+/**
+ * Map LZ4 block size to frame block size ID, zero selects library default
+ */
+static LZ4F_blockSizeID_t lz4_block_size_id ( size_t block_size )
+{
+    switch ( block_size )
+    {
+    case 65536:
+        return LZ4F_max64KB;
+    case 262144:
+        return LZ4F_max256KB;
+    case 1048576:
+        return LZ4F_max1MB;
+    case 4194304:
+        return LZ4F_max4MB;
+    }
+
+    return LZ4F_default;
+}
+
+/**
+ * Map frame block size ID to LZ4 block size
+ */
+static size_t lz4_block_size ( LZ4F_blockSizeID_t id )
+{
+    switch ( id )
+    {
+    case LZ4F_max256KB:
+        return 262144;
+    case LZ4F_max1MB:
+        return 1048576;
+    case LZ4F_max4MB:
+        return 4194304;
+    default:
+        return LZ4_BLOCK_DEFAULT;
+    }
+}
+
+/**
+ * Estimate memory LZ4F keeps in its own context, block copies and linked window,
+ * compression state too when compressing
+ */
+static size_t lz4_internal_size ( int input, size_t block_size, int linked, int level )
+{
+    if ( input )
+    {
+        return 2 * block_size + ( linked ? LZ4_LINKED_WINDOW : 0 );
+    }
+
+    return block_size + ( linked ? LZ4_LINKED_WINDOW : 0 )
+        + ( level >= LZ4_HC_LEVEL_MIN ? LZ4_HC_STATE_SIZE : LZ4_STATE_SIZE );
+}
+
+/**
+ * Estimate memory taken by LZ4 stream with current stream settings,
+ * input frames are assumed to use default block size
+ */
+size_t lz4_stream_memory ( int input, int level )
+{
+    size_t size;
+    size_t block_size;
+    LZ4F_preferences_t prefs;
+
+    size = MAX ( LZ4F_HEADER_SIZE_MAX, stream_params (  )->buffer_size );
+
+    if ( input )
+    {
+        return budget_cost ( sizeof ( struct lz4_stream_context_t ) ) + budget_cost ( size )
+            + budget_cost ( LZ4_BLOCK_DEFAULT ) + lz4_internal_size ( 1, LZ4_BLOCK_DEFAULT, 0, 0 );
+    }
+
+    memset ( &prefs, 0, sizeof ( prefs ) );
+    prefs.frameInfo.blockSizeID = lz4_block_size_id ( stream_params (  )->lz4_block_size );
+    block_size = lz4_block_size ( prefs.frameInfo.blockSizeID );
+
+    return budget_cost ( sizeof ( struct lz4_stream_context_t ) ) + budget_cost ( size )
+        + budget_cost ( LZ4F_compressBound ( size, &prefs ) )
+        + lz4_internal_size ( 0, block_size, stream_params (  )->lz4_linked, level );
+}
+
+/**
+ * Count LZ4F internal memory against budget, growing reservation when needed
+ */
+static int lz4_stream_reserve_internal ( struct lz4_stream_context_t *context, size_t size )
+{
+    if ( size <= context->reserved )
+    {
+        return 0;
+    }
+
+    if ( budget_reserve ( size - context->reserved ) < 0 )
+    {
+        return -1;
+    }
+
+    context->reserved = size;
+
+    return 0;
+}
+
+/**
+ * Size decode buffer for largest block of frame, so blocks decode straight into it
+ */
+static int lz4_stream_frame ( struct lz4_stream_context_t *context,
+    const LZ4F_frameInfo_t * info )
+{
+    size_t block_size;
+    uint8_t *buffer;
+
+    if ( info->frameType != LZ4F_frame )
+    {
+        return 0;
+    }
+
+    block_size = lz4_block_size ( info->blockSizeID );
+
+    if ( lz4_stream_reserve_internal ( context, lz4_internal_size ( 1, block_size,
+                info->blockMode == LZ4F_blockLinked, 0 ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( block_size <= context->capacity )
+    {
+        return 0;
+    }
+
+    if ( !( buffer = ( uint8_t * ) budget_alloc ( block_size ) ) )
+    {
+        return -1;
+    }
+
+    budget_free ( context->buffer );
+    context->buffer = buffer;
+    context->capacity = block_size;
+
+    return 0;
+}
+
 /**
  * Dequeue data from cache buffer
  */
@@ -42,45 +193,105 @@ static size_t dequeue_buffer ( struct lz4_stream_context_t *context, void *data,
     dequeue_len = MIN ( len, context->length - context->offset );
     memcpy ( data, context->buffer + context->offset, dequeue_len );
     context->offset += dequeue_len;
+    stream_count_copy ( dequeue_len );
 
     return dequeue_len;
 }
 
 /**
- * Read data from AES stream
+ * Get compressed input, borrowed from internal stream buffer when it has one
  */
-static ssize_t lz4_stream_read ( struct io_stream_t *io, void *data, size_t len )
+static ssize_t lz4_stream_input ( struct lz4_stream_context_t *context, const void **data )
 {
-    int ret;
-    size_t ilen;
-    size_t olen;
-    struct lz4_stream_context_t *context;
+    ssize_t ilen;
 
-    context = ( struct lz4_stream_context_t * ) io->context;
+    if ( context->internal->peek )
+    {
+        return context->internal->peek ( context->internal, data, SIZE_MAX );
+    }
 
-    if ( context->offset < context->length )
+    if ( context->work_offset == context->work_length )
     {
-        return dequeue_buffer ( context, data, len );
+        if ( ( ilen =
+                context->internal->read_max ( context->internal, context->workbuf,
+                    context->size ) ) <= 0 )
+        {
+            return ilen;
+        }
+
+        context->work_offset = 0;
+        context->work_length = ilen;
     }
 
+    *data = context->workbuf + context->work_offset;
+
+    return context->work_length - context->work_offset;
+}
+
+/**
+ * Decompress next data into cache buffer
+ */
+static int lz4_stream_fill ( struct lz4_stream_context_t *context )
+{
+    size_t ret;
+    ssize_t ilen;
+    size_t olen;
+    size_t used;
+    const void *input;
+    LZ4F_frameInfo_t info;
+
     do
     {
-        if ( ( ssize_t ) ( ilen =
-                context->internal->read_max ( context->internal, context->workbuf,
-                    sizeof ( context->workbuf ) ) ) <= 0 )
+        if ( ( ilen = lz4_stream_input ( context, &input ) ) <= 0 )
         {
             return -1;
         }
 
-        olen = context->capacity;
+        used = ilen;
+        olen = 0;
+
+        /* Frame header is looked at first, it fails while header is split over inputs */
+        if ( !context->frame_known
+            && !LZ4F_isError ( LZ4F_getFrameInfo ( context->lz4_dctx, &info, input, &used ) ) )
+        {
+            context->frame_known = 1;
 
-        ret =
-            LZ4F_decompress ( context->lz4_dctx, context->buffer, &olen, context->workbuf, &ilen,
-            NULL );
+            if ( lz4_stream_frame ( context, &info ) < 0 )
+            {
+                return -1;
+            }
 
-        if ( LZ4F_isError ( ret ) )
+        } else
         {
-            return -1;
+            used = ilen;
+            olen = context->capacity;
+
+            ret =
+                LZ4F_decompress ( context->lz4_dctx, context->buffer, &olen, input, &used,
+                NULL );
+
+            if ( LZ4F_isError ( ret ) )
+            {
+                return -1;
+            }
+
+            /* Next frame may have other block size */
+            if ( !ret )
+            {
+                context->frame_known = 0;
+            }
+        }
+
+        if ( context->internal->peek )
+        {
+            if ( context->internal->consume ( context->internal, used ) < 0 )
+            {
+                return -1;
+            }
+
+        } else
+        {
+            context->work_offset += used;
         }
 
     } while ( !olen );
@@ -88,9 +299,58 @@ static ssize_t lz4_stream_read ( struct io_stream_t *io, void *data, size_t len
     context->offset = 0;
     context->length = olen;
 
+    return 0;
+}
+
+/**
+ * Read data from LZ4 stream
+ */
+static ssize_t lz4_stream_read ( struct io_stream_t *io, void *data, size_t len )
+{
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+
+    if ( context->offset == context->length && lz4_stream_fill ( context ) < 0 )
+    {
+        return -1;
+    }
+
     return dequeue_buffer ( context, data, len );
 }
 
+/**
+ * Borrow decompressed data from LZ4 stream
+ */
+static ssize_t lz4_stream_peek ( struct io_stream_t *io, const void **data, size_t len )
+{
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+
+    if ( context->offset == context->length && lz4_stream_fill ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    *data = context->buffer + context->offset;
+
+    return MIN ( len, context->length - context->offset );
+}
+
+/**
+ * Drop data borrowed from LZ4 stream
+ */
+static int lz4_stream_consume ( struct io_stream_t *io, size_t len )
+{
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+    context->offset += MIN ( len, context->length - context->offset );
+
+    return 0;
+}
+
 /**
  * Begin LZ4 stream compression
  */
@@ -99,7 +359,7 @@ static int lz4_stream_begin ( struct lz4_stream_context_t *context )
     size_t length;
 
     length =
-        LZ4F_compressBegin ( context->lz4_ctx, context->workbuf, sizeof ( context->workbuf ),
+        LZ4F_compressBegin ( context->lz4_ctx, context->workbuf, context->size,
         &context->lz4_prefs );
 
     if ( LZ4F_isError ( length ) )
@@ -135,7 +395,7 @@ static ssize_t lz4_stream_write ( struct io_stream_t *io, const void *data, size
         }
     }
 
-    ilen = MIN ( len, CHUNK_SIZE );
+    ilen = MIN ( len, context->size );
     olen =
         LZ4F_compressUpdate ( context->lz4_ctx, context->buffer, context->capacity, data, ilen,
         NULL );
@@ -165,15 +425,17 @@ static int lz4_stream_verify ( struct io_stream_t *io )
     return context->internal->verify ( context->internal );
 }
 
-/*
- * Flush LZ4 stream output
+/**
+ * End LZ4 stream frame if one is open
  */
-static int lz4_stream_flush ( struct io_stream_t *io )
+static int lz4_stream_end ( struct lz4_stream_context_t *context )
 {
     size_t olen;
-    struct lz4_stream_context_t *context;
 
-    context = ( struct lz4_stream_context_t * ) io->context;
+    if ( context->begin_flag )
+    {
+        return 0;
+    }
 
     olen = LZ4F_compressEnd ( context->lz4_ctx, context->buffer, context->capacity, NULL );
 
@@ -187,9 +449,114 @@ static int lz4_stream_flush ( struct io_stream_t *io )
         return -1;
     }
 
+    context->begin_flag = 1;
+    return 0;
+}
+
+/*
+ * Flush LZ4 stream output
+ */
+static int lz4_stream_flush ( struct io_stream_t *io )
+{
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+
+    if ( lz4_stream_end ( context ) < 0 )
+    {
+        return -1;
+    }
+
     return context->internal->flush ( context->internal );
 }
 
+/*
+ * Start new LZ4 frame decodable on its own
+ */
+static int lz4_stream_split ( struct io_stream_t *io, uint64_t * offset )
+{
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+
+    if ( lz4_stream_end ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    return context->internal->split ( context->internal, offset );
+}
+
+/*
+ * Write annotation data as LZ4 skippable frame
+ */
+static int lz4_stream_annotate ( struct io_stream_t *io, const void *data, size_t len )
+{
+    uint8_t header[LZ4_SKIPPABLE_HEADER_SIZE];
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+
+    if ( len > UINT32_MAX )
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if ( lz4_stream_end ( context ) < 0 )
+    {
+        return -1;
+    }
+
+    header[0] = LZ4_SKIPPABLE_MAGIC & 0xff;
+    header[1] = ( LZ4_SKIPPABLE_MAGIC >> 8 ) & 0xff;
+    header[2] = ( LZ4_SKIPPABLE_MAGIC >> 16 ) & 0xff;
+    header[3] = ( LZ4_SKIPPABLE_MAGIC >> 24 ) & 0xff;
+    header[4] = len & 0xff;
+    header[5] = ( len >> 8 ) & 0xff;
+    header[6] = ( len >> 16 ) & 0xff;
+    header[7] = ( len >> 24 ) & 0xff;
+
+    if ( context->internal->write_complete ( context->internal, header, sizeof ( header ) ) < 0 )
+    {
+        return -1;
+    }
+
+    return context->internal->write_complete ( context->internal, data, len );
+}
+
+/*
+ * Seek LZ4 stream to frame at storage offset
+ */
+static int lz4_stream_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+
+    LZ4F_resetDecompressionContext ( context->lz4_dctx );
+
+    context->frame_known = 0;
+    context->offset = 0;
+    context->length = 0;
+    context->work_offset = 0;
+    context->work_length = 0;
+
+    return context->internal->seek ( context->internal, offset );
+}
+
+/*
+ * Get LZ4 stream storage length
+ */
+static int lz4_stream_length ( struct io_stream_t *io, uint64_t * length )
+{
+    struct lz4_stream_context_t *context;
+
+    context = ( struct lz4_stream_context_t * ) io->context;
+
+    return context->internal->length ( context->internal, length );
+}
+
 /*
  * Close LZ4 stream
  */
@@ -201,9 +568,16 @@ static void lz4_stream_close ( struct io_stream_t *io )
 
     if ( context->buffer )
     {
-        free ( context->buffer );
+        budget_free ( context->buffer );
     }
 
+    if ( context->workbuf )
+    {
+        budget_free ( context->workbuf );
+    }
+
+    budget_release ( context->reserved );
+
     if ( io->write )
     {
         LZ4F_freeCompressionContext ( context->lz4_ctx );
@@ -215,6 +589,9 @@ static void lz4_stream_close ( struct io_stream_t *io )
     }
 
     context->internal->close ( context->internal );
+
+    budget_free ( context );
+    free ( io );
 }
 
 /**
@@ -226,7 +603,7 @@ struct io_stream_t *input_lz4_stream_new ( struct io_stream_t *internal )
     struct lz4_stream_context_t *context;
 
     if ( !( context =
-            ( struct lz4_stream_context_t * ) calloc ( 1, sizeof ( struct
+            ( struct lz4_stream_context_t * ) budget_calloc ( sizeof ( struct
                     lz4_stream_context_t ) ) ) )
     {
         return NULL;
@@ -236,35 +613,41 @@ struct io_stream_t *input_lz4_stream_new ( struct io_stream_t *internal )
     context->internal = internal;
     context->offset = 0;
     context->length = 0;
+    context->size = MAX ( LZ4F_HEADER_SIZE_MAX, stream_params (  )->buffer_size );
 
     /* Prepare LZ4 decompression context */
     if ( LZ4F_isError ( LZ4F_createDecompressionContext ( &context->lz4_dctx, LZ4F_VERSION ) ) )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
-    /* Obtain decompression bound */
-    context->capacity = 256 * CHUNK_SIZE;
+    /* Decompression buffer is allocated once frame header tells block size */
+    context->capacity = 0;
 
-    /* Allocate compression buffer */
-    if ( !( context->buffer = ( uint8_t * ) malloc ( context->capacity ) ) )
+    /* Allocate compressed input buffer */
+    if ( !( context->workbuf = ( uint8_t * ) budget_alloc ( context->size ) ) )
     {
-        LZ4F_freeCompressionContext ( context->lz4_ctx );
-        free ( context );
+        LZ4F_freeDecompressionContext ( context->lz4_dctx );
+        budget_free ( context );
         return NULL;
     }
 
     if ( !( io = io_stream_new (  ) ) )
     {
-        LZ4F_freeCompressionContext ( context->lz4_ctx );
-        free ( context );
+        LZ4F_freeDecompressionContext ( context->lz4_dctx );
+        budget_free ( context->workbuf );
+        budget_free ( context );
         return NULL;
     }
 
     io->context = ( struct io_base_context_t * ) context;
     io->read = lz4_stream_read;
+    io->peek = lz4_stream_peek;
+    io->consume = lz4_stream_consume;
     io->verify = lz4_stream_verify;
+    io->seek = lz4_stream_seek;
+    io->length = lz4_stream_length;
     io->close = lz4_stream_close;
 
     return io;
@@ -279,7 +662,7 @@ struct io_stream_t *output_lz4_stream_new ( struct io_stream_t *internal, int le
     struct lz4_stream_context_t *context;
 
     if ( !( context =
-            ( struct lz4_stream_context_t * ) calloc ( 1, sizeof ( struct
+            ( struct lz4_stream_context_t * ) budget_calloc ( sizeof ( struct
                     lz4_stream_context_t ) ) ) )
     {
         return NULL;
@@ -288,38 +671,68 @@ struct io_stream_t *output_lz4_stream_new ( struct io_stream_t *internal, int le
     /* Initialize stream context */
     context->begin_flag = 1;
     context->internal = internal;
+    context->size = MAX ( LZ4F_HEADER_SIZE_MAX, stream_params (  )->buffer_size );
     memset ( &context->lz4_prefs, 0, sizeof ( context->lz4_prefs ) );
     context->lz4_prefs.compressionLevel = level;
+    context->lz4_prefs.frameInfo.blockSizeID =
+        lz4_block_size_id ( stream_params (  )->lz4_block_size );
+    context->lz4_prefs.frameInfo.blockMode =
+        stream_params (  )->lz4_linked ? LZ4F_blockLinked : LZ4F_blockIndependent;
 
     /* Prepare LZ4 compression context */
     if ( LZ4F_isError ( LZ4F_createCompressionContext ( &context->lz4_ctx, LZ4F_VERSION ) ) )
     {
-        free ( context );
+        budget_free ( context );
         return NULL;
     }
 
     /* Obtain compression bound */
-    context->capacity = LZ4F_compressBound ( CHUNK_SIZE, &context->lz4_prefs );
+    context->capacity = LZ4F_compressBound ( context->size, &context->lz4_prefs );
 
     /* Allocate compression buffer */
-    if ( !( context->buffer = ( uint8_t * ) malloc ( context->capacity ) ) )
+    if ( !( context->buffer = ( uint8_t * ) budget_alloc ( context->capacity ) ) )
+    {
+        LZ4F_freeCompressionContext ( context->lz4_ctx );
+        budget_free ( context );
+        return NULL;
+    }
+
+    /* Allocate frame header buffer */
+    if ( !( context->workbuf = ( uint8_t * ) budget_alloc ( context->size ) ) )
+    {
+        LZ4F_freeCompressionContext ( context->lz4_ctx );
+        budget_free ( context->buffer );
+        budget_free ( context );
+        return NULL;
+    }
+
+    /* LZ4F allocates block buffer and state on first write */
+    if ( lz4_stream_reserve_internal ( context, lz4_internal_size ( 0,
+                lz4_block_size ( context->lz4_prefs.frameInfo.blockSizeID ),
+                context->lz4_prefs.frameInfo.blockMode == LZ4F_blockLinked, level ) ) < 0 )
     {
         LZ4F_freeCompressionContext ( context->lz4_ctx );
-        free ( context );
+        budget_free ( context->workbuf );
+        budget_free ( context->buffer );
+        budget_free ( context );
         return NULL;
     }
 
     if ( !( io = io_stream_new (  ) ) )
     {
         LZ4F_freeCompressionContext ( context->lz4_ctx );
-        free ( context->buffer );
-        free ( context );
+        budget_release ( context->reserved );
+        budget_free ( context->workbuf );
+        budget_free ( context->buffer );
+        budget_free ( context );
         return NULL;
     }
 
     io->context = ( struct io_base_context_t * ) context;
     io->write = lz4_stream_write;
     io->flush = lz4_stream_flush;
+    io->split = lz4_stream_split;
+    io->annotate = lz4_stream_annotate;
     io->close = lz4_stream_close;
 
     return io;
@@ -9,20 +9,333 @@
  */
 static void show_usage ( void )
 {
-    fprintf ( stderr, "usage: sbox -{cxelthp}[snb0..9] [stdin|password] archive path [paths...]\n"
+    fprintf ( stderr, "usage: sbox -{caxelthp}[snub0..9] [stdin|password] archive [paths...]\n"
         "\n"
         "version: " SBOX_VERSION "\n"
         "\n"
         "options:\n"
         "  -c    create new archive\n"
+        "  -a    append files to existing archive\n"
         "  -x    extract archive\n"
         "  -l    list only files in archive\n"
-        "  -t    test archive checksum\n"
+        "  -t    test archive and file checksums\n"
         "  -h    show help message\n"
         "  -s    do not print progress\n"
         "  -n    turn off lz4 compression\n"
+        "  -u    extract only files that differ by size or mtime\n"
         "  -b    use best compression ratio\n"
-        "  -p    use password protection\n" "  -0..9 preset compression ratio\n" "\n" );
+        "  -p    use password protection\n" "  -0..9 preset compression ratio\n" "\n"
+        "long options:\n"
+        "  --reference=archive  pack only changes since archive, repeat for\n"
+        "                       base followed by its increments\n"
+        "  --chain              archives are base followed by increments\n"
+        "  --dedup              store identical file contents once\n"
+        "  --dedup=mode         restore duplicates as copy, reflink or link\n"
+        "  --repository=dir     keep file contents as chunks in repository,\n"
+        "                       archive holds only chunk references\n"
+        "  --shards=count       spread file contents over archive.0, archive.1, ...\n"
+        "                       restored concurrently\n"
+        "  -j count             run parallel work on count threads, default one\n"
+        "                       per CPU\n"
+        "  --affinity           pin worker threads to CPUs\n"
+        "  --crypto=backend     encrypt with openssl or mbedtls, default first\n"
+        "                       one built in\n"
+        "  --buffer-size=size   stream buffer size, power of two from 4K to 16M,\n"
+        "                       default 64K\n"
+        "  --lz4-block=size     lz4 block size 64K, 256K, 1M or 4M\n"
+        "  --lz4-linked         compress lz4 blocks linked to previous ones\n"
+        "  --max-memory=size    keep memory use under size, file list spills\n"
+        "                       to TMPDIR past it\n"
+        "  --stats              print bytes and time per stream stage to stderr\n"
+        "  --stats=json         print stream stage stats as JSON\n" "\n"
+        "long options go before password, archive and paths, -- ends them\n" "\n" );
+}
+
+/**
+ * Long options taken out of argument list
+ */
+struct long_options_t
+{
+    int chain;
+    uint32_t options;
+    const char *repository;
+    int shards;
+    int jobs;
+    int affinity;
+    size_t reference_count;
+    const char **references;
+    struct stream_params_t stream;
+    size_t max_memory;
+};
+
+/**
+ * Parse worker thread count
+ */
+static int parse_jobs ( const char *value, struct long_options_t *long_options )
+{
+    long_options->jobs = atoi ( value );
+
+    if ( long_options->jobs < 1 || long_options->jobs > POOL_THREADS_MAX )
+    {
+        fprintf ( stderr, "Error: Thread count must be 1 to %i.\n", POOL_THREADS_MAX );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse size with optional K, M or G suffix
+ */
+static int parse_size ( const char *value, size_t *size )
+{
+    char *end;
+    unsigned long long number;
+    unsigned long long scale = 1;
+
+    if ( !isdigit ( ( unsigned char ) *value ) )
+    {
+        return -1;
+    }
+
+    errno = 0;
+    number = strtoull ( value, &end, 10 );
+
+    if ( errno )
+    {
+        return -1;
+    }
+
+    if ( *end == 'K' || *end == 'k' )
+    {
+        scale = 1024;
+        end++;
+
+    } else if ( *end == 'M' || *end == 'm' )
+    {
+        scale = 1024 * 1024;
+        end++;
+
+    } else if ( *end == 'G' || *end == 'g' )
+    {
+        scale = 1024 * 1024 * 1024;
+        end++;
+    }
+
+    if ( *end || number > SIZE_MAX / scale )
+    {
+        return -1;
+    }
+
+    *size = number * scale;
+
+    return 0;
+}
+
+/**
+ * Take long options out of argument list, thread count too, options end at
+ * first argument after flags or at -- so passwords and paths are left as they are
+ */
+static int parse_long_options ( int *argc, char *argv[], struct long_options_t *long_options )
+{
+    int i;
+    int count = 1;
+    int flags = 0;
+
+    for ( i = 1; i < *argc; i++ )
+    {
+        if ( !strcmp ( argv[i], "--" ) )
+        {
+            i++;
+            break;
+
+        } else if ( !strcmp ( argv[i], "-j" ) && i + 1 < *argc )
+        {
+            if ( parse_jobs ( argv[++i], long_options ) < 0 )
+            {
+                return -1;
+            }
+
+        } else if ( !strncmp ( argv[i], "-j", 2 ) && isdigit ( ( unsigned char ) argv[i][2] ) )
+        {
+            if ( parse_jobs ( argv[i] + 2, long_options ) < 0 )
+            {
+                return -1;
+            }
+
+        } else if ( strncmp ( argv[i], "--", 2 ) )
+        {
+            if ( flags || argv[i][0] != '-' )
+            {
+                break;
+            }
+
+            flags = 1;
+            argv[count++] = argv[i];
+
+        } else if ( !strncmp ( argv[i], "--reference=", 12 ) && argv[i][12] )
+        {
+            long_options->references[long_options->reference_count++] = argv[i] + 12;
+
+        } else if ( !strncmp ( argv[i], "--repository=", 13 ) && argv[i][13] )
+        {
+            long_options->repository = argv[i] + 13;
+
+        } else if ( !strncmp ( argv[i], "--shards=", 9 ) )
+        {
+            long_options->shards = atoi ( argv[i] + 9 );
+
+            if ( long_options->shards < 1 || long_options->shards > SHARD_MAX )
+            {
+                fprintf ( stderr, "Error: Shard count must be 1 to %i.\n", SHARD_MAX );
+                return -1;
+            }
+
+        } else if ( !strncmp ( argv[i], "--crypto=", 9 ) )
+        {
+#ifdef ENABLE_ENCRYPTION
+            if ( crypto_backend_select ( argv[i] + 9 ) < 0 )
+#endif
+            {
+                fprintf ( stderr, "Error: Crypto backend %s not built in.\n", argv[i] + 9 );
+                return -1;
+            }
+
+        } else if ( !strncmp ( argv[i], "--buffer-size=", 14 ) )
+        {
+            if ( parse_size ( argv[i] + 14, &long_options->stream.buffer_size ) < 0 )
+            {
+                fprintf ( stderr, "Error: Invalid buffer size '%s'.\n", argv[i] + 14 );
+                return -1;
+            }
+
+        } else if ( !strncmp ( argv[i], "--lz4-block=", 12 ) )
+        {
+            if ( parse_size ( argv[i] + 12, &long_options->stream.lz4_block_size ) < 0 )
+            {
+                fprintf ( stderr, "Error: Invalid lz4 block size '%s'.\n", argv[i] + 12 );
+                return -1;
+            }
+
+        } else if ( !strncmp ( argv[i], "--max-memory=", 13 ) )
+        {
+            if ( parse_size ( argv[i] + 13, &long_options->max_memory ) < 0
+                || !long_options->max_memory )
+            {
+                fprintf ( stderr, "Error: Invalid memory budget '%s'.\n", argv[i] + 13 );
+                return -1;
+            }
+
+        } else if ( !strcmp ( argv[i], "--lz4-linked" ) )
+        {
+            long_options->stream.lz4_linked = 1;
+
+        } else if ( !strcmp ( argv[i], "--affinity" ) )
+        {
+            long_options->affinity = 1;
+
+        } else if ( !strcmp ( argv[i], "--chain" ) )
+        {
+            long_options->chain = 1;
+
+        } else if ( !strcmp ( argv[i], "--dedup" ) || !strcmp ( argv[i], "--dedup=copy" ) )
+        {
+            long_options->options |= OPTION_DEDUP;
+
+        } else if ( !strcmp ( argv[i], "--dedup=reflink" ) )
+        {
+            long_options->options |= OPTION_DEDUP | OPTION_DEDUP_REFLINK;
+
+        } else if ( !strcmp ( argv[i], "--dedup=link" ) )
+        {
+            long_options->options |= OPTION_DEDUP | OPTION_DEDUP_LINK;
+
+        } else if ( !strcmp ( argv[i], "--stats" ) )
+        {
+            long_options->options |= OPTION_STATS;
+
+        } else if ( !strcmp ( argv[i], "--stats=json" ) )
+        {
+            long_options->options |= OPTION_STATS | OPTION_STATS_JSON;
+
+        } else
+        {
+            fprintf ( stderr, "Error: Unknown option '%s', put -- before arguments "
+                "starting with -.\n", argv[i] );
+            return -1;
+        }
+    }
+
+    while ( i < *argc )
+    {
+        argv[count++] = argv[i++];
+    }
+
+    if ( stream_params_set ( &long_options->stream ) < 0 )
+    {
+        fprintf ( stderr, "Error: Buffer size must be power of two from %i to %i, "
+            "lz4 block size 64K, 256K, 1M or 4M.\n", STREAM_BUFFER_MIN, STREAM_BUFFER_MAX );
+        return -1;
+    }
+
+    long_options->references[long_options->reference_count] = NULL;
+    argv[count] = NULL;
+    *argc = count;
+
+    return 0;
+}
+
+/**
+ * Count shard files next to archive, each is read by own stream
+ */
+static int count_shard_files ( const char *archive )
+{
+    int count;
+    char *path;
+    struct stat st;
+
+    for ( count = 0; count < SHARD_MAX; count++ )
+    {
+        if ( !( path = shard_path ( archive, count ) ) )
+        {
+            break;
+        }
+
+        if ( stat ( path, &st ) < 0 )
+        {
+            free ( path );
+            break;
+        }
+
+        free ( path );
+    }
+
+    return count;
+}
+
+/**
+ * Check memory budget covers stream buffers of task, shards and repository
+ * have streams of own beside archive stream
+ */
+static int check_memory_budget ( size_t limit, int input, const char *password,
+    uint8_t compression, int level, int streams )
+{
+    size_t needed;
+
+    needed = streams * ( stream_memory_estimate ( input, password, compression, level )
+        + sizeof ( struct iter_context_t ) + stream_params (  )->buffer_size );
+
+    if ( needed > limit )
+    {
+        fprintf ( stderr, "Error: Memory budget of %luK is below %luK needed by stream "
+            "buffers, lower --buffer-size or --lz4-block.\n", ( unsigned long ) ( limit / 1024 ),
+            ( unsigned long ) ( ( needed + 1023 ) / 1024 ) );
+        return -1;
+    }
+
+    budget_set ( limit, needed );
+
+    return 0;
 }
 
 /**
@@ -203,21 +516,48 @@ int main ( int argc, char *argv[] )
 {
     int status = 0;
 #ifndef EXTRACT_ONLY
-    int level;
+    int level = 0;
+    int shards;
 #endif
     uint32_t options = OPTION_VERBOSE | OPTION_LZ4;
     int arg_off;
     int flag_c;
+    int flag_a;
     int flag_x;
     int flag_l;
     int flag_t;
     int flag_s;
     int flag_n;
     int flag_p;
+    int flag_u;
     const char *password = NULL;
 #ifdef ENABLE_STDIN_PASSWORD
     char password_buf[256];
 #endif
+    struct long_options_t long_options;
+    struct pool_t *pool;
+
+    /* Take long options out of arguments */
+    long_options.chain = 0;
+    long_options.options = 0;
+    long_options.repository = NULL;
+    long_options.shards = 1;
+    long_options.jobs = 0;
+    long_options.affinity = 0;
+    long_options.reference_count = 0;
+    long_options.stream = *stream_params (  );
+    long_options.max_memory = 0;
+
+    if ( !( long_options.references = ( const char ** ) malloc ( argc * sizeof ( char * ) ) ) )
+    {
+        return 1;
+    }
+
+    if ( parse_long_options ( &argc, argv, &long_options ) < 0 )
+    {
+        show_usage (  );
+        return 1;
+    }
 
     /* Validate arguments count */
     if ( argc < 3 )
@@ -228,23 +568,28 @@ int main ( int argc, char *argv[] )
 
     /* Parse flags from arguments */
     flag_c = check_flag ( argv[1], 'c' );
+    flag_a = check_flag ( argv[1], 'a' );
     flag_x = check_flag ( argv[1], 'x' );
     flag_l = check_flag ( argv[1], 'l' );
     flag_t = check_flag ( argv[1], 't' );
     flag_s = check_flag ( argv[1], 's' );
     flag_n = check_flag ( argv[1], 'n' );
     flag_p = check_flag ( argv[1], 'p' );
+    flag_u = check_flag ( argv[1], 'u' );
 
     /* Get password from command line */
     arg_off = !!flag_p;
 
     /* Tasks are exclusive */
-    if ( flag_c + flag_x + flag_l + flag_t != 1 )
+    if ( flag_c + flag_a + flag_x + flag_l + flag_t != 1 )
     {
         show_usage (  );
         return 1;
     }
 
+    /* Merge options given in long form */
+    options |= long_options.options;
+
     /* Unset verbose if silent mode flag set */
     if ( flag_s )
     {
@@ -263,6 +608,18 @@ int main ( int argc, char *argv[] )
         options |= OPTION_TESTONLY;
     }
 
+    /* Set append option if needed */
+    if ( flag_a )
+    {
+        options |= OPTION_APPEND;
+    }
+
+    /* Set update option if needed */
+    if ( flag_u )
+    {
+        options |= OPTION_UPDATE;
+    }
+
     /* Unset lz4 compression if needed */
     if ( flag_n )
     {
@@ -310,11 +667,39 @@ int main ( int argc, char *argv[] )
         }
     }
 
+    /* Budget impossible for task fails before any work, LZ4 input assumed */
+    if ( long_options.max_memory )
+    {
+        if ( flag_c || flag_a )
+        {
+            shards = long_options.shards > 1 ? long_options.shards : 0;
+
+        } else
+        {
+            shards = long_options.chain ? 0 : count_shard_files ( argv[arg_off + 2] );
+        }
+
+        if ( check_memory_budget ( long_options.max_memory, !( flag_c || flag_a ), password,
+                ( flag_c || flag_a ) && !( options & OPTION_LZ4 ) ? COMP_NONE : COMP_LZ4,
+                level, ( shards ? shards + 1 : 1 ) + !!long_options.repository ) < 0 )
+        {
+            return 1;
+        }
+    }
+
+    /* Start workers shared by parallel parts of the task */
+    if ( !( pool = pool_new ( long_options.jobs, long_options.affinity ) ) )
+    {
+        perror ( "pool" );
+        return 1;
+    }
+
     /* Perform the task */
-    if ( flag_c )
+    if ( flag_c || flag_a )
     {
         if ( argc < arg_off + 4 )
         {
+            pool_free ( pool );
             show_usage (  );
             return 1;
         }
@@ -324,22 +709,45 @@ int main ( int argc, char *argv[] )
 #else
         status =
             sbox_pack_archive ( argv[arg_off + 2], options, level, password,
-            ( const char ** ) ( argv + arg_off + 3 ) );
+            ( const char ** ) ( argv + arg_off + 3 ), long_options.references,
+            long_options.repository, long_options.shards, pool );
 
 #endif
     } else if ( flag_x || flag_l || flag_t )
     {
-        if ( argc != arg_off + 3 )
+        if ( argc < arg_off + 3 )
         {
+            pool_free ( pool );
             show_usage (  );
             return 1;
         }
-        status = sbox_unpack_archive ( argv[arg_off + 2], options, password );
+        if ( long_options.chain )
+        {
+            status =
+                sbox_restore_archives ( ( const char ** ) ( argv + arg_off + 2 ), options,
+                password, long_options.repository, pool );
+
+        } else
+        {
+            status =
+                sbox_unpack_archive ( argv[arg_off + 2], options, password,
+                ( const char ** ) ( argv + arg_off + 3 ), long_options.repository, pool );
+        }
     }
 
+    pool_free ( pool );
+    free ( long_options.references );
+
     /* Finally print error code and quit if found */
     if ( status < 0 )
     {
+        if ( budget_shortfall (  ) )
+        {
+            fprintf ( stderr, "Error: Memory budget of %luK exceeded by %luK allocation.\n",
+                ( unsigned long ) ( budget_limit (  ) / 1024 ),
+                ( unsigned long ) ( ( budget_shortfall (  ) + 1023 ) / 1024 ) );
+        }
+
         fprintf ( stderr, "failure: %i\n", errno ? errno : -1 );
         return 1;
     }
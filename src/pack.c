@@ -13,13 +13,65 @@ int sbox_pack_callback ( void *context, struct sbox_node_t *node, const char *pa
 {
     int fd;
     size_t len;
-    size_t sum = 0;
+    uint32_t crc = 0;
+    uint64_t sum = 0;
+    uint64_t storage_offset;
+    void *data;
     struct io_stream_t *io;
     struct iter_context_t *iter_context;
     struct stat statbuf;
 
     iter_context = ( struct iter_context_t * ) context;
 
+    if ( iter_context->shards && iter_context->shards[node->index] != iter_context->shard )
+    {
+        return 0;
+    }
+
+    /* Other task failed, stop before next entry */
+    if ( iter_context->pool && pool_cancelled ( iter_context->pool ) )
+    {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    if ( !node->mode )
+    {
+        if ( iter_context->options & OPTION_VERBOSE )
+        {
+            show_progress ( 'r', path );
+        }
+
+        return 0;
+    }
+
+    /* Hard link or duplicate shares content stored with its target */
+    if ( node->link != FILE_NET_NONE )
+    {
+        /* Duplicate matched target content before packing, so it must not change since */
+        if ( node->flags & FILE_NET_FLAG_COPY )
+        {
+            if ( stat ( path, &statbuf ) < 0 )
+            {
+                perror ( path );
+                return -1;
+            }
+
+            if ( statbuf.st_mtime != node->mtime || ( uint64_t ) statbuf.st_size != node->size )
+            {
+                fprintf ( stderr, "Error: File '%s' has changed.\n", path );
+                return -1;
+            }
+        }
+
+        if ( iter_context->options & OPTION_VERBOSE )
+        {
+            show_progress ( 'a', path );
+        }
+
+        return 0;
+    }
+
     if ( node->mode & S_IFDIR )
     {
         if ( stat ( path, &statbuf ) < 0 )
@@ -57,23 +109,74 @@ int sbox_pack_callback ( void *context, struct sbox_node_t *node, const char *pa
         return -1;
     }
 
+    if ( !iter_context->repository
+        && iter_context->offset - iter_context->block_offset >= INDEX_BLOCK_SIZE )
+    {
+        if ( iter_context->io->split ( iter_context->io, &storage_offset ) < 0 )
+        {
+            close ( fd );
+            return -1;
+        }
+
+        if ( archive_index_append ( iter_context->index, iter_context->offset,
+                storage_offset ) < 0 )
+        {
+            close ( fd );
+            return -1;
+        }
+
+        iter_context->block_offset = iter_context->offset;
+    }
+
     if ( !( io = file_stream_new ( fd ) ) )
     {
         close ( fd );
         return -1;
     }
 
-    while ( ( ssize_t ) ( len =
-            io->read_max ( io, iter_context->buffer, sizeof ( iter_context->buffer ) ) ) > 0 )
+    if ( !( io = stats_stream_wrap ( io, "files" ) ) )
+    {
+        return -1;
+    }
+
+    if ( iter_context->repository )
     {
-        if ( iter_context->io->write_complete ( iter_context->io, iter_context->buffer, len ) < 0 )
+        if ( repository_store ( iter_context->repository, io, iter_context->io, &sum ) < 0 )
         {
             perror ( path );
             io->close ( io );
             return -1;
         }
 
-        sum += len;
+    } else
+    {
+        /* File is read straight into archive stream buffer */
+        for ( ;; )
+        {
+            if ( ( ssize_t ) ( len =
+                    stream_reserve ( iter_context->io, &data, iter_context->buffer,
+                        iter_context->buffer_size ) ) < 0 )
+            {
+                perror ( path );
+                io->close ( io );
+                return -1;
+            }
+
+            if ( ( ssize_t ) ( len = io->read_max ( io, data, len ) ) <= 0 )
+            {
+                break;
+            }
+
+            crc = crc32c_update ( crc, data, len );
+            sum += len;
+
+            if ( stream_commit ( iter_context->io, data, len ) < 0 )
+            {
+                perror ( path );
+                io->close ( io );
+                return -1;
+            }
+        }
     }
 
     io->close ( io );
@@ -84,6 +187,19 @@ int sbox_pack_callback ( void *context, struct sbox_node_t *node, const char *pa
         return -1;
     }
 
+    /* Shard keeps checksums of own files only, listed in file net order */
+    if ( iter_context->checksum_entries )
+    {
+        iter_context->checksum_entries[iter_context->checksum_count] = node->index;
+        iter_context->checksums[iter_context->checksum_count++] = crc;
+
+    } else if ( iter_context->checksums )
+    {
+        iter_context->checksums[node->index] = crc;
+    }
+
+    iter_context->offset += sum;
+
     if ( iter_context->options & OPTION_VERBOSE )
     {
         show_progress ( 'a', path );
@@ -93,16 +209,146 @@ int sbox_pack_callback ( void *context, struct sbox_node_t *node, const char *pa
 }
 
 /**
- * Pack files to an archive
+ * Build file net of entries changed since reference archives
  */
-int sbox_pack_archive ( const char *archive, uint32_t options, int level, const char *password,
-    const char *files[] )
+static struct file_net_t *sbox_pack_diff ( struct arena_t *arena, const char *password,
+    const char *files[], const char *references[] )
+{
+    struct file_net_t *net;
+    struct file_net_t *reference;
+    struct file_net_t *increment;
+
+    if ( !( reference = sbox_load_file_net ( arena, *references, password ) ) )
+    {
+        return NULL;
+    }
+
+    /* Fold increments into base to get state they describe */
+    for ( references++; *references; references++ )
+    {
+        if ( !( increment = sbox_load_file_net ( arena, *references, password ) ) )
+        {
+            return NULL;
+        }
+
+        if ( !( reference = file_net_merge ( arena, reference, increment ) ) )
+        {
+            return NULL;
+        }
+    }
+
+    if ( !( net = build_file_net ( arena, files ) ) )
+    {
+        return NULL;
+    }
+
+    return file_net_diff ( arena, net, reference );
+}
+
+/**
+ * Save file checksums after file contents, one per file net entry or, if entries
+ * are given, one per listed entry keyed by its distance from previous one
+ */
+static int sbox_pack_save_checksums ( struct io_stream_t *io, const uint32_t * checksums,
+    const uint32_t * entries, uint32_t count )
+{
+    uint32_t i;
+    uint32_t last = 0;
+    size_t len = 0;
+    uint8_t bytes[4096];
+
+    if ( io->write_complete ( io, sbox_checksum_prefix, ARCHIVE_PREFIX_LENGTH ) < 0
+        || stream_write_varint ( io, count ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( entries )
+        {
+            len += varint_encode ( bytes + len, entries[i] - last );
+            last = entries[i];
+        }
+
+        bytes[len++] = checksums[i] >> 24;
+        bytes[len++] = ( checksums[i] >> 16 ) & 0xff;
+        bytes[len++] = ( checksums[i] >> 8 ) & 0xff;
+        bytes[len++] = checksums[i] & 0xff;
+
+        if ( len > sizeof ( bytes ) - VARINT_LIMIT - 4 || i + 1 == count )
+        {
+            if ( io->write_complete ( io, bytes, len ) < 0 )
+            {
+                return -1;
+            }
+
+            len = 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Finish archive body, either file checksums and block index or end of chunk references
+ */
+static int sbox_pack_finish ( struct io_stream_t *io, struct repository_t *repo,
+    struct archive_index_t *index, const struct iter_context_t *iter_context, uint32_t count )
+{
+    uint64_t storage_offset;
+
+    if ( !repo )
+    {
+        /* Own block lets unpack reach checksums without decoding last files */
+        if ( iter_context->offset > iter_context->block_offset
+            && ( io->split ( io, &storage_offset ) < 0
+                || archive_index_append ( index, iter_context->offset, storage_offset ) < 0 ) )
+        {
+            return -1;
+        }
+
+        if ( sbox_pack_save_checksums ( io, iter_context->checksums,
+                iter_context->checksum_entries, iter_context->checksum_entries
+                ? iter_context->checksum_count : count ) < 0 )
+        {
+            return -1;
+        }
+
+        return archive_index_save ( index, io );
+    }
+
+    if ( repository_commit ( repo ) < 0 || stream_write_varint ( io, 0 ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( iter_context->options & OPTION_VERBOSE )
+    {
+        repository_show_stats ( repo );
+    }
+
+    return 0;
+}
+
+/**
+ * Shard being packed
+ */
+struct pack_shard_t
+{
+    struct io_stream_t *io;
+    struct archive_index_t index;
+    struct iter_context_t *context;
+};
+
+/**
+ * Write sharded archive head, file net followed by shard assignment
+ */
+static int sbox_pack_shard_map ( const char *archive, const struct file_net_t *net,
+    const uint8_t * shards, int count, const char *password, int compression, int level )
 {
     int fd;
-    int compression;
     struct io_stream_t *io;
-    struct sbox_node_t *root;
-    struct iter_context_t *iter_context;
 
     if ( ( fd = open ( archive, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
     {
@@ -110,58 +356,455 @@ int sbox_pack_archive ( const char *archive, uint32_t options, int level, const
         return -1;
     }
 
-    compression = ( options & OPTION_LZ4 ) ? COMP_LZ4 : 0;
-
     if ( !( io = output_stream_new ( fd, password, compression, level ) ) )
     {
         close ( fd );
         return -1;
     }
 
-    if ( io->write_complete ( io, sbox_archive_prefix, sizeof ( sbox_archive_prefix ) ) < 0 )
+    if ( io->write_complete ( io, sbox_sharded_prefix, ARCHIVE_PREFIX_LENGTH ) < 0
+        || file_net_save ( net, io ) < 0 || shard_save_map ( io, shards, net->count, count ) < 0
+        || io->flush ( io ) < 0 )
     {
         io->close ( io );
         return -1;
     }
 
-    if ( !( root = build_file_net ( files ) ) )
+    io->close ( io );
+
+    return 0;
+}
+
+/**
+ * Open shard output with own codec and crypto stream
+ */
+static int sbox_pack_open_shard ( struct pack_shard_t *shard, const char *archive, int number,
+    uint32_t entries, const char *password, int compression, int level )
+{
+    int fd;
+    char *path;
+    uint64_t storage_offset;
+
+    if ( !( path = shard_path ( archive, number ) ) )
+    {
+        return -1;
+    }
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
     {
-        io->close ( io );
+        perror ( path );
+        free ( path );
         return -1;
     }
 
-    if ( file_net_save ( root, io ) < 0 )
+    free ( path );
+
+    if ( !( shard->io = output_stream_new ( fd, password, compression, level ) ) )
     {
-        free_file_net ( root );
-        io->close ( io );
+        close ( fd );
         return -1;
     }
 
-    if ( !( iter_context =
-            ( struct iter_context_t * ) malloc ( sizeof ( struct iter_context_t ) ) ) )
+    if ( shard->io->write_complete ( shard->io, sbox_shard_prefix, ARCHIVE_PREFIX_LENGTH ) < 0
+        || stream_write_varint ( shard->io, number ) < 0
+        || stream_write_varint ( shard->io, entries ) < 0
+        || shard->io->split ( shard->io, &storage_offset ) < 0
+        || archive_index_append ( &shard->index, 0, storage_offset ) < 0 )
     {
-        free_file_net ( root );
-        io->close ( io );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Free shard outputs from memory
+ */
+static void sbox_pack_close_shards ( struct pack_shard_t *shards, int count )
+{
+    int i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( shards[i].context )
+        {
+            free ( shards[i].context->checksums );
+            free ( shards[i].context->checksum_entries );
+            iter_context_free ( shards[i].context );
+        }
+
+        if ( shards[i].io )
+        {
+            shards[i].io->close ( shards[i].io );
+        }
+
+        archive_index_free ( &shards[i].index );
+    }
+
+    free ( shards );
+}
+
+/**
+ * Pack file contents to independently decodable shards, shards run on pool
+ */
+static int sbox_pack_shards ( const char *archive, const struct file_net_t *net,
+    uint32_t options, int level, const char *password, int count, struct pool_t *pool )
+{
+    int i;
+    int compression;
+    uint32_t entry;
+    uint8_t *map;
+    uint32_t files[SHARD_MAX] = { 0 };
+    struct pack_shard_t *shards;
+    struct iter_context_t *contexts[SHARD_MAX];
+
+    compression = ( options & OPTION_LZ4 ) ? COMP_LZ4 : 0;
+
+    if ( !( map = shard_assign ( net, count ) ) )
+    {
+        return -1;
+    }
+
+    if ( sbox_pack_shard_map ( archive, net, map, count, password, compression, level ) < 0 )
+    {
+        free ( map );
+        return -1;
+    }
+
+    if ( !( shards = ( struct pack_shard_t * ) calloc ( count, sizeof ( struct pack_shard_t ) ) ) )
+    {
+        free ( map );
+        return -1;
+    }
+
+    for ( entry = FILE_NET_ROOT + 1; entry < net->count; entry++ )
+    {
+        if ( map[entry] != SHARD_NONE )
+        {
+            files[map[entry]]++;
+        }
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        archive_index_new ( &shards[i].index );
+
+        if ( !( contexts[i] = shards[i].context = iter_context_new (  ) ) )
+        {
+            sbox_pack_close_shards ( shards, i + 1 );
+            free ( map );
+            return -1;
+        }
+
+        contexts[i]->options = options;
+        contexts[i]->io = NULL;
+        contexts[i]->paths = NULL;
+        contexts[i]->index = &shards[i].index;
+        contexts[i]->links = NULL;
+        contexts[i]->repository = NULL;
+        contexts[i]->pool = NULL;
+        contexts[i]->checksum_count = 0;
+        contexts[i]->shards = map;
+        contexts[i]->shard = i;
+        contexts[i]->damaged = 0;
+        contexts[i]->offset = 0;
+        contexts[i]->block_offset = 0;
+        contexts[i]->stream_offset = 0;
+
+        if ( !( contexts[i]->checksums = ( uint32_t * ) malloc ( ( files[i] + 1 )
+                    * sizeof ( uint32_t ) ) )
+            || !( contexts[i]->checksum_entries = ( uint32_t * ) malloc ( ( files[i] + 1 )
+                    * sizeof ( uint32_t ) ) )
+            || sbox_pack_open_shard ( shards + i, archive, i, net->count, password, compression,
+                level ) < 0 )
+        {
+            sbox_pack_close_shards ( shards, i + 1 );
+            free ( map );
+            return -1;
+        }
+
+        contexts[i]->io = shards[i].io;
+    }
+
+    /* Directories and tombstones belong to no shard, check them first */
+    contexts[0]->shard = SHARD_NONE;
+
+    if ( file_net_iter ( net, contexts[0], sbox_pack_callback ) < 0 )
+    {
+        sbox_pack_close_shards ( shards, count );
+        free ( map );
+        return -1;
+    }
+
+    contexts[0]->shard = 0;
+
+    if ( shard_run ( pool, net, contexts, count, sbox_pack_callback ) < 0 )
+    {
+        sbox_pack_close_shards ( shards, count );
+        free ( map );
+        return -1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( sbox_pack_finish ( shards[i].io, NULL, &shards[i].index, contexts[i],
+                net->count ) < 0 || shards[i].io->flush ( shards[i].io ) < 0 )
+        {
+            sbox_pack_close_shards ( shards, count );
+            free ( map );
+            return -1;
+        }
+    }
+
+    sbox_pack_close_shards ( shards, count );
+    free ( map );
+
+    return 0;
+}
+
+/**
+ * Open archive output, appended segment starts at current archive end
+ */
+static int sbox_pack_open_output ( const char *archive, const char *password, uint32_t options,
+    uint64_t * start )
+{
+    int fd;
+    off_t end;
+
+    if ( ~options & OPTION_APPEND )
+    {
+        if ( ( fd = open ( archive, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+        {
+            perror ( archive );
+        }
+
+        return fd;
+    }
+
+    if ( sbox_check_append ( archive, password ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( ( fd = open ( archive, O_WRONLY | O_BINARY ) ) < 0 )
+    {
+        perror ( archive );
+        return -1;
+    }
+
+    if ( ( end = lseek ( fd, 0, SEEK_END ) ) < 0 )
+    {
+        perror ( archive );
+        close ( fd );
+        return -1;
+    }
+
+    *start = end;
+
+    return fd;
+}
+
+/**
+ * Drop unfinished output, appended segment is cut off to keep archive readable
+ */
+static void sbox_pack_discard ( struct io_stream_t *io, int fd, uint64_t start, uint32_t options )
+{
+    if ( options & OPTION_APPEND && ftruncate ( fd, start ) < 0 )
+    {
+        perror ( "ftruncate" );
+    }
+
+    io->close ( io );
+}
+
+/**
+ * Pack files to an archive
+ */
+static int sbox_pack_task ( const char *archive, uint32_t options, int level,
+    const char *password, const char *files[], const char *references[],
+    const char *repository, int shards, struct pool_t *pool )
+{
+    int fd;
+    int compression;
+    uint64_t start = 0;
+    uint64_t storage_offset;
+    struct io_stream_t *io;
+    struct arena_t arena;
+    struct file_net_t *net;
+    struct iter_context_t *iter_context;
+    struct archive_index_t index;
+    struct repository_t *repo = NULL;
+
+    arena_new ( &arena );
+
+    /* Build file net first, reference archives may share output path */
+    if ( !( net = references && references[0] ? sbox_pack_diff ( &arena, password, files,
+                references ) : build_file_net ( &arena, files ) ) )
+    {
+        arena_free ( &arena );
+        return -1;
+    }
+
+    if ( options & OPTION_DEDUP && file_net_dedup ( net, pool ) < 0 )
+    {
+        arena_free ( &arena );
+        return -1;
+    }
+
+    if ( options & OPTION_APPEND && ( shards > 1 || repository ) )
+    {
+        fprintf ( stderr, "Error: Append cannot be combined with shards or repository.\n" );
+        arena_free ( &arena );
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( shards > 1 )
+    {
+        if ( repository )
+        {
+            fprintf ( stderr, "Error: Shards cannot be combined with repository.\n" );
+            arena_free ( &arena );
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( sbox_pack_shards ( archive, net, options, level, password, shards, pool ) < 0 )
+        {
+            arena_free ( &arena );
+            return -1;
+        }
+
+        arena_free ( &arena );
+        return 0;
+    }
+
+    compression = ( options & OPTION_LZ4 ) ? COMP_LZ4 : 0;
+
+    if ( repository && !( repo = repository_open ( repository, password, compression, level ) ) )
+    {
+        arena_free ( &arena );
+        return -1;
+    }
+
+    if ( ( fd = sbox_pack_open_output ( archive, password, options, &start ) ) < 0 )
+    {
+        if ( repo )
+        {
+            repository_close ( repo );
+        }
+        arena_free ( &arena );
+        return -1;
+    }
+
+    if ( !( io = output_range_stream_new ( fd, start, password, compression, level ) ) )
+    {
+        if ( repo )
+        {
+            repository_close ( repo );
+        }
+        arena_free ( &arena );
+        if ( options & OPTION_APPEND && ftruncate ( fd, start ) < 0 )
+        {
+            perror ( archive );
+        }
+        close ( fd );
+        return -1;
+    }
+
+    if ( io->write_complete ( io, repo ? sbox_manifest_prefix : sbox_archive_prefix,
+            ARCHIVE_PREFIX_LENGTH ) < 0 || file_net_save ( net, io ) < 0 )
+    {
+        if ( repo )
+        {
+            repository_close ( repo );
+        }
+        arena_free ( &arena );
+        sbox_pack_discard ( io, fd, start, options );
+        return -1;
+    }
+
+    archive_index_new ( &index );
+
+    if ( !repo && ( io->split ( io, &storage_offset ) < 0
+            || archive_index_append ( &index, 0, storage_offset ) < 0 ) )
+    {
+        archive_index_free ( &index );
+        arena_free ( &arena );
+        sbox_pack_discard ( io, fd, start, options );
+        return -1;
+    }
+
+    if ( !( iter_context = iter_context_new (  ) ) )
+    {
+        if ( repo )
+        {
+            repository_close ( repo );
+        }
+        archive_index_free ( &index );
+        arena_free ( &arena );
+        sbox_pack_discard ( io, fd, start, options );
         return -1;
     }
 
     iter_context->options = options;
     iter_context->io = io;
+    iter_context->paths = NULL;
+    iter_context->index = &index;
+    iter_context->links = NULL;
+    iter_context->repository = repo;
+    iter_context->pool = NULL;
+    iter_context->checksums = NULL;
+    iter_context->checksum_entries = NULL;
+    iter_context->checksum_count = 0;
+    iter_context->shards = NULL;
+    iter_context->shard = 0;
+    iter_context->damaged = 0;
+    iter_context->offset = 0;
+    iter_context->block_offset = 0;
+    iter_context->stream_offset = 0;
+
+    /* Chunk ids already check contents stored in repository */
+    if ( !repo && !( iter_context->checksums =
+            ( uint32_t * ) calloc ( net->count, sizeof ( uint32_t ) ) ) )
+    {
+        iter_context_free ( iter_context );
+        archive_index_free ( &index );
+        arena_free ( &arena );
+        sbox_pack_discard ( io, fd, start, options );
+        return -1;
+    }
 
-    if ( file_net_iter ( root, iter_context, sbox_pack_callback ) < 0 )
+    if ( file_net_iter ( net, iter_context, sbox_pack_callback ) < 0
+        || sbox_pack_finish ( io, repo, &index, iter_context, net->count ) < 0 )
     {
-        free ( iter_context );
-        free_file_net ( root );
-        io->close ( io );
+        free ( iter_context->checksums );
+        iter_context_free ( iter_context );
+        if ( repo )
+        {
+            repository_close ( repo );
+        }
+        archive_index_free ( &index );
+        arena_free ( &arena );
+        sbox_pack_discard ( io, fd, start, options );
         return -1;
     }
 
-    free ( iter_context );
-    free_file_net ( root );
+    free ( iter_context->checksums );
+    iter_context_free ( iter_context );
+    arena_free ( &arena );
 
-    if ( io->flush ( io ) < 0 )
+    if ( repo )
     {
-        io->close ( io );
+        repository_close ( repo );
+    }
+
+    archive_index_free ( &index );
+
+    if ( io->flush ( io ) < 0
+        || ( options & OPTION_APPEND && archive_segment_finish ( fd, start ) < 0 ) )
+    {
+        sbox_pack_discard ( io, fd, start, options );
         return -1;
     }
 
@@ -170,4 +813,40 @@ int sbox_pack_archive ( const char *archive, uint32_t options, int level, const
     return 0;
 }
 
+/**
+ * Pack files to an archive, only changes since reference archives if given,
+ * file contents go to chunk repository if given and archive becomes its manifest,
+ * or to given number of shards next to archive, appending adds new segment to archive,
+ * stream stage stats are printed at the end if requested
+ */
+int sbox_pack_archive ( const char *archive, uint32_t options, int level, const char *password,
+    const char *files[], const char *references[], const char *repository, int shards,
+    struct pool_t *pool )
+{
+    int status;
+
+    if ( options & OPTION_STATS )
+    {
+        stats_start (  );
+    }
+
+#ifdef ENABLE_ENCRYPTION
+    aes_key_cache_begin (  );
+#endif
+
+    status = sbox_pack_task ( archive, options, level, password, files, references,
+        repository, shards, pool );
+
+#ifdef ENABLE_ENCRYPTION
+    aes_key_cache_end (  );
+#endif
+
+    if ( options & OPTION_STATS )
+    {
+        stats_show ( !!( options & OPTION_STATS_JSON ) );
+    }
+
+    return status;
+}
+
 #endif
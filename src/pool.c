@@ -0,0 +1,425 @@
+/* ------------------------------------------------------------------
+ * SBox - Work Stealing Thread Pool
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <pthread.h>
+
+/**
+ * Queued task
+ */
+struct pool_task_t
+{
+    pool_task_fn run;
+    void *arg;
+};
+
+/**
+ * Bounded task deque, owner works at tail and thieves take from head
+ */
+struct pool_deque_t
+{
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+    struct pool_task_t tasks[POOL_QUEUE_SIZE];
+};
+
+/**
+ * Pool worker
+ */
+struct pool_worker_t
+{
+    struct pool_t *pool;
+    pthread_t thread;
+    int index;
+    struct pool_deque_t deque;
+};
+
+/**
+ * Thread pool
+ */
+struct pool_t
+{
+    int count;
+    int started;
+    struct pool_worker_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    size_t queued;
+    size_t pending;
+    size_t next;
+    int stopping;
+    int cancelled;
+    int error;
+};
+
+/**
+ * Worker running on current thread, none outside pool
+ */
+static __thread struct pool_worker_t *pool_current;
+
+/**
+ * Push task to deque tail, fails if deque is full
+ */
+static int pool_deque_push ( struct pool_deque_t *deque, pool_task_fn run, void *arg )
+{
+    struct pool_task_t *task;
+
+    pthread_mutex_lock ( &deque->lock );
+
+    if ( deque->tail - deque->head == POOL_QUEUE_SIZE )
+    {
+        pthread_mutex_unlock ( &deque->lock );
+        return -1;
+    }
+
+    task = deque->tasks + deque->tail++ % POOL_QUEUE_SIZE;
+    task->run = run;
+    task->arg = arg;
+
+    pthread_mutex_unlock ( &deque->lock );
+
+    return 0;
+}
+
+/**
+ * Take task from deque, newest one for owner and oldest one for thieves
+ */
+static int pool_deque_take ( struct pool_deque_t *deque, int steal, struct pool_task_t *task )
+{
+    pthread_mutex_lock ( &deque->lock );
+
+    if ( deque->tail == deque->head )
+    {
+        pthread_mutex_unlock ( &deque->lock );
+        return -1;
+    }
+
+    if ( steal )
+    {
+        *task = deque->tasks[deque->head++ % POOL_QUEUE_SIZE];
+
+    } else
+    {
+        *task = deque->tasks[--deque->tail % POOL_QUEUE_SIZE];
+    }
+
+    pthread_mutex_unlock ( &deque->lock );
+
+    return 0;
+}
+
+/**
+ * Find next task for worker, stealing from other workers if own deque is empty
+ */
+static int pool_find_task ( struct pool_worker_t *worker, struct pool_task_t *task )
+{
+    int i;
+    struct pool_t *pool;
+
+    pool = worker->pool;
+
+    if ( pool_deque_take ( &worker->deque, 0, task ) >= 0 )
+    {
+        return 0;
+    }
+
+    for ( i = 1; i < pool->started; i++ )
+    {
+        if ( pool_deque_take ( &pool->workers[( worker->index + i ) % pool->started].deque, 1,
+                task ) >= 0 )
+        {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Run task unless pool was cancelled, failure cancels remaining tasks
+ */
+static void pool_run_task ( struct pool_t *pool, pool_task_fn run, void *arg )
+{
+    if ( !__atomic_load_n ( &pool->cancelled, __ATOMIC_ACQUIRE ) && run ( arg ) < 0 )
+    {
+        pool_cancel ( pool, errno );
+    }
+
+    pthread_mutex_lock ( &pool->lock );
+
+    if ( !--pool->pending )
+    {
+        pthread_cond_broadcast ( &pool->done );
+    }
+
+    pthread_mutex_unlock ( &pool->lock );
+}
+
+/**
+ * Pin worker to one CPU
+ */
+static void pool_pin_worker ( struct pool_worker_t *worker )
+{
+#ifdef __linux__
+    long cpus;
+    cpu_set_t set;
+
+    if ( ( cpus = sysconf ( _SC_NPROCESSORS_ONLN ) ) <= 0 )
+    {
+        return;
+    }
+
+    CPU_ZERO ( &set );
+    CPU_SET ( worker->index % cpus, &set );
+    pthread_setaffinity_np ( worker->thread, sizeof ( set ), &set );
+#else
+    UNUSED ( worker );
+#endif
+}
+
+/**
+ * Worker thread entry
+ */
+static void *pool_worker_main ( void *arg )
+{
+    struct pool_t *pool;
+    struct pool_task_t task;
+    struct pool_worker_t *worker;
+
+    worker = ( struct pool_worker_t * ) arg;
+    pool = worker->pool;
+    pool_current = worker;
+
+    /* Wait until pool_new knows how many workers started */
+    pthread_mutex_lock ( &pool->lock );
+    pthread_mutex_unlock ( &pool->lock );
+
+    for ( ;; )
+    {
+        if ( pool_find_task ( worker, &task ) >= 0 )
+        {
+            __atomic_fetch_sub ( &pool->queued, 1, __ATOMIC_ACQ_REL );
+            pool_run_task ( pool, task.run, task.arg );
+            continue;
+        }
+
+        pthread_mutex_lock ( &pool->lock );
+
+        while ( !pool->stopping && !__atomic_load_n ( &pool->queued, __ATOMIC_ACQUIRE ) )
+        {
+            pthread_cond_wait ( &pool->wake, &pool->lock );
+        }
+
+        if ( pool->stopping && !__atomic_load_n ( &pool->queued, __ATOMIC_ACQUIRE ) )
+        {
+            pthread_mutex_unlock ( &pool->lock );
+            break;
+        }
+
+        pthread_mutex_unlock ( &pool->lock );
+    }
+
+    return NULL;
+}
+
+/**
+ * Create new thread pool, zero threads means one per online CPU
+ */
+struct pool_t *pool_new ( int threads, int affinity )
+{
+    int i;
+    struct pool_t *pool;
+
+    if ( threads <= 0 && ( threads = sysconf ( _SC_NPROCESSORS_ONLN ) ) <= 0 )
+    {
+        threads = 1;
+    }
+
+    if ( !( pool = ( struct pool_t * ) calloc ( 1, sizeof ( struct pool_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( pool->workers =
+            ( struct pool_worker_t * ) calloc ( threads, sizeof ( struct pool_worker_t ) ) ) )
+    {
+        free ( pool );
+        return NULL;
+    }
+
+    pool->count = threads;
+    pthread_mutex_init ( &pool->lock, NULL );
+    pthread_cond_init ( &pool->wake, NULL );
+    pthread_cond_init ( &pool->done, NULL );
+
+    for ( i = 0; i < threads; i++ )
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init ( &pool->workers[i].deque.lock, NULL );
+    }
+
+    /* Pool works with fewer threads if system refuses more, even with none */
+    pthread_mutex_lock ( &pool->lock );
+
+    for ( i = 0; i < threads; i++ )
+    {
+        if ( pthread_create ( &pool->workers[i].thread, NULL, pool_worker_main,
+                pool->workers + i ) )
+        {
+            break;
+        }
+
+        if ( affinity )
+        {
+            pool_pin_worker ( pool->workers + i );
+        }
+
+        pool->started++;
+    }
+
+    pthread_mutex_unlock ( &pool->lock );
+
+    return pool;
+}
+
+/**
+ * Get number of pool threads
+ */
+int pool_threads ( const struct pool_t *pool )
+{
+    return pool->started;
+}
+
+/**
+ * Submit task to pool, it runs on calling thread if queues are full
+ */
+void pool_submit ( struct pool_t *pool, pool_task_fn run, void *arg )
+{
+    int i;
+    struct pool_worker_t *worker = NULL;
+
+    pthread_mutex_lock ( &pool->lock );
+    pool->pending++;
+
+    if ( !pool_current || pool_current->pool != pool )
+    {
+        pool->next++;
+    }
+
+    pthread_mutex_unlock ( &pool->lock );
+
+    /* Task is counted before workers can see it, so taking it never wraps count */
+    __atomic_fetch_add ( &pool->queued, 1, __ATOMIC_ACQ_REL );
+
+    if ( pool_current && pool_current->pool == pool
+        && pool_deque_push ( &pool_current->deque, run, arg ) >= 0 )
+    {
+        worker = pool_current;
+    }
+
+    for ( i = 0; !worker && i < pool->started; i++ )
+    {
+        if ( pool_deque_push ( &pool->workers[( pool->next + i ) % pool->started].deque, run,
+                arg ) >= 0 )
+        {
+            worker = pool->workers + ( pool->next + i ) % pool->started;
+        }
+    }
+
+    if ( !worker )
+    {
+        __atomic_fetch_sub ( &pool->queued, 1, __ATOMIC_ACQ_REL );
+        pool_run_task ( pool, run, arg );
+        return;
+    }
+
+    pthread_mutex_lock ( &pool->lock );
+    pthread_cond_signal ( &pool->wake );
+    pthread_mutex_unlock ( &pool->lock );
+}
+
+/**
+ * Cancel tasks not yet started, first error is kept
+ */
+void pool_cancel ( struct pool_t *pool, int error )
+{
+    pthread_mutex_lock ( &pool->lock );
+
+    if ( !pool->cancelled )
+    {
+        pool->error = error ? error : ECANCELED;
+        __atomic_store_n ( &pool->cancelled, 1, __ATOMIC_RELEASE );
+    }
+
+    pthread_mutex_unlock ( &pool->lock );
+}
+
+/**
+ * Check if pool was cancelled, running tasks should stop early
+ */
+int pool_cancelled ( struct pool_t *pool )
+{
+    return __atomic_load_n ( &pool->cancelled, __ATOMIC_ACQUIRE );
+}
+
+/**
+ * Wait for all submitted tasks, not to be called from a task,
+ * fails with first task error and resets pool for next batch
+ */
+int pool_wait ( struct pool_t *pool )
+{
+    int status = 0;
+
+    pthread_mutex_lock ( &pool->lock );
+
+    while ( pool->pending )
+    {
+        pthread_cond_wait ( &pool->done, &pool->lock );
+    }
+
+    if ( pool->cancelled )
+    {
+        errno = pool->error;
+        status = -1;
+    }
+
+    pool->error = 0;
+    __atomic_store_n ( &pool->cancelled, 0, __ATOMIC_RELEASE );
+
+    pthread_mutex_unlock ( &pool->lock );
+
+    return status;
+}
+
+/**
+ * Stop pool threads and free pool from memory
+ */
+void pool_free ( struct pool_t *pool )
+{
+    int i;
+
+    pthread_mutex_lock ( &pool->lock );
+    pool->stopping = 1;
+    pthread_cond_broadcast ( &pool->wake );
+    pthread_mutex_unlock ( &pool->lock );
+
+    for ( i = 0; i < pool->started; i++ )
+    {
+        pthread_join ( pool->workers[i].thread, NULL );
+    }
+
+    for ( i = 0; i < pool->count; i++ )
+    {
+        pthread_mutex_destroy ( &pool->workers[i].deque.lock );
+    }
+
+    pthread_cond_destroy ( &pool->done );
+    pthread_cond_destroy ( &pool->wake );
+    pthread_mutex_destroy ( &pool->lock );
+    free ( pool->workers );
+    free ( pool );
+}
@@ -0,0 +1,769 @@
+/* ------------------------------------------------------------------
+ * SBox - Chunk Repository
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+#define REPO_CHUNK_MIN 65536
+#define REPO_CHUNK_MASK 0x3ffff
+#define REPO_PACK_LIMIT 67108864
+#define REPO_GEAR_SEED 0x5b0c5eed2024ULL
+
+/**
+ * Repository index magic
+ */
+static const uint8_t repository_index_magic[4] = { 's', 'b', 'x', 'r' };
+
+/**
+ * Repository chunk location
+ */
+struct repository_chunk_t
+{
+    uint8_t id[REPOSITORY_ID_LEN];
+    uint32_t pack;
+    uint32_t length;
+    uint64_t storage;
+};
+
+/**
+ * Chunk repository, packs of chunks addressed by keyed content hash
+ */
+struct repository_t
+{
+    char *path;
+    const char *password;
+    uint8_t compression;
+    int level;
+    size_t count;
+    size_t mask;
+    struct repository_chunk_t *chunks;
+    uint32_t pack_count;
+    uint32_t pack;
+    struct io_stream_t *pack_io;
+    uint64_t pack_length;
+    struct ext_buffer_t records;
+    struct io_stream_t *read_io;
+    uint32_t read_pack;
+    const struct crypto_backend_t *crypto;
+    void *mac;
+    uint64_t gear[256];
+    uint8_t *buffer;
+    uint64_t new_chunks;
+    uint64_t new_bytes;
+    uint64_t reused_chunks;
+    uint64_t reused_bytes;
+};
+
+/**
+ * Fill gear table used by content defined chunking
+ */
+static void repository_gear_init ( uint64_t gear[256] )
+{
+    size_t i;
+    uint64_t state = REPO_GEAR_SEED;
+    uint64_t value;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        value = ( state += 0x9E3779B97F4A7C15ULL );
+        value = ( value ^ ( value >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+        value = ( value ^ ( value >> 27 ) ) * 0x94D049BB133111EBULL;
+        gear[i] = value ^ ( value >> 31 );
+    }
+}
+
+/**
+ * Compute chunk identifier, keyed by password if given
+ */
+static int repository_chunk_id ( struct repository_t *repo, const uint8_t * data, size_t len,
+    uint8_t id[REPOSITORY_ID_LEN] )
+{
+    if ( repo->crypto->mac_update ( repo->mac, data, len ) < 0
+        || repo->crypto->mac_finish ( repo->mac, id ) < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Get first chunk table slot for identifier
+ */
+static size_t repository_home ( size_t mask, const uint8_t id[REPOSITORY_ID_LEN] )
+{
+    size_t i;
+    size_t hash = 0;
+
+    for ( i = 0; i < sizeof ( size_t ); i++ )
+    {
+        hash = ( hash << 8 ) | id[i];
+    }
+
+    return hash & mask;
+}
+
+/**
+ * Find chunk table slot for identifier, empty slot if not present
+ */
+static struct repository_chunk_t *repository_slot ( const struct repository_t *repo,
+    const uint8_t id[REPOSITORY_ID_LEN] )
+{
+    size_t pos;
+    struct repository_chunk_t *chunk;
+
+    for ( pos = repository_home ( repo->mask, id ); ( chunk = repo->chunks + pos )->length;
+        pos = ( pos + 1 ) & repo->mask )
+    {
+        if ( !memcmp ( chunk->id, id, REPOSITORY_ID_LEN ) )
+        {
+            break;
+        }
+    }
+
+    return chunk;
+}
+
+/**
+ * Double chunk table capacity
+ */
+static int repository_grow ( struct repository_t *repo )
+{
+    size_t i;
+    size_t pos;
+    size_t mask;
+    struct repository_chunk_t *chunks;
+
+    mask = 2 * repo->mask + 1;
+
+    if ( !( chunks =
+            ( struct repository_chunk_t * ) calloc ( mask + 1,
+                sizeof ( struct repository_chunk_t ) ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i <= repo->mask; i++ )
+    {
+        if ( !repo->chunks[i].length )
+        {
+            continue;
+        }
+
+        pos = repository_home ( mask, repo->chunks[i].id );
+
+        while ( chunks[pos].length )
+        {
+            pos = ( pos + 1 ) & mask;
+        }
+
+        chunks[pos] = repo->chunks[i];
+    }
+
+    free ( repo->chunks );
+    repo->chunks = chunks;
+    repo->mask = mask;
+
+    return 0;
+}
+
+/**
+ * Add chunk location to table
+ */
+static int repository_insert ( struct repository_t *repo, const uint8_t id[REPOSITORY_ID_LEN],
+    uint32_t pack, uint64_t storage, uint32_t length )
+{
+    struct repository_chunk_t *chunk;
+
+    if ( pack >= repo->pack_count )
+    {
+        repo->pack_count = pack + 1;
+    }
+
+    chunk = repository_slot ( repo, id );
+
+    if ( chunk->length )
+    {
+        return 0;
+    }
+
+    memcpy ( chunk->id, id, REPOSITORY_ID_LEN );
+    chunk->pack = pack;
+    chunk->length = length;
+    chunk->storage = storage;
+
+    if ( ++repo->count * 2 > repo->mask )
+    {
+        return repository_grow ( repo );
+    }
+
+    return 0;
+}
+
+/**
+ * Decode repository index records
+ */
+static int repository_parse_index ( struct repository_t *repo, const uint8_t * bytes,
+    size_t length )
+{
+    uint64_t pack;
+    uint64_t storage;
+    uint64_t chunk_length;
+    const uint8_t *id;
+    const uint8_t *end = bytes + length;
+
+    if ( length < sizeof ( repository_index_magic )
+        || memcmp ( bytes, repository_index_magic, sizeof ( repository_index_magic ) ) )
+    {
+        fprintf ( stderr, "Error: Repository index not recognized.\n" );
+        errno = EINVAL;
+        return -1;
+    }
+
+    bytes += sizeof ( repository_index_magic );
+
+    while ( bytes < end )
+    {
+        if ( ( size_t ) ( end - bytes ) < REPOSITORY_ID_LEN )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        id = bytes;
+        bytes += REPOSITORY_ID_LEN;
+
+        if ( varint_decode ( &bytes, end, &pack ) < 0
+            || varint_decode ( &bytes, end, &storage ) < 0
+            || varint_decode ( &bytes, end, &chunk_length ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( pack >= UINT32_MAX || !chunk_length || chunk_length > REPOSITORY_CHUNK_MAX )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( repository_insert ( repo, id, pack, storage, chunk_length ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Load repository index file
+ */
+static int repository_load_index ( struct repository_t *repo, const char *path )
+{
+    int fd;
+    int status;
+    uint8_t *bytes;
+    struct stat statbuf;
+
+    if ( ( fd = open ( path, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        if ( errno == ENOENT )
+        {
+            return 0;
+        }
+
+        perror ( path );
+        return -1;
+    }
+
+    if ( fstat ( fd, &statbuf ) < 0 )
+    {
+        perror ( path );
+        close ( fd );
+        return -1;
+    }
+
+    if ( !( bytes = ( uint8_t * ) malloc ( MAX ( statbuf.st_size, 1 ) ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    if ( read ( fd, bytes, statbuf.st_size ) != statbuf.st_size )
+    {
+        perror ( path );
+        free ( bytes );
+        close ( fd );
+        return -1;
+    }
+
+    close ( fd );
+
+    status = repository_parse_index ( repo, bytes, statbuf.st_size );
+
+    free ( bytes );
+
+    return status;
+}
+
+/**
+ * Build path of repository file into buffer
+ */
+static void repository_file_path ( const struct repository_t *repo, const char *name,
+    uint32_t pack, char *path, size_t size )
+{
+    if ( name )
+    {
+        snprintf ( path, size, "%s/%s", repo->path, name );
+
+    } else
+    {
+        snprintf ( path, size, "%s/%08x.pack", repo->path, pack );
+    }
+}
+
+/**
+ * Open chunk repository, creating it if needed
+ */
+struct repository_t *repository_open ( const char *path, const char *password,
+    uint8_t compression, int level )
+{
+    const char *key;
+    char index_path[PATH_LIMIT];
+    struct repository_t *repo;
+
+    if ( mkdir ( path, 0755 ) < 0 && errno != EEXIST )
+    {
+        perror ( path );
+        return NULL;
+    }
+
+    if ( !( repo = ( struct repository_t * ) calloc ( 1, sizeof ( struct repository_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    repo->password = password;
+    repo->compression = compression;
+    repo->level = level;
+    repo->mask = 1023;
+    repo->read_pack = UINT32_MAX;
+    repository_gear_init ( repo->gear );
+
+    if ( !( repo->path = strdup ( path ) ) )
+    {
+        repository_close ( repo );
+        return NULL;
+    }
+
+    if ( ext_buffer_new ( &repo->records ) < 0 )
+    {
+        repository_close ( repo );
+        return NULL;
+    }
+
+    if ( !( repo->chunks =
+            ( struct repository_chunk_t * ) calloc ( repo->mask + 1,
+                sizeof ( struct repository_chunk_t ) ) ) )
+    {
+        repository_close ( repo );
+        return NULL;
+    }
+
+    if ( !( repo->buffer = ( uint8_t * ) malloc ( REPOSITORY_CHUNK_MAX ) ) )
+    {
+        repository_close ( repo );
+        return NULL;
+    }
+
+    key = password ? password : "sbox";
+
+    /* Chunk ids are HMAC-SHA-256 from crypto backend */
+#ifdef ENABLE_ENCRYPTION
+    repo->crypto = crypto_backend (  );
+#else
+    fprintf ( stderr, "Error: Crypto support not enabled.\n" );
+    repository_close ( repo );
+    errno = ENOTSUP;
+    return NULL;
+#endif
+
+    if ( !( repo->mac = repo->crypto->mac_new ( ( const uint8_t * ) key, strlen ( key ) ) ) )
+    {
+        repository_close ( repo );
+        errno = EINVAL;
+        return NULL;
+    }
+
+    repository_file_path ( repo, "index", 0, index_path, sizeof ( index_path ) );
+
+    if ( repository_load_index ( repo, index_path ) < 0 )
+    {
+        repository_close ( repo );
+        return NULL;
+    }
+
+    return repo;
+}
+
+/**
+ * Close current pack of new chunks
+ */
+static int repository_close_pack ( struct repository_t *repo )
+{
+    if ( !repo->pack_io )
+    {
+        return 0;
+    }
+
+    if ( repo->pack_io->flush ( repo->pack_io ) < 0 )
+    {
+        repo->pack_io->close ( repo->pack_io );
+        repo->pack_io = NULL;
+        return -1;
+    }
+
+    repo->pack_io->close ( repo->pack_io );
+    repo->pack_io = NULL;
+
+    return 0;
+}
+
+/**
+ * Open new pack for new chunks
+ */
+static int repository_open_pack ( struct repository_t *repo )
+{
+    int fd;
+    char path[PATH_LIMIT];
+
+    repository_file_path ( repo, NULL, repo->pack_count, path, sizeof ( path ) );
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    if ( !( repo->pack_io = output_stream_new ( fd, repo->password, repo->compression,
+                repo->level ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    repo->pack = repo->pack_count++;
+    repo->pack_length = 0;
+
+    return 0;
+}
+
+/**
+ * Store chunk unless repository already has it, then reference it in manifest
+ */
+static int repository_put ( struct repository_t *repo, const uint8_t * data, size_t len,
+    struct io_stream_t *manifest )
+{
+    uint64_t storage;
+    uint8_t id[REPOSITORY_ID_LEN];
+    struct repository_chunk_t *chunk;
+
+    if ( repository_chunk_id ( repo, data, len, id ) < 0 )
+    {
+        return -1;
+    }
+
+    chunk = repository_slot ( repo, id );
+
+    if ( chunk->length )
+    {
+        repo->reused_chunks++;
+        repo->reused_bytes += len;
+
+    } else
+    {
+        if ( repo->pack_io && repo->pack_length >= REPO_PACK_LIMIT
+            && repository_close_pack ( repo ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( !repo->pack_io && repository_open_pack ( repo ) < 0 )
+        {
+            return -1;
+        }
+
+        /* Each chunk starts new compressed block so it can be read alone */
+        if ( repo->pack_io->split ( repo->pack_io, &storage ) < 0
+            || repo->pack_io->write_complete ( repo->pack_io, data, len ) < 0 )
+        {
+            return -1;
+        }
+
+        repo->pack_length += len;
+        repo->new_chunks++;
+        repo->new_bytes += len;
+
+        if ( ext_buffer_append_bytes ( &repo->records, id, sizeof ( id ) ) < 0
+            || ext_buffer_append_varint ( &repo->records, repo->pack ) < 0
+            || ext_buffer_append_varint ( &repo->records, storage ) < 0
+            || ext_buffer_append_varint ( &repo->records, len ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( repository_insert ( repo, id, repo->pack, storage, len ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( stream_write_varint ( manifest, len ) < 0
+        || manifest->write_complete ( manifest, id, sizeof ( id ) ) < 0 )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Find content defined chunk boundary using gear rolling hash
+ */
+static size_t repository_cut ( const struct repository_t *repo, const uint8_t * data, size_t len )
+{
+    size_t i;
+    uint64_t hash = 0;
+
+    if ( len <= REPO_CHUNK_MIN )
+    {
+        return len;
+    }
+
+    /* Gear hash depends on last 64 bytes only */
+    for ( i = REPO_CHUNK_MIN - 64; i < len; i++ )
+    {
+        hash = ( hash << 1 ) + repo->gear[data[i]];
+
+        if ( i >= REPO_CHUNK_MIN && !( hash & REPO_CHUNK_MASK ) )
+        {
+            return i + 1;
+        }
+    }
+
+    return len;
+}
+
+/**
+ * Split stream content into chunks, store them and reference them in manifest
+ */
+int repository_store ( struct repository_t *repo, struct io_stream_t *input,
+    struct io_stream_t *manifest, uint64_t * size )
+{
+    int eof = 0;
+    size_t cut;
+    size_t filled = 0;
+    ssize_t len;
+
+    *size = 0;
+
+    for ( ;; )
+    {
+        while ( !eof && filled < REPOSITORY_CHUNK_MAX )
+        {
+            if ( ( len = input->read ( input, repo->buffer + filled,
+                        REPOSITORY_CHUNK_MAX - filled ) ) < 0 )
+            {
+                return -1;
+            }
+
+            eof = !len;
+            filled += len;
+        }
+
+        if ( !filled )
+        {
+            break;
+        }
+
+        cut = repository_cut ( repo, repo->buffer, filled );
+
+        if ( repository_put ( repo, repo->buffer, cut, manifest ) < 0 )
+        {
+            return -1;
+        }
+
+        *size += cut;
+        memmove ( repo->buffer, repo->buffer + cut, filled - cut );
+        filled -= cut;
+    }
+
+    return 0;
+}
+
+/**
+ * Close pack and record its chunks in repository index
+ */
+int repository_commit ( struct repository_t *repo )
+{
+    int fd;
+    char path[PATH_LIMIT];
+    struct stat statbuf;
+
+    if ( repository_close_pack ( repo ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( !repo->records.length )
+    {
+        return 0;
+    }
+
+    repository_file_path ( repo, "index", 0, path, sizeof ( path ) );
+
+    if ( ( fd = open ( path, O_CREAT | O_WRONLY | O_APPEND | O_BINARY, 0644 ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    if ( fstat ( fd, &statbuf ) < 0 )
+    {
+        perror ( path );
+        close ( fd );
+        return -1;
+    }
+
+    if ( !statbuf.st_size && write ( fd, repository_index_magic,
+            sizeof ( repository_index_magic ) ) != sizeof ( repository_index_magic ) )
+    {
+        perror ( path );
+        close ( fd );
+        return -1;
+    }
+
+    if ( write ( fd, repo->records.bytes, repo->records.length )
+        != ( ssize_t ) repo->records.length )
+    {
+        perror ( path );
+        close ( fd );
+        return -1;
+    }
+
+    close ( fd );
+    ext_buffer_clear ( &repo->records );
+
+    return 0;
+}
+
+/**
+ * Load chunk content from repository and check it against its identifier
+ */
+int repository_load ( struct repository_t *repo, const uint8_t id[REPOSITORY_ID_LEN],
+    uint8_t * data, size_t len )
+{
+    int fd;
+    char path[PATH_LIMIT];
+    uint8_t check[REPOSITORY_ID_LEN];
+    struct repository_chunk_t *chunk;
+
+    chunk = repository_slot ( repo, id );
+
+    if ( !chunk->length )
+    {
+        fprintf ( stderr, "Error: Chunk missing from repository.\n" );
+        errno = ENOENT;
+        return -1;
+    }
+
+    if ( chunk->length != len )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( repo->read_pack != chunk->pack )
+    {
+        if ( repo->read_io )
+        {
+            repo->read_io->close ( repo->read_io );
+            repo->read_io = NULL;
+            repo->read_pack = UINT32_MAX;
+        }
+
+        repository_file_path ( repo, NULL, chunk->pack, path, sizeof ( path ) );
+
+        if ( ( fd = open ( path, O_RDONLY | O_BINARY ) ) < 0 )
+        {
+            perror ( path );
+            return -1;
+        }
+
+        if ( !( repo->read_io = input_stream_new ( fd, repo->password, NULL ) ) )
+        {
+            close ( fd );
+            return -1;
+        }
+
+        repo->read_pack = chunk->pack;
+    }
+
+    if ( repo->read_io->seek ( repo->read_io, chunk->storage ) < 0
+        || repo->read_io->read_complete ( repo->read_io, data, len ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( repository_chunk_id ( repo, data, len, check ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( memcmp ( check, id, REPOSITORY_ID_LEN ) )
+    {
+        fprintf ( stderr, "Error: Chunk checksum mismatch.\n" );
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Show repository growth caused by last store
+ */
+void repository_show_stats ( const struct repository_t *repo )
+{
+    printf ( "repository: %llu new chunks (%llu bytes), %llu reused (%llu bytes)\n",
+        ( unsigned long long ) repo->new_chunks, ( unsigned long long ) repo->new_bytes,
+        ( unsigned long long ) repo->reused_chunks, ( unsigned long long ) repo->reused_bytes );
+}
+
+/**
+ * Close chunk repository, uncommitted chunks are dropped from index
+ */
+void repository_close ( struct repository_t *repo )
+{
+    if ( repo->pack_io )
+    {
+        repo->pack_io->close ( repo->pack_io );
+    }
+
+    if ( repo->read_io )
+    {
+        repo->read_io->close ( repo->read_io );
+    }
+
+    if ( repo->mac )
+    {
+        repo->crypto->mac_free ( repo->mac );
+    }
+
+    ext_buffer_free ( &repo->records );
+    free ( repo->buffer );
+    free ( repo->chunks );
+    free ( repo->path );
+    free ( repo );
+}
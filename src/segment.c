@@ -0,0 +1,122 @@
+/* ------------------------------------------------------------------
+ * SBox - Archive Segments
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+#define SEGMENT_FOOTER_LEN 12
+
+/**
+ * Appended segment footer magic
+ */
+static const uint8_t archive_segment_magic[4] = { 's', 'b', 'x', 'a' };
+
+/**
+ * Append segment to list
+ */
+static int archive_segments_append ( struct archive_segment_t **segments, size_t *count,
+    uint64_t start, uint64_t end )
+{
+    struct archive_segment_t *backup;
+
+    backup = *segments;
+
+    if ( !( *segments =
+            ( struct archive_segment_t * ) realloc ( *segments,
+                ( *count + 1 ) * sizeof ( struct archive_segment_t ) ) ) )
+    {
+        free ( backup );
+        return -1;
+    }
+
+    ( *segments )[*count].start = start;
+    ( *segments )[*count].end = end;
+    ( *count )++;
+
+    return 0;
+}
+
+/**
+ * List archive segments in append order, walking footers back from file end
+ */
+int archive_segments_load ( int fd, struct archive_segment_t **segments, size_t *count )
+{
+    size_t i;
+    uint64_t end;
+    uint64_t start;
+    uint8_t footer[SEGMENT_FOOTER_LEN];
+    struct archive_segment_t segment;
+    struct stat statbuf;
+
+    *segments = NULL;
+    *count = 0;
+
+    if ( fstat ( fd, &statbuf ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( end = statbuf.st_size;; end = start )
+    {
+        if ( end < sizeof ( footer )
+            || pread ( fd, footer, sizeof ( footer ), end - sizeof ( footer ) ) != sizeof ( footer )
+            || memcmp ( footer + 8, archive_segment_magic, sizeof ( archive_segment_magic ) ) )
+        {
+            if ( archive_segments_append ( segments, count, 0, end ) < 0 )
+            {
+                return -1;
+            }
+
+            break;
+        }
+
+        for ( start = 0, i = 0; i < 8; i++ )
+        {
+            start = ( start << 8 ) | footer[i];
+        }
+
+        if ( !start || start >= end - sizeof ( footer ) )
+        {
+            free ( *segments );
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( archive_segments_append ( segments, count, start, end - sizeof ( footer ) ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    for ( i = 0; i < *count / 2; i++ )
+    {
+        segment = ( *segments )[i];
+        ( *segments )[i] = ( *segments )[*count - 1 - i];
+        ( *segments )[*count - 1 - i] = segment;
+    }
+
+    return 0;
+}
+
+/**
+ * Finish appended segment with footer pointing at its start
+ */
+int archive_segment_finish ( int fd, uint64_t start )
+{
+    int i;
+    uint8_t footer[SEGMENT_FOOTER_LEN];
+
+    for ( i = 0; i < 8; i++ )
+    {
+        footer[i] = ( start >> ( 56 - 8 * i ) ) & 0xff;
+    }
+
+    memcpy ( footer + 8, archive_segment_magic, sizeof ( archive_segment_magic ) );
+
+    if ( write ( fd, footer, sizeof ( footer ) ) != sizeof ( footer ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+/* ------------------------------------------------------------------
+ * SBox - Archive Shards
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+
+/**
+ * File content waiting for shard assignment
+ */
+struct shard_item_t
+{
+    uint64_t size;
+    uint32_t entry;
+};
+
+/**
+ * Shard task state
+ */
+struct shard_task_t
+{
+    const struct file_net_t *net;
+    struct iter_context_t *context;
+    file_net_iter_callback callback;
+};
+
+/**
+ * Compare shard items, largest first and file net order on ties
+ */
+static int shard_compare_items ( const void *a, const void *b )
+{
+    const struct shard_item_t *item_a = ( const struct shard_item_t * ) a;
+    const struct shard_item_t *item_b = ( const struct shard_item_t * ) b;
+
+    if ( item_a->size != item_b->size )
+    {
+        return item_a->size > item_b->size ? -1 : 1;
+    }
+
+    return item_a->entry < item_b->entry ? -1 : item_a->entry > item_b->entry;
+}
+
+/**
+ * Assign file contents to shards, duplicates follow their target
+ */
+uint8_t *shard_assign ( const struct file_net_t *net, int count )
+{
+    int i;
+    int best;
+    uint32_t entry;
+    size_t pos;
+    size_t item_count = 0;
+    uint64_t loads[SHARD_MAX];
+    uint8_t *shards;
+    struct shard_item_t *items;
+    struct sbox_node_t node;
+
+    if ( count < 1 || count > SHARD_MAX )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( !( shards = ( uint8_t * ) malloc ( net->count ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( items =
+            ( struct shard_item_t * ) malloc ( net->count * sizeof ( struct shard_item_t ) ) ) )
+    {
+        free ( shards );
+        return NULL;
+    }
+
+    memset ( shards, SHARD_NONE, net->count );
+
+    for ( entry = FILE_NET_ROOT + 1; entry < net->count; entry++ )
+    {
+        file_net_get ( net, entry, &node );
+
+        if ( file_net_has_body ( &node ) )
+        {
+            items[item_count].size = node.size;
+            items[item_count++].entry = entry;
+        }
+    }
+
+    qsort ( items, item_count, sizeof ( struct shard_item_t ), shard_compare_items );
+
+    memset ( loads, 0, sizeof ( loads ) );
+
+    /* Largest remaining content goes to least loaded shard */
+    for ( pos = 0; pos < item_count; pos++ )
+    {
+        for ( best = 0, i = 1; i < count; i++ )
+        {
+            if ( loads[i] < loads[best] )
+            {
+                best = i;
+            }
+        }
+
+        loads[best] += items[pos].size;
+        shards[items[pos].entry] = best;
+    }
+
+    free ( items );
+
+    /* Links are restored by shard holding their target */
+    for ( entry = FILE_NET_ROOT + 1; entry < net->count; entry++ )
+    {
+        file_net_get ( net, entry, &node );
+
+        if ( node.link != FILE_NET_NONE )
+        {
+            shards[entry] = shards[node.link];
+        }
+    }
+
+    return shards;
+}
+
+/**
+ * Get path of archive shard
+ */
+char *shard_path ( const char *archive, int shard )
+{
+    size_t len;
+    char *path;
+
+    len = strlen ( archive ) + 8;
+
+    if ( !( path = ( char * ) malloc ( len ) ) )
+    {
+        return NULL;
+    }
+
+    snprintf ( path, len, "%s.%d", archive, shard );
+
+    return path;
+}
+
+/**
+ * Save shard assignment to stream
+ */
+int shard_save_map ( struct io_stream_t *io, const uint8_t * shards, uint32_t entries, int count )
+{
+    if ( stream_write_varint ( io, count ) < 0 || stream_write_varint ( io, entries ) < 0 )
+    {
+        return -1;
+    }
+
+    return io->write_complete ( io, shards, entries );
+}
+
+/**
+ * Load shard assignment from stream
+ */
+uint8_t *shard_load_map ( struct io_stream_t *io, const struct file_net_t *net, int *count )
+{
+    uint32_t i;
+    uint64_t shard_count;
+    uint64_t entries;
+    uint8_t *shards;
+
+    if ( stream_read_varint ( io, &shard_count ) < 0 || stream_read_varint ( io, &entries ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( !shard_count || shard_count > SHARD_MAX || entries != net->count )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( !( shards = ( uint8_t * ) malloc ( net->count ) ) )
+    {
+        return NULL;
+    }
+
+    if ( io->read_complete ( io, shards, net->count ) < 0 )
+    {
+        free ( shards );
+        return NULL;
+    }
+
+    for ( i = 0; i < net->count; i++ )
+    {
+        if ( shards[i] != SHARD_NONE && shards[i] >= shard_count )
+        {
+            free ( shards );
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    *count = shard_count;
+
+    return shards;
+}
+
+/**
+ * Shard task entry
+ */
+static int shard_task ( void *arg )
+{
+    struct shard_task_t *task;
+
+    task = ( struct shard_task_t * ) arg;
+
+    return file_net_iter ( task->net, task->context, task->callback );
+}
+
+/**
+ * Browse file net once per shard, shards run as pool tasks
+ */
+int shard_run ( struct pool_t *pool, const struct file_net_t *net,
+    struct iter_context_t *contexts[], int count, file_net_iter_callback callback )
+{
+    int i;
+    struct shard_task_t tasks[SHARD_MAX];
+
+    for ( i = 0; i < count; i++ )
+    {
+        tasks[i].net = net;
+        tasks[i].context = contexts[i];
+        tasks[i].callback = callback;
+        contexts[i]->pool = pool;
+
+        /* Without pool shards are processed one after another */
+        if ( !pool && shard_task ( tasks + i ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( !pool )
+    {
+        return 0;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        pool_submit ( pool, shard_task, tasks + i );
+    }
+
+    return pool_wait ( pool );
+}
@@ -0,0 +1,689 @@
+/* ------------------------------------------------------------------
+ * SBox - Stream Stage Statistics
+ * ------------------------------------------------------------------ */
+
+#include "sbox.h"
+#include <pthread.h>
+
+/**
+ * Counters of stream stage, stacks sharing stage name add up
+ */
+struct stats_stage_t
+{
+    const char *name;
+    uint64_t calls;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t wall_ns;
+    uint64_t blocked_ns;
+};
+
+/**
+ * Call in progress on this thread, time blocked is added by stages below
+ */
+struct stats_frame_t
+{
+    uint64_t blocked_ns;
+};
+
+/**
+ * Stats stream context
+ */
+struct stats_stream_context_t
+{
+    struct io_stream_t *internal;
+    struct stats_stage_t *stage;
+};
+
+/**
+ * Stages registered so far, collection switch and its start time
+ */
+static struct stats_stage_t stats_stages[STATS_STAGE_MAX];
+static size_t stats_stage_count;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stats_active;
+static uint64_t stats_start_ns;
+static uint64_t stats_start_copies;
+static uint64_t stats_start_copy_bytes;
+
+/**
+ * Innermost stats stream call of this thread
+ */
+static __thread struct stats_frame_t *stats_frame;
+
+/**
+ * Get monotonic time in nanoseconds
+ */
+static uint64_t stats_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ( uint64_t ) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Find stage by name, register it if new
+ */
+static struct stats_stage_t *stats_stage ( const char *name )
+{
+    size_t i;
+    struct stats_stage_t *stage = NULL;
+
+    pthread_mutex_lock ( &stats_lock );
+
+    for ( i = 0; i < stats_stage_count; i++ )
+    {
+        if ( !strcmp ( stats_stages[i].name, name ) )
+        {
+            stage = stats_stages + i;
+            break;
+        }
+    }
+
+    if ( !stage && stats_stage_count < STATS_STAGE_MAX )
+    {
+        stage = stats_stages + stats_stage_count++;
+        stage->name = name;
+    }
+
+    pthread_mutex_unlock ( &stats_lock );
+
+    if ( !stage )
+    {
+        errno = ENOSPC;
+    }
+
+    return stage;
+}
+
+/**
+ * Open call frame, time spent below it counts as blocked
+ */
+static uint64_t stats_enter ( struct stats_frame_t *frame, struct stats_frame_t **parent )
+{
+    frame->blocked_ns = 0;
+    *parent = stats_frame;
+    stats_frame = frame;
+
+    return stats_now (  );
+}
+
+/**
+ * Close call frame and add it to stage and to caller frame
+ */
+static void stats_leave ( struct stats_stream_context_t *context, struct stats_frame_t *frame,
+    struct stats_frame_t *parent, uint64_t start, ssize_t read_len, ssize_t write_len )
+{
+    uint64_t elapsed;
+    struct stats_stage_t *stage;
+
+    elapsed = stats_now (  ) - start;
+    stats_frame = parent;
+
+    if ( parent )
+    {
+        parent->blocked_ns += elapsed;
+    }
+
+    stage = context->stage;
+
+    __atomic_fetch_add ( &stage->calls, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add ( &stage->wall_ns, elapsed, __ATOMIC_RELAXED );
+    __atomic_fetch_add ( &stage->blocked_ns, MIN ( frame->blocked_ns, elapsed ),
+        __ATOMIC_RELAXED );
+
+    if ( read_len > 0 )
+    {
+        __atomic_fetch_add ( &stage->read_bytes, read_len, __ATOMIC_RELAXED );
+    }
+
+    if ( write_len > 0 )
+    {
+        __atomic_fetch_add ( &stage->write_bytes, write_len, __ATOMIC_RELAXED );
+    }
+}
+
+/*
+ * Read data from stats stream
+ */
+static ssize_t stats_stream_read ( struct io_stream_t *io, void *data, size_t len )
+{
+    ssize_t length;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    length = context->internal->read ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, length, 0 );
+
+    return length;
+}
+
+/*
+ * Read complete data chunk from stats stream
+ */
+static int stats_stream_read_complete ( struct io_stream_t *io, void *data, size_t len )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->read_complete ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, status < 0 ? 0 : ( ssize_t ) len, 0 );
+
+    return status;
+}
+
+/*
+ * Read longest data chunk from stats stream
+ */
+static ssize_t stats_stream_read_max ( struct io_stream_t *io, void *data, size_t len )
+{
+    ssize_t length;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    length = context->internal->read_max ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, length, 0 );
+
+    return length;
+}
+
+/*
+ * Write data to stats stream
+ */
+static ssize_t stats_stream_write ( struct io_stream_t *io, const void *data, size_t len )
+{
+    ssize_t length;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    length = context->internal->write ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, 0, length );
+
+    return length;
+}
+
+/*
+ * Write complete data chunk to stats stream
+ */
+static int stats_stream_write_complete ( struct io_stream_t *io, const void *data, size_t len )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->write_complete ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, 0, status < 0 ? 0 : ( ssize_t ) len );
+
+    return status;
+}
+
+/*
+ * Borrow data from stats stream, counted once consumed
+ */
+static ssize_t stats_stream_peek ( struct io_stream_t *io, const void **data, size_t len )
+{
+    ssize_t length;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    length = context->internal->peek ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    return length;
+}
+
+/*
+ * Drop data borrowed from stats stream
+ */
+static int stats_stream_consume ( struct io_stream_t *io, size_t len )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->consume ( context->internal, len );
+    stats_leave ( context, &frame, parent, start, status < 0 ? 0 : ( ssize_t ) len, 0 );
+
+    return status;
+}
+
+/*
+ * Borrow space for data written to stats stream, counted once committed
+ */
+static ssize_t stats_stream_reserve ( struct io_stream_t *io, void **data, size_t len )
+{
+    ssize_t length;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    length = context->internal->reserve ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    return length;
+}
+
+/*
+ * Pass data written to space borrowed from stats stream
+ */
+static int stats_stream_commit ( struct io_stream_t *io, size_t len )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->commit ( context->internal, len );
+    stats_leave ( context, &frame, parent, start, 0, status < 0 ? 0 : ( ssize_t ) len );
+
+    return status;
+}
+
+/*
+ * Verify stats stream integrity
+ */
+static int stats_stream_verify ( struct io_stream_t *io )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->verify ( context->internal );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    return status;
+}
+
+/*
+ * Flush stats stream output
+ */
+static int stats_stream_flush ( struct io_stream_t *io )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->flush ( context->internal );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    return status;
+}
+
+/*
+ * Start new block in stats stream output
+ */
+static int stats_stream_split ( struct io_stream_t *io, uint64_t * offset )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->split ( context->internal, offset );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    return status;
+}
+
+/*
+ * Write annotation data to stats stream
+ */
+static int stats_stream_annotate ( struct io_stream_t *io, const void *data, size_t len )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->annotate ( context->internal, data, len );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    return status;
+}
+
+/*
+ * Seek stats stream to storage offset
+ */
+static int stats_stream_seek ( struct io_stream_t *io, uint64_t offset )
+{
+    int status;
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    status = context->internal->seek ( context->internal, offset );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    return status;
+}
+
+/*
+ * Get stats stream storage length
+ */
+static int stats_stream_length ( struct io_stream_t *io, uint64_t * length )
+{
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    return context->internal->length ( context->internal, length );
+}
+
+/*
+ * Close IO stream, closing stages below may wait for their workers
+ */
+static void stats_stream_close ( struct io_stream_t *io )
+{
+    uint64_t start;
+    struct stats_frame_t frame;
+    struct stats_frame_t *parent;
+    struct stats_stream_context_t *context;
+
+    context = ( struct stats_stream_context_t * ) io->context;
+
+    start = stats_enter ( &frame, &parent );
+    context->internal->close ( context->internal );
+    stats_leave ( context, &frame, parent, start, 0, 0 );
+
+    free ( context );
+    free ( io );
+}
+
+/**
+ * Create new stats stream counting bytes, calls, wall and blocked time
+ * of internal stream under given stage name
+ */
+struct io_stream_t *stats_stream_new ( struct io_stream_t *internal, const char *name )
+{
+    struct io_stream_t *io;
+    struct stats_stage_t *stage;
+    struct stats_stream_context_t *context;
+
+    if ( !( stage = stats_stage ( name ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( io = io_stream_new (  ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( context =
+            ( struct stats_stream_context_t * ) malloc ( sizeof ( struct
+                    stats_stream_context_t ) ) ) )
+    {
+        free ( io );
+        return NULL;
+    }
+
+    context->internal = internal;
+    context->stage = stage;
+
+    /* Optional operations stay unset when internal stream lacks them */
+    io->context = context;
+    io->read = stats_stream_read;
+    io->read_complete = stats_stream_read_complete;
+    io->read_max = stats_stream_read_max;
+    io->write = stats_stream_write;
+    io->write_complete = stats_stream_write_complete;
+    io->verify = internal->verify ? stats_stream_verify : NULL;
+    io->flush = internal->flush ? stats_stream_flush : NULL;
+    io->split = internal->split ? stats_stream_split : NULL;
+    io->annotate = internal->annotate ? stats_stream_annotate : NULL;
+    io->seek = internal->seek ? stats_stream_seek : NULL;
+    io->length = internal->length ? stats_stream_length : NULL;
+    io->peek = internal->peek ? stats_stream_peek : NULL;
+    io->consume = internal->peek ? stats_stream_consume : NULL;
+    io->reserve = internal->reserve ? stats_stream_reserve : NULL;
+    io->commit = internal->reserve ? stats_stream_commit : NULL;
+    io->close = stats_stream_close;
+
+    return io;
+}
+
+/**
+ * Wrap stream in stats stream if stats are collected, stream is closed on failure
+ */
+struct io_stream_t *stats_stream_wrap ( struct io_stream_t *stream, const char *name )
+{
+    struct io_stream_t *stats_stream;
+
+    if ( !__atomic_load_n ( &stats_active, __ATOMIC_RELAXED ) )
+    {
+        return stream;
+    }
+
+    if ( !( stats_stream = stats_stream_new ( stream, name ) ) )
+    {
+        stream->close ( stream );
+        return NULL;
+    }
+
+    return stats_stream;
+}
+
+/**
+ * Start collecting stats of new streams, counters start from zero
+ */
+void stats_start ( void )
+{
+    size_t i;
+
+    pthread_mutex_lock ( &stats_lock );
+
+    for ( i = 0; i < stats_stage_count; i++ )
+    {
+        stats_stages[i].calls = 0;
+        stats_stages[i].read_bytes = 0;
+        stats_stages[i].write_bytes = 0;
+        stats_stages[i].wall_ns = 0;
+        stats_stages[i].blocked_ns = 0;
+    }
+
+    stream_copy_stats ( &stats_start_copies, &stats_start_copy_bytes );
+    stats_start_ns = stats_now (  );
+    __atomic_store_n ( &stats_active, 1, __ATOMIC_RELAXED );
+
+    pthread_mutex_unlock ( &stats_lock );
+}
+
+/**
+ * Get time for wait about to start, zero if no stats stream call is in progress
+ */
+uint64_t stats_wait_begin ( void )
+{
+    return stats_frame ? stats_now (  ) : 0;
+}
+
+/**
+ * Count wait as time blocked by stats stream call in progress
+ */
+void stats_wait_end ( uint64_t start )
+{
+    if ( start && stats_frame )
+    {
+        stats_frame->blocked_ns += stats_now (  ) - start;
+    }
+}
+
+/**
+ * Convert nanoseconds to milliseconds
+ */
+static double stats_ms ( uint64_t ns )
+{
+    return ns / 1000000.0;
+}
+
+/**
+ * Get throughput in MB/s of bytes passed in given time
+ */
+static double stats_rate ( uint64_t bytes, uint64_t ns )
+{
+    return ns ? bytes * 1000.0 / ns : 0.0;
+}
+
+/**
+ * Print stats as JSON
+ */
+static void stats_show_json ( uint64_t elapsed, uint64_t copies, uint64_t copy_bytes,
+    size_t peak, size_t spilled )
+{
+    size_t i;
+    const struct stats_stage_t *stage;
+
+    fprintf ( stderr, "{\"elapsed_ns\":%llu,\"stages\":[", ( unsigned long long ) elapsed );
+
+    for ( i = 0; i < stats_stage_count; i++ )
+    {
+        stage = stats_stages + i;
+        fprintf ( stderr, "%s{\"name\":\"%s\",\"calls\":%llu,\"read_bytes\":%llu,"
+            "\"write_bytes\":%llu,\"wall_ns\":%llu,\"blocked_ns\":%llu}", i ? "," : "",
+            stage->name, ( unsigned long long ) stage->calls,
+            ( unsigned long long ) stage->read_bytes, ( unsigned long long ) stage->write_bytes,
+            ( unsigned long long ) stage->wall_ns, ( unsigned long long ) stage->blocked_ns );
+    }
+
+    fprintf ( stderr, "],\"copies\":%llu,\"copy_bytes\":%llu,\"memory_peak\":%lu,"
+        "\"memory_spilled\":%lu}\n", ( unsigned long long ) copies,
+        ( unsigned long long ) copy_bytes, ( unsigned long ) peak, ( unsigned long ) spilled );
+}
+
+/**
+ * Print stats as table
+ */
+static void stats_show_table ( uint64_t elapsed, uint64_t copies, uint64_t copy_bytes,
+    size_t peak, size_t spilled )
+{
+    size_t i;
+    uint64_t bytes;
+    uint64_t busy;
+    const struct stats_stage_t *stage;
+
+    fprintf ( stderr, "%-8s %10s %12s %12s %10s %10s %10s %9s\n", "stage", "calls", "read MB",
+        "written MB", "wall ms", "blocked ms", "busy ms", "MB/s" );
+
+    for ( i = 0; i < stats_stage_count; i++ )
+    {
+        stage = stats_stages + i;
+        bytes = stage->read_bytes + stage->write_bytes;
+        busy = stage->wall_ns - stage->blocked_ns;
+
+        fprintf ( stderr, "%-8s %10llu %12.2f %12.2f %10.1f %10.1f %10.1f %9.1f\n",
+            stage->name, ( unsigned long long ) stage->calls, stage->read_bytes / 1048576.0,
+            stage->write_bytes / 1048576.0, stats_ms ( stage->wall_ns ),
+            stats_ms ( stage->blocked_ns ), stats_ms ( busy ), stats_rate ( bytes, busy ) );
+    }
+
+    fprintf ( stderr, "elapsed %.1f ms, copies %llu of %.2f MB, memory peak %luK, "
+        "spilled %luK\n", stats_ms ( elapsed ), ( unsigned long long ) copies,
+        copy_bytes / 1048576.0, ( unsigned long ) ( peak / 1024 ),
+        ( unsigned long ) ( spilled / 1024 ) );
+}
+
+/**
+ * Stop collecting stats and print summary of stages to stderr, busy time
+ * is wall time less time blocked on stages below or on worker threads
+ */
+void stats_show ( int json )
+{
+    int error;
+    size_t used;
+    size_t peak;
+    size_t spilled;
+    uint64_t elapsed;
+    uint64_t copies;
+    uint64_t copy_bytes;
+
+    error = errno;
+
+    pthread_mutex_lock ( &stats_lock );
+
+    __atomic_store_n ( &stats_active, 0, __ATOMIC_RELAXED );
+    elapsed = stats_now (  ) - stats_start_ns;
+    stream_copy_stats ( &copies, &copy_bytes );
+    copies -= stats_start_copies;
+    copy_bytes -= stats_start_copy_bytes;
+    budget_stats ( &used, &peak, &spilled );
+
+    if ( json )
+    {
+        stats_show_json ( elapsed, copies, copy_bytes, peak, spilled );
+
+    } else
+    {
+        stats_show_table ( elapsed, copies, copy_bytes, peak, spilled );
+    }
+
+    pthread_mutex_unlock ( &stats_lock );
+
+    errno = error;
+}
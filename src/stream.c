@@ -4,6 +4,17 @@
 
 #include "sbox.h"
 
+/**
+ * Copies made between stream buffers, shared by all streams
+ */
+static uint64_t stream_copies;
+static uint64_t stream_copy_bytes;
+
+/**
+ * Settings used by new streams
+ */
+static struct stream_params_t stream_current = { CHUNK_SIZE, 0, 0 };
+
 /**
  * Create new IO stream
  */
@@ -23,11 +34,30 @@ struct io_stream_t *io_stream_new ( void )
     return io;
 }
 
+/**
+ * Check if stream layers may run on own threads, single CPU gains nothing by it
+ */
+static int stream_async_enabled ( void )
+{
+    return sysconf ( _SC_NPROCESSORS_ONLN ) > 1;
+}
+
 /**
  * Create new input stream
  */
-struct io_stream_t *input_stream_new ( int fd, const char *password )
+struct io_stream_t *input_stream_new ( int fd, const char *password,
+    struct io_stream_t **storage )
 {
+    return input_range_stream_new ( fd, 0, UINT64_MAX, password, storage );
+}
+
+/**
+ * Create new input stream over part of file
+ */
+struct io_stream_t *input_range_stream_new ( int fd, uint64_t start, uint64_t end,
+    const char *password, struct io_stream_t **storage )
+{
+    uint8_t version;
     uint8_t compression;
     struct io_stream_t *file_stream;
     struct io_stream_t *storage_stream;
@@ -38,7 +68,12 @@ struct io_stream_t *input_stream_new ( int fd, const char *password )
     struct io_stream_t *buffer_stream;
     unsigned char prefix[ARCHIVE_PREFIX_LENGTH];
 
-    if ( !( file_stream = file_stream_new ( fd ) ) )
+    if ( !( file_stream = file_range_stream_new ( fd, start, end ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( file_stream = stats_stream_wrap ( file_stream, "archive" ) ) )
     {
         return NULL;
     }
@@ -51,6 +86,11 @@ struct io_stream_t *input_stream_new ( int fd, const char *password )
             file_stream->close ( file_stream );
             return NULL;
         }
+
+        if ( !( storage_stream = stats_stream_wrap ( storage_stream, "aes" ) ) )
+        {
+            return NULL;
+        }
 #else
         UNUSED ( password );
         fprintf ( stderr, "Error: Crypto support not enabled.\n" );
@@ -63,6 +103,21 @@ struct io_stream_t *input_stream_new ( int fd, const char *password )
         storage_stream = file_stream;
     }
 
+    /* Storage is read ahead on own thread while upper layers decode */
+    if ( stream_async_enabled (  ) )
+    {
+        if ( !( stream = input_async_stream_new ( storage_stream, ASYNC_STREAM_DEPTH ) ) )
+        {
+            storage_stream->close ( storage_stream );
+            return NULL;
+        }
+
+        if ( !( storage_stream = stats_stream_wrap ( stream, "async" ) ) )
+        {
+            return NULL;
+        }
+    }
+
     if ( storage_stream->read_complete ( storage_stream, prefix, sizeof ( prefix ) ) < 0 )
     {
         storage_stream->close ( storage_stream );
@@ -77,6 +132,22 @@ struct io_stream_t *input_stream_new ( int fd, const char *password )
         return NULL;
     }
 
+    if ( storage_stream->read_complete ( storage_stream, &version, sizeof ( version ) ) < 0 )
+    {
+        storage_stream->close ( storage_stream );
+        return NULL;
+    }
+
+    /* Archives before format versioning carry compression mode here, they count as version 1 */
+    if ( version != ARCHIVE_FORMAT_VERSION )
+    {
+        fprintf ( stderr, "Error: Unsupported archive format version %u, expected %u.\n",
+            version > COMP_LZ4 ? version : 1, ARCHIVE_FORMAT_VERSION );
+        storage_stream->close ( storage_stream );
+        errno = ENOTSUP;
+        return NULL;
+    }
+
     if ( storage_stream->read_complete ( storage_stream, &compression,
             sizeof ( compression ) ) < 0 )
     {
@@ -97,7 +168,10 @@ struct io_stream_t *input_stream_new ( int fd, const char *password )
             return NULL;
         }
 
-        stream = inflate_stream;
+        if ( !( stream = stats_stream_wrap ( inflate_stream, "lz4" ) ) )
+        {
+            return NULL;
+        }
         break;
 #else
         fprintf ( stderr, "Error: Compression support not enabled.\n" );
@@ -118,6 +192,11 @@ struct io_stream_t *input_stream_new ( int fd, const char *password )
         return NULL;
     }
 
+    if ( storage )
+    {
+        *storage = storage_stream;
+    }
+
     return buffer_stream;
 }
 
@@ -127,15 +206,31 @@ struct io_stream_t *input_stream_new ( int fd, const char *password )
 struct io_stream_t *output_stream_new ( int fd, const char *password, uint8_t compression,
     int level )
 {
+    return output_range_stream_new ( fd, 0, password, compression, level );
+}
+
+/**
+ * Create new output stream starting at given file offset
+ */
+struct io_stream_t *output_range_stream_new ( int fd, uint64_t start, const char *password,
+    uint8_t compression, int level )
+{
+    uint8_t version = ARCHIVE_FORMAT_VERSION;
     struct io_stream_t *file_stream;
     struct io_stream_t *storage_stream;
 #ifdef ENABLE_LZ4
     struct io_stream_t *deflate_stream;
 #endif
     struct io_stream_t *stream;
+    struct io_stream_t *async_stream;
     struct io_stream_t *buffer_stream;
 
-    if ( !( file_stream = file_stream_new ( fd ) ) )
+    if ( !( file_stream = file_range_stream_new ( fd, start, UINT64_MAX ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( file_stream = stats_stream_wrap ( file_stream, "archive" ) ) )
     {
         return NULL;
     }
@@ -148,6 +243,11 @@ struct io_stream_t *output_stream_new ( int fd, const char *password, uint8_t co
             file_stream->close ( file_stream );
             return NULL;
         }
+
+        if ( !( storage_stream = stats_stream_wrap ( storage_stream, "aes" ) ) )
+        {
+            return NULL;
+        }
 #else
         UNUSED ( password );
         fprintf ( stderr, "Error: Crypto support not enabled.\n" );
@@ -167,6 +267,12 @@ struct io_stream_t *output_stream_new ( int fd, const char *password, uint8_t co
         return NULL;
     }
 
+    if ( storage_stream->write_complete ( storage_stream, &version, sizeof ( version ) ) < 0 )
+    {
+        storage_stream->close ( storage_stream );
+        return NULL;
+    }
+
     if ( storage_stream->write_complete ( storage_stream, &compression,
             sizeof ( compression ) ) < 0 )
     {
@@ -187,7 +293,10 @@ struct io_stream_t *output_stream_new ( int fd, const char *password, uint8_t co
             return NULL;
         }
 
-        stream = deflate_stream;
+        if ( !( stream = stats_stream_wrap ( deflate_stream, "lz4" ) ) )
+        {
+            return NULL;
+        }
         break;
 #else
         UNUSED ( level );
@@ -203,6 +312,21 @@ struct io_stream_t *output_stream_new ( int fd, const char *password, uint8_t co
         return NULL;
     }
 
+    /* Compression, encryption and writes run on own thread while files are read */
+    if ( stream_async_enabled (  ) )
+    {
+        if ( !( async_stream = output_async_stream_new ( stream, ASYNC_STREAM_DEPTH ) ) )
+        {
+            stream->close ( stream );
+            return NULL;
+        }
+
+        if ( !( stream = stats_stream_wrap ( async_stream, "async" ) ) )
+        {
+            return NULL;
+        }
+    }
+
     if ( !( buffer_stream = buffer_stream_new ( stream ) ) )
     {
         stream->close ( stream );
@@ -280,3 +404,221 @@ int stream_write_complete ( struct io_stream_t *io, const void *mem, size_t tota
 
     return 0;
 }
+
+/**
+ * Borrow readable data from stream buffer, read into mem if stream has none
+ */
+ssize_t stream_peek ( struct io_stream_t *io, const void **data, void *mem, size_t total )
+{
+    if ( io->peek )
+    {
+        return io->peek ( io, data, total );
+    }
+
+    *data = mem;
+
+    return io->read ( io, mem, total );
+}
+
+/**
+ * Drop data borrowed by stream_peek
+ */
+int stream_consume ( struct io_stream_t *io, size_t total )
+{
+    if ( io->peek )
+    {
+        return io->consume ( io, total );
+    }
+
+    return 0;
+}
+
+/**
+ * Borrow writable space from stream buffer, mem is used if stream has none
+ */
+ssize_t stream_reserve ( struct io_stream_t *io, void **data, void *mem, size_t total )
+{
+    if ( io->reserve )
+    {
+        return io->reserve ( io, data, total );
+    }
+
+    *data = mem;
+
+    return total;
+}
+
+/**
+ * Pass data written to space borrowed by stream_reserve
+ */
+int stream_commit ( struct io_stream_t *io, const void *data, size_t total )
+{
+    if ( io->reserve )
+    {
+        return io->commit ( io, total );
+    }
+
+    return io->write_complete ( io, data, total );
+}
+
+/**
+ * Get stream settings used by new streams
+ */
+const struct stream_params_t *stream_params ( void )
+{
+    return &stream_current;
+}
+
+/**
+ * Change stream settings used by new streams, buffer size must be power of two
+ * and LZ4 block size one of 64K, 256K, 1M or 4M
+ */
+int stream_params_set ( const struct stream_params_t *params )
+{
+    if ( params->buffer_size < STREAM_BUFFER_MIN || params->buffer_size > STREAM_BUFFER_MAX
+        || params->buffer_size & ( params->buffer_size - 1 ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch ( params->lz4_block_size )
+    {
+    case 0:
+    case 65536:
+    case 262144:
+    case 1048576:
+    case 4194304:
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    stream_current = *params;
+
+    return 0;
+}
+
+/**
+ * Allocate iterate context with buffer of current stream buffer size
+ */
+struct iter_context_t *iter_context_new ( void )
+{
+    struct iter_context_t *iter_context;
+
+    if ( !( iter_context =
+            ( struct iter_context_t * ) budget_calloc ( sizeof ( struct iter_context_t )
+                + stream_current.buffer_size ) ) )
+    {
+        return NULL;
+    }
+
+    iter_context->buffer_size = stream_current.buffer_size;
+
+    return iter_context;
+}
+
+/**
+ * Free iterate context
+ */
+void iter_context_free ( struct iter_context_t *iter_context )
+{
+    budget_free ( iter_context );
+}
+
+/**
+ * Estimate memory taken by stream stack with current settings, LZ4 input assumed
+ * to use default block size since frame header is not read yet
+ */
+size_t stream_memory_estimate ( int input, const char *password, uint8_t compression,
+    int level )
+{
+    size_t memory;
+
+    memory = budget_cost ( stream_current.buffer_size );
+
+    if ( stream_async_enabled (  ) )
+    {
+        memory += budget_cost ( ASYNC_STREAM_DEPTH * stream_current.buffer_size );
+    }
+#ifdef ENABLE_ENCRYPTION
+    if ( password )
+    {
+        memory += aes_stream_memory (  );
+    }
+#else
+    UNUSED ( password );
+#endif
+#ifdef ENABLE_LZ4
+    if ( compression == COMP_LZ4 )
+    {
+        memory += lz4_stream_memory ( input, level );
+    }
+#else
+    UNUSED ( input );
+    UNUSED ( compression );
+    UNUSED ( level );
+#endif
+
+    return memory;
+}
+
+/**
+ * Count bytes copied between stream buffers
+ */
+void stream_count_copy ( size_t total )
+{
+    __atomic_fetch_add ( &stream_copies, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add ( &stream_copy_bytes, total, __ATOMIC_RELAXED );
+}
+
+/**
+ * Get number of copies and bytes copied between stream buffers
+ */
+void stream_copy_stats ( uint64_t * copies, uint64_t * bytes )
+{
+    *copies = __atomic_load_n ( &stream_copies, __ATOMIC_RELAXED );
+    *bytes = __atomic_load_n ( &stream_copy_bytes, __ATOMIC_RELAXED );
+}
+
+/**
+ * Read variable length integer from stream
+ */
+int stream_read_varint ( struct io_stream_t *io, uint64_t * value )
+{
+    uint8_t byte;
+    unsigned int shift = 0;
+
+    *value = 0;
+
+    do
+    {
+        if ( shift >= 64 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( io->read_complete ( io, &byte, sizeof ( byte ) ) < 0 )
+        {
+            return -1;
+        }
+
+        *value |= ( uint64_t ) ( byte & 0x7f ) << shift;
+        shift += 7;
+
+    } while ( byte & 0x80 );
+
+    return 0;
+}
+
+/**
+ * Write variable length integer to stream
+ */
+int stream_write_varint ( struct io_stream_t *io, uint64_t value )
+{
+    uint8_t bytes[VARINT_LIMIT];
+
+    return io->write_complete ( io, bytes, varint_encode ( bytes, value ) );
+}
@@ -3,184 +3,1498 @@
  * ------------------------------------------------------------------ */
 
 #include "sbox.h"
+#include <ftw.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#define PATH_UNSELECTED 0
+#define PATH_SELECTED 1
+#define PATH_ANCESTOR 2
+
+#define ARCHIVE_PLAIN 0
+#define ARCHIVE_MANIFEST 1
+#define ARCHIVE_SHARDED 2
+#define ARCHIVE_SHARD 3
+
+/**
+ * Hard link target met while unpacking
+ */
+struct link_target_t
+{
+    uint32_t entry;
+    uint64_t offset;
+    char *path;
+};
+
+/**
+ * Hard link targets in file net order
+ */
+struct link_table_t
+{
+    size_t count;
+    size_t capacity;
+    struct link_target_t *targets;
+};
+
+/**
+ * Match archive path against requested paths
+ */
+static int sbox_unpack_match ( const char **paths, const char *path )
+{
+    int result = PATH_UNSELECTED;
+    size_t len;
+    size_t path_len;
+
+    path_len = strlen ( path );
+
+    for ( ; *paths; paths++ )
+    {
+        len = strlen ( *paths );
+
+        while ( len > 1 && ( *paths )[len - 1] == '/' )
+        {
+            len--;
+        }
+
+        if ( path_len >= len && !strncmp ( path, *paths, len )
+            && ( path_len == len || path[len] == '/' ) )
+        {
+            return PATH_SELECTED;
+        }
+
+        if ( path_len < len && !strncmp ( *paths, path, path_len ) && ( *paths )[path_len] == '/' )
+        {
+            result = PATH_ANCESTOR;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Create new hard link target table
+ */
+static void link_table_new ( struct link_table_t *table )
+{
+    table->count = 0;
+    table->capacity = 0;
+    table->targets = NULL;
+}
+
+/**
+ * Append hard link target, entries come in increasing order
+ */
+static struct link_target_t *link_table_append ( struct link_table_t *table, uint32_t entry,
+    uint64_t offset )
+{
+    size_t capacity;
+    struct link_target_t *targets;
+    struct link_target_t *target;
+
+    if ( table->count == table->capacity )
+    {
+        capacity = table->capacity ? 2 * table->capacity : 64;
+
+        if ( !( targets =
+                ( struct link_target_t * ) realloc ( table->targets,
+                    capacity * sizeof ( struct link_target_t ) ) ) )
+        {
+            return NULL;
+        }
+
+        table->targets = targets;
+        table->capacity = capacity;
+    }
+
+    target = table->targets + table->count++;
+    target->entry = entry;
+    target->offset = offset;
+    target->path = NULL;
+
+    return target;
+}
+
+/**
+ * Find hard link target by file net entry
+ */
+static struct link_target_t *link_table_find ( const struct link_table_t *table, uint32_t entry )
+{
+    size_t lo = 0;
+    size_t hi = table->count;
+    size_t mid;
+
+    while ( lo < hi )
+    {
+        mid = lo + ( hi - lo ) / 2;
+
+        if ( table->targets[mid].entry < entry )
+        {
+            lo = mid + 1;
+
+        } else
+        {
+            hi = mid;
+        }
+    }
+
+    if ( lo < table->count && table->targets[lo].entry == entry )
+    {
+        return table->targets + lo;
+    }
+
+    return NULL;
+}
+
+/**
+ * Free hard link target table from memory
+ */
+static void link_table_free ( struct link_table_t *table )
+{
+    size_t i;
+
+    for ( i = 0; i < table->count; i++ )
+    {
+        free ( table->targets[i].path );
+    }
+
+    free ( table->targets );
+}
+
+/**
+ * Borrow next archive data, fails at end of stream like read_complete
+ */
+static size_t sbox_unpack_borrow ( struct iter_context_t *iter_context, const void **data,
+    size_t len )
+{
+    ssize_t length;
+
+    if ( ( length = stream_peek ( iter_context->io, data, iter_context->buffer, len ) ) < 0 )
+    {
+        return 0;
+    }
+
+    if ( !length )
+    {
+        errno = ENODATA;
+        return 0;
+    }
+
+    return length;
+}
+
+/**
+ * Position archive stream at current file content
+ */
+static int sbox_unpack_locate ( struct iter_context_t *iter_context )
+{
+    size_t len;
+    const void *data;
+    const struct archive_block_t *block;
+
+    if ( iter_context->offset < iter_context->stream_offset && !iter_context->index )
+    {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    if ( iter_context->index
+        && ( block = archive_index_lookup ( iter_context->index, iter_context->offset ) )
+        && ( block->logical > iter_context->stream_offset
+            || iter_context->offset < iter_context->stream_offset ) )
+    {
+        if ( iter_context->io->seek ( iter_context->io, block->storage ) < 0 )
+        {
+            return -1;
+        }
+
+        iter_context->stream_offset = block->logical;
+    }
+
+    while ( iter_context->stream_offset < iter_context->offset )
+    {
+        len = MIN ( iter_context->buffer_size,
+            iter_context->offset - iter_context->stream_offset );
+
+        if ( ( len = sbox_unpack_borrow ( iter_context, &data, len ) ) == 0 )
+        {
+            return -1;
+        }
+
+        if ( stream_consume ( iter_context->io, len ) < 0 )
+        {
+            return -1;
+        }
+
+        iter_context->stream_offset += len;
+    }
+
+    return 0;
+}
+
+/**
+ * Check if destination file already matches archive entry
+ */
+static int sbox_unpack_unchanged ( const struct sbox_node_t *node, const char *path )
+{
+    struct stat statbuf;
+
+    if ( fstatat ( AT_FDCWD, path, &statbuf, 0 ) < 0 )
+    {
+        return 0;
+    }
+
+    return S_ISREG ( statbuf.st_mode ) && ( uint64_t ) statbuf.st_size == node->size
+        && statbuf.st_mtime == node->mtime;
+}
+
+/**
+ * Check if two paths are hard links to the same file
+ */
+static int sbox_unpack_same_file ( const char *path, const char *other )
+{
+    struct stat statbuf;
+    struct stat other_statbuf;
+
+    if ( fstatat ( AT_FDCWD, path, &statbuf, AT_SYMLINK_NOFOLLOW ) < 0
+        || fstatat ( AT_FDCWD, other, &other_statbuf, AT_SYMLINK_NOFOLLOW ) < 0 )
+    {
+        return 0;
+    }
+
+    return statbuf.st_dev == other_statbuf.st_dev && statbuf.st_ino == other_statbuf.st_ino;
+}
+
+/**
+ * Remove one entry of tombstoned tree
+ */
+static int sbox_unpack_remove_entry ( const char *path, const struct stat *statbuf, int flag,
+    struct FTW *ftw )
+{
+    UNUSED ( statbuf );
+    UNUSED ( flag );
+    UNUSED ( ftw );
+
+    if ( remove ( path ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Remove path recorded as deleted by an increment
+ */
+static int sbox_unpack_tombstone ( struct iter_context_t *iter_context, const char *path )
+{
+    if ( iter_context->options & OPTION_LISTONLY )
+    {
+        show_progress ( 'r', path );
+        return 0;
+    }
+
+    if ( iter_context->options & OPTION_TESTONLY )
+    {
+        return 0;
+    }
+
+    if ( nftw ( path, sbox_unpack_remove_entry, 16, FTW_DEPTH | FTW_PHYS ) < 0 && errno != ENOENT )
+    {
+        return -1;
+    }
+
+    if ( iter_context->options & OPTION_VERBOSE )
+    {
+        show_progress ( 'r', path );
+    }
+
+    return 0;
+}
+
+/**
+ * Compare file content checksum against one recorded for entry
+ */
+static void sbox_unpack_check ( struct iter_context_t *iter_context, uint32_t entry, uint32_t crc,
+    const char *path )
+{
+    uint32_t low = 0;
+    uint32_t high;
+    uint32_t middle;
+
+    if ( !iter_context->checksums )
+    {
+        return;
+    }
+
+    /* Shard lists checksums of own files only, sorted by entry */
+    if ( iter_context->checksum_entries )
+    {
+        high = iter_context->checksum_count;
+
+        while ( low < high )
+        {
+            middle = low + ( high - low ) / 2;
+
+            if ( iter_context->checksum_entries[middle] < entry )
+            {
+                low = middle + 1;
+
+            } else
+            {
+                high = middle;
+            }
+        }
+
+        if ( low == iter_context->checksum_count || iter_context->checksum_entries[low] != entry )
+        {
+            return;
+        }
+
+        entry = low;
+    }
+
+    if ( iter_context->checksums[entry] != crc )
+    {
+        fprintf ( stderr, "Error: File '%s' checksum mismatch.\n", path );
+        iter_context->damaged = 1;
+    }
+}
+
+/**
+ * Write current file content from archive stream to path, entry holds its checksum
+ */
+static int sbox_unpack_write ( struct iter_context_t *iter_context, struct sbox_node_t *node,
+    uint32_t entry, const char *path )
+{
+    int fd;
+    size_t len;
+    size_t sum = 0;
+    uint32_t crc = 0;
+    const void *data;
+    struct io_stream_t *io;
+    struct timespec times[2];
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, node->mode ) ) < 0 )
+    {
+        perror ( path );
+        return -1;
+    }
+
+    if ( !( io = file_stream_new ( fd ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    if ( !( io = stats_stream_wrap ( io, "files" ) ) )
+    {
+        return -1;
+    }
+
+    if ( node->size )
+    {
+        do
+        {
+            len = MIN ( iter_context->buffer_size, node->size - sum );
+
+            if ( ( len = sbox_unpack_borrow ( iter_context, &data, len ) ) == 0 )
+            {
+                io->close ( io );
+                return -1;
+            }
+
+            if ( io->write_complete ( io, data, len ) < 0 )
+            {
+                perror ( path );
+                io->close ( io );
+                return -1;
+            }
+
+            crc = crc32c_update ( crc, data, len );
+            sum += len;
+
+            if ( stream_consume ( iter_context->io, len ) < 0 )
+            {
+                io->close ( io );
+                return -1;
+            }
+
+        } while ( sum < node->size );
+    }
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = node->mtime;
+    times[1].tv_nsec = 0;
+
+    if ( futimens ( fd, times ) < 0 )
+    {
+        perror ( path );
+    }
+
+    io->close ( io );
+
+    iter_context->offset += sum;
+    iter_context->stream_offset += sum;
+
+    sbox_unpack_check ( iter_context, entry, crc, path );
+
+    if ( iter_context->options & OPTION_VERBOSE )
+    {
+        show_progress ( 'x', path );
+    }
+
+    return 0;
+}
+
+/**
+ * Create duplicate from already extracted file, reflinking it if requested
+ */
+static int sbox_unpack_clone ( struct iter_context_t *iter_context, struct sbox_node_t *node,
+    const char *source, const char *path )
+{
+    int fd;
+    int source_fd;
+    ssize_t len;
+    uint64_t sum = 0;
+    struct timespec times[2];
+
+    if ( ( source_fd = open ( source, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, node->mode ) ) < 0 )
+    {
+        close ( source_fd );
+        return -1;
+    }
+#ifdef FICLONE
+    if ( iter_context->options & OPTION_DEDUP_REFLINK && ioctl ( fd, FICLONE, source_fd ) >= 0 )
+    {
+        sum = node->size;
+    }
+#endif
+    while ( sum < node->size
+        && ( len = read ( source_fd, iter_context->buffer, iter_context->buffer_size ) ) > 0 )
+    {
+        if ( write ( fd, iter_context->buffer, len ) != len )
+        {
+            close ( fd );
+            close ( source_fd );
+            return -1;
+        }
+
+        sum += len;
+    }
+
+    close ( source_fd );
+
+    if ( sum != node->size )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = node->mtime;
+    times[1].tv_nsec = 0;
+
+    if ( futimens ( fd, times ) < 0 )
+    {
+        perror ( path );
+    }
+
+    close ( fd );
+
+    return 0;
+}
+
+/**
+ * Recreate hard link or duplicate from its target, decoding target content if needed
+ */
+static int sbox_unpack_link ( struct iter_context_t *iter_context, struct sbox_node_t *node,
+    const char *path )
+{
+    uint64_t offset;
+    struct link_target_t *target;
+
+    if ( iter_context->options & ( OPTION_LISTONLY | OPTION_TESTONLY ) )
+    {
+        show_progress ( iter_context->options & OPTION_LISTONLY ? 'l' : 't', path );
+        return 0;
+    }
+
+    if ( !( target = link_table_find ( iter_context->links, node->link ) ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Hard link is unchanged only while it still shares inode with its target */
+    if ( iter_context->options & OPTION_UPDATE && sbox_unpack_unchanged ( node, path )
+        && ( !( node->flags & FILE_NET_FLAG_LINK || iter_context->options & OPTION_DEDUP_LINK )
+            || ( target->path && sbox_unpack_same_file ( path, target->path ) ) ) )
+    {
+        return 0;
+    }
+
+    if ( target->path )
+    {
+        if ( unlink ( path ) < 0 && errno != ENOENT )
+        {
+            perror ( path );
+            return -1;
+        }
+
+        if ( node->flags & FILE_NET_FLAG_LINK || iter_context->options & OPTION_DEDUP_LINK
+            ? linkat ( AT_FDCWD, target->path, AT_FDCWD, path, 0 ) >= 0
+            : sbox_unpack_clone ( iter_context, node, target->path, path ) >= 0 )
+        {
+            if ( iter_context->options & OPTION_VERBOSE )
+            {
+                show_progress ( 'x', path );
+            }
+
+            return 0;
+        }
+    }
+
+    /* Target was not extracted or cannot be reused, decode its content again */
+    offset = iter_context->offset;
+    iter_context->offset = target->offset;
+
+    if ( sbox_unpack_locate ( iter_context ) < 0
+        || sbox_unpack_write ( iter_context, node, node->link, path ) < 0 )
+    {
+        return -1;
+    }
+
+    iter_context->offset = offset;
+
+    if ( !target->path && !( target->path = strdup ( path ) ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * SBox archive unpack callback
+ */
+int sbox_unpack_callback ( void *context, struct sbox_node_t *node, const char *path )
+{
+    int selection = PATH_SELECTED;
+    size_t len;
+    size_t sum = 0;
+    uint32_t crc = 0;
+    const void *data;
+    struct iter_context_t *iter_context;
+    struct link_target_t *target = NULL;
+    struct stat statbuf;
+
+    iter_context = ( struct iter_context_t * ) context;
+
+    if ( iter_context->shards && iter_context->shards[node->index] != iter_context->shard )
+    {
+        return 0;
+    }
+
+    /* Other task failed, stop before next entry */
+    if ( iter_context->pool && pool_cancelled ( iter_context->pool ) )
+    {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    if ( iter_context->paths )
+    {
+        selection = sbox_unpack_match ( iter_context->paths, path );
+    }
+
+    if ( node->flags & FILE_NET_FLAG_TARGET )
+    {
+        if ( !( target =
+                link_table_append ( iter_context->links, node->index, iter_context->offset ) ) )
+        {
+            return -1;
+        }
+    }
+
+    if ( node->link != FILE_NET_NONE )
+    {
+        return selection == PATH_SELECTED ? sbox_unpack_link ( iter_context, node, path ) : 0;
+    }
+
+    if ( selection == PATH_UNSELECTED || ( selection == PATH_ANCESTOR
+            && ( iter_context->options & ( OPTION_LISTONLY | OPTION_TESTONLY ) ) ) )
+    {
+        iter_context->offset += node->size;
+        return 0;
+    }
+
+    if ( !node->mode )
+    {
+        return sbox_unpack_tombstone ( iter_context, path );
+    }
+
+    if ( iter_context->options & OPTION_LISTONLY )
+    {
+        show_progress ( 'l', path );
+        return 0;
+    }
+
+    if ( node->mode & S_IFDIR )
+    {
+        if ( iter_context->options & OPTION_TESTONLY )
+        {
+            show_progress ( 't', path );
+            return 0;
+        }
+
+        if ( stat ( path, &statbuf ) >= 0 )
+        {
+            if ( statbuf.st_mode & S_IFDIR )
+            {
+                return 0;
+            }
+
+        } else
+        {
+            return mkdir ( path, node->mode );
+        }
+    }
+
+    if ( iter_context->options & OPTION_UPDATE && sbox_unpack_unchanged ( node, path ) )
+    {
+        iter_context->offset += node->size;
+
+    } else
+    {
+        if ( sbox_unpack_locate ( iter_context ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( iter_context->options & OPTION_TESTONLY )
+        {
+            if ( node->size )
+            {
+                do
+                {
+                    len = MIN ( iter_context->buffer_size, node->size - sum );
+
+                    if ( ( len = sbox_unpack_borrow ( iter_context, &data, len ) ) == 0 )
+                    {
+                        return -1;
+                    }
+
+                    crc = crc32c_update ( crc, data, len );
+                    sum += len;
+
+                    if ( stream_consume ( iter_context->io, len ) < 0 )
+                    {
+                        return -1;
+                    }
+
+                } while ( sum < node->size );
+            }
+
+            iter_context->offset += sum;
+            iter_context->stream_offset += sum;
+
+            sbox_unpack_check ( iter_context, node->index, crc, path );
+            show_progress ( 't', path );
+            return 0;
+        }
+
+        if ( sbox_unpack_write ( iter_context, node, node->index, path ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( target && !( target->path = strdup ( path ) ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Load archive index and rewind to first file content, missing index is
+ * an error only if required
+ */
+static int sbox_unpack_load_index ( struct io_stream_t *io, struct io_stream_t *storage,
+    struct archive_index_t *index, int required )
+{
+    if ( archive_index_load ( index, storage ) < 0 )
+    {
+        if ( errno == ENOENT && !required )
+        {
+            return 0;
+        }
+
+        if ( errno == ENOENT )
+        {
+            fprintf ( stderr, "Error: Archive index not found.\n" );
+        }
+
+        return -1;
+    }
+
+    if ( io->seek ( io, index->blocks[0].storage ) < 0 )
+    {
+        archive_index_free ( index );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Load shard file checksums keyed by entry and rewind to first file content
+ */
+static int sbox_unpack_load_shard_checksums ( struct iter_context_t *iter_context,
+    const struct file_net_t *net, uint64_t count )
+{
+    uint32_t i;
+    uint64_t delta;
+    uint64_t entry = 0;
+    uint8_t bytes[4];
+    struct io_stream_t *io;
+
+    io = iter_context->io;
+
+    if ( !( iter_context->checksum_entries =
+            ( uint32_t * ) malloc ( ( count + 1 ) * sizeof ( uint32_t ) ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( stream_read_varint ( io, &delta ) < 0
+            || io->read_complete ( io, bytes, sizeof ( bytes ) ) < 0 )
+        {
+            return -1;
+        }
+
+        /* Entries are strictly increasing and within file net */
+        if ( !delta || delta >= net->count - entry )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        entry += delta;
+        iter_context->checksum_entries[i] = entry;
+        iter_context->checksums[i] = ( uint32_t ) bytes[0] << 24 | ( uint32_t ) bytes[1] << 16
+            | ( uint32_t ) bytes[2] << 8 | bytes[3];
+    }
+
+    iter_context->checksum_count = count;
+    iter_context->offset = 0;
+    iter_context->stream_offset = 0;
+
+    return io->seek ( io, iter_context->index->blocks[0].storage );
+}
+
+/**
+ * Load file checksums stored in own block after file contents and rewind to first
+ * file content, archives written without them are left unchecked
+ */
+static int sbox_unpack_load_checksums ( struct iter_context_t *iter_context,
+    const struct file_net_t *net )
+{
+    size_t len;
+    size_t pos;
+    uint32_t i;
+    uint32_t entry = 0;
+    uint64_t count;
+    uint8_t prefix[ARCHIVE_PREFIX_LENGTH];
+    uint8_t *bytes;
+    struct sbox_node_t node;
+    struct io_stream_t *io;
+
+    io = iter_context->io;
+
+    for ( i = FILE_NET_ROOT + 1; i < net->count; i++ )
+    {
+        file_net_get ( net, i, &node );
+
+        if ( file_net_has_body ( &node ) && ( !iter_context->shards
+                || iter_context->shards[i] == iter_context->shard ) )
+        {
+            iter_context->offset += node.size;
+        }
+    }
+
+    if ( iter_context->index->blocks[iter_context->index->count - 1].logical
+        != iter_context->offset )
+    {
+        iter_context->offset = 0;
+        return 0;
+    }
+
+    if ( sbox_unpack_locate ( iter_context ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( io->read_complete ( io, prefix, sizeof ( prefix ) ) >= 0
+        && !memcmp ( prefix, sbox_checksum_prefix, ARCHIVE_PREFIX_LENGTH ) )
+    {
+        if ( stream_read_varint ( io, &count ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( iter_context->shards ? count >= net->count : count != net->count )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if ( !( iter_context->checksums =
+                ( uint32_t * ) malloc ( ( count + 1 ) * sizeof ( uint32_t ) ) ) )
+        {
+            return -1;
+        }
+
+        if ( iter_context->shards )
+        {
+            return sbox_unpack_load_shard_checksums ( iter_context, net, count );
+        }
+
+        bytes = ( uint8_t * ) iter_context->buffer;
+
+        while ( entry < count )
+        {
+            len = MIN ( iter_context->buffer_size / 4, count - entry );
+
+            if ( io->read_complete ( io, bytes, len * 4 ) < 0 )
+            {
+                return -1;
+            }
+
+            for ( pos = 0; pos < len * 4; pos += 4 )
+            {
+                iter_context->checksums[entry++] = ( uint32_t ) bytes[pos] << 24
+                    | ( uint32_t ) bytes[pos + 1] << 16 | ( uint32_t ) bytes[pos + 2] << 8
+                    | bytes[pos + 3];
+            }
+        }
+    }
+
+    iter_context->offset = 0;
+    iter_context->stream_offset = 0;
+
+    return io->seek ( io, iter_context->index->blocks[0].storage );
+}
+
+/**
+ * Open archive or one of its segments and check its prefix, telling which kind of archive it is
+ */
+static struct io_stream_t *sbox_unpack_open ( const char *archive,
+    const struct archive_segment_t *segment, const char *password, struct io_stream_t **storage,
+    int *kind )
+{
+    int fd;
+    struct io_stream_t *io;
+    unsigned char prefix[ARCHIVE_PREFIX_LENGTH];
+
+    if ( ( fd = open ( archive, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        perror ( archive );
+        return NULL;
+    }
+
+    if ( !( io = segment ? input_range_stream_new ( fd, segment->start, segment->end, password,
+                storage ) : input_stream_new ( fd, password, storage ) ) )
+    {
+        close ( fd );
+        return NULL;
+    }
+
+    if ( io->read_complete ( io, prefix, sizeof ( prefix ) ) < 0 )
+    {
+        io->close ( io );
+        return NULL;
+    }
+
+    if ( !memcmp ( prefix, sbox_archive_prefix, ARCHIVE_PREFIX_LENGTH ) )
+    {
+        *kind = ARCHIVE_PLAIN;
+
+    } else if ( !memcmp ( prefix, sbox_manifest_prefix, ARCHIVE_PREFIX_LENGTH ) )
+    {
+        *kind = ARCHIVE_MANIFEST;
+
+    } else if ( !memcmp ( prefix, sbox_sharded_prefix, ARCHIVE_PREFIX_LENGTH ) )
+    {
+        *kind = ARCHIVE_SHARDED;
+
+    } else if ( !memcmp ( prefix, sbox_shard_prefix, ARCHIVE_PREFIX_LENGTH ) )
+    {
+        *kind = ARCHIVE_SHARD;
+
+    } else
+    {
+        fprintf ( stderr, "Error: Archive not recognized.\n" );
+        io->close ( io );
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return io;
+}
+
+/**
+ * List archive segments, archive never appended to has only one
+ */
+static int sbox_unpack_segments ( const char *archive, struct archive_segment_t **segments,
+    size_t *count )
+{
+    int fd;
+
+    if ( ( fd = open ( archive, O_RDONLY | O_BINARY ) ) < 0 )
+    {
+        perror ( archive );
+        return -1;
+    }
+
+    if ( archive_segments_load ( fd, segments, count ) < 0 )
+    {
+        perror ( archive );
+        close ( fd );
+        return -1;
+    }
+
+    close ( fd );
+
+    return 0;
+}
+
+/**
+ * Load file net from an archive segment
+ */
+static struct file_net_t *sbox_load_segment_net ( struct arena_t *arena, const char *archive,
+    const struct archive_segment_t *segment, const char *password )
+{
+    int kind;
+    struct io_stream_t *io;
+    struct file_net_t *net;
+
+    if ( !( io = sbox_unpack_open ( archive, segment, password, NULL, &kind ) ) )
+    {
+        return NULL;
+    }
+
+    if ( kind == ARCHIVE_SHARD )
+    {
+        fprintf ( stderr, "Error: Archive is a shard, use its sharded archive.\n" );
+        io->close ( io );
+        errno = EINVAL;
+        return NULL;
+    }
+
+    net = file_net_load ( arena, io );
+
+    io->close ( io );
+
+    return net;
+}
+
+/**
+ * Load file net from an archive, appended segments merged in order
+ */
+struct file_net_t *sbox_load_file_net ( struct arena_t *arena, const char *archive,
+    const char *password )
+{
+    size_t i;
+    size_t count;
+    struct file_net_t *net = NULL;
+    struct file_net_t *segment_net;
+    struct archive_segment_t *segments;
+
+    if ( sbox_unpack_segments ( archive, &segments, &count ) < 0 )
+    {
+        return NULL;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( !( segment_net = sbox_load_segment_net ( arena, archive,
+                    count > 1 ? segments + i : NULL, password ) ) )
+        {
+            free ( segments );
+            return NULL;
+        }
+
+        if ( !( net = net ? file_net_merge ( arena, net, segment_net ) : segment_net ) )
+        {
+            free ( segments );
+            return NULL;
+        }
+    }
+
+    free ( segments );
+
+    return net;
+}
+
+/**
+ * Check that archive can take appended segments
+ */
+int sbox_check_append ( const char *archive, const char *password )
+{
+    int kind;
+    struct io_stream_t *io;
+
+    if ( !( io = sbox_unpack_open ( archive, NULL, password, NULL, &kind ) ) )
+    {
+        return -1;
+    }
+
+    io->close ( io );
+
+    if ( kind != ARCHIVE_PLAIN )
+    {
+        fprintf ( stderr, "Error: Only plain archives can be appended to.\n" );
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
 
 /**
- * SBox archive unpack callback
+ * Open chunk stream over contents referenced by manifest
  */
-int sbox_unpack_callback ( void *context, struct sbox_node_t *node, const char *path )
+static struct io_stream_t *sbox_unpack_chunks ( struct io_stream_t *io, const char *password,
+    const char *repository, struct repository_t **repo, struct archive_index_t *index )
+{
+    struct io_stream_t *chunks;
+
+    if ( !repository )
+    {
+        fprintf ( stderr, "Error: Archive is a repository manifest, repository not given.\n" );
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( !( *repo = repository_open ( repository, password, 0, 0 ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( chunks = chunk_stream_new ( *repo, io, index ) ) )
+    {
+        repository_close ( *repo );
+        return NULL;
+    }
+
+    return chunks;
+}
+
+/**
+ * Shard being unpacked
+ */
+struct unpack_shard_t
 {
-    int fd;
-    size_t len;
-    size_t sum = 0;
     struct io_stream_t *io;
-    struct iter_context_t *iter_context;
-    struct stat statbuf;
+    struct archive_index_t index;
+    struct link_table_t links;
+    struct iter_context_t *context;
+};
 
-    iter_context = ( struct iter_context_t * ) context;
+/**
+ * Open archive shard and position it at first file content
+ */
+static int sbox_unpack_open_shard ( struct unpack_shard_t *shard, const char *archive,
+    int number, const char *password, const struct file_net_t *net, int index_mode )
+{
+    int kind;
+    char *path;
+    uint64_t value;
+    uint64_t entries;
+    struct io_stream_t *storage;
 
-    if ( iter_context->options & OPTION_LISTONLY )
+    if ( !( path = shard_path ( archive, number ) ) )
     {
-        show_progress ( 'l', path );
-        return 0;
+        return -1;
     }
 
-    if ( node->mode & S_IFDIR )
+    if ( !( shard->io = sbox_unpack_open ( path, NULL, password, &storage, &kind ) ) )
     {
-        if ( iter_context->options & OPTION_TESTONLY )
+        free ( path );
+        return -1;
+    }
+
+    if ( kind != ARCHIVE_SHARD || stream_read_varint ( shard->io, &value ) < 0
+        || stream_read_varint ( shard->io, &entries ) < 0 || value != ( uint64_t ) number
+        || entries != net->count )
+    {
+        fprintf ( stderr, "Error: Shard '%s' does not belong to archive.\n", path );
+        free ( path );
+        errno = EINVAL;
+        return -1;
+    }
+
+    free ( path );
+
+    if ( index_mode && sbox_unpack_load_index ( shard->io, storage, &shard->index,
+            index_mode > 1 ) < 0 )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Free unpacked shards from memory
+ */
+static void sbox_unpack_close_shards ( struct unpack_shard_t *shards, int count )
+{
+    int i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( shards[i].context )
         {
-            show_progress ( 't', path );
-            return 0;
+            free ( shards[i].context->checksums );
+            free ( shards[i].context->checksum_entries );
+            iter_context_free ( shards[i].context );
         }
 
-        if ( stat ( path, &statbuf ) >= 0 )
+        if ( shards[i].io )
         {
-            if ( statbuf.st_mode & S_IFDIR )
-            {
-                return 0;
-            }
+            shards[i].io->close ( shards[i].io );
+        }
 
-        } else
+        link_table_free ( &shards[i].links );
+        archive_index_free ( &shards[i].index );
+    }
+
+    free ( shards );
+}
+
+/**
+ * Verify checksums of encrypted shards read from start to end
+ */
+static int sbox_unpack_verify_shards ( struct io_stream_t *io, struct unpack_shard_t *shards,
+    int count, int full )
+{
+    int i;
+
+    if ( io->verify ( io ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; full && i < count; i++ )
+    {
+        if ( shards[i].io->verify ( shards[i].io ) < 0 )
         {
-            return mkdir ( path, node->mode );
+            return -1;
         }
     }
 
-    if ( iter_context->options & OPTION_TESTONLY )
+    return 0;
+}
+
+/**
+ * Unpack files from sharded archive, shards run on pool
+ */
+static int sbox_unpack_shards ( const char *archive, struct io_stream_t *io,
+    const struct file_net_t *net, uint32_t options, const char *password, const char *paths[],
+    struct pool_t *pool )
+{
+    int i;
+    int count;
+    int index_mode;
+    int status = 0;
+    uint8_t *map;
+    struct unpack_shard_t *shards;
+    struct iter_context_t *contexts[SHARD_MAX];
+
+    if ( !( map = shard_load_map ( io, net, &count ) ) )
+    {
+        return -1;
+    }
+
+    if ( !( shards =
+            ( struct unpack_shard_t * ) calloc ( count, sizeof ( struct unpack_shard_t ) ) ) )
+    {
+        free ( map );
+        return -1;
+    }
+
+    /* Index is required for seeking, optional for file checksums */
+    index_mode = paths || options & OPTION_UPDATE ? 2 : !password;
+
+    for ( i = 0; i < count; i++ )
     {
-        if ( node->size )
+        archive_index_new ( &shards[i].index );
+        link_table_new ( &shards[i].links );
+
+        if ( !( contexts[i] = shards[i].context = iter_context_new (  ) ) )
         {
-            do
-            {
-                len = MIN ( sizeof ( iter_context->buffer ), node->size - sum );
+            sbox_unpack_close_shards ( shards, count );
+            free ( map );
+            return -1;
+        }
 
-                if ( iter_context->io->read_complete ( iter_context->io, iter_context->buffer,
-                        len ) < 0 )
-                {
-                    return -1;
-                }
+        contexts[i]->checksums = NULL;
+        contexts[i]->checksum_entries = NULL;
+        contexts[i]->checksum_count = 0;
+
+        if ( sbox_unpack_open_shard ( shards + i, archive, i, password, net, index_mode ) < 0 )
+        {
+            sbox_unpack_close_shards ( shards, count );
+            free ( map );
+            return -1;
+        }
 
-                sum += len;
+        contexts[i]->options = options;
+        contexts[i]->io = shards[i].io;
+        contexts[i]->paths = paths;
+        contexts[i]->index = shards[i].index.count ? &shards[i].index : NULL;
+        contexts[i]->links = &shards[i].links;
+        contexts[i]->repository = NULL;
+        contexts[i]->pool = NULL;
+        contexts[i]->shards = map;
+        contexts[i]->shard = i;
+        contexts[i]->damaged = 0;
+        contexts[i]->offset = 0;
+        contexts[i]->block_offset = 0;
+        contexts[i]->stream_offset = 0;
 
-            } while ( sum < node->size );
+        if ( contexts[i]->index && sbox_unpack_load_checksums ( contexts[i], net ) < 0 )
+        {
+            sbox_unpack_close_shards ( shards, count );
+            free ( map );
+            return -1;
         }
-        show_progress ( 't', path );
-        return 0;
     }
 
-    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, node->mode ) ) < 0 )
+    /* Directories and tombstones belong to no shard, files need them first */
+    contexts[0]->shard = SHARD_NONE;
+
+    if ( file_net_iter ( net, contexts[0], sbox_unpack_callback ) < 0 )
     {
-        perror ( path );
+        sbox_unpack_close_shards ( shards, count );
+        free ( map );
         return -1;
     }
 
-    if ( !( io = file_stream_new ( fd ) ) )
+    contexts[0]->shard = 0;
+
+    if ( shard_run ( pool, net, contexts, count, sbox_unpack_callback ) < 0 )
     {
-        close ( fd );
+        sbox_unpack_close_shards ( shards, count );
+        free ( map );
         return -1;
     }
 
-    if ( node->size )
+    for ( i = 0; i < count; i++ )
     {
-        do
+        if ( contexts[i]->damaged )
         {
-            len = MIN ( sizeof ( iter_context->buffer ), node->size - sum );
-
-            if ( iter_context->io->read_complete ( iter_context->io, iter_context->buffer,
-                    len ) < 0 )
-            {
-                close ( fd );
-                return -1;
-            }
-
-            if ( io->write_complete ( io, iter_context->buffer, len ) < 0 )
-            {
-                perror ( path );
-                close ( fd );
-                return -1;
-            }
+            errno = EINVAL;
+            status = -1;
+        }
+    }
 
-            sum += len;
+    if ( password && ~options & OPTION_UPDATE )
+    {
+        if ( sbox_unpack_verify_shards ( io, shards, count, !paths ) < 0 )
+        {
+            fprintf ( stderr, "archive checksum: bad\n" );
+            errno = EINVAL;
+            status = -1;
 
-        } while ( sum < node->size );
+        } else
+        {
+            printf ( "archive checksum: ok\n" );
+        }
     }
 
-    io->close ( io );
+    /* Shards are read only at selected blocks, their checksums cannot be checked */
+    if ( password && options & OPTION_UPDATE )
+    {
+        fprintf ( stderr, "archive checksum: not verified, only selected blocks were read\n" );
 
-    if ( iter_context->options & OPTION_VERBOSE )
+    } else if ( password && paths )
     {
-        show_progress ( 'x', path );
+        fprintf ( stderr, "archive checksum: shards not verified, only selected blocks "
+            "were read\n" );
     }
 
-    return 0;
+    sbox_unpack_close_shards ( shards, count );
+    free ( map );
+
+    return status;
 }
 
 /**
- * Unpack files from an archive
+ * Unpack files from an archive segment, contents of manifest come from chunk repository
+ * and contents of sharded archive from its shards
  */
-int sbox_unpack_archive ( const char *archive, uint32_t options, const char *password )
+static int sbox_unpack_segment ( const char *archive, const struct archive_segment_t *segment,
+    uint32_t options, const char *password, const char *paths[], const char *repository,
+    struct pool_t *pool )
 {
-    int fd;
     int status = 0;
+    int kind;
     struct io_stream_t *io;
-    struct sbox_node_t *root;
+    struct io_stream_t *storage;
+    struct io_stream_t *body = NULL;
+    struct arena_t arena;
+    struct file_net_t *net;
     struct iter_context_t *iter_context;
-    unsigned char prefix[ARCHIVE_PREFIX_LENGTH];
+    struct archive_index_t index;
+    struct link_table_t links;
+    struct repository_t *repo = NULL;
 
-    if ( ( fd = open ( archive, O_RDONLY | O_BINARY ) ) < 0 )
+    if ( !( io = sbox_unpack_open ( archive, segment, password, &storage, &kind ) ) )
     {
-        perror ( archive );
         return -1;
     }
 
-    if ( !( io = input_stream_new ( fd, password ) ) )
+    if ( kind == ARCHIVE_SHARD )
     {
-        close ( fd );
+        fprintf ( stderr, "Error: Archive is a shard, use its sharded archive.\n" );
+        io->close ( io );
+        errno = EINVAL;
         return -1;
     }
 
-    if ( io->read_complete ( io, prefix, sizeof ( prefix ) ) < 0 )
+    arena_new ( &arena );
+
+    if ( !( net = file_net_load ( &arena, io ) ) )
     {
+        arena_free ( &arena );
         io->close ( io );
         return -1;
     }
 
-    if ( memcmp ( prefix, sbox_archive_prefix, ARCHIVE_PREFIX_LENGTH ) != 0 )
+    if ( paths && !paths[0] )
     {
-        fprintf ( stderr, "Error: Archive not recognized.\n" );
-        io->close ( io );
-        errno = EINVAL;
-        return -1;
+        paths = NULL;
     }
 
-    if ( !( root = file_net_load ( io ) ) )
+    if ( kind == ARCHIVE_SHARDED && ~options & OPTION_LISTONLY )
     {
+        status = sbox_unpack_shards ( archive, io, net, options, password, paths, pool );
+        arena_free ( &arena );
         io->close ( io );
-        return -1;
+        return status;
     }
 
-    if ( !( iter_context =
-            ( struct iter_context_t * ) malloc ( sizeof ( struct iter_context_t ) ) ) )
+    archive_index_new ( &index );
+
+    if ( kind == ARCHIVE_MANIFEST && ~options & OPTION_LISTONLY )
+    {
+        if ( !( body = sbox_unpack_chunks ( io, password, repository, &repo, &index ) ) )
+        {
+            archive_index_free ( &index );
+            arena_free ( &arena );
+            io->close ( io );
+            return -1;
+        }
+
+    } else if ( ( paths || options & OPTION_UPDATE || !password )
+        && ~options & OPTION_LISTONLY )
+    {
+        /* Full restore of encrypted archive reads sequentially to verify it */
+        if ( sbox_unpack_load_index ( io, storage, &index, paths
+                || options & OPTION_UPDATE ) < 0 )
+        {
+            arena_free ( &arena );
+            io->close ( io );
+            return -1;
+        }
+    }
+
+    if ( !( iter_context = iter_context_new (  ) ) )
     {
-        free_file_net ( root );
+        if ( body )
+        {
+            body->close ( body );
+            repository_close ( repo );
+        }
+        archive_index_free ( &index );
+        arena_free ( &arena );
         io->close ( io );
         return -1;
     }
 
     iter_context->options = options;
-    iter_context->io = io;
+    iter_context->io = body ? body : io;
+    iter_context->paths = paths;
+    iter_context->index = index.count ? &index : NULL;
+    iter_context->links = &links;
+    iter_context->repository = repo;
+    iter_context->pool = NULL;
+    iter_context->checksums = NULL;
+    iter_context->checksum_entries = NULL;
+    iter_context->checksum_count = 0;
+    iter_context->shards = NULL;
+    iter_context->shard = 0;
+    iter_context->damaged = 0;
+    iter_context->offset = 0;
+    iter_context->block_offset = 0;
+    iter_context->stream_offset = 0;
 
-    if ( file_net_iter ( root, iter_context, sbox_unpack_callback ) < 0 )
+    link_table_new ( &links );
+
+    if ( ( !body && iter_context->index
+            && sbox_unpack_load_checksums ( iter_context, net ) < 0 )
+        || file_net_iter ( net, iter_context, sbox_unpack_callback ) < 0 )
     {
-        free ( iter_context );
-        free_file_net ( root );
+        link_table_free ( &links );
+        free ( iter_context->checksums );
+        iter_context_free ( iter_context );
+        if ( body )
+        {
+            body->close ( body );
+            repository_close ( repo );
+        }
+        archive_index_free ( &index );
+        arena_free ( &arena );
         io->close ( io );
         return -1;
     }
 
-    free ( iter_context );
-    free_file_net ( root );
+    if ( iter_context->damaged )
+    {
+        errno = EINVAL;
+        status = -1;
+    }
+
+    link_table_free ( &links );
+    free ( iter_context->checksums );
+    iter_context_free ( iter_context );
+    archive_index_free ( &index );
+    arena_free ( &arena );
+
+    if ( body )
+    {
+        body->close ( body );
+        repository_close ( repo );
+    }
 
-    if ( password && ~options & OPTION_LISTONLY )
+    /* Manifest is fully read at this point, its checksum holds even for partial restore */
+    if ( password && ( body || !paths ) && !( options & ( OPTION_LISTONLY | OPTION_UPDATE ) ) )
     {
         if ( io->verify ( io ) < 0 )
         {
@@ -192,9 +1506,145 @@ int sbox_unpack_archive ( const char *archive, uint32_t options, const char *pas
         {
             printf ( "archive checksum: ok\n" );
         }
+
+    } else if ( password && ( paths || options & OPTION_UPDATE ) && ~options & OPTION_LISTONLY )
+    {
+        fprintf ( stderr, "archive checksum: not verified, only selected blocks were read\n" );
     }
 
     io->close ( io );
 
     return status;
 }
+
+/**
+ * List files of archive segments merged in order
+ */
+static int sbox_unpack_list_merged ( const char *archive, uint32_t options, const char *password,
+    const char *paths[] )
+{
+    int status;
+    struct arena_t arena;
+    struct file_net_t *net;
+    struct link_table_t links;
+    struct iter_context_t *iter_context;
+
+    arena_new ( &arena );
+
+    if ( !( net = sbox_load_file_net ( &arena, archive, password ) ) )
+    {
+        arena_free ( &arena );
+        return -1;
+    }
+
+    if ( !( iter_context = iter_context_new (  ) ) )
+    {
+        arena_free ( &arena );
+        return -1;
+    }
+
+    iter_context->options = options;
+    iter_context->paths = paths && paths[0] ? paths : NULL;
+    iter_context->links = &links;
+
+    link_table_new ( &links );
+
+    status = file_net_iter ( net, iter_context, sbox_unpack_callback );
+
+    link_table_free ( &links );
+    iter_context_free ( iter_context );
+    arena_free ( &arena );
+
+    return status;
+}
+
+/**
+ * Unpack files from archive segments
+ */
+static int sbox_unpack_task ( const char *archive, uint32_t options, const char *password,
+    const char *paths[], const char *repository, struct pool_t *pool )
+{
+    size_t i;
+    size_t count;
+    struct archive_segment_t *segments;
+
+    if ( sbox_unpack_segments ( archive, &segments, &count ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( count == 1 )
+    {
+        free ( segments );
+        return sbox_unpack_segment ( archive, NULL, options, password, paths, repository, pool );
+    }
+
+    if ( options & OPTION_LISTONLY )
+    {
+        free ( segments );
+        return sbox_unpack_list_merged ( archive, options, password, paths );
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( sbox_unpack_segment ( archive, segments + i, options, password, paths,
+                repository, pool ) < 0 )
+        {
+            free ( segments );
+            return -1;
+        }
+    }
+
+    free ( segments );
+
+    return 0;
+}
+
+/**
+ * Unpack files from an archive, appended segments are applied in order,
+ * stream stage stats are printed at the end if requested
+ */
+int sbox_unpack_archive ( const char *archive, uint32_t options, const char *password,
+    const char *paths[], const char *repository, struct pool_t *pool )
+{
+    int status;
+
+    if ( options & OPTION_STATS )
+    {
+        stats_start (  );
+    }
+
+#ifdef ENABLE_ENCRYPTION
+    aes_key_cache_begin (  );
+#endif
+
+    status = sbox_unpack_task ( archive, options, password, paths, repository, pool );
+
+#ifdef ENABLE_ENCRYPTION
+    aes_key_cache_end (  );
+#endif
+
+    if ( options & OPTION_STATS )
+    {
+        stats_show ( !!( options & OPTION_STATS_JSON ) );
+    }
+
+    return status;
+}
+
+/**
+ * Unpack base archive and replay its increments
+ */
+int sbox_restore_archives ( const char *archives[], uint32_t options, const char *password,
+    const char *repository, struct pool_t *pool )
+{
+    for ( ; *archives; archives++ )
+    {
+        if ( sbox_unpack_archive ( *archives, options, password, NULL, repository, pool ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -12,7 +12,172 @@ void show_progress ( char action, const char *path )
     printf ( " %c %s\n", action, path );
 }
 
+/**
+ * Create new expandable buffer
+ */
+int ext_buffer_new ( struct ext_buffer_t *buffer )
+{
+    buffer->length = 0;
+    buffer->capacity = 256;
+
+    if ( !( buffer->bytes = ( uint8_t * ) budget_spill_alloc ( buffer->capacity ) ) )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Clear expandable buffer content
+ */
+void ext_buffer_clear ( struct ext_buffer_t *buffer )
+{
+    buffer->length = 0;
+}
+
+/**
+ * Reserve space in expandable buffer
+ */
+int ext_buffer_reserve ( struct ext_buffer_t *buffer, size_t len )
+{
+    uint8_t *backup;
+
+    if ( buffer->length + len >= buffer->capacity )
+    {
+        buffer->capacity = 2 * ( buffer->length + len );
+        backup = buffer->bytes;
+
+        if ( !( buffer->bytes =
+                ( uint8_t * ) budget_spill_realloc ( buffer->bytes, buffer->capacity ) ) )
+        {
+            budget_free ( backup );
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Append one byte to expandable buffer
+ */
+int ext_buffer_append ( struct ext_buffer_t *buffer, uint8_t byte )
+{
+    if ( ext_buffer_reserve ( buffer, 1 ) < 0 )
+    {
+        return -1;
+    }
+
+    buffer->bytes[buffer->length++] = byte;
+    return 0;
+}
+
+/**
+ * Append bytes to expandable buffer
+ */
+int ext_buffer_append_bytes ( struct ext_buffer_t *buffer, const void *bytes, size_t len )
+{
+    if ( ext_buffer_reserve ( buffer, len ) < 0 )
+    {
+        return -1;
+    }
+
+    memcpy ( buffer->bytes + buffer->length, bytes, len );
+    buffer->length += len;
+    return 0;
+}
+
+/**
+ * Encode variable length integer, returns encoded length
+ */
+size_t varint_encode ( uint8_t * bytes, uint64_t value )
+{
+    size_t len = 0;
+
+    while ( value >= 0x80 )
+    {
+        bytes[len++] = ( uint8_t ) ( value | 0x80 );
+        value >>= 7;
+    }
+
+    bytes[len++] = ( uint8_t ) value;
+    return len;
+}
+
+/**
+ * Append variable length integer to expandable buffer
+ */
+int ext_buffer_append_varint ( struct ext_buffer_t *buffer, uint64_t value )
+{
+    if ( ext_buffer_reserve ( buffer, VARINT_LIMIT ) < 0 )
+    {
+        return -1;
+    }
+
+    buffer->length += varint_encode ( buffer->bytes + buffer->length, value );
+    return 0;
+}
+
+/**
+ * Free expandable buffer from memory
+ */
+void ext_buffer_free ( struct ext_buffer_t *buffer )
+{
+    budget_free ( buffer->bytes );
+}
+
+/**
+ * Decode variable length integer from memory
+ */
+int varint_decode ( const uint8_t ** bytes, const uint8_t * end, uint64_t * value )
+{
+    uint8_t byte;
+    unsigned int shift = 0;
+    uint64_t result = 0;
+    const uint8_t *ptr = *bytes;
+
+    do
+    {
+        if ( ptr >= end || shift >= 64 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        byte = *ptr++;
+        result |= ( uint64_t ) ( byte & 0x7f ) << shift;
+        shift += 7;
+
+    } while ( byte & 0x80 );
+
+    *bytes = ptr;
+    *value = result;
+
+    return 0;
+}
+
 /**
  * SBox archive prefix
  */
 const uint8_t sbox_archive_prefix[ARCHIVE_PREFIX_LENGTH] = { 's', 'b', 'o', 'x' };
+
+/**
+ * SBox repository manifest prefix
+ */
+const uint8_t sbox_manifest_prefix[ARCHIVE_PREFIX_LENGTH] = { 's', 'b', 'x', 'm' };
+
+/**
+ * SBox file checksum table prefix
+ */
+const uint8_t sbox_checksum_prefix[ARCHIVE_PREFIX_LENGTH] = { 's', 'b', 'x', 'k' };
+
+/**
+ * SBox sharded archive prefix
+ */
+const uint8_t sbox_sharded_prefix[ARCHIVE_PREFIX_LENGTH] = { 's', 'b', 'x', 's' };
+
+/**
+ * SBox archive shard prefix
+ */
+const uint8_t sbox_shard_prefix[ARCHIVE_PREFIX_LENGTH] = { 's', 'b', 'x', 'd' };